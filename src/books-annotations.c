@@ -0,0 +1,413 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "books-annotations.h"
+
+/*
+ * Highlights and notes of one book, held in memory while it is open. The
+ * annotations of each spine document are sorted by start and treated as
+ * an implicit balanced search tree, every node knowing the largest end
+ * below it. Finding the k annotations that overlap a range then takes
+ * O(log n + k), however many a document has. Changes show up at once and
+ * are written to the database in order by a thread of their own.
+ */
+
+/* Milliseconds to wait for the other connections to release the database */
+#define BUSY_TIMEOUT    5000
+
+typedef struct {
+    /* BooksAnnotation sorted by start, then end */
+    GArray      *items;
+
+    /* Largest end in the subtree rooted at each index */
+    guint       *max_ends;
+    gboolean     dirty;
+} Chapter;
+
+typedef enum {
+    WRITE_ADD,
+    WRITE_REMOVE
+} WriteKind;
+
+typedef struct {
+    WriteKind    kind;
+    guint        index;
+    guint        start;
+    guint        end;
+    gchar       *note;
+} WriteJob;
+
+struct _BooksAnnotations {
+    gint64       book_id;
+    gchar       *db_path;
+
+    /* Maps spine indices to chapters */
+    GHashTable  *chapters;
+
+    /* A single thread, so writes happen in the order they were made */
+    GThreadPool *writer;
+    sqlite3     *write_db;
+};
+
+
+static void
+clear_annotation (BooksAnnotation *annotation)
+{
+    g_free (annotation->note);
+}
+
+static void
+free_chapter (Chapter *chapter)
+{
+    g_array_free (chapter->items, TRUE);
+    g_free (chapter->max_ends);
+    g_free (chapter);
+}
+
+static Chapter *
+get_chapter (BooksAnnotations *annotations,
+             guint index,
+             gboolean create)
+{
+    Chapter *chapter;
+
+    chapter = g_hash_table_lookup (annotations->chapters, GUINT_TO_POINTER (index));
+
+    if (chapter == NULL && create) {
+        chapter = g_new0 (Chapter, 1);
+        chapter->items = g_array_new (FALSE, FALSE, sizeof (BooksAnnotation));
+        g_array_set_clear_func (chapter->items, (GDestroyNotify) clear_annotation);
+        g_hash_table_insert (annotations->chapters, GUINT_TO_POINTER (index), chapter);
+    }
+
+    return chapter;
+}
+
+static gint
+compare_annotations (const BooksAnnotation *a,
+                     const BooksAnnotation *b)
+{
+    if (a->start != b->start)
+        return a->start < b->start ? -1 : 1;
+
+    if (a->end != b->end)
+        return a->end < b->end ? -1 : 1;
+
+    return 0;
+}
+
+static guint
+build_max_ends (Chapter *chapter,
+                guint first,
+                guint last)
+{
+    BooksAnnotation *annotation;
+    guint middle;
+    guint max_end;
+
+    if (first >= last)
+        return 0;
+
+    middle = first + (last - first) / 2;
+    annotation = &g_array_index (chapter->items, BooksAnnotation, middle);
+
+    max_end = annotation->end;
+    max_end = MAX (max_end, build_max_ends (chapter, first, middle));
+    max_end = MAX (max_end, build_max_ends (chapter, middle + 1, last));
+    chapter->max_ends[middle] = max_end;
+
+    return max_end;
+}
+
+/* Changes only mark the chapter, it is rebuilt once on the next lookup */
+static void
+update_chapter (Chapter *chapter)
+{
+    if (!chapter->dirty)
+        return;
+
+    g_array_sort (chapter->items, (GCompareFunc) compare_annotations);
+    g_free (chapter->max_ends);
+    chapter->max_ends = g_new0 (guint, MAX (chapter->items->len, 1));
+    build_max_ends (chapter, 0, chapter->items->len);
+    chapter->dirty = FALSE;
+}
+
+/* Collects the indices of annotations overlapping [start, end) in order */
+static void
+find_overlapping (Chapter *chapter,
+                  guint first,
+                  guint last,
+                  guint start,
+                  guint end,
+                  GArray *found)
+{
+    BooksAnnotation *annotation;
+    guint middle;
+
+    if (first >= last)
+        return;
+
+    middle = first + (last - first) / 2;
+
+    /* Nothing below reaches into the range */
+    if (chapter->max_ends[middle] <= start)
+        return;
+
+    find_overlapping (chapter, first, middle, start, end, found);
+    annotation = &g_array_index (chapter->items, BooksAnnotation, middle);
+
+    /* Everything to the right starts behind the range */
+    if (annotation->start >= end)
+        return;
+
+    if (annotation->end > start)
+        g_array_append_val (found, middle);
+
+    find_overlapping (chapter, middle + 1, last, start, end, found);
+}
+
+static void
+free_write_job (WriteJob *job)
+{
+    g_free (job->note);
+    g_free (job);
+}
+
+static void
+write_annotation (WriteJob *job,
+                  BooksAnnotations *annotations)
+{
+    const gchar *insert_sql = "INSERT OR REPLACE INTO annotations "
+                              "(book_id, spine_index, start_offset, end_offset, note) VALUES (?, ?, ?, ?, ?)";
+    const gchar *delete_sql = "DELETE FROM annotations WHERE book_id = ? AND spine_index = ? "
+                              "AND start_offset = ? AND end_offset = ?";
+    sqlite3_stmt *stmt = NULL;
+
+    if (annotations->write_db == NULL) {
+        if (sqlite3_open (annotations->db_path, &annotations->write_db) != SQLITE_OK) {
+            g_warning ("Could not open %s to save annotations", annotations->db_path);
+            sqlite3_close (annotations->write_db);
+            annotations->write_db = NULL;
+            free_write_job (job);
+            return;
+        }
+
+        sqlite3_busy_timeout (annotations->write_db, BUSY_TIMEOUT);
+    }
+
+    sqlite3_prepare_v2 (annotations->write_db, job->kind == WRITE_ADD ? insert_sql : delete_sql,
+                        -1, &stmt, NULL);
+    sqlite3_bind_int64 (stmt, 1, annotations->book_id);
+    sqlite3_bind_int (stmt, 2, (gint) job->index);
+    sqlite3_bind_int (stmt, 3, (gint) job->start);
+    sqlite3_bind_int (stmt, 4, (gint) job->end);
+
+    if (job->kind == WRITE_ADD && job->note != NULL)
+        sqlite3_bind_text (stmt, 5, job->note, -1, NULL);
+    else if (job->kind == WRITE_ADD)
+        sqlite3_bind_null (stmt, 5);
+
+    if (sqlite3_step (stmt) != SQLITE_DONE)
+        g_warning ("Could not save annotation: %s", sqlite3_errmsg (annotations->write_db));
+
+    sqlite3_finalize (stmt);
+    free_write_job (job);
+}
+
+static void
+queue_write (BooksAnnotations *annotations,
+             WriteKind kind,
+             guint index,
+             const BooksAnnotation *annotation)
+{
+    WriteJob *job;
+
+    job = g_new0 (WriteJob, 1);
+    job->kind = kind;
+    job->index = index;
+    job->start = annotation->start;
+    job->end = annotation->end;
+    job->note = g_strdup (annotation->note);
+
+    g_thread_pool_push (annotations->writer, job, NULL);
+}
+
+/**
+ * Reads all annotations of @book_id from @db. Changes are written through
+ * a separate connection to @db_path.
+ */
+BooksAnnotations *
+books_annotations_new (sqlite3 *db,
+                       const gchar *db_path,
+                       gint64 book_id)
+{
+    const gchar *select_sql = "SELECT spine_index, start_offset, end_offset, note FROM annotations "
+                              "WHERE book_id = ?";
+    sqlite3_stmt *select_stmt = NULL;
+    BooksAnnotations *annotations;
+
+    annotations = g_new0 (BooksAnnotations, 1);
+    annotations->book_id = book_id;
+    annotations->db_path = g_strdup (db_path);
+    annotations->chapters = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) free_chapter);
+    annotations->writer = g_thread_pool_new ((GFunc) write_annotation, annotations, 1, FALSE, NULL);
+
+    sqlite3_prepare_v2 (db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_int64 (select_stmt, 1, book_id);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        BooksAnnotation annotation;
+        Chapter *chapter;
+
+        chapter = get_chapter (annotations, (guint) sqlite3_column_int (select_stmt, 0), TRUE);
+        annotation.start = (guint) sqlite3_column_int (select_stmt, 1);
+        annotation.end = (guint) sqlite3_column_int (select_stmt, 2);
+        annotation.note = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 3));
+
+        g_array_append_val (chapter->items, annotation);
+        chapter->dirty = TRUE;
+    }
+
+    sqlite3_finalize (select_stmt);
+    return annotations;
+}
+
+/**
+ * Frees @annotations once the changes made so far have been written.
+ */
+void
+books_annotations_free (BooksAnnotations *annotations)
+{
+    if (annotations == NULL)
+        return;
+
+    g_thread_pool_free (annotations->writer, FALSE, TRUE);
+
+    if (annotations->write_db != NULL)
+        sqlite3_close (annotations->write_db);
+
+    g_hash_table_destroy (annotations->chapters);
+    g_free (annotations->db_path);
+    g_free (annotations);
+}
+
+/**
+ * Returns the annotations of spine document @index overlapping the range
+ * from @start to @end, ordered by start. The array holds pointers into
+ * @annotations that stay valid until it is changed; free only the array.
+ */
+GPtrArray *
+books_annotations_lookup (BooksAnnotations *annotations,
+                          guint index,
+                          guint start,
+                          guint end)
+{
+    GPtrArray *result;
+    GArray *found;
+    Chapter *chapter;
+    guint i;
+
+    g_return_val_if_fail (annotations != NULL, NULL);
+
+    result = g_ptr_array_new ();
+    chapter = get_chapter (annotations, index, FALSE);
+
+    if (chapter == NULL)
+        return result;
+
+    update_chapter (chapter);
+    found = g_array_new (FALSE, FALSE, sizeof (guint));
+    find_overlapping (chapter, 0, chapter->items->len, start, end, found);
+
+    for (i = 0; i < found->len; i++)
+        g_ptr_array_add (result, &g_array_index (chapter->items, BooksAnnotation, g_array_index (found, guint, i)));
+
+    g_array_free (found, TRUE);
+    return result;
+}
+
+/**
+ * Highlights the range from @start to @end of spine document @index,
+ * optionally with a @note. An annotation of the same range is replaced.
+ */
+void
+books_annotations_add (BooksAnnotations *annotations,
+                       guint index,
+                       guint start,
+                       guint end,
+                       const gchar *note)
+{
+    BooksAnnotation annotation;
+    Chapter *chapter;
+    guint i;
+
+    g_return_if_fail (annotations != NULL && start < end);
+
+    chapter = get_chapter (annotations, index, TRUE);
+
+    for (i = 0; i < chapter->items->len; i++) {
+        BooksAnnotation *existing;
+
+        existing = &g_array_index (chapter->items, BooksAnnotation, i);
+
+        if (existing->start == start && existing->end == end) {
+            g_array_remove_index_fast (chapter->items, i);
+            break;
+        }
+    }
+
+    annotation.start = start;
+    annotation.end = end;
+    annotation.note = note != NULL && *note != '\0' ? g_strdup (note) : NULL;
+
+    g_array_append_val (chapter->items, annotation);
+    chapter->dirty = TRUE;
+
+    queue_write (annotations, WRITE_ADD, index, &annotation);
+}
+
+/**
+ * Removes all annotations of spine document @index that overlap the range
+ * from @start to @end. Returns how many there were.
+ */
+guint
+books_annotations_remove (BooksAnnotations *annotations,
+                          guint index,
+                          guint start,
+                          guint end)
+{
+    Chapter *chapter;
+    GArray *found;
+    guint n_removed;
+    guint i;
+
+    g_return_val_if_fail (annotations != NULL, 0);
+
+    chapter = get_chapter (annotations, index, FALSE);
+
+    if (chapter == NULL)
+        return 0;
+
+    update_chapter (chapter);
+    found = g_array_new (FALSE, FALSE, sizeof (guint));
+    find_overlapping (chapter, 0, chapter->items->len, start, end, found);
+
+    /* Back to front, the indices in front stay valid */
+    for (i = found->len; i > 0; i--) {
+        guint position;
+
+        position = g_array_index (found, guint, i - 1);
+        queue_write (annotations, WRITE_REMOVE, index, &g_array_index (chapter->items, BooksAnnotation, position));
+        g_array_remove_index (chapter->items, position);
+    }
+
+    n_removed = found->len;
+    g_array_free (found, TRUE);
+
+    if (n_removed > 0)
+        chapter->dirty = TRUE;
+
+    return n_removed;
+}
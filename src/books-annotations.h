@@ -0,0 +1,38 @@
+#ifndef BOOKS_ANNOTATIONS_H
+#define BOOKS_ANNOTATIONS_H
+
+#include <glib.h>
+#include <sqlite3.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BooksAnnotations BooksAnnotations;
+
+/* A highlighted range of a spine document, offsets count UTF-16 units */
+typedef struct {
+    guint    start;
+    guint    end;
+    gchar   *note;
+} BooksAnnotation;
+
+BooksAnnotations *books_annotations_new         (sqlite3            *db,
+                                                 const gchar        *db_path,
+                                                 gint64              book_id);
+void              books_annotations_free        (BooksAnnotations   *annotations);
+GPtrArray        *books_annotations_lookup      (BooksAnnotations   *annotations,
+                                                 guint               index,
+                                                 guint               start,
+                                                 guint               end);
+void              books_annotations_add         (BooksAnnotations   *annotations,
+                                                 guint               index,
+                                                 guint               start,
+                                                 guint               end,
+                                                 const gchar        *note);
+guint             books_annotations_remove      (BooksAnnotations   *annotations,
+                                                 guint               index,
+                                                 guint               start,
+                                                 guint               end);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,667 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "books-bitmap.h"
+
+/*
+ * Compressed set of 32 bit integers in the style of roaring bitmaps. The
+ * upper 16 bits of a value select a container, which keeps the lower 16
+ * bits in a sorted array while it holds few values and as plain bitmap of
+ * 65536 bits otherwise. Sparse sets stay small, dense ones are combined a
+ * word at a time.
+ */
+
+/* Above this an array takes more memory than a bitmap */
+#define ARRAY_MAX_CARDINALITY   4096
+
+#define BITMAP_WORDS            (65536 / 64)
+
+typedef enum {
+    OP_AND,
+    OP_OR,
+    OP_AND_NOT
+} BitmapOp;
+
+typedef struct {
+    guint16  key;
+    guint32  cardinality;
+    guint32  capacity;
+    guint16 *values;
+    guint64 *words;
+} Container;
+
+struct _BooksBitmap {
+    Container   *containers;
+    guint        n_containers;
+    guint        capacity;
+};
+
+
+BooksBitmap *
+books_bitmap_new (void)
+{
+    return g_new0 (BooksBitmap, 1);
+}
+
+static void
+copy_container (Container *dest,
+                const Container *source)
+{
+    *dest = *source;
+
+    if (source->words != NULL) {
+        dest->words = g_new (guint64, BITMAP_WORDS);
+        memcpy (dest->words, source->words, BITMAP_WORDS * sizeof (guint64));
+    }
+    else {
+        dest->capacity = MAX (source->cardinality, 1);
+        dest->values = g_new (guint16, dest->capacity);
+        memcpy (dest->values, source->values, source->cardinality * sizeof (guint16));
+    }
+}
+
+BooksBitmap *
+books_bitmap_copy (const BooksBitmap *bitmap)
+{
+    BooksBitmap *copy;
+    guint i;
+
+    g_return_val_if_fail (bitmap != NULL, NULL);
+
+    copy = books_bitmap_new ();
+    copy->containers = g_new0 (Container, MAX (bitmap->n_containers, 1));
+    copy->n_containers = bitmap->n_containers;
+    copy->capacity = MAX (bitmap->n_containers, 1);
+
+    for (i = 0; i < bitmap->n_containers; i++)
+        copy_container (&copy->containers[i], &bitmap->containers[i]);
+
+    return copy;
+}
+
+static void
+clear_container (Container *container)
+{
+    g_free (container->values);
+    g_free (container->words);
+    container->values = NULL;
+    container->words = NULL;
+    container->cardinality = 0;
+    container->capacity = 0;
+}
+
+void
+books_bitmap_free (BooksBitmap *bitmap)
+{
+    guint i;
+
+    if (bitmap == NULL)
+        return;
+
+    for (i = 0; i < bitmap->n_containers; i++)
+        clear_container (&bitmap->containers[i]);
+
+    g_free (bitmap->containers);
+    g_free (bitmap);
+}
+
+static guint
+count_bits (guint64 word)
+{
+    /* Sums adjacent bits, pairs and nibbles in parallel */
+    word = word - ((word >> 1) & G_GUINT64_CONSTANT (0x5555555555555555));
+    word = (word & G_GUINT64_CONSTANT (0x3333333333333333)) +
+           ((word >> 2) & G_GUINT64_CONSTANT (0x3333333333333333));
+    word = (word + (word >> 4)) & G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f);
+
+    return (guint) ((word * G_GUINT64_CONSTANT (0x0101010101010101)) >> 56);
+}
+
+/*
+ * Returns the position of @key in the containers, or where it has to be
+ * inserted if there is no such container.
+ */
+static guint
+find_container (const BooksBitmap *bitmap,
+                guint16 key,
+                gboolean *found)
+{
+    guint low;
+    guint high;
+
+    low = 0;
+    high = bitmap->n_containers;
+
+    while (low < high) {
+        guint middle;
+
+        middle = low + (high - low) / 2;
+
+        if (bitmap->containers[middle].key < key)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    *found = low < bitmap->n_containers && bitmap->containers[low].key == key;
+    return low;
+}
+
+static guint
+find_value (const guint16 *values,
+            guint n_values,
+            guint16 value,
+            gboolean *found)
+{
+    guint low;
+    guint high;
+
+    low = 0;
+    high = n_values;
+
+    while (low < high) {
+        guint middle;
+
+        middle = low + (high - low) / 2;
+
+        if (values[middle] < value)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    *found = low < n_values && values[low] == value;
+    return low;
+}
+
+static Container *
+get_container (BooksBitmap *bitmap,
+               guint16 key)
+{
+    Container *container;
+    gboolean found;
+    guint position;
+
+    position = find_container (bitmap, key, &found);
+
+    if (found)
+        return &bitmap->containers[position];
+
+    if (bitmap->n_containers == bitmap->capacity) {
+        bitmap->capacity = MAX (bitmap->capacity * 2, 4);
+        bitmap->containers = g_renew (Container, bitmap->containers, bitmap->capacity);
+    }
+
+    container = &bitmap->containers[position];
+    memmove (container + 1, container, (bitmap->n_containers - position) * sizeof (Container));
+    bitmap->n_containers++;
+
+    memset (container, 0, sizeof (Container));
+    container->key = key;
+    return container;
+}
+
+static void
+remove_container (BooksBitmap *bitmap,
+                  guint position)
+{
+    Container *container;
+
+    container = &bitmap->containers[position];
+    clear_container (container);
+    memmove (container, container + 1, (bitmap->n_containers - position - 1) * sizeof (Container));
+    bitmap->n_containers--;
+}
+
+/*
+ * Returns the bits of @container, which are written to @buffer if it
+ * keeps an array.
+ */
+static guint64 *
+get_words (const Container *container,
+           guint64 *buffer)
+{
+    guint i;
+
+    if (container->words != NULL)
+        return container->words;
+
+    memset (buffer, 0, BITMAP_WORDS * sizeof (guint64));
+
+    for (i = 0; i < container->cardinality; i++)
+        buffer[container->values[i] >> 6] |= G_GUINT64_CONSTANT (1) << (container->values[i] & 63);
+
+    return buffer;
+}
+
+/*
+ * Replaces the contents of @container with @words, which may be its own,
+ * in whichever form is smaller.
+ */
+static void
+set_words (Container *container,
+           const guint64 *words)
+{
+    guint cardinality = 0;
+    guint i;
+
+    for (i = 0; i < BITMAP_WORDS; i++)
+        cardinality += count_bits (words[i]);
+
+    if (cardinality <= ARRAY_MAX_CARDINALITY) {
+        guint16 *values;
+        guint n_values = 0;
+
+        values = g_new (guint16, MAX (cardinality, 1));
+
+        for (i = 0; i < BITMAP_WORDS; i++) {
+            guint64 word;
+
+            /* Visits the set bits from the lowest, clearing each */
+            for (word = words[i]; word != 0; word &= word - 1)
+                values[n_values++] = (guint16) (i * 64 + count_bits ((word & (~word + 1)) - 1));
+        }
+
+        clear_container (container);
+        container->values = values;
+        container->capacity = MAX (cardinality, 1);
+    }
+    else if (container->words == NULL) {
+        clear_container (container);
+        container->words = g_new (guint64, BITMAP_WORDS);
+        memcpy (container->words, words, BITMAP_WORDS * sizeof (guint64));
+    }
+    else if (container->words != words) {
+        memcpy (container->words, words, BITMAP_WORDS * sizeof (guint64));
+    }
+
+    container->cardinality = cardinality;
+}
+
+void
+books_bitmap_add (BooksBitmap *bitmap,
+                  guint32 value)
+{
+    Container *container;
+    guint16 low;
+    guint64 mask;
+    gboolean found;
+    guint position;
+
+    g_return_if_fail (bitmap != NULL);
+
+    container = get_container (bitmap, value >> 16);
+    low = value & 0xffff;
+    mask = G_GUINT64_CONSTANT (1) << (low & 63);
+
+    if (container->words != NULL) {
+        if (!(container->words[low >> 6] & mask)) {
+            container->words[low >> 6] |= mask;
+            container->cardinality++;
+        }
+
+        return;
+    }
+
+    position = find_value (container->values, container->cardinality, low, &found);
+
+    if (found)
+        return;
+
+    if (container->cardinality == ARRAY_MAX_CARDINALITY) {
+        guint64 buffer[BITMAP_WORDS];
+
+        get_words (container, buffer);
+        buffer[low >> 6] |= mask;
+        set_words (container, buffer);
+        return;
+    }
+
+    if (container->cardinality == container->capacity) {
+        container->capacity = MIN (MAX (container->capacity * 2, 4), ARRAY_MAX_CARDINALITY);
+        container->values = g_renew (guint16, container->values, container->capacity);
+    }
+
+    memmove (container->values + position + 1, container->values + position,
+             (container->cardinality - position) * sizeof (guint16));
+    container->values[position] = low;
+    container->cardinality++;
+}
+
+void
+books_bitmap_remove (BooksBitmap *bitmap,
+                     guint32 value)
+{
+    Container *container;
+    guint16 low;
+    gboolean found;
+    guint index;
+
+    g_return_if_fail (bitmap != NULL);
+
+    index = find_container (bitmap, value >> 16, &found);
+
+    if (!found)
+        return;
+
+    container = &bitmap->containers[index];
+    low = value & 0xffff;
+
+    if (container->words != NULL) {
+        guint64 mask;
+
+        mask = G_GUINT64_CONSTANT (1) << (low & 63);
+
+        if (!(container->words[low >> 6] & mask))
+            return;
+
+        container->words[low >> 6] &= ~mask;
+        container->cardinality--;
+
+        if (container->cardinality <= ARRAY_MAX_CARDINALITY)
+            set_words (container, container->words);
+    }
+    else {
+        guint position;
+
+        position = find_value (container->values, container->cardinality, low, &found);
+
+        if (!found)
+            return;
+
+        memmove (container->values + position, container->values + position + 1,
+                 (container->cardinality - position - 1) * sizeof (guint16));
+        container->cardinality--;
+    }
+
+    if (container->cardinality == 0)
+        remove_container (bitmap, index);
+}
+
+gboolean
+books_bitmap_contains (const BooksBitmap *bitmap,
+                       guint32 value)
+{
+    const Container *container;
+    guint16 low;
+    gboolean found;
+    guint index;
+
+    g_return_val_if_fail (bitmap != NULL, FALSE);
+
+    index = find_container (bitmap, value >> 16, &found);
+
+    if (!found)
+        return FALSE;
+
+    container = &bitmap->containers[index];
+    low = value & 0xffff;
+
+    if (container->words != NULL)
+        return (container->words[low >> 6] & (G_GUINT64_CONSTANT (1) << (low & 63))) != 0;
+
+    find_value (container->values, container->cardinality, low, &found);
+    return found;
+}
+
+guint64
+books_bitmap_get_cardinality (const BooksBitmap *bitmap)
+{
+    guint64 cardinality = 0;
+    guint i;
+
+    g_return_val_if_fail (bitmap != NULL, 0);
+
+    for (i = 0; i < bitmap->n_containers; i++)
+        cardinality += bitmap->containers[i].cardinality;
+
+    return cardinality;
+}
+
+/**
+ * Returns all values in ascending order as array of guint32.
+ */
+GArray *
+books_bitmap_to_array (const BooksBitmap *bitmap)
+{
+    GArray *values;
+    guint i;
+
+    g_return_val_if_fail (bitmap != NULL, NULL);
+
+    values = g_array_sized_new (FALSE, FALSE, sizeof (guint32),
+                                (guint) books_bitmap_get_cardinality (bitmap));
+
+    for (i = 0; i < bitmap->n_containers; i++) {
+        const Container *container;
+        guint32 high;
+        guint j;
+
+        container = &bitmap->containers[i];
+        high = (guint32) container->key << 16;
+
+        if (container->words == NULL) {
+            for (j = 0; j < container->cardinality; j++) {
+                guint32 value;
+
+                value = high | container->values[j];
+                g_array_append_val (values, value);
+            }
+
+            continue;
+        }
+
+        for (j = 0; j < BITMAP_WORDS; j++) {
+            guint64 word;
+
+            for (word = container->words[j]; word != 0; word &= word - 1) {
+                guint32 value;
+
+                value = high | (j * 64 + count_bits ((word & (~word + 1)) - 1));
+                g_array_append_val (values, value);
+            }
+        }
+    }
+
+    return values;
+}
+
+static guint
+merge_values (const guint16 *a,
+              guint n_a,
+              const guint16 *b,
+              guint n_b,
+              guint16 *result,
+              BitmapOp op)
+{
+    guint i = 0;
+    guint j = 0;
+    guint n = 0;
+
+    while (i < n_a && j < n_b) {
+        if (a[i] < b[j]) {
+            if (op != OP_AND)
+                result[n++] = a[i];
+
+            i++;
+        }
+        else if (a[i] > b[j]) {
+            if (op == OP_OR)
+                result[n++] = b[j];
+
+            j++;
+        }
+        else {
+            if (op != OP_AND_NOT)
+                result[n++] = a[i];
+
+            i++;
+            j++;
+        }
+    }
+
+    if (op != OP_AND) {
+        while (i < n_a)
+            result[n++] = a[i++];
+    }
+
+    if (op == OP_OR) {
+        while (j < n_b)
+            result[n++] = b[j++];
+    }
+
+    return n;
+}
+
+static void
+combine_containers (Container *container,
+                    const Container *other,
+                    BitmapOp op)
+{
+    guint64 buffer[BITMAP_WORDS];
+    guint64 other_buffer[BITMAP_WORDS];
+    guint64 *words;
+    const guint64 *other_words;
+    guint i;
+
+    if (container->words == NULL && other->words == NULL) {
+        guint16 *values;
+        guint capacity;
+
+        capacity = MAX (container->cardinality + other->cardinality, 1);
+        values = g_new (guint16, capacity);
+
+        container->cardinality = merge_values (container->values, container->cardinality,
+                                               other->values, other->cardinality, values, op);
+        g_free (container->values);
+        container->values = values;
+        container->capacity = capacity;
+
+        /* Only a union can outgrow the array */
+        if (container->cardinality > ARRAY_MAX_CARDINALITY)
+            set_words (container, get_words (container, buffer));
+
+        return;
+    }
+
+    words = get_words (container, buffer);
+    other_words = get_words (other, other_buffer);
+
+    for (i = 0; i < BITMAP_WORDS; i++) {
+        switch (op) {
+            case OP_AND:
+                words[i] &= other_words[i];
+                break;
+
+            case OP_OR:
+                words[i] |= other_words[i];
+                break;
+
+            case OP_AND_NOT:
+                words[i] &= ~other_words[i];
+                break;
+        }
+    }
+
+    set_words (container, words);
+}
+
+static void
+combine (BooksBitmap *bitmap,
+         const BooksBitmap *other,
+         BitmapOp op)
+{
+    Container *containers;
+    guint capacity;
+    guint n = 0;
+    guint i = 0;
+    guint j = 0;
+
+    capacity = MAX (bitmap->n_containers + other->n_containers, 1);
+    containers = g_new0 (Container, capacity);
+
+    /* Both are sorted by key, so matching containers are merged in one pass */
+    while (i < bitmap->n_containers || j < other->n_containers) {
+        Container *container;
+        const Container *other_container;
+
+        container = i < bitmap->n_containers ? &bitmap->containers[i] : NULL;
+        other_container = j < other->n_containers ? &other->containers[j] : NULL;
+
+        if (other_container == NULL || (container != NULL && container->key < other_container->key)) {
+            if (op == OP_AND)
+                clear_container (container);
+            else
+                containers[n++] = *container;
+
+            i++;
+        }
+        else if (container == NULL || other_container->key < container->key) {
+            if (op == OP_OR)
+                copy_container (&containers[n++], other_container);
+
+            j++;
+        }
+        else {
+            combine_containers (container, other_container, op);
+
+            if (container->cardinality > 0)
+                containers[n++] = *container;
+            else
+                clear_container (container);
+
+            i++;
+            j++;
+        }
+    }
+
+    g_free (bitmap->containers);
+    bitmap->containers = containers;
+    bitmap->n_containers = n;
+    bitmap->capacity = capacity;
+}
+
+/**
+ * Keeps only values that are also in @other.
+ */
+void
+books_bitmap_and (BooksBitmap *bitmap,
+                  const BooksBitmap *other)
+{
+    g_return_if_fail (bitmap != NULL && other != NULL);
+
+    if (bitmap != other)
+        combine (bitmap, other, OP_AND);
+}
+
+/**
+ * Adds all values of @other.
+ */
+void
+books_bitmap_or (BooksBitmap *bitmap,
+                 const BooksBitmap *other)
+{
+    g_return_if_fail (bitmap != NULL && other != NULL);
+
+    if (bitmap != other)
+        combine (bitmap, other, OP_OR);
+}
+
+/**
+ * Removes all values of @other.
+ */
+void
+books_bitmap_and_not (BooksBitmap *bitmap,
+                      const BooksBitmap *other)
+{
+    BooksBitmap *copy;
+
+    g_return_if_fail (bitmap != NULL && other != NULL);
+
+    copy = bitmap == other ? books_bitmap_copy (other) : NULL;
+    combine (bitmap, copy != NULL ? copy : other, OP_AND_NOT);
+    books_bitmap_free (copy);
+}
@@ -0,0 +1,30 @@
+#ifndef BOOKS_BITMAP_H
+#define BOOKS_BITMAP_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BooksBitmap BooksBitmap;
+
+BooksBitmap     *books_bitmap_new               (void);
+BooksBitmap     *books_bitmap_copy              (const BooksBitmap  *bitmap);
+void             books_bitmap_free              (BooksBitmap        *bitmap);
+void             books_bitmap_add               (BooksBitmap        *bitmap,
+                                                 guint32             value);
+void             books_bitmap_remove            (BooksBitmap        *bitmap,
+                                                 guint32             value);
+gboolean         books_bitmap_contains          (const BooksBitmap  *bitmap,
+                                                 guint32             value);
+guint64          books_bitmap_get_cardinality   (const BooksBitmap  *bitmap);
+GArray          *books_bitmap_to_array          (const BooksBitmap  *bitmap);
+void             books_bitmap_and               (BooksBitmap        *bitmap,
+                                                 const BooksBitmap  *other);
+void             books_bitmap_or                (BooksBitmap        *bitmap,
+                                                 const BooksBitmap  *other);
+void             books_bitmap_and_not           (BooksBitmap        *bitmap,
+                                                 const BooksBitmap  *other);
+
+G_END_DECLS
+
+#endif
@@ -3,373 +3,4509 @@
 #endif
 
 #include <string.h>
+#include <locale.h>
 #include <sqlite3.h>
 #include <glib/gi18n.h>
 #include <glib/gstdio.h>
 
 #include "books-collection.h"
-#include "books-removed-dialog.h"
+#include "books-content-hash.h"
+#include "books-cover-cache.h"
+#include "books-listing-cache.h"
+#include "books-search-index.h"
+#include "books-snapshot.h"
+#include "books-string-pool.h"
+#include "books-tags.h"
+#include "books-thumbnail.h"
+#include "books-verifier.h"
 
 
-G_DEFINE_TYPE(BooksCollection, books_collection, G_TYPE_OBJECT)
+static void books_collection_tree_model_init    (GtkTreeModelIface *iface);
+static void books_collection_tree_sortable_init (GtkTreeSortableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BooksCollection, books_collection, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL,
+                                                books_collection_tree_model_init)
+                         G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_SORTABLE,
+                                                books_collection_tree_sortable_init))
 
 #define BOOKS_COLLECTION_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_COLLECTION, BooksCollectionPrivate))
 
-static void   set_pixbuf_column_from_file (BooksCollectionPrivate *priv, GtkTreeIter *iter, const gchar *cover);
-static gchar *get_author_title_markup     (const gchar *author, const gchar *title);
+/* Number of threads testing folders for missing books concurrently */
+#define MISSING_BOOK_THREADS    8
+
+/* Follows G_DIR_SEPARATOR in byte order, bounds the paths below a folder */
+#define PATH_RANGE_END          "0"
+
+/* Rows are fetched from the database in pages of this size */
+#define PAGE_SIZE               64
+
+/* Upper bound of rows kept in memory, least recently used go first */
+#define MAX_CACHED_ROWS         2048
+
+/* Memory spent on decoded covers */
+#define COVER_CACHE_SIZE        (16 * 1024 * 1024)
+
+/* Version of the meta.db layout, stored as PRAGMA user_version */
+#define SCHEMA_VERSION          13
+
+/* Share of the filter term's trigrams a book needs for a fuzzy match */
+#define FUZZY_MATCH_THRESHOLD   0.6
+
+/* Seconds without changes before the snapshot is rewritten */
+#define SNAPSHOT_DELAY          10
+
+/* Removed books deleted per transaction, keeps the main thread responsive */
+#define PURGE_BATCH_SIZE        256
+
+/* Books filled in per transaction by the backfill after an upgrade */
+#define BACKFILL_BATCH_SIZE     32
+
+/* Milliseconds to wait for the other connection to release the database */
+#define BUSY_TIMEOUT            5000
+
+typedef struct _BooksRow BooksRow;
+typedef struct _PurgeJob PurgeJob;
+typedef struct _MissingCheck MissingCheck;
+typedef struct _VerifyJob VerifyJob;
+
+static gchar    *get_author_title_markup     (const gchar *author, const gchar *title);
+static gchar    *get_series_label            (const gchar *series, gdouble index);
+static void      forget_book                 (BooksCollectionPrivate *priv, sqlite3_stmt *select_stmt);
+static void      delete_book_from_db         (BooksCollectionPrivate *priv, const gchar *path);
+static gchar    *get_search_key              (const gchar *author, const gchar *title, const gchar *series);
+static gchar    *get_author_sort_name        (const gchar *author);
+static void      bind_sort_keys              (sqlite3_stmt *stmt, gint column, const gchar *author_sort, const gchar *title);
+static void      bind_series_key             (sqlite3_stmt *stmt, gint column, const gchar *series);
+static void      refresh_model               (BooksCollection *collection);
+static void      schedule_refresh            (BooksCollection *collection);
+static void      mark_changed                (BooksCollection *collection);
+static gboolean  execute_sql                 (BooksCollectionPrivate *priv, const gchar *sql);
+static gint64    get_path_id                 (BooksCollectionPrivate *priv, const gchar *path);
+static BooksRow *lookup_row                  (BooksCollectionPrivate *priv, guint index);
+static gchar    *get_row_path                (const BooksRow *row);
+static void      set_row_path                (BooksCollectionPrivate *priv, BooksRow *row, const gchar *path);
+static void      forget_row                  (BooksCollectionPrivate *priv, BooksRow *row);
+static void      on_cover_loaded             (BooksCoverCache *cache, const gchar *thumbnail, BooksCollection *collection);
+static void      on_missing_books_found      (BooksCollection *collection, GAsyncResult *result, gpointer user_data);
+static void      find_missing_books_thread   (GTask *task, BooksCollection *collection, MissingCheck *check, GCancellable *cancellable);
+static void      free_missing_check          (MissingCheck *check);
+static void      on_books_purged             (BooksCollection *collection, GAsyncResult *result, gpointer user_data);
+static void      purge_books_thread          (GTask *task, BooksCollection *collection, PurgeJob *job, GCancellable *cancellable);
+static void      free_purge_job              (PurgeJob *job);
+static void      verify_books_thread         (GTask *task, BooksCollection *collection, VerifyJob *job, GCancellable *cancellable);
+static void      free_verify_job             (VerifyJob *job);
+static void      on_books_backfilled         (BooksCollection *collection, GAsyncResult *result, gpointer user_data);
+static void      backfill_books_thread       (GTask *task, BooksCollection *collection, const gchar *db_path, GCancellable *cancellable);
+
+enum {
+    PROP_0,
+    PROP_FILTER_TERM,
+    PROP_LIBRARY
+};
+
+enum {
+    BOOKS_REMOVED,
+    LAST_SIGNAL
+};
+
+static guint collection_signals[LAST_SIGNAL] = { 0 };
+
+/* Strings that repeat across books come from the string pool */
+struct _BooksRow {
+    gint64       id;
+    const gchar *author;
+    gchar       *title;
+    const gchar *folder;
+    gchar       *name;
+    const gchar *cover;
+    gchar       *thumbnail;
+    const gchar *series;
+    GList        link;
+};
+
+struct _BooksCollectionPrivate {
+    sqlite3         *db;
+    gchar           *db_path;
+
+    /* Value of the library property, NULL for the default library */
+    gchar           *library;
+
+    gchar           *filter_term;
+    GdkPixbuf       *placeholder;
+
+    /* Normalized filter term and search keys of all books, see get_search_key */
+    gchar           *search_term;
+    BooksSearchIndex *search_index;
+
+    /* Shelf terms of the filter, see split_filter_term */
+    BooksTags       *tags;
+    gchar          **shelf_terms;
+
+    /* Removed books, hidden until they are purged */
+    BooksBitmap     *tombstones;
+
+    /* Books on shares that could not be reached, kept but shown dimmed */
+    BooksBitmap     *offline;
+    BooksListingCache *listings;
+
+    /* Maps ids of books that failed verification to the problem found */
+    GHashTable      *damaged;
+
+    /* Book ids in display order, i.e. filtered and sorted */
+    GArray          *ids;
+
+    /* Books are narrowed down to @facet_value of @facet_kind if set */
+    BooksFacets     *facets;
+    BooksFacetKind   facet_kind;
+    gchar           *facet_value;
+
+    /* Row cache, maps book ids to rows */
+    GHashTable      *rows;
+    GQueue           lru;
+    BooksStringPool *strings;
+
+    /* Ids imported again since the last refresh, announced as changed */
+    GHashTable      *reimported;
+    sqlite3_stmt    *page_stmt;
+
+    /* Covers are decoded in the background, only for visible rows */
+    BooksCoverCache *covers;
+    GHashTable      *requested;
+    guint            visible_first;
+    guint            visible_last;
+
+    /* Mapped copy of the rows, valid until the collection changes */
+    BooksSnapshot   *snapshot;
+    gchar           *snapshot_path;
+    guint            snapshot_source;
+    gboolean         snapshot_dirty;
+
+    gint             stamp;
+    gint             sort_column_id;
+    GtkSortType      sort_order;
+    guint            refresh_source;
+};
+
+typedef struct {
+    gint64          id;
+    gchar          *path;
+    BooksFileState  state;
+} MissingBook;
+
+/* The books of one folder, looked up together */
+typedef struct {
+    gchar       *path;
+    GPtrArray   *books;
+} MissingFolder;
+
+struct _MissingCheck {
+    gchar               *db_path;
+    BooksLibraryLocation location;
+    BooksListingCache   *listings;
+};
+
+typedef struct {
+    gchar      **missing;
+    GArray      *offline;
+} MissingResult;
+
+struct _PurgeJob {
+    gchar       *db_path;
+    gchar      **other_db_paths;
+    GArray      *ids;
+};
+
+struct _VerifyJob {
+    gchar       *db_path;
+    guint64      rate;
+};
+
+/* Result of a book whose state changed, handed to the main thread */
+typedef struct {
+    BooksCollection *collection;
+    gchar           *db_path;
+    gint64           id;
+    gchar           *problem;
+} VerifyReport;
+
+/**
+ * Creates a collection showing the library stored in the database file
+ * @library, or the default library if %NULL.
+ */
+BooksCollection *
+books_collection_new (const gchar *library)
+{
+    return BOOKS_COLLECTION (g_object_new (BOOKS_TYPE_COLLECTION, "library", library, NULL));
+}
+
+GtkTreeModel *
+books_collection_get_model (BooksCollection *collection)
+{
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+    return GTK_TREE_MODEL (collection);
+}
+
+/**
+ * Returns the path of the database the collection shows, for readers in
+ * other threads.
+ */
+const gchar *
+books_collection_get_database (BooksCollection *collection)
+{
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+    return collection->priv->db_path;
+}
+
+static void
+insert_facet (BooksCollectionPrivate *priv,
+              gint64 id,
+              BooksFacetKind kind,
+              const gchar *value)
+{
+    const gchar *insert_sql = "INSERT OR IGNORE INTO facets (book_id, kind, value) VALUES (?, ?, ?)";
+    sqlite3_stmt *insert_stmt = NULL;
+
+    sqlite3_prepare_v2 (priv->db, insert_sql, -1, &insert_stmt, NULL);
+    sqlite3_bind_int64 (insert_stmt, 1, id);
+    sqlite3_bind_int (insert_stmt, 2, kind);
+    sqlite3_bind_text (insert_stmt, 3, value, strlen (value), NULL);
+    sqlite3_step (insert_stmt);
+    sqlite3_finalize (insert_stmt);
+}
+
+static void
+insert_facets (BooksCollectionPrivate *priv,
+               gint64 id,
+               BooksFacetKind kind,
+               gchar **values)
+{
+    guint i;
+
+    for (i = 0; values[i] != NULL; i++)
+        insert_facet (priv, id, kind, values[i]);
+}
+
+/*
+ * Hands what the reader stored for the book @from over to the book @to.
+ * Deleting a book drops these rows by trigger, so while a book is
+ * imported again they are parked under its negated id.
+ */
+static void
+move_reader_data (BooksCollectionPrivate *priv,
+                  gint64 from,
+                  gint64 to)
+{
+    static const gchar *move_sql[] = {
+        "UPDATE OR REPLACE positions SET book_id = ?2 WHERE book_id = ?1",
+        "UPDATE OR REPLACE annotations SET book_id = ?2 WHERE book_id = ?1",
+        NULL
+    };
+    guint i;
+
+    for (i = 0; move_sql[i] != NULL; i++) {
+        sqlite3_stmt *move_stmt = NULL;
+
+        sqlite3_prepare_v2 (priv->db, move_sql[i], -1, &move_stmt, NULL);
+        sqlite3_bind_int64 (move_stmt, 1, from);
+        sqlite3_bind_int64 (move_stmt, 2, to);
+        sqlite3_step (move_stmt);
+        sqlite3_finalize (move_stmt);
+    }
+}
+
+/**
+ * Adds the book in @path to the collection, replacing an entry of the
+ * same file. @content_hash is computed if it is %NULL.
+ */
+void
+books_collection_add_book (BooksCollection *collection,
+                           BooksEpub *epub,
+                           const gchar *path,
+                           const gchar *content_hash)
+{
+    BooksCollectionPrivate *priv;
+    const gchar *author;
+    const gchar *title;
+    const gchar *cover;
+    const gchar *empty = "";
+    const gchar *insert_sql = "INSERT INTO books (author, title, path, cover, size, mtime, thumbnail, search_key, "
+                              "                   author_sort, author_key, title_key, content_hash, identifier, "
+                              "                   series, series_index, series_key) "
+                              "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    sqlite3_stmt *insert_stmt = NULL;
+    gchar *thumbnail = NULL;
+    gchar *search_key;
+    gchar *author_sort;
+    gchar *computed_hash = NULL;
+    gchar *identifier;
+    gchar *series;
+    gdouble series_index;
+    gchar **languages;
+    gchar **subjects;
+    gchar **shelves;
+    BooksRow *row;
+    gint64 old_id;
+    gint64 id;
+    gboolean inserted;
+    guint i;
+    GStatBuf buf;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    priv = collection->priv;
+    author = books_epub_get_meta (epub, "creator");
+    title = books_epub_get_meta (epub, "title");
+    cover = books_epub_get_cover (epub);
+
+    if (author == NULL)
+        author = "n/a";
+
+    if (title == NULL)
+        title = empty;
+
+    author_sort = books_epub_get_author_sort (epub);
+
+    if (author_sort == NULL)
+        author_sort = get_author_sort_name (author);
+
+    if (content_hash == NULL)
+        content_hash = computed_hash = books_content_hash_compute (path, NULL, NULL);
+
+    identifier = books_epub_get_identifier (epub);
+    series = books_epub_get_series (epub, &series_index);
+
+    mark_changed (collection);
+    sqlite3_exec (priv->db, "SAVEPOINT add_book", NULL, NULL, NULL);
+
+    /*
+     * Paths are unique, a book imported again replaces the old entry but
+     * stays on its shelves and keeps reading position and annotations.
+     */
+    old_id = get_path_id (priv, path);
+    shelves = books_tags_get_book_tags (priv->tags, old_id);
+
+    if (old_id > 0)
+        move_reader_data (priv, old_id, -old_id);
+
+    delete_book_from_db (priv, path);
+
+    sqlite3_prepare_v2 (priv->db, insert_sql, -1, &insert_stmt, NULL);
+    sqlite3_bind_text (insert_stmt, 1, author, strlen (author), NULL);
+    sqlite3_bind_text (insert_stmt, 2, title, strlen (title), NULL);
+    sqlite3_bind_text (insert_stmt, 3, path, strlen (path), NULL);
+
+    if (cover != NULL)
+        sqlite3_bind_text (insert_stmt, 4, cover, strlen (cover), NULL);
+    else
+        sqlite3_bind_text (insert_stmt, 4, empty, strlen (empty), NULL);
+
+    /* Remember size and modification time so that rescans can skip the book */
+    if (g_stat (path, &buf) == 0) {
+        thumbnail = books_thumbnail_get_name (path, buf.st_size, buf.st_mtime);
+        sqlite3_bind_int64 (insert_stmt, 5, buf.st_size);
+        sqlite3_bind_int64 (insert_stmt, 6, buf.st_mtime);
+        sqlite3_bind_text (insert_stmt, 7, thumbnail, strlen (thumbnail), NULL);
+    }
+
+    search_key = get_search_key (author, title, series);
+    sqlite3_bind_text (insert_stmt, 8, search_key, strlen (search_key), NULL);
+    sqlite3_bind_text (insert_stmt, 9, author_sort, strlen (author_sort), NULL);
+    bind_sort_keys (insert_stmt, 10, author_sort, title);
+
+    if (content_hash != NULL)
+        sqlite3_bind_text (insert_stmt, 12, content_hash, strlen (content_hash), NULL);
+
+    if (identifier != NULL)
+        sqlite3_bind_text (insert_stmt, 13, identifier, strlen (identifier), NULL);
+
+    if (series != NULL) {
+        sqlite3_bind_text (insert_stmt, 14, series, strlen (series), NULL);
+        sqlite3_bind_double (insert_stmt, 15, series_index);
+        bind_series_key (insert_stmt, 16, series);
+    }
+
+    inserted = sqlite3_step (insert_stmt) == SQLITE_DONE;
+    sqlite3_finalize (insert_stmt);
+    g_free (author_sort);
+    g_free (thumbnail);
+    g_free (computed_hash);
+    g_free (identifier);
+
+    id = sqlite3_last_insert_rowid (priv->db);
+
+    /* Ids are reused, a purge in flight may have just freed this one */
+    if (inserted && books_bitmap_contains (priv->tombstones, (guint32) id)) {
+        books_bitmap_remove (priv->tombstones, (guint32) id);
+
+        if (priv->search_index != NULL)
+            books_search_index_remove (priv->search_index, id);
+
+        books_tags_forget_book (priv->tags, id);
+    }
+
+    if (old_id > 0 && inserted)
+        move_reader_data (priv, -old_id, id);
+
+    languages = books_epub_get_meta_list (epub, "language");
+    subjects = books_epub_get_meta_list (epub, "subject");
+
+    for (i = 0; languages[i] != NULL; i++) {
+        gchar *language;
+
+        language = g_ascii_strdown (languages[i], -1);
+        g_free (languages[i]);
+        languages[i] = language;
+    }
+
+    insert_facet (priv, id, BOOKS_FACET_AUTHOR, author);
+    insert_facets (priv, id, BOOKS_FACET_LANGUAGE, languages);
+    insert_facets (priv, id, BOOKS_FACET_SUBJECT, subjects);
+
+    if (series != NULL)
+        insert_facet (priv, id, BOOKS_FACET_SERIES, series);
+
+    for (i = 0; shelves[i] != NULL; i++) {
+        GArray *ids;
+
+        ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+        g_array_append_val (ids, id);
+        books_tags_add (priv->tags, shelves[i], ids);
+        g_array_free (ids, TRUE);
+    }
+
+    g_strfreev (shelves);
+    g_free (series);
+    g_strfreev (languages);
+    g_strfreev (subjects);
+
+    sqlite3_exec (priv->db, "RELEASE add_book", NULL, NULL, NULL);
+
+    if (priv->search_index != NULL)
+        books_search_index_add (priv->search_index, id, search_key);
+
+    g_free (search_key);
+
+    /* SQLite hands out the id of the replaced book again if it was the last */
+    row = g_hash_table_lookup (priv->rows, &id);
+
+    if (row != NULL)
+        forget_row (priv, row);
+
+    g_hash_table_remove (priv->damaged, &id);
+    g_hash_table_add (priv->reimported, g_memdup (&id, sizeof (gint64)));
+
+    /* Imports arrive in bursts, the views are updated once per burst */
+    schedule_refresh (collection);
+}
+
+/*
+ * Returns the id of the book in @path or -1 if there is none.
+ */
+static gint64
+get_path_id (BooksCollectionPrivate *priv,
+             const gchar *path)
+{
+    const gchar *select_sql = "SELECT id FROM books WHERE path = ?";
+    sqlite3_stmt *select_stmt = NULL;
+    gint64 id = -1;
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_text (select_stmt, 1, path, strlen (path), NULL);
+
+    if (sqlite3_step (select_stmt) == SQLITE_ROW)
+        id = sqlite3_column_int64 (select_stmt, 0);
+
+    sqlite3_finalize (select_stmt);
+    return id;
+}
+
+static gboolean
+has_path (BooksCollectionPrivate *priv,
+          const gchar *path)
+{
+    return get_path_id (priv, path) >= 0;
+}
+
+/*
+ * Looks for another file with the same contents first, then for one with
+ * the same identifier. Both are single lookups on an index.
+ */
+static BooksDuplicate *
+find_duplicate (BooksCollectionPrivate *priv,
+                const gchar *path,
+                const gchar *content_hash,
+                const gchar *identifier)
+{
+    const gchar *select_sql[] = {
+        "SELECT id, path FROM books WHERE content_hash = ?1 AND path != ?2 AND NOT removed LIMIT 1",
+        "SELECT id, path FROM books WHERE identifier = ?1 AND path != ?2 AND NOT removed LIMIT 1"
+    };
+    const gchar *keys[] = { content_hash, identifier };
+    BooksDuplicate *duplicate = NULL;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (keys) && duplicate == NULL; i++) {
+        sqlite3_stmt *select_stmt = NULL;
+
+        if (keys[i] == NULL)
+            continue;
+
+        sqlite3_prepare_v2 (priv->db, select_sql[i], -1, &select_stmt, NULL);
+        sqlite3_bind_text (select_stmt, 1, keys[i], strlen (keys[i]), NULL);
+        sqlite3_bind_text (select_stmt, 2, path, strlen (path), NULL);
+
+        if (sqlite3_step (select_stmt) == SQLITE_ROW) {
+            duplicate = g_new0 (BooksDuplicate, 1);
+            duplicate->id = sqlite3_column_int64 (select_stmt, 0);
+            duplicate->existing_path = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+            duplicate->path = g_strdup (path);
+            duplicate->content_hash = g_strdup (content_hash);
+            duplicate->exact = i == 0;
+        }
+
+        sqlite3_finalize (select_stmt);
+    }
+
+    return duplicate;
+}
+
+/**
+ * Adds the book in @path like books_collection_add_book(), unless it is a
+ * copy or another edition of a book in the collection. In that case
+ * nothing is added and the duplicate is returned, to be merged or skipped
+ * by the user. Exact copies of books whose file is gone are taken as
+ * moved and merged right away.
+ *
+ * @epub may be %NULL if the caller already knows @content_hash to be in
+ * the collection and did not bother opening the file.
+ */
+BooksDuplicate *
+books_collection_add_unique_book (BooksCollection *collection,
+                                  BooksEpub *epub,
+                                  const gchar *path,
+                                  const gchar *content_hash)
+{
+    BooksCollectionPrivate *priv;
+    BooksDuplicate *duplicate = NULL;
+    GError *error = NULL;
+
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+    priv = collection->priv;
+
+    /* A known file that changed is an update and never a duplicate */
+    if (!has_path (priv, path)) {
+        gchar *identifier;
+
+        identifier = epub != NULL ? books_epub_get_identifier (epub) : NULL;
+        duplicate = find_duplicate (priv, path, content_hash, identifier);
+        g_free (identifier);
+    }
+
+    if (duplicate != NULL) {
+        if (!duplicate->exact || g_file_test (duplicate->existing_path, G_FILE_TEST_EXISTS))
+            return duplicate;
+
+        books_collection_merge_book (collection, duplicate->id, path, content_hash);
+        books_duplicate_free (duplicate);
+        return NULL;
+    }
+
+    /* The copy it was taken for has been removed in the meantime */
+    if (epub == NULL) {
+        BooksEpub *opened;
+
+        opened = books_epub_new ();
+
+        if (books_epub_open (opened, path, &error))
+            books_collection_add_book (collection, opened, path, content_hash);
+        else {
+            g_printerr ("%s\n", error->message);
+            g_error_free (error);
+        }
+
+        g_object_unref (opened);
+        return NULL;
+    }
+
+    books_collection_add_book (collection, epub, path, content_hash);
+    return NULL;
+}
+
+static void
+skip_file (BooksCollectionPrivate *priv,
+           const gchar *path,
+           const gchar *content_hash)
+{
+    const gchar *insert_sql = "INSERT OR REPLACE INTO skipped_files (path, size, mtime, content_hash) "
+                              "VALUES (?, ?, ?, ?)";
+    sqlite3_stmt *insert_stmt = NULL;
+    GStatBuf buf;
+
+    if (g_stat (path, &buf) != 0)
+        return;
+
+    sqlite3_prepare_v2 (priv->db, insert_sql, -1, &insert_stmt, NULL);
+    sqlite3_bind_text (insert_stmt, 1, path, strlen (path), NULL);
+    sqlite3_bind_int64 (insert_stmt, 2, buf.st_size);
+    sqlite3_bind_int64 (insert_stmt, 3, buf.st_mtime);
+
+    if (content_hash != NULL)
+        sqlite3_bind_text (insert_stmt, 4, content_hash, strlen (content_hash), NULL);
+
+    sqlite3_step (insert_stmt);
+    sqlite3_finalize (insert_stmt);
+}
+
+static void
+remove_scanned_thumbnail (const gchar *path)
+{
+    GStatBuf buf;
+
+    /* Created by the scanner before the file turned out to be a duplicate */
+    if (g_stat (path, &buf) == 0) {
+        gchar *thumbnail;
+
+        thumbnail = books_thumbnail_get_name (path, buf.st_size, buf.st_mtime);
+        books_thumbnail_remove (thumbnail);
+        g_free (thumbnail);
+    }
+}
+
+/**
+ * Points the book @id to the file in @path, keeping its metadata. Its
+ * previous file is not picked up again by rescans if it still exists.
+ */
+void
+books_collection_merge_book (BooksCollection *collection,
+                             gint64 id,
+                             const gchar *path,
+                             const gchar *content_hash)
+{
+    BooksCollectionPrivate *priv;
+    const gchar *select_sql = "SELECT path, content_hash FROM books WHERE id = ?";
+    const gchar *update_sql = "UPDATE books SET path = ?1, size = ?2, mtime = ?3, content_hash = ?4 WHERE id = ?5";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *update_stmt = NULL;
+    gchar *old_path = NULL;
+    gchar *old_hash = NULL;
+    BooksRow *row;
+    GStatBuf buf;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    priv = collection->priv;
+
+    if (g_stat (path, &buf) != 0)
+        return;
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_int64 (select_stmt, 1, id);
+
+    if (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        old_path = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 0));
+        old_hash = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+    }
+
+    sqlite3_finalize (select_stmt);
+
+    if (old_path == NULL)
+        return;
+
+    mark_changed (collection);
+    sqlite3_exec (priv->db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+    delete_book_from_db (priv, path);
+    skip_file (priv, old_path, old_hash);
+
+    /* The thumbnail name is kept, the cover has not changed */
+    sqlite3_prepare_v2 (priv->db, update_sql, -1, &update_stmt, NULL);
+    sqlite3_bind_text (update_stmt, 1, path, strlen (path), NULL);
+    sqlite3_bind_int64 (update_stmt, 2, buf.st_size);
+    sqlite3_bind_int64 (update_stmt, 3, buf.st_mtime);
+
+    if (content_hash != NULL)
+        sqlite3_bind_text (update_stmt, 4, content_hash, strlen (content_hash), NULL);
+
+    sqlite3_bind_int64 (update_stmt, 5, id);
+    sqlite3_step (update_stmt);
+    sqlite3_finalize (update_stmt);
+
+    sqlite3_exec (priv->db, "COMMIT TRANSACTION", NULL, NULL, NULL);
+    remove_scanned_thumbnail (path);
+
+    /* Paths are not displayed, the cached row is patched in place */
+    row = g_hash_table_lookup (priv->rows, &id);
+
+    if (row != NULL)
+        set_row_path (priv, row, path);
+
+    g_free (old_path);
+    g_free (old_hash);
+
+    /* In case @path belonged to another book before */
+    schedule_refresh (collection);
+}
+
+/**
+ * Keeps the duplicate in @path out of the collection, also on later
+ * rescans as long as it does not change.
+ */
+void
+books_collection_skip_file (BooksCollection *collection,
+                            const gchar *path,
+                            const gchar *content_hash)
+{
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    skip_file (collection->priv, path, content_hash);
+    remove_scanned_thumbnail (path);
+}
+
+void
+books_duplicate_free (BooksDuplicate *duplicate)
+{
+    if (duplicate == NULL)
+        return;
+
+    g_free (duplicate->existing_path);
+    g_free (duplicate->path);
+    g_free (duplicate->content_hash);
+    g_free (duplicate);
+}
+
+void
+books_collection_remove_book (BooksCollection *collection,
+                              GtkTreeIter *iter)
+{
+    GArray *ids;
+    gint64 id;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+    g_return_if_fail (iter->stamp == collection->priv->stamp);
+
+    ids = g_array_sized_new (FALSE, FALSE, sizeof (gint64), 1);
+    id = g_array_index (collection->priv->ids, gint64, GPOINTER_TO_UINT (iter->user_data));
+    g_array_append_val (ids, id);
+
+    books_collection_remove_books (collection, ids);
+    g_array_free (ids, TRUE);
+}
+
+/*
+ * Sets the removed flag of @ids to @removed and mirrors it in the
+ * tombstones. Returns %TRUE if any book changed.
+ */
+static gboolean
+set_removed (BooksCollection *collection,
+             GArray *ids,
+             gboolean removed)
+{
+    BooksCollectionPrivate *priv;
+    const gchar *update_sql = "UPDATE books SET removed = ?1 WHERE id = ?2 AND removed != ?1";
+    sqlite3_stmt *update_stmt = NULL;
+    gboolean changed = FALSE;
+    guint i;
+
+    if (ids->len == 0)
+        return FALSE;
+
+    priv = collection->priv;
+    mark_changed (collection);
+
+    sqlite3_prepare_v2 (priv->db, update_sql, -1, &update_stmt, NULL);
+    sqlite3_exec (priv->db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+    for (i = 0; i < ids->len; i++) {
+        gint64 id;
+
+        id = g_array_index (ids, gint64, i);
+
+        sqlite3_reset (update_stmt);
+        sqlite3_bind_int (update_stmt, 1, removed);
+        sqlite3_bind_int64 (update_stmt, 2, id);
+        sqlite3_step (update_stmt);
+
+        if (sqlite3_changes (priv->db) == 0 || id < 0 || id > G_MAXUINT32)
+            continue;
+
+        if (removed)
+            books_bitmap_add (priv->tombstones, (guint32) id);
+        else
+            books_bitmap_remove (priv->tombstones, (guint32) id);
+
+        changed = TRUE;
+    }
+
+    sqlite3_exec (priv->db, "COMMIT TRANSACTION", NULL, NULL, NULL);
+    sqlite3_finalize (update_stmt);
+
+    return changed;
+}
+
+/**
+ * Removes the books with the given @ids, an array of #gint64 as returned
+ * by books_collection_get_book_id(), all at once. They are only hidden
+ * until books_collection_purge_removed_books() is called and can be
+ * brought back with books_collection_restore_books() until then.
+ */
+void
+books_collection_remove_books (BooksCollection *collection,
+                               GArray *ids)
+{
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    if (set_removed (collection, ids, TRUE))
+        refresh_model (collection);
+}
+
+/**
+ * Undoes books_collection_remove_books() for @ids that have not been
+ * purged yet.
+ */
+void
+books_collection_restore_books (BooksCollection *collection,
+                                GArray *ids)
+{
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    if (set_removed (collection, ids, FALSE))
+        refresh_model (collection);
+}
+
+/**
+ * Deletes all books removed so far for good, in the background. Books
+ * removed while this runs are not affected.
+ */
+void
+books_collection_purge_removed_books (BooksCollection *collection)
+{
+    BooksCollectionPrivate *priv;
+    PurgeJob *job;
+    GTask *task;
+    GSettings *settings;
+    GPtrArray *other_db_paths;
+    gchar **names;
+    guint i;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    priv = collection->priv;
+
+    if (books_bitmap_get_cardinality (priv->tombstones) == 0)
+        return;
+
+    /* All libraries extract into the same place, see is_extract_dir_unshared */
+    settings = g_settings_new ("com.github.matze.books");
+    names = books_libraries_get_names (settings);
+    other_db_paths = g_ptr_array_new ();
+
+    for (i = 0; names[i] != NULL; i++) {
+        gchar *database;
+
+        database = books_libraries_get_database (settings, names[i]);
+
+        if (database == NULL)
+            database = books_libraries_get_default_database ();
+
+        if (g_strcmp0 (database, priv->db_path))
+            g_ptr_array_add (other_db_paths, database);
+        else
+            g_free (database);
+    }
+
+    g_ptr_array_add (other_db_paths, NULL);
+    g_strfreev (names);
+    g_object_unref (settings);
+
+    job = g_new0 (PurgeJob, 1);
+    job->db_path = g_strdup (priv->db_path);
+    job->other_db_paths = (gchar **) g_ptr_array_free (other_db_paths, FALSE);
+    job->ids = books_bitmap_to_array (priv->tombstones);
+
+    task = g_task_new (collection, NULL, (GAsyncReadyCallback) on_books_purged, NULL);
+    g_task_set_task_data (task, job, (GDestroyNotify) free_purge_job);
+    g_task_run_in_thread (task, (GTaskThreadFunc) purge_books_thread);
+    g_object_unref (task);
+}
+
+void
+books_collection_remove_path (BooksCollection *collection,
+                              const gchar *path)
+{
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    mark_changed (collection);
+    delete_book_from_db (collection->priv, path);
+    refresh_model (collection);
+}
+
+void
+books_collection_remove_paths (BooksCollection *collection,
+                               const gchar * const *paths)
+{
+    BooksCollectionPrivate *priv;
+    guint i;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+    priv = collection->priv;
+    mark_changed (collection);
+
+    sqlite3_exec (priv->db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+    for (i = 0; paths[i] != NULL; i++)
+        delete_book_from_db (priv, paths[i]);
+
+    sqlite3_exec (priv->db, "COMMIT TRANSACTION", NULL, NULL, NULL);
+
+    /* A single model update instead of one per book */
+    refresh_model (collection);
+}
+
+/**
+ * Looks for books whose files are gone in the background and removes
+ * them. Books in folders that cannot be reached are marked unavailable
+ * instead. @location tells whether to treat folders as remote.
+ */
+void
+books_collection_check_missing_books (BooksCollection *collection,
+                                      BooksLibraryLocation location)
+{
+    MissingCheck *check;
+    GTask *task;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    check = g_new0 (MissingCheck, 1);
+    check->db_path = g_strdup (collection->priv->db_path);
+    check->location = location;
+    check->listings = collection->priv->listings;
+
+    task = g_task_new (collection, NULL, (GAsyncReadyCallback) on_missing_books_found, NULL);
+    g_task_set_task_data (task, check, (GDestroyNotify) free_missing_check);
+    g_task_set_priority (task, G_PRIORITY_LOW);
+    g_task_run_in_thread (task, (GTaskThreadFunc) find_missing_books_thread);
+    g_object_unref (task);
+}
+
+/**
+ * Checks the archives of books added or changed since their last check in
+ * the background, reading no more than @bytes_per_second. Results are
+ * kept in the database as they come in, so a cancelled run goes on where
+ * it stopped next time. Damaged books are flagged in the model.
+ */
+void
+books_collection_verify_books (BooksCollection *collection,
+                               guint64 bytes_per_second,
+                               GCancellable *cancellable)
+{
+    VerifyJob *job;
+    GTask *task;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    job = g_new0 (VerifyJob, 1);
+    job->db_path = g_strdup (collection->priv->db_path);
+    job->rate = bytes_per_second;
+
+    task = g_task_new (collection, cancellable, NULL, NULL);
+    g_task_set_task_data (task, job, (GDestroyNotify) free_verify_job);
+    g_task_set_priority (task, G_PRIORITY_LOW);
+    g_task_run_in_thread (task, (GTaskThreadFunc) verify_books_thread);
+    g_object_unref (task);
+}
+
+void
+books_collection_remove_folder (BooksCollection *collection,
+                                const gchar *folder)
+{
+    BooksCollectionPrivate *priv;
+    gchar *prefix;
+    gchar *end;
+    const gchar *select_sql = "SELECT id, thumbnail FROM books WHERE path >= ?1 AND path < ?2";
+    const gchar *remove_sql = "DELETE FROM books WHERE path >= ?1 AND path < ?2";
+    const gchar *skipped_sql = "DELETE FROM skipped_files WHERE path >= ?1 AND path < ?2";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *remove_stmt = NULL;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+    priv = collection->priv;
+    mark_changed (collection);
+
+    /* All paths below the folder, as a range on the path index */
+    prefix = g_strconcat (folder, G_DIR_SEPARATOR_S, NULL);
+    end = g_strconcat (folder, PATH_RANGE_END, NULL);
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_text (select_stmt, 1, prefix, strlen (prefix), NULL);
+    sqlite3_bind_text (select_stmt, 2, end, strlen (end), NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW)
+        forget_book (priv, select_stmt);
+
+    sqlite3_finalize (select_stmt);
+
+    sqlite3_prepare_v2 (priv->db, remove_sql, -1, &remove_stmt, NULL);
+    sqlite3_bind_text (remove_stmt, 1, prefix, strlen (prefix), NULL);
+    sqlite3_bind_text (remove_stmt, 2, end, strlen (end), NULL);
+    sqlite3_step (remove_stmt);
+    sqlite3_finalize (remove_stmt);
+
+    sqlite3_prepare_v2 (priv->db, skipped_sql, -1, &remove_stmt, NULL);
+    sqlite3_bind_text (remove_stmt, 1, prefix, strlen (prefix), NULL);
+    sqlite3_bind_text (remove_stmt, 2, end, strlen (end), NULL);
+    sqlite3_step (remove_stmt);
+    sqlite3_finalize (remove_stmt);
+
+    g_free (prefix);
+    g_free (end);
+    refresh_model (collection);
+}
+
+void
+books_collection_rename_path (BooksCollection *collection,
+                              const gchar *old_path,
+                              const gchar *new_path)
+{
+    BooksCollectionPrivate *priv;
+    GHashTableIter iter;
+    BooksRow *row;
+    gchar *prefix;
+    gchar *end;
+    const gchar *rename_sql = "UPDATE books SET path = ?2 || substr(path, length(?1) + 1) "
+                              "WHERE path = ?1 OR (path >= ?3 AND path < ?4)";
+    sqlite3_stmt *rename_stmt = NULL;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+    priv = collection->priv;
+    prefix = g_strconcat (old_path, G_DIR_SEPARATOR_S, NULL);
+    end = g_strconcat (old_path, PATH_RANGE_END, NULL);
+    mark_changed (collection);
+
+    /* Books below a renamed directory move along with it */
+    sqlite3_prepare_v2 (priv->db, rename_sql, -1, &rename_stmt, NULL);
+    sqlite3_bind_text (rename_stmt, 1, old_path, strlen (old_path), NULL);
+    sqlite3_bind_text (rename_stmt, 2, new_path, strlen (new_path), NULL);
+    sqlite3_bind_text (rename_stmt, 3, prefix, strlen (prefix), NULL);
+    sqlite3_bind_text (rename_stmt, 4, end, strlen (end), NULL);
+    sqlite3_step (rename_stmt);
+    sqlite3_finalize (rename_stmt);
+
+    g_free (prefix);
+    g_free (end);
+
+    /* Paths are not displayed, so cached rows are patched in place */
+    g_hash_table_iter_init (&iter, priv->rows);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &row)) {
+        gsize old_length;
+        gchar *path;
+
+        old_length = strlen (old_path);
+        path = get_row_path (row);
+
+        if (!strncmp (path, old_path, old_length) &&
+            (path[old_length] == '\0' || path[old_length] == G_DIR_SEPARATOR)) {
+            gchar *renamed;
+
+            renamed = g_strconcat (new_path, path + old_length, NULL);
+            set_row_path (priv, row, renamed);
+            g_free (renamed);
+        }
+
+        g_free (path);
+    }
+}
+
+GHashTable *
+books_collection_get_file_stamps (BooksCollection *collection)
+{
+    BooksCollectionPrivate *priv;
+    GHashTable *stamps;
+    const gchar *select_sql = "SELECT path, size, mtime FROM books "
+                              "UNION ALL SELECT path, size, mtime FROM skipped_files";
+    sqlite3_stmt *select_stmt = NULL;
+
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+
+    priv = collection->priv;
+    stamps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        BooksFileStamp *stamp;
+
+        stamp = g_new0 (BooksFileStamp, 1);
+        stamp->size = sqlite3_column_int64 (select_stmt, 1);
+        stamp->mtime = sqlite3_column_int64 (select_stmt, 2);
+        g_hash_table_insert (stamps, g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 0)), stamp);
+    }
+
+    sqlite3_finalize (select_stmt);
+    return stamps;
+}
+
+/**
+ * Returns the content hashes of all books as set.
+ */
+GHashTable *
+books_collection_get_content_hashes (BooksCollection *collection)
+{
+    GHashTable *hashes;
+    const gchar *select_sql = "SELECT content_hash FROM books WHERE content_hash IS NOT NULL AND NOT removed";
+    sqlite3_stmt *select_stmt = NULL;
+
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+
+    hashes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    sqlite3_prepare_v2 (collection->priv->db, select_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW)
+        g_hash_table_add (hashes, g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 0)));
+
+    sqlite3_finalize (select_stmt);
+    return hashes;
+}
+
+/**
+ * Queues decoding the covers of the rows between @start and @end plus one
+ * screen worth of rows on either side. Covers of rows that have been
+ * requested before but are out of range now are not decoded anymore.
+ */
+void
+books_collection_request_covers (BooksCollection *collection,
+                                 GtkTreePath *start,
+                                 GtkTreePath *end)
+{
+    BooksCollectionPrivate *priv;
+    guint first;
+    guint last;
+    guint margin;
+    guint i;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    priv = collection->priv;
+
+    if (priv->ids->len == 0)
+        return;
+
+    first = MIN (gtk_tree_path_get_indices (start)[0], priv->ids->len - 1);
+    last = MIN (gtk_tree_path_get_indices (end)[0], priv->ids->len - 1);
+
+    if (first > last)
+        return;
+
+    margin = last - first + 1;
+    priv->visible_first = first > margin ? first - margin : 0;
+    priv->visible_last = MIN (last + margin, priv->ids->len - 1);
+
+    books_cover_cache_begin_requests (priv->covers);
+    g_hash_table_remove_all (priv->requested);
+
+    for (i = priv->visible_first; i <= priv->visible_last; i++) {
+        BooksRow *row;
+
+        row = lookup_row (priv, i);
+
+        if (row == NULL || row->cover == NULL || *row->cover == '\0')
+            continue;
+
+        if (books_cover_cache_lookup (priv->covers, row->thumbnail) != NULL)
+            continue;
+
+        g_hash_table_insert (priv->requested, g_strdup (row->thumbnail), g_memdup (&row->id, sizeof (gint64)));
+        books_cover_cache_request (priv->covers, row->thumbnail, row->cover);
+    }
+}
+
+/**
+ * Returns the authors, languages and subjects of all books with the
+ * number of books for each, see #BooksFacets.
+ */
+GtkTreeModel *
+books_collection_get_facets (BooksCollection *collection)
+{
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+    return books_facets_get_model (collection->priv->facets);
+}
+
+/**
+ * Shows only books with @value as @kind, e.g. books of one author, or
+ * all books again if @value is %NULL. The filter term still applies.
+ */
+void
+books_collection_set_facet (BooksCollection *collection,
+                            BooksFacetKind kind,
+                            const gchar *value)
+{
+    BooksCollectionPrivate *priv;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+
+    priv = collection->priv;
+
+    if (priv->facet_kind == kind && !g_strcmp0 (priv->facet_value, value))
+        return;
+
+    g_free (priv->facet_value);
+    priv->facet_kind = kind;
+    priv->facet_value = g_strdup (value);
+    refresh_model (collection);
+}
+
+/**
+ * Returns the names of all shelves. Free with g_strfreev().
+ */
+gchar **
+books_collection_get_shelves (BooksCollection *collection)
+{
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+    return books_tags_get_names (collection->priv->tags);
+}
+
+/**
+ * Puts the books @ids on @shelf, which is created if needed. Shelves
+ * are filtered with terms such as shelf:work in the filter term.
+ */
+void
+books_collection_add_to_shelf (BooksCollection *collection,
+                               GArray *ids,
+                               const gchar *shelf)
+{
+    BooksCollectionPrivate *priv;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+    g_return_if_fail (shelf != NULL && *shelf != '\0');
+
+    priv = collection->priv;
+    books_tags_add (priv->tags, shelf, ids);
+
+    if (priv->shelf_terms != NULL)
+        refresh_model (collection);
+}
+
+void
+books_collection_remove_from_shelf (BooksCollection *collection,
+                                    GArray *ids,
+                                    const gchar *shelf)
+{
+    BooksCollectionPrivate *priv;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+    g_return_if_fail (shelf != NULL);
+
+    priv = collection->priv;
+    books_tags_remove (priv->tags, shelf, ids);
+
+    if (priv->shelf_terms != NULL)
+        refresh_model (collection);
+}
+
+/**
+ * Returns the id of the book at @path or -1 if there is none.
+ */
+gint64
+books_collection_get_book_id (BooksCollection *collection,
+                              GtkTreePath *path)
+{
+    BooksCollectionPrivate *priv;
+    gint index;
+
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), -1);
+
+    priv = collection->priv;
+    index = gtk_tree_path_get_indices (path)[0];
+
+    if (index < 0 || index >= priv->ids->len)
+        return -1;
+
+    return g_array_index (priv->ids, gint64, index);
+}
+
+/**
+ * Looks up where reading of the book at @path stopped. Returns %FALSE if
+ * it has not been opened before. Free the fragment with g_free().
+ */
+gboolean
+books_collection_get_position (BooksCollection *collection,
+                               const gchar *path,
+                               BooksPosition *position)
+{
+    const gchar *select_sql = "SELECT spine_index, fragment, fraction FROM positions "
+                              "JOIN books ON books.id = positions.book_id WHERE books.path = ?";
+    sqlite3_stmt *select_stmt = NULL;
+    gboolean found;
+
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection) && path != NULL, FALSE);
+
+    sqlite3_prepare_v2 (collection->priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_text (select_stmt, 1, path, -1, NULL);
+    found = sqlite3_step (select_stmt) == SQLITE_ROW;
+
+    if (found) {
+        position->index = (guint) sqlite3_column_int (select_stmt, 0);
+        position->fragment = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+        position->fraction = CLAMP (sqlite3_column_double (select_stmt, 2), 0.0, 1.0);
+    }
+
+    sqlite3_finalize (select_stmt);
+    return found;
+}
+
+/**
+ * Remembers @position for the book at @path. Nothing is stored if the
+ * book is not part of the open library.
+ */
+void
+books_collection_set_position (BooksCollection *collection,
+                               const gchar *path,
+                               const BooksPosition *position)
+{
+    const gchar *insert_sql = "INSERT OR REPLACE INTO positions (book_id, spine_index, fragment, fraction) "
+                              "SELECT id, ?2, ?3, ?4 FROM books WHERE path = ?1";
+    sqlite3_stmt *insert_stmt = NULL;
+
+    g_return_if_fail (BOOKS_IS_COLLECTION (collection) && path != NULL && position != NULL);
+
+    sqlite3_prepare_v2 (collection->priv->db, insert_sql, -1, &insert_stmt, NULL);
+    sqlite3_bind_text (insert_stmt, 1, path, -1, NULL);
+    sqlite3_bind_int (insert_stmt, 2, (gint) position->index);
+
+    if (position->fragment != NULL)
+        sqlite3_bind_text (insert_stmt, 3, position->fragment, -1, NULL);
+    else
+        sqlite3_bind_null (insert_stmt, 3);
+
+    sqlite3_bind_double (insert_stmt, 4, position->fraction);
+    sqlite3_step (insert_stmt);
+    sqlite3_finalize (insert_stmt);
+}
+
+/**
+ * Loads the highlights and notes of the book at @path, or returns %NULL
+ * if it is not part of the open library. Free with
+ * books_annotations_free().
+ */
+BooksAnnotations *
+books_collection_get_annotations (BooksCollection *collection,
+                                  const gchar *path)
+{
+    BooksCollectionPrivate *priv;
+    gint64 id;
+
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection) && path != NULL, NULL);
+
+    priv = collection->priv;
+    id = get_path_id (priv, path);
+
+    if (id < 0)
+        return NULL;
+
+    return books_annotations_new (priv->db, priv->db_path, id);
+}
+
+BooksEpub *
+books_collection_get_book (BooksCollection *collection,
+                           GtkTreePath *path,
+                           GError **error)
+{
+    BooksCollectionPrivate *priv;
+    BooksRow *row;
+    BooksEpub *epub;
+    gchar *book_path;
+    gint index;
+
+    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+
+    priv = collection->priv;
+    index = gtk_tree_path_get_indices (path)[0];
+
+    if (index < 0 || index >= priv->ids->len)
+        return NULL;
+
+    row = lookup_row (priv, index);
+
+    if (row == NULL)
+        return NULL;
+
+    book_path = get_row_path (row);
+
+    /* The share may be back, the listing tells without waiting long */
+    if (books_bitmap_contains (priv->offline, (guint32) row->id)) {
+        BooksFileState state;
+        GtkTreeIter iter;
+
+        state = books_listing_cache_lookup (priv->listings, book_path, NULL);
+
+        if (state == BOOKS_FILE_UNREACHABLE) {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_HOST_UNREACHABLE,
+                         _("The folder of “%s” cannot be reached. Check that its share is mounted."),
+                         row->title);
+            g_free (book_path);
+            return NULL;
+        }
+
+        books_bitmap_remove (priv->offline, (guint32) row->id);
+        iter.stamp = priv->stamp;
+        iter.user_data = GINT_TO_POINTER (index);
+        gtk_tree_model_row_changed (GTK_TREE_MODEL (collection), path, &iter);
+    }
+
+    epub = books_epub_new ();
+
+    if (books_epub_open (epub, book_path, error)) {
+        g_free (book_path);
+        return epub;
+    }
+
+    g_free (book_path);
+    g_object_unref (epub);
+    return NULL;
+}
+
+static gchar *
+get_row_path (const BooksRow *row)
+{
+    if (row->folder == NULL)
+        return g_strdup (row->name);
+
+    return g_strconcat (row->folder, G_DIR_SEPARATOR_S, row->name, NULL);
+}
+
+/* Books of a folder share it, only the file name is kept per row */
+static void
+set_row_path (BooksCollectionPrivate *priv,
+              BooksRow *row,
+              const gchar *path)
+{
+    const gchar *separator;
+
+    books_string_pool_release (priv->strings, row->folder);
+    g_free (row->name);
+    separator = path != NULL ? strrchr (path, G_DIR_SEPARATOR) : NULL;
+
+    if (separator != NULL) {
+        gchar *folder;
+
+        folder = g_strndup (path, separator - path);
+        row->folder = books_string_pool_acquire (priv->strings, folder);
+        row->name = g_strdup (separator + 1);
+        g_free (folder);
+    }
+    else {
+        row->folder = NULL;
+        row->name = g_strdup (path);
+    }
+}
+
+static void
+set_row_series (BooksCollectionPrivate *priv,
+                BooksRow *row,
+                const gchar *series,
+                gdouble index)
+{
+    gchar *label;
+
+    label = get_series_label (series, index);
+    row->series = books_string_pool_acquire (priv->strings, label);
+    g_free (label);
+}
+
+static void
+free_row (BooksCollectionPrivate *priv,
+          BooksRow *row)
+{
+    books_string_pool_release (priv->strings, row->author);
+    books_string_pool_release (priv->strings, row->folder);
+    books_string_pool_release (priv->strings, row->cover);
+    books_string_pool_release (priv->strings, row->series);
+    g_free (row->title);
+    g_free (row->name);
+    g_free (row->thumbnail);
+    g_free (row);
+}
+
+static void
+forget_row (BooksCollectionPrivate *priv,
+            BooksRow *row)
+{
+    g_queue_unlink (&priv->lru, &row->link);
+    g_hash_table_remove (priv->rows, &row->id);
+    free_row (priv, row);
+}
+
+static void
+forget_all_rows (BooksCollectionPrivate *priv)
+{
+    GList *link;
+
+    g_hash_table_remove_all (priv->rows);
+
+    while ((link = g_queue_pop_head_link (&priv->lru)) != NULL)
+        free_row (priv, link->data);
+}
+
+static void
+trim_row_cache (BooksCollectionPrivate *priv)
+{
+    while (priv->lru.length > MAX_CACHED_ROWS)
+        forget_row (priv, g_queue_peek_tail (&priv->lru));
+}
+
+static void
+load_page (BooksCollectionPrivate *priv,
+           guint page)
+{
+    guint first;
+    guint last;
+    guint i;
+
+    first = page * PAGE_SIZE;
+    last = MIN (first + PAGE_SIZE, priv->ids->len);
+
+    sqlite3_reset (priv->page_stmt);
+    sqlite3_clear_bindings (priv->page_stmt);
+
+    for (i = first; i < last; i++)
+        sqlite3_bind_int64 (priv->page_stmt, i - first + 1, g_array_index (priv->ids, gint64, i));
+
+    while (sqlite3_step (priv->page_stmt) == SQLITE_ROW) {
+        BooksRow *row;
+        gint64 id;
+
+        id = sqlite3_column_int64 (priv->page_stmt, 0);
+
+        if (g_hash_table_contains (priv->rows, &id))
+            continue;
+
+        row = g_new0 (BooksRow, 1);
+        row->id = id;
+        row->author = books_string_pool_acquire (priv->strings, (const gchar *) sqlite3_column_text (priv->page_stmt, 1));
+        row->title = g_strdup ((const gchar *) sqlite3_column_text (priv->page_stmt, 2));
+        set_row_path (priv, row, (const gchar *) sqlite3_column_text (priv->page_stmt, 3));
+        row->cover = books_string_pool_acquire (priv->strings, (const gchar *) sqlite3_column_text (priv->page_stmt, 4));
+        row->thumbnail = g_strdup ((const gchar *) sqlite3_column_text (priv->page_stmt, 5));
+        set_row_series (priv, row, (const gchar *) sqlite3_column_text (priv->page_stmt, 8),
+                        sqlite3_column_double (priv->page_stmt, 9));
+        row->link.data = row;
+
+        /* Books imported before thumbnails existed */
+        if (row->thumbnail == NULL)
+            row->thumbnail = books_thumbnail_get_name ((const gchar *) sqlite3_column_text (priv->page_stmt, 3),
+                                                       sqlite3_column_int64 (priv->page_stmt, 6),
+                                                       sqlite3_column_int64 (priv->page_stmt, 7));
+
+        g_hash_table_insert (priv->rows, &row->id, row);
+        g_queue_push_head_link (&priv->lru, &row->link);
+    }
+
+    trim_row_cache (priv);
+}
+
+/*
+ * Rows of an unchanged collection come from the snapshot, which is a
+ * binary search in memory instead of a query.
+ */
+static BooksRow *
+load_snapshot_row (BooksCollectionPrivate *priv,
+                   gint64 id)
+{
+    BooksSnapshotRow snapshot_row;
+    BooksRow *row;
+
+    if (!books_snapshot_lookup (priv->snapshot, id, &snapshot_row))
+        return NULL;
+
+    row = g_new0 (BooksRow, 1);
+    row->id = id;
+    row->author = books_string_pool_acquire (priv->strings, snapshot_row.author);
+    row->title = g_strdup (snapshot_row.title);
+    set_row_path (priv, row, snapshot_row.path);
+    row->cover = books_string_pool_acquire (priv->strings, snapshot_row.cover);
+    row->thumbnail = g_strdup (snapshot_row.thumbnail);
+    set_row_series (priv, row, snapshot_row.series, snapshot_row.series_index);
+    row->link.data = row;
+
+    g_hash_table_insert (priv->rows, &row->id, row);
+    g_queue_push_head_link (&priv->lru, &row->link);
+    trim_row_cache (priv);
+
+    return row;
+}
+
+static BooksRow *
+lookup_row (BooksCollectionPrivate *priv,
+            guint index)
+{
+    BooksRow *row;
+    gint64 id;
+
+    id = g_array_index (priv->ids, gint64, index);
+    row = g_hash_table_lookup (priv->rows, &id);
+
+    if (row == NULL && priv->snapshot != NULL)
+        row = load_snapshot_row (priv, id);
+
+    if (row == NULL) {
+        load_page (priv, index / PAGE_SIZE);
+        row = g_hash_table_lookup (priv->rows, &id);
+
+        if (row == NULL)
+            return NULL;
+    }
+
+    g_queue_unlink (&priv->lru, &row->link);
+    g_queue_push_head_link (&priv->lru, &row->link);
+    return row;
+}
+
+static gchar *
+get_author_title_markup (const gchar *author,
+                         const gchar *title)
+{
+    return g_markup_printf_escaped ("%s &#8212; <i>%s</i>", author, title);
+}
+
+/*
+ * Returns e.g. "Discworld #4", or %NULL if the book is not part of a
+ * series. Half numbers such as 2.5 are used for novellas.
+ */
+static gchar *
+get_series_label (const gchar *series,
+                  gdouble index)
+{
+    gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+    if (series == NULL || *series == '\0')
+        return NULL;
+
+    if (index <= 0.0)
+        return g_strdup (series);
+
+    return g_strdup_printf ("%s #%s", series, g_ascii_formatd (buffer, sizeof (buffer), "%g", index));
+}
+
+/*
+ * Drops everything kept outside the books table for the book in the
+ * current row of @select_stmt, which yields id and thumbnail.
+ */
+static void
+forget_book (BooksCollectionPrivate *priv,
+             sqlite3_stmt *select_stmt)
+{
+    books_thumbnail_remove ((const gchar *) sqlite3_column_text (select_stmt, 1));
+
+    if (priv->search_index != NULL)
+        books_search_index_remove (priv->search_index, sqlite3_column_int64 (select_stmt, 0));
+
+    books_tags_forget_book (priv->tags, sqlite3_column_int64 (select_stmt, 0));
+    books_bitmap_remove (priv->tombstones, (guint32) sqlite3_column_int64 (select_stmt, 0));
+}
+
+static void
+delete_book_from_db (BooksCollectionPrivate *priv,
+                     const gchar *path)
+{
+    const gchar *select_sql = "SELECT id, thumbnail FROM books WHERE path=?";
+    const gchar *remove_sql = "DELETE FROM books WHERE path=?";
+    const gchar *skipped_sql = "DELETE FROM skipped_files WHERE path=?";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *remove_stmt = NULL;
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_text (select_stmt, 1, path, strlen (path), NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW)
+        forget_book (priv, select_stmt);
+
+    sqlite3_finalize (select_stmt);
+
+    sqlite3_prepare_v2 (priv->db, remove_sql, -1, &remove_stmt, NULL);
+    sqlite3_bind_text (remove_stmt, 1, path, strlen (path), NULL);
+    sqlite3_step (remove_stmt);
+    sqlite3_finalize (remove_stmt);
+
+    sqlite3_prepare_v2 (priv->db, skipped_sql, -1, &remove_stmt, NULL);
+    sqlite3_bind_text (remove_stmt, 1, path, strlen (path), NULL);
+    sqlite3_step (remove_stmt);
+    sqlite3_finalize (remove_stmt);
+}
+
+static gchar *
+get_search_key (const gchar *author,
+                const gchar *title,
+                const gchar *series)
+{
+    gchar *normalized_author;
+    gchar *normalized_title;
+    gchar *normalized_series;
+    gchar *key;
+
+    /* The separators keep a term from matching across fields */
+    normalized_author = books_search_index_normalize (author);
+    normalized_title = books_search_index_normalize (title);
+    normalized_series = books_search_index_normalize (series);
+    key = g_strconcat (normalized_author, "\n", normalized_title, "\n", normalized_series, NULL);
+
+    g_free (normalized_author);
+    g_free (normalized_title);
+    g_free (normalized_series);
+
+    return key;
+}
+
+static GHashTable *
+get_id_set (GArray *ids)
+{
+    GHashTable *set;
+    guint i;
+
+    /* Keys point into the array which must outlive the set */
+    set = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+    for (i = 0; i < ids->len; i++)
+        g_hash_table_add (set, &g_array_index (ids, gint64, i));
+
+    return set;
+}
+
+/*
+ * Guesses how an author without file-as metadata is sorted, moving the
+ * last name first: "Leo Tolstoy" becomes "Tolstoy, Leo".
+ */
+static gchar *
+get_author_sort_name (const gchar *author)
+{
+    gchar *name;
+    gchar *last;
+    gchar *sort_name;
+
+    name = g_strstrip (g_strdup (author != NULL ? author : ""));
+    last = strrchr (name, ' ');
+
+    /* Already inverted or a single name */
+    if (strchr (name, ',') != NULL || last == NULL)
+        return name;
+
+    *last = '\0';
+    sort_name = g_strdup_printf ("%s, %s", last + 1, name);
+    g_free (name);
+
+    return sort_name;
+}
+
+static const gchar *
+get_title_sort_name (const gchar *title)
+{
+    static const gchar *articles[] = { "the ", "a ", "an ", NULL };
+    guint i;
+
+    if (title == NULL)
+        return "";
+
+    /* "The Hobbit" is sorted as "Hobbit" */
+    for (i = 0; articles[i] != NULL; i++) {
+        gsize length;
+
+        length = strlen (articles[i]);
+
+        if (!g_ascii_strncasecmp (title, articles[i], length) && title[length] != '\0')
+            return title + length;
+    }
+
+    return title;
+}
+
+/*
+ * Binds the collation keys of author and title to @column and the one
+ * after. They are compared bytewise, which is what SQLite does by default
+ * with blobs, so the sort indexes are in locale order.
+ */
+static void
+bind_sort_keys (sqlite3_stmt *stmt,
+                gint column,
+                const gchar *author_sort,
+                const gchar *title)
+{
+    gchar *author_key;
+    gchar *title_key;
+
+    author_key = g_utf8_collate_key (author_sort, -1);
+    title_key = g_utf8_collate_key (get_title_sort_name (title), -1);
+
+    sqlite3_bind_blob (stmt, column, author_key, strlen (author_key), g_free);
+    sqlite3_bind_blob (stmt, column + 1, title_key, strlen (title_key), g_free);
+}
+
+static void
+bind_series_key (sqlite3_stmt *stmt,
+                 gint column,
+                 const gchar *series)
+{
+    gchar *series_key;
+
+    series_key = g_utf8_collate_key (get_title_sort_name (series), -1);
+    sqlite3_bind_blob (stmt, column, series_key, strlen (series_key), g_free);
+}
+
+static void
+load_search_index (BooksCollectionPrivate *priv)
+{
+    const gchar *select_sql = "SELECT id, search_key FROM books";
+    sqlite3_stmt *select_stmt = NULL;
+
+    priv->search_index = books_search_index_new ();
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW)
+        books_search_index_add (priv->search_index,
+                                sqlite3_column_int64 (select_stmt, 0),
+                                (const gchar *) sqlite3_column_text (select_stmt, 1));
+
+    sqlite3_finalize (select_stmt);
+}
+
+/*
+ * Returns the ids of the books in the selected facet, or %NULL if none is
+ * selected.
+ */
+static GHashTable *
+get_facet_set (BooksCollectionPrivate *priv)
+{
+    const gchar *select_sql = "SELECT book_id FROM facets WHERE kind = ? AND value = ?";
+    sqlite3_stmt *select_stmt = NULL;
+    GHashTable *set;
+
+    if (priv->facet_value == NULL)
+        return NULL;
+
+    set = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_int (select_stmt, 1, priv->facet_kind);
+    sqlite3_bind_text (select_stmt, 2, priv->facet_value, strlen (priv->facet_value), NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gint64 id;
+
+        id = sqlite3_column_int64 (select_stmt, 0);
+        g_hash_table_add (set, g_memdup (&id, sizeof (gint64)));
+    }
+
+    sqlite3_finalize (select_stmt);
+    return set;
+}
+
+/*
+ * Keeps the books of @ids that contain the filter term, in their order,
+ * followed by books of the selected facet that merely resemble it, best
+ * matches first. @ids may be the result of a shorter term: books that
+ * contain the longer term contain the shorter one, but similarity does
+ * not shrink along, so similar books are not taken from @ids.
+ */
+static GArray *
+filter_ids (BooksCollectionPrivate *priv,
+            GArray *ids)
+{
+    GArray *matches;
+    GArray *fuzzy_matches;
+    GArray *similar;
+    GHashTable *candidates;
+    GHashTable *exact;
+    guint i;
+
+    /* The index is only needed once the user starts filtering */
+    if (priv->search_index == NULL)
+        load_search_index (priv);
+
+    matches = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    for (i = 0; i < ids->len; i++) {
+        const gchar *key;
+        gint64 id;
+
+        id = g_array_index (ids, gint64, i);
+        key = books_search_index_get_key (priv->search_index, id);
+
+        if (key != NULL && strstr (key, priv->search_term) != NULL)
+            g_array_append_val (matches, id);
+    }
+
+    /* The index covers all books, not only those of the selected facet */
+    candidates = get_facet_set (priv);
+    exact = get_id_set (matches);
+    fuzzy_matches = books_search_index_match (priv->search_index, priv->search_term, FUZZY_MATCH_THRESHOLD);
+    similar = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    for (i = 0; i < fuzzy_matches->len; i++) {
+        BooksSearchMatch *match;
+
+        match = &g_array_index (fuzzy_matches, BooksSearchMatch, i);
+
+        if ((candidates == NULL || g_hash_table_contains (candidates, &match->id)) &&
+            !g_hash_table_contains (exact, &match->id))
+            g_array_append_val (similar, match->id);
+    }
+
+    /* The set points into matches, which must not grow before it is gone */
+    g_hash_table_destroy (exact);
+
+    if (candidates != NULL)
+        g_hash_table_destroy (candidates);
+    g_array_append_vals (matches, similar->data, similar->len);
+
+    g_array_free (similar, TRUE);
+    g_array_free (fuzzy_matches, TRUE);
+
+    return matches;
+}
+
+/*
+ * Keeps the books of @ids that are on the shelves of the filter term and
+ * have not been removed, in their order. Consumes @ids.
+ */
+static GArray *
+filter_visible (BooksCollectionPrivate *priv,
+                GArray *ids)
+{
+    BooksBitmap *included;
+    BooksBitmap *excluded;
+    GArray *matches;
+    guint i;
+
+    books_tags_match (priv->tags, priv->shelf_terms, &included, &excluded);
+
+    if (books_bitmap_get_cardinality (priv->tombstones) > 0) {
+        if (excluded == NULL)
+            excluded = books_bitmap_new ();
+
+        books_bitmap_or (excluded, priv->tombstones);
+    }
+
+    if (included == NULL && excluded == NULL)
+        return ids;
+
+    matches = g_array_sized_new (FALSE, FALSE, sizeof (gint64), ids->len);
+
+    for (i = 0; i < ids->len; i++) {
+        gint64 id;
+
+        id = g_array_index (ids, gint64, i);
+
+        if (id < 0 || id > G_MAXUINT32)
+            continue;
+
+        if ((included == NULL || books_bitmap_contains (included, (guint32) id)) &&
+            (excluded == NULL || !books_bitmap_contains (excluded, (guint32) id)))
+            g_array_append_val (matches, id);
+    }
+
+    books_bitmap_free (included);
+    books_bitmap_free (excluded);
+    g_array_free (ids, TRUE);
+
+    return matches;
+}
+
+/*
+ * Splits @term into shelf terms such as shelf:work,project, -shelf:done
+ * or shelf:"to read" and returns the remaining text. Quotes only count
+ * once they are balanced.
+ */
+static gchar *
+split_filter_term (const gchar *term,
+                   gchar ***shelf_terms)
+{
+    GPtrArray *shelves;
+    GString *text;
+    gchar **argv;
+    gint i;
+
+    *shelf_terms = NULL;
+
+    if (term == NULL || strstr (term, "shelf:") == NULL ||
+        !g_shell_parse_argv (term, NULL, &argv, NULL))
+        return g_strdup (term != NULL ? term : "");
+
+    shelves = g_ptr_array_new ();
+    text = g_string_new (NULL);
+
+    for (i = 0; argv[i] != NULL; i++) {
+        /* A prefix without name is still being typed */
+        if (g_str_has_prefix (argv[i], "shelf:")) {
+            if (argv[i][6] != '\0')
+                g_ptr_array_add (shelves, g_strdup (argv[i] + 6));
+        }
+        else if (g_str_has_prefix (argv[i], "-shelf:")) {
+            if (argv[i][7] != '\0')
+                g_ptr_array_add (shelves, g_strconcat ("-", argv[i] + 7, NULL));
+        }
+        else {
+            g_string_append_printf (text, text->len > 0 ? " %s" : "%s", argv[i]);
+        }
+    }
+
+    if (shelves->len > 0) {
+        g_ptr_array_add (shelves, NULL);
+        *shelf_terms = (gchar **) g_ptr_array_free (shelves, FALSE);
+    }
+    else
+        g_ptr_array_free (shelves, TRUE);
+
+    g_strfreev (argv);
+    return g_string_free (text, FALSE);
+}
+
+static gboolean
+equal_terms (gchar **a,
+             gchar **b)
+{
+    guint i;
+
+    if (a == NULL || b == NULL)
+        return a == b;
+
+    for (i = 0; a[i] != NULL && b[i] != NULL; i++) {
+        if (strcmp (a[i], b[i]))
+            return FALSE;
+    }
+
+    return a[i] == b[i];
+}
+
+static gchar *
+get_order_clause (BooksCollectionPrivate *priv)
+{
+    const gchar *direction;
+
+    direction = priv->sort_order == GTK_SORT_DESCENDING ? "DESC" : "ASC";
+
+    /* Matches the indexes created by the migrations */
+    switch (priv->sort_column_id) {
+        case BOOKS_COLLECTION_AUTHOR_COLUMN:
+        case BOOKS_COLLECTION_MARKUP_COLUMN:
+            return g_strdup_printf ("author_key %s, title_key %s, id %s",
+                                    direction, direction, direction);
+
+        case BOOKS_COLLECTION_TITLE_COLUMN:
+            return g_strdup_printf ("title_key %s, id %s", direction, direction);
+
+        case BOOKS_COLLECTION_SERIES_COLUMN:
+            return g_strdup_printf ("series_key %s, series_index %s, title_key %s, id %s",
+                                    direction, direction, direction, direction);
+
+        default:
+            return g_strdup ("id");
+    }
+}
+
+/*
+ * Appends the ids of books matching @condition to @ids in the order of
+ * @order.
+ */
+static void
+append_ids (BooksCollectionPrivate *priv,
+            GArray *ids,
+            const gchar *condition,
+            const gchar *order)
+{
+    gchar *select_sql;
+    sqlite3_stmt *select_stmt = NULL;
+
+    /* Ids of a facet come straight from the (kind, value, book_id) index */
+    if (priv->facet_value != NULL)
+        select_sql = g_strdup_printf ("SELECT id FROM books WHERE %s AND id IN "
+                                      "(SELECT book_id FROM facets WHERE kind = ?1 AND value = ?2) "
+                                      "ORDER BY %s", condition, order);
+    else
+        select_sql = g_strdup_printf ("SELECT id FROM books WHERE %s ORDER BY %s", condition, order);
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+
+    if (priv->facet_value != NULL) {
+        sqlite3_bind_int (select_stmt, 1, priv->facet_kind);
+        sqlite3_bind_text (select_stmt, 2, priv->facet_value, strlen (priv->facet_value), NULL);
+    }
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gint64 id;
+
+        id = sqlite3_column_int64 (select_stmt, 0);
+        g_array_append_val (ids, id);
+    }
+
+    sqlite3_finalize (select_stmt);
+    g_free (select_sql);
+}
+
+static GArray *
+select_ids (BooksCollectionPrivate *priv)
+{
+    GArray *ids;
+    gchar *order;
+
+    ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+    order = get_order_clause (priv);
+
+    /*
+     * Books without a series come last in either direction. Selecting
+     * them separately keeps both parts in index order, sorting by
+     * "series_key IS NULL" first would need a temporary B-tree. Their
+     * series_index is NULL as well, so they end up ordered by title.
+     */
+    if (priv->sort_column_id == BOOKS_COLLECTION_SERIES_COLUMN) {
+        append_ids (priv, ids, "series_key IS NOT NULL", order);
+        append_ids (priv, ids, "series_key IS NULL", order);
+    }
+    else
+        append_ids (priv, ids, "1", order);
+
+    g_free (order);
+
+    if (priv->search_term != NULL && *priv->search_term != '\0') {
+        GArray *matches;
+
+        matches = filter_ids (priv, ids);
+        g_array_free (ids, TRUE);
+        ids = matches;
+    }
+
+    return filter_visible (priv, ids);
+}
+
+/*
+ * Announces the kept rows in priv->ids, still in their old order, in the
+ * order they have in @new_ids. Fuzzy matches are ranked by score and
+ * books move between exact and fuzzy matches while the filter term
+ * grows, so the relative order of kept rows is not stable.
+ */
+static void
+reorder_kept_ids (BooksCollection *collection,
+                  GArray *new_ids)
+{
+    BooksCollectionPrivate *priv;
+    GHashTable *old_positions;
+    GArray *reordered;
+    GtkTreePath *path;
+    gint *new_order;
+    gboolean changed = FALSE;
+    guint i;
+
+    priv = collection->priv;
+
+    if (priv->ids->len < 2)
+        return;
+
+    /* Positions are stored plus one, so that the first is not NULL */
+    old_positions = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+    for (i = 0; i < priv->ids->len; i++)
+        g_hash_table_insert (old_positions, &g_array_index (priv->ids, gint64, i), GUINT_TO_POINTER (i + 1));
+
+    reordered = g_array_sized_new (FALSE, FALSE, sizeof (gint64), priv->ids->len);
+    new_order = g_new (gint, priv->ids->len);
+
+    for (i = 0; i < new_ids->len; i++) {
+        gint64 *id;
+        guint position;
+
+        id = &g_array_index (new_ids, gint64, i);
+        position = GPOINTER_TO_UINT (g_hash_table_lookup (old_positions, id));
+
+        if (position == 0)
+            continue;
+
+        new_order[reordered->len] = (gint) position - 1;
+        changed |= reordered->len != position - 1;
+        g_array_append_val (reordered, *id);
+    }
+
+    g_hash_table_destroy (old_positions);
+
+    if (!changed) {
+        g_array_free (reordered, TRUE);
+        g_free (new_order);
+        return;
+    }
+
+    g_array_free (priv->ids, TRUE);
+    priv->ids = reordered;
+
+    path = gtk_tree_path_new ();
+    gtk_tree_model_rows_reordered (GTK_TREE_MODEL (collection), path, NULL, new_order);
+    gtk_tree_path_free (path);
+    g_free (new_order);
+}
+
+static void
+update_ids (BooksCollection *collection,
+            GArray *new_ids)
+{
+    BooksCollectionPrivate *priv;
+    GArray *old_ids;
+    GArray *kept_ids;
+    GHashTable *old_set;
+    GHashTable *new_set;
+    GtkTreeIter iter;
+    gint i;
+
+    priv = collection->priv;
+
+    if (priv->refresh_source != 0) {
+        g_source_remove (priv->refresh_source);
+        priv->refresh_source = 0;
+    }
+
+    /*
+     * Only the rows that differ are announced: deletions from the back,
+     * then a reordering of the kept rows if needed, then insertions from
+     * the front, which keeps every emitted index valid.
+     */
+    old_ids = priv->ids;
+    old_set = get_id_set (old_ids);
+    new_set = get_id_set (new_ids);
+    kept_ids = g_array_sized_new (FALSE, FALSE, sizeof (gint64), MIN (old_ids->len, new_ids->len));
+
+    for (i = 0; i < old_ids->len; i++) {
+        gint64 *id;
+
+        id = &g_array_index (old_ids, gint64, i);
+
+        if (g_hash_table_contains (new_set, id)) {
+            g_array_append_val (kept_ids, *id);
+        }
+        else {
+            BooksRow *row;
+
+            /* Row ids can be reused by SQLite after a deletion */
+            row = g_hash_table_lookup (priv->rows, id);
+
+            if (row != NULL)
+                forget_row (priv, row);
+        }
+    }
+
+    priv->ids = kept_ids;
+
+    for (i = old_ids->len - 1; i >= 0; i--) {
+        if (!g_hash_table_contains (new_set, &g_array_index (old_ids, gint64, i))) {
+            GtkTreePath *path;
+
+            path = gtk_tree_path_new_from_indices (i, -1);
+            gtk_tree_model_row_deleted (GTK_TREE_MODEL (collection), path);
+            gtk_tree_path_free (path);
+        }
+    }
+
+    /* Replaces priv->ids if the kept rows changed their order */
+    reorder_kept_ids (collection, new_ids);
+
+    g_array_free (priv->ids, TRUE);
+    priv->ids = new_ids;
+    iter.stamp = priv->stamp;
+
+    for (i = 0; i < new_ids->len; i++) {
+        if (!g_hash_table_contains (old_set, &g_array_index (new_ids, gint64, i))) {
+            GtkTreePath *path;
+
+            path = gtk_tree_path_new_from_indices (i, -1);
+            iter.user_data = GINT_TO_POINTER (i);
+            gtk_tree_model_row_inserted (GTK_TREE_MODEL (collection), path, &iter);
+            gtk_tree_path_free (path);
+        }
+    }
+
+    /* Kept ids whose book was imported again show different data */
+    for (i = 0; i < new_ids->len && g_hash_table_size (priv->reimported) > 0; i++) {
+        gint64 *id;
+
+        id = &g_array_index (new_ids, gint64, i);
+
+        if (g_hash_table_contains (old_set, id) && g_hash_table_contains (priv->reimported, id)) {
+            GtkTreePath *path;
+
+            path = gtk_tree_path_new_from_indices (i, -1);
+            iter.user_data = GINT_TO_POINTER (i);
+            gtk_tree_model_row_changed (GTK_TREE_MODEL (collection), path, &iter);
+            gtk_tree_path_free (path);
+        }
+    }
+
+    g_hash_table_remove_all (priv->reimported);
+    g_hash_table_destroy (old_set);
+    g_hash_table_destroy (new_set);
+    g_array_free (old_ids, TRUE);
+}
+
+static void
+refresh_model (BooksCollection *collection)
+{
+    update_ids (collection, select_ids (collection->priv));
+    books_facets_update (collection->priv->facets);
+}
+
+static gboolean
+refresh_in_idle (BooksCollection *collection)
+{
+    collection->priv->refresh_source = 0;
+    refresh_model (collection);
+    return FALSE;
+}
+
+static void
+schedule_refresh (BooksCollection *collection)
+{
+    BooksCollectionPrivate *priv;
+
+    priv = collection->priv;
+
+    if (priv->refresh_source == 0)
+        priv->refresh_source = g_idle_add ((GSourceFunc) refresh_in_idle, collection);
+}
+
+static void
+write_snapshot (const gchar *db_path,
+                const gchar *snapshot_path)
+{
+    GError *error = NULL;
+
+    if (!books_snapshot_write (db_path, snapshot_path, &error)) {
+        g_warning (_("Could not write snapshot: %s\n"), error->message);
+        g_error_free (error);
+    }
+}
+
+static void
+write_snapshot_thread (GTask *task,
+                       BooksCollection *collection,
+                       gchar **paths,
+                       GCancellable *cancellable)
+{
+    write_snapshot (paths[0], paths[1]);
+}
+
+static gboolean
+write_snapshot_in_background (BooksCollection *collection)
+{
+    BooksCollectionPrivate *priv;
+    GTask *task;
+    gchar **paths;
+
+    priv = collection->priv;
+    priv->snapshot_source = 0;
+
+    /* Changes from now on need a new generation again */
+    priv->snapshot_dirty = FALSE;
+
+    paths = g_new0 (gchar *, 3);
+    paths[0] = g_strdup (priv->db_path);
+    paths[1] = g_strdup (priv->snapshot_path);
+
+    task = g_task_new (collection, NULL, NULL, NULL);
+    g_task_set_task_data (task, paths, (GDestroyNotify) g_strfreev);
+    g_task_run_in_thread (task, (GTaskThreadFunc) write_snapshot_thread);
+    g_object_unref (task);
+
+    return FALSE;
+}
+
+/*
+ * Has to be called before the books table is modified. The generation is
+ * bumped first, so a crash in between never leaves a snapshot behind that
+ * still looks current.
+ */
+static void
+mark_changed (BooksCollection *collection)
+{
+    BooksCollectionPrivate *priv;
+
+    priv = collection->priv;
+    books_snapshot_free (priv->snapshot);
+    priv->snapshot = NULL;
+
+    if (!priv->snapshot_dirty) {
+        execute_sql (priv, "UPDATE properties SET value = value + 1 WHERE name = 'generation'");
+        priv->snapshot_dirty = TRUE;
+    }
+
+    if (priv->snapshot_source != 0)
+        g_source_remove (priv->snapshot_source);
+
+    priv->snapshot_source = g_timeout_add_seconds (SNAPSHOT_DELAY,
+                                                   (GSourceFunc) write_snapshot_in_background,
+                                                   collection);
+}
+
+/*
+ * Announces the new order of the same set of books, callers have to
+ * apply pending changes with refresh_model() first.
+ */
+static void
+resort_model (BooksCollection *collection)
+{
+    BooksCollectionPrivate *priv;
+    GArray *old_ids;
+    GHashTable *old_positions;
+    GtkTreePath *path;
+    gint *new_order;
+    guint i;
+
+    priv = collection->priv;
+    old_ids = priv->ids;
+    priv->ids = select_ids (priv);
+    old_positions = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+    for (i = 0; i < old_ids->len; i++)
+        g_hash_table_insert (old_positions, &g_array_index (old_ids, gint64, i), GUINT_TO_POINTER (i));
+
+    new_order = g_new (gint, priv->ids->len);
+
+    for (i = 0; i < priv->ids->len; i++)
+        new_order[i] = GPOINTER_TO_UINT (g_hash_table_lookup (old_positions, &g_array_index (priv->ids, gint64, i)));
+
+    path = gtk_tree_path_new ();
+    gtk_tree_model_rows_reordered (GTK_TREE_MODEL (collection), path, NULL, new_order);
+
+    gtk_tree_path_free (path);
+    g_free (new_order);
+    g_hash_table_destroy (old_positions);
+    g_array_free (old_ids, TRUE);
+}
+
+static gboolean
+execute_sql (BooksCollectionPrivate *priv,
+             const gchar *sql)
+{
+    gchar *db_error = NULL;
+
+    if (sqlite3_exec (priv->db, sql, NULL, NULL, &db_error) != SQLITE_OK) {
+        g_warning (_("Could not update database: %s\n"), db_error);
+        sqlite3_free (db_error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gint
+get_schema_version (BooksCollectionPrivate *priv)
+{
+    sqlite3_stmt *version_stmt = NULL;
+    gint version = 0;
+
+    sqlite3_prepare_v2 (priv->db, "PRAGMA user_version", -1, &version_stmt, NULL);
+
+    if (sqlite3_step (version_stmt) == SQLITE_ROW)
+        version = sqlite3_column_int (version_stmt, 0);
+
+    sqlite3_finalize (version_stmt);
+    return version;
+}
+
+static gboolean
+has_books_table (BooksCollectionPrivate *priv)
+{
+    sqlite3_stmt *table_stmt = NULL;
+    gboolean exists;
+
+    sqlite3_prepare_v2 (priv->db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'books'",
+                        -1, &table_stmt, NULL);
+    exists = sqlite3_step (table_stmt) == SQLITE_ROW;
+    sqlite3_finalize (table_stmt);
+
+    return exists;
+}
+
+static void
+add_column_if_missing (BooksCollectionPrivate *priv,
+                       const gchar *definition)
+{
+    gchar *alter_sql;
+
+    /* Fails with "duplicate column name" if the column exists already */
+    alter_sql = g_strdup_printf ("ALTER TABLE books ADD COLUMN %s", definition);
+    sqlite3_exec (priv->db, alter_sql, NULL, NULL, NULL);
+    g_free (alter_sql);
+}
+
+static void
+update_search_keys (BooksCollectionPrivate *priv)
+{
+    const gchar *select_sql = "SELECT id, author, title, series FROM books WHERE search_key IS NULL";
+    const gchar *update_sql = "UPDATE books SET search_key = ? WHERE id = ?";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *update_stmt = NULL;
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_prepare_v2 (priv->db, update_sql, -1, &update_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gchar *key;
+
+        key = get_search_key ((const gchar *) sqlite3_column_text (select_stmt, 1),
+                              (const gchar *) sqlite3_column_text (select_stmt, 2),
+                              (const gchar *) sqlite3_column_text (select_stmt, 3));
+
+        sqlite3_reset (update_stmt);
+        sqlite3_bind_text (update_stmt, 1, key, strlen (key), g_free);
+        sqlite3_bind_int64 (update_stmt, 2, sqlite3_column_int64 (select_stmt, 0));
+        sqlite3_step (update_stmt);
+    }
+
+    sqlite3_finalize (update_stmt);
+    sqlite3_finalize (select_stmt);
+}
+
+/*
+ * Version 1 is the original table without primary key and indexes. It
+ * is copied into the new layout, keeping the row ids and dropping books
+ * that were inserted more than once.
+ */
+static gboolean
+migrate_to_v2 (BooksCollectionPrivate *priv)
+{
+    gboolean upgrade;
+
+    upgrade = has_books_table (priv);
+
+    if (upgrade) {
+        /* Columns added piecemeal before the schema was versioned */
+        add_column_if_missing (priv, "size INTEGER");
+        add_column_if_missing (priv, "mtime INTEGER");
+        add_column_if_missing (priv, "thumbnail TEXT");
+        add_column_if_missing (priv, "search_key TEXT");
+
+        if (!execute_sql (priv, "ALTER TABLE books RENAME TO books_v1"))
+            return FALSE;
+    }
+
+    if (!execute_sql (priv,
+                      "CREATE TABLE books (id INTEGER PRIMARY KEY, author TEXT, title TEXT, path TEXT NOT NULL, "
+                      "                    cover TEXT, size INTEGER, mtime INTEGER, thumbnail TEXT, search_key TEXT);"
+                      "CREATE UNIQUE INDEX books_path_index ON books (path)"))
+        return FALSE;
+
+    if (upgrade) {
+        if (!execute_sql (priv,
+                          "INSERT OR IGNORE INTO books (id, author, title, path, cover, size, mtime, thumbnail, search_key) "
+                          "    SELECT rowid, author, title, path, cover, size, mtime, thumbnail, search_key "
+                          "    FROM books_v1 WHERE path IS NOT NULL ORDER BY rowid;"
+                          "DROP TABLE books_v1"))
+            return FALSE;
+    }
+
+    /* Sorting is done by SQLite, walking these instead of sorting rows */
+    return execute_sql (priv,
+                        "CREATE INDEX books_author_index ON books (author COLLATE NOCASE, title COLLATE NOCASE);"
+                        "CREATE INDEX books_title_index ON books (title COLLATE NOCASE)");
+}
+
+/*
+ * Version 3 sorts by locale collation keys instead of NOCASE, see
+ * update_sort_keys. The keys are filled in by check_collation_locale.
+ */
+static gboolean
+migrate_to_v3 (BooksCollectionPrivate *priv)
+{
+    return execute_sql (priv,
+                        "ALTER TABLE books ADD COLUMN author_sort TEXT;"
+                        "ALTER TABLE books ADD COLUMN author_key BLOB;"
+                        "ALTER TABLE books ADD COLUMN title_key BLOB;"
+                        "DROP INDEX books_author_index;"
+                        "DROP INDEX books_title_index;"
+                        "CREATE INDEX books_author_key_index ON books (author_key, title_key);"
+                        "CREATE INDEX books_title_key_index ON books (title_key);"
+                        "CREATE TABLE properties (name TEXT PRIMARY KEY, value TEXT)");
+}
+
+static gboolean
+migrate_to_v4 (BooksCollectionPrivate *priv)
+{
+    /* Hashes of existing books are filled in by the backfill, see migrate_to_v13 */
+    return execute_sql (priv,
+                        "ALTER TABLE books ADD COLUMN content_hash TEXT;"
+                        "ALTER TABLE books ADD COLUMN identifier TEXT;"
+                        "CREATE INDEX books_content_hash_index ON books (content_hash);"
+                        "CREATE INDEX books_identifier_index ON books (identifier);"
+                        "CREATE TABLE skipped_files (path TEXT PRIMARY KEY, size INTEGER, mtime INTEGER, "
+                        "                            content_hash TEXT)");
+}
+
+static gboolean
+migrate_to_v5 (BooksCollectionPrivate *priv)
+{
+    /*
+     * Counts per facet value are maintained by triggers, so they change
+     * with the rows instead of being recounted. Languages and subjects of
+     * existing books are filled in by the backfill.
+     */
+    return execute_sql (priv,
+                        "CREATE TABLE facets (book_id INTEGER NOT NULL, kind INTEGER NOT NULL, value TEXT NOT NULL);"
+                        "CREATE UNIQUE INDEX facets_book_index ON facets (book_id, kind, value);"
+                        "CREATE INDEX facets_value_index ON facets (kind, value, book_id);"
+                        "CREATE TABLE facet_counts (kind INTEGER NOT NULL, value TEXT NOT NULL, count INTEGER NOT NULL, "
+                        "                           PRIMARY KEY (kind, value));"
+                        "CREATE TRIGGER facets_inserted AFTER INSERT ON facets BEGIN "
+                        "    INSERT OR IGNORE INTO facet_counts VALUES (new.kind, new.value, 0); "
+                        "    UPDATE facet_counts SET count = count + 1 WHERE kind = new.kind AND value = new.value; "
+                        "END;"
+                        "CREATE TRIGGER facets_deleted AFTER DELETE ON facets BEGIN "
+                        "    UPDATE facet_counts SET count = count - 1 WHERE kind = old.kind AND value = old.value; "
+                        "    DELETE FROM facet_counts WHERE kind = old.kind AND value = old.value AND count <= 0; "
+                        "END;"
+                        "CREATE TRIGGER books_deleted AFTER DELETE ON books BEGIN "
+                        "    DELETE FROM facets WHERE book_id = old.id; "
+                        "END;"
+                        "INSERT INTO facets (book_id, kind, value) SELECT id, 0, author FROM books WHERE author IS NOT NULL");
+}
+
+static gboolean
+migrate_to_v6 (BooksCollectionPrivate *priv)
+{
+    /* Series of existing books are filled in by the backfill */
+    return execute_sql (priv,
+                        "ALTER TABLE books ADD COLUMN series TEXT;"
+                        "ALTER TABLE books ADD COLUMN series_index REAL;"
+                        "ALTER TABLE books ADD COLUMN series_key BLOB;"
+                        "CREATE INDEX books_series_key_index ON books (series_key, series_index, title_key)");
+}
+
+static gboolean
+migrate_to_v7 (BooksCollectionPrivate *priv)
+{
+    return execute_sql (priv,
+                        "CREATE TABLE tags (id INTEGER PRIMARY KEY, name TEXT NOT NULL);"
+                        "CREATE TABLE book_tags (tag_id INTEGER NOT NULL, book_id INTEGER NOT NULL, "
+                        "                        PRIMARY KEY (tag_id, book_id));"
+                        "CREATE INDEX book_tags_book_index ON book_tags (book_id);"
+                        "CREATE TRIGGER books_untagged AFTER DELETE ON books BEGIN "
+                        "    DELETE FROM book_tags WHERE book_id = old.id; "
+                        "END");
+}
+
+static gboolean
+migrate_to_v8 (BooksCollectionPrivate *priv)
+{
+    /*
+     * Removed books keep their facets until they are purged but do not
+     * count anymore. Deleting a book first drops its facets, while the
+     * removed flag is still readable.
+     */
+    return execute_sql (priv,
+                        "ALTER TABLE books ADD COLUMN removed INTEGER NOT NULL DEFAULT 0;"
+                        "CREATE INDEX books_removed_index ON books (id) WHERE removed;"
+                        "DROP TRIGGER books_deleted;"
+                        "CREATE TRIGGER books_deleted BEFORE DELETE ON books BEGIN "
+                        "    DELETE FROM facets WHERE book_id = old.id; "
+                        "END;"
+                        "DROP TRIGGER facets_deleted;"
+                        "CREATE TRIGGER facets_deleted AFTER DELETE ON facets "
+                        "WHEN NOT EXISTS (SELECT 1 FROM books WHERE id = old.book_id AND removed) BEGIN "
+                        "    UPDATE facet_counts SET count = count - 1 WHERE kind = old.kind AND value = old.value; "
+                        "    DELETE FROM facet_counts WHERE kind = old.kind AND value = old.value AND count <= 0; "
+                        "END;"
+                        "CREATE TRIGGER books_tombstoned AFTER UPDATE OF removed ON books "
+                        "WHEN new.removed AND NOT old.removed BEGIN "
+                        "    UPDATE facet_counts SET count = count - 1 WHERE rowid IN "
+                        "        (SELECT facet_counts.rowid FROM facets JOIN facet_counts USING (kind, value) "
+                        "         WHERE book_id = new.id); "
+                        "    DELETE FROM facet_counts WHERE count <= 0 AND rowid IN "
+                        "        (SELECT facet_counts.rowid FROM facets JOIN facet_counts USING (kind, value) "
+                        "         WHERE book_id = new.id); "
+                        "END;"
+                        "CREATE TRIGGER books_restored AFTER UPDATE OF removed ON books "
+                        "WHEN old.removed AND NOT new.removed BEGIN "
+                        "    INSERT OR IGNORE INTO facet_counts SELECT kind, value, 0 FROM facets WHERE book_id = new.id; "
+                        "    UPDATE facet_counts SET count = count + 1 WHERE rowid IN "
+                        "        (SELECT facet_counts.rowid FROM facets JOIN facet_counts USING (kind, value) "
+                        "         WHERE book_id = new.id); "
+                        "END");
+}
+
+static gboolean
+migrate_to_v9 (BooksCollectionPrivate *priv)
+{
+    /* A check holds for the file as of mtime, problem is NULL if it passed */
+    return execute_sql (priv,
+                        "CREATE TABLE verified (book_id INTEGER PRIMARY KEY, mtime INTEGER, problem TEXT);"
+                        "CREATE TRIGGER books_unverified AFTER DELETE ON books BEGIN "
+                        "    DELETE FROM verified WHERE book_id = old.id; "
+                        "END");
+}
+
+static gboolean
+migrate_to_v10 (BooksCollectionPrivate *priv)
+{
+    /* Kept apart from books, saving a position does not outdate the snapshot */
+    return execute_sql (priv,
+                        "CREATE TABLE positions (book_id INTEGER PRIMARY KEY, spine_index INTEGER NOT NULL, "
+                        "                        fragment TEXT, fraction REAL NOT NULL);"
+                        "CREATE TRIGGER books_unread AFTER DELETE ON books BEGIN "
+                        "    DELETE FROM positions WHERE book_id = old.id; "
+                        "END");
+}
+
+static gboolean
+migrate_to_v11 (BooksCollectionPrivate *priv)
+{
+    return execute_sql (priv,
+                        "CREATE TABLE annotations (book_id INTEGER NOT NULL, spine_index INTEGER NOT NULL, "
+                        "                          start_offset INTEGER NOT NULL, end_offset INTEGER NOT NULL, "
+                        "                          note TEXT);"
+                        "CREATE UNIQUE INDEX annotations_range_index "
+                        "    ON annotations (book_id, spine_index, start_offset, end_offset);"
+                        "CREATE TRIGGER books_unannotated AFTER DELETE ON books BEGIN "
+                        "    DELETE FROM annotations WHERE book_id = old.id; "
+                        "END");
+}
+
+static gboolean
+migrate_to_v12 (BooksCollectionPrivate *priv)
+{
+    /* Search keys include the series, also those of version 1 rows */
+    if (!execute_sql (priv, "UPDATE books SET search_key = NULL"))
+        return FALSE;
+
+    update_search_keys (priv);
+    return TRUE;
+}
+
+/*
+ * Versions 4 to 6 dropped the stamps of all books, so that the next scan
+ * read what they added. Books from outside the library folders are never
+ * scanned though. Instead, every book is read once by backfill_books, the
+ * property holds the last id done.
+ */
+static gboolean
+migrate_to_v13 (BooksCollectionPrivate *priv)
+{
+    return execute_sql (priv, "INSERT OR REPLACE INTO properties (name, value) VALUES ('backfill', 0)");
+}
+
+static void
+update_sort_keys (BooksCollectionPrivate *priv)
+{
+    const gchar *select_sql = "SELECT id, author, author_sort, title, series FROM books";
+    const gchar *update_sql = "UPDATE books SET author_sort = ?1, author_key = ?2, title_key = ?3, series_key = ?5 "
+                              "WHERE id = ?4";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *update_stmt = NULL;
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_prepare_v2 (priv->db, update_sql, -1, &update_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gchar *author_sort;
+
+        /* Books imported before file-as was read get a guess */
+        if (sqlite3_column_type (select_stmt, 2) == SQLITE_NULL)
+            author_sort = get_author_sort_name ((const gchar *) sqlite3_column_text (select_stmt, 1));
+        else
+            author_sort = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 2));
+
+        sqlite3_reset (update_stmt);
+        sqlite3_bind_text (update_stmt, 1, author_sort, strlen (author_sort), g_free);
+        bind_sort_keys (update_stmt, 2, author_sort, (const gchar *) sqlite3_column_text (select_stmt, 3));
+        sqlite3_bind_int64 (update_stmt, 4, sqlite3_column_int64 (select_stmt, 0));
+
+        if (sqlite3_column_type (select_stmt, 4) != SQLITE_NULL)
+            bind_series_key (update_stmt, 5, (const gchar *) sqlite3_column_text (select_stmt, 4));
+        else
+            sqlite3_bind_null (update_stmt, 5);
+
+        sqlite3_step (update_stmt);
+    }
+
+    sqlite3_finalize (update_stmt);
+    sqlite3_finalize (select_stmt);
+}
+
+/*
+ * Collation keys are only comparable within one locale, so they are
+ * recomputed when the library is opened under a different one.
+ */
+static void
+check_collation_locale (BooksCollectionPrivate *priv)
+{
+    const gchar *select_sql = "SELECT value FROM properties WHERE name = 'collation-locale'";
+    const gchar *update_sql = "INSERT OR REPLACE INTO properties (name, value) VALUES ('collation-locale', ?)";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *update_stmt = NULL;
+    const gchar *locale;
+    gboolean changed = TRUE;
+
+    locale = setlocale (LC_COLLATE, NULL);
+
+    if (locale == NULL)
+        locale = "C";
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &select_stmt, NULL);
+
+    if (sqlite3_step (select_stmt) == SQLITE_ROW)
+        changed = g_strcmp0 ((const gchar *) sqlite3_column_text (select_stmt, 0), locale) != 0;
+
+    sqlite3_finalize (select_stmt);
+
+    if (!changed)
+        return;
+
+    execute_sql (priv, "BEGIN TRANSACTION");
+    update_sort_keys (priv);
+
+    sqlite3_prepare_v2 (priv->db, update_sql, -1, &update_stmt, NULL);
+    sqlite3_bind_text (update_stmt, 1, locale, strlen (locale), NULL);
+    sqlite3_step (update_stmt);
+    sqlite3_finalize (update_stmt);
+
+    execute_sql (priv, "COMMIT TRANSACTION");
+}
+
+static gint64
+get_generation (BooksCollectionPrivate *priv)
+{
+    const gchar *insert_sql = "INSERT OR IGNORE INTO properties (name, value) VALUES ('generation', ?)";
+    const gchar *select_sql = "SELECT value FROM properties WHERE name = 'generation'";
+    sqlite3_stmt *stmt = NULL;
+    gint64 generation = 0;
+
+    /* Random start, so a snapshot never matches a recreated database */
+    sqlite3_prepare_v2 (priv->db, insert_sql, -1, &stmt, NULL);
+    sqlite3_bind_int64 (stmt, 1, g_random_int ());
+    sqlite3_step (stmt);
+    sqlite3_finalize (stmt);
+
+    sqlite3_prepare_v2 (priv->db, select_sql, -1, &stmt, NULL);
+
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+        generation = sqlite3_column_int64 (stmt, 0);
+
+    sqlite3_finalize (stmt);
+    return generation;
+}
+
+static void
+upgrade_db (BooksCollectionPrivate *priv)
+{
+    gchar *version_sql;
+    gint version;
+    gboolean success = TRUE;
+
+    version = get_schema_version (priv);
+
+    if (version >= SCHEMA_VERSION)
+        return;
+
+    /* Either all steps are applied or none */
+    execute_sql (priv, "BEGIN TRANSACTION");
+
+    if (success && version < 2)
+        success = migrate_to_v2 (priv);
+
+    if (success && version < 3)
+        success = migrate_to_v3 (priv);
+
+    if (success && version < 4)
+        success = migrate_to_v4 (priv);
+
+    if (success && version < 5)
+        success = migrate_to_v5 (priv);
+
+    if (success && version < 6)
+        success = migrate_to_v6 (priv);
+
+    if (success && version < 7)
+        success = migrate_to_v7 (priv);
+
+    if (success && version < 8)
+        success = migrate_to_v8 (priv);
+
+    if (success && version < 9)
+        success = migrate_to_v9 (priv);
+
+    if (success && version < 10)
+        success = migrate_to_v10 (priv);
+
+    if (success && version < 11)
+        success = migrate_to_v11 (priv);
+
+    if (success && version < 12)
+        success = migrate_to_v12 (priv);
+
+    if (success && version < 13)
+        success = migrate_to_v13 (priv);
+
+    if (!success) {
+        execute_sql (priv, "ROLLBACK TRANSACTION");
+        return;
+    }
+
+    version_sql = g_strdup_printf ("PRAGMA user_version = %i", SCHEMA_VERSION);
+    execute_sql (priv, version_sql);
+    execute_sql (priv, "COMMIT TRANSACTION");
+    g_free (version_sql);
+}
+
+static void
+create_db (BooksCollectionPrivate *priv,
+           const gchar *db_path)
+{
+    GString *page_sql;
+    gchar *config_path;
+    guint i;
+
+    priv->db_path = db_path != NULL ? g_strdup (db_path) : books_libraries_get_default_database ();
+    config_path = g_path_get_dirname (priv->db_path);
+
+    /* Make sure the path exists */
+    if (!g_file_test (config_path, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
+        g_mkdir_with_parents (config_path, 0700);
+
+    g_assert (sqlite3_open (priv->db_path, &priv->db) == SQLITE_OK);
+    sqlite3_busy_timeout (priv->db, BUSY_TIMEOUT);
+
+    /*
+     * Readers such as the missing book check do not block writers with a
+     * write-ahead log. Syncing at checkpoints only is safe in WAL mode.
+     */
+    execute_sql (priv, "PRAGMA journal_mode = WAL");
+    execute_sql (priv, "PRAGMA synchronous = NORMAL");
+
+    /* Map up to 64 MiB and cache 8 MiB of pages */
+    execute_sql (priv, "PRAGMA mmap_size = 67108864");
+    execute_sql (priv, "PRAGMA cache_size = -8192");
+
+    upgrade_db (priv);
+    check_collation_locale (priv);
+
+    page_sql = g_string_new ("SELECT id, author, title, path, cover, thumbnail, size, mtime, series, series_index "
+                             "FROM books WHERE id IN (?");
+
+    for (i = 1; i < PAGE_SIZE; i++)
+        g_string_append (page_sql, ", ?");
+
+    g_string_append (page_sql, ")");
+    sqlite3_prepare_v2 (priv->db, page_sql->str, -1, &priv->page_stmt, NULL);
+    g_string_free (page_sql, TRUE);
+
+    g_free (config_path);
+}
+
+/* Books removed in a previous session are picked up by the next purge */
+static BooksBitmap *
+load_tombstones (BooksCollectionPrivate *priv)
+{
+    sqlite3_stmt *select_stmt = NULL;
+    BooksBitmap *tombstones;
+
+    tombstones = books_bitmap_new ();
+    sqlite3_prepare_v2 (priv->db, "SELECT id FROM books WHERE removed", -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gint64 id;
+
+        id = sqlite3_column_int64 (select_stmt, 0);
+
+        if (id >= 0 && id <= G_MAXUINT32)
+            books_bitmap_add (tombstones, (guint32) id);
+    }
+
+    sqlite3_finalize (select_stmt);
+    return tombstones;
+}
+
+static GHashTable *
+load_damaged (BooksCollectionPrivate *priv)
+{
+    sqlite3_stmt *select_stmt = NULL;
+    GHashTable *damaged;
+
+    damaged = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+    sqlite3_prepare_v2 (priv->db, "SELECT book_id, problem FROM verified WHERE problem IS NOT NULL",
+                        -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gint64 id;
+
+        id = sqlite3_column_int64 (select_stmt, 0);
+        g_hash_table_insert (damaged, g_memdup (&id, sizeof (gint64)),
+                             g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1)));
+    }
+
+    sqlite3_finalize (select_stmt);
+    return damaged;
+}
+
+static void
+free_missing_book (MissingBook *book)
+{
+    g_free (book->path);
+    g_free (book);
+}
+
+static void
+free_missing_folder (MissingFolder *folder)
+{
+    g_free (folder->path);
+    g_ptr_array_free (folder->books, TRUE);
+    g_free (folder);
+}
+
+static void
+free_missing_check (MissingCheck *check)
+{
+    g_free (check->db_path);
+    g_free (check);
+}
+
+static void
+free_missing_result (MissingResult *result)
+{
+    g_strfreev (result->missing);
+    g_array_free (result->offline, TRUE);
+    g_free (result);
+}
+
+/*
+ * Books on a share are looked up in one listing of their folder, which
+ * costs a single round trip instead of one per book. A folder that
+ * cannot be listed leaves its books unreachable, never missing.
+ */
+static void
+test_missing_folder (MissingFolder *folder,
+                     MissingCheck *check)
+{
+    gboolean remote;
+    guint i;
+
+    if (check->location == BOOKS_LIBRARY_LOCATION_AUTO)
+        remote = books_listing_cache_is_remote (check->listings, folder->path);
+    else
+        remote = check->location == BOOKS_LIBRARY_LOCATION_REMOTE;
+
+    for (i = 0; i < folder->books->len; i++) {
+        MissingBook *book;
+
+        book = g_ptr_array_index (folder->books, i);
+
+        if (remote)
+            book->state = books_listing_cache_lookup (check->listings, book->path, NULL);
+        else
+            book->state = g_file_test (book->path, G_FILE_TEST_EXISTS) ? BOOKS_FILE_PRESENT : BOOKS_FILE_MISSING;
+    }
+}
+
+static void
+find_missing_books_thread (GTask *task,
+                           BooksCollection *collection,
+                           MissingCheck *check,
+                           GCancellable *cancellable)
+{
+    GHashTable *folders;
+    GHashTableIter iter;
+    MissingFolder *folder;
+    MissingResult *result;
+    GPtrArray *missing;
+    GThreadPool *pool;
+    sqlite3 *db;
+    sqlite3_stmt *select_stmt = NULL;
+
+    /* The main thread keeps using its own connection meanwhile */
+    if (sqlite3_open_v2 (check->db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        sqlite3_close (db);
+        g_task_return_pointer (task, NULL, NULL);
+        return;
+    }
+
+    folders = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) free_missing_folder);
+    sqlite3_prepare_v2 (db, "SELECT id, path FROM books", -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        MissingBook *book;
+        gchar *dirname;
+
+        book = g_new0 (MissingBook, 1);
+        book->id = sqlite3_column_int64 (select_stmt, 0);
+        book->path = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+
+        dirname = g_path_get_dirname (book->path);
+        folder = g_hash_table_lookup (folders, dirname);
+
+        if (folder == NULL) {
+            folder = g_new0 (MissingFolder, 1);
+            folder->path = dirname;
+            folder->books = g_ptr_array_new_with_free_func ((GDestroyNotify) free_missing_book);
+            g_hash_table_insert (folders, folder->path, folder);
+        }
+        else {
+            g_free (dirname);
+        }
+
+        g_ptr_array_add (folder->books, book);
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_close (db);
+
+    /* Folders in parallel, on slow or remote disks latency dominates */
+    pool = g_thread_pool_new ((GFunc) test_missing_folder, check, MISSING_BOOK_THREADS, FALSE, NULL);
+    g_hash_table_iter_init (&iter, folders);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &folder) &&
+           !g_cancellable_is_cancelled (cancellable))
+        g_thread_pool_push (pool, folder, NULL);
+
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    result = g_new0 (MissingResult, 1);
+    result->offline = g_array_new (FALSE, FALSE, sizeof (gint64));
+    missing = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, folders);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &folder)) {
+        guint i;
+
+        for (i = 0; i < folder->books->len; i++) {
+            MissingBook *book;
+
+            book = g_ptr_array_index (folder->books, i);
+
+            if (book->state == BOOKS_FILE_MISSING)
+                g_ptr_array_add (missing, g_strdup (book->path));
+            else if (book->state == BOOKS_FILE_UNREACHABLE)
+                g_array_append_val (result->offline, book->id);
+        }
+    }
+
+    g_ptr_array_add (missing, NULL);
+    result->missing = (gchar **) g_ptr_array_free (missing, FALSE);
+    g_hash_table_destroy (folders);
+    g_task_return_pointer (task, result, (GDestroyNotify) free_missing_result);
+}
+
+static void
+free_purge_job (PurgeJob *job)
+{
+    g_free (job->db_path);
+    g_strfreev (job->other_db_paths);
+    g_array_free (job->ids, TRUE);
+    g_free (job);
+}
+
+static gboolean
+is_file_name_used (sqlite3 *db,
+                   const gchar *suffix)
+{
+    const gchar *select_sql = "SELECT 1 FROM books WHERE substr(path, -length(?1)) = ?1 LIMIT 1";
+    sqlite3_stmt *select_stmt = NULL;
+    gboolean used;
+
+    sqlite3_prepare_v2 (db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_text (select_stmt, 1, suffix, -1, NULL);
+    used = sqlite3_step (select_stmt) == SQLITE_ROW;
+    sqlite3_finalize (select_stmt);
+    return used;
+}
+
+/*
+ * Returns whether no book of any library shares the files
+ * books_epub_open() extracted the book in @path to. Libraries that cannot
+ * be read count as sharing them.
+ */
+static gboolean
+is_extract_dir_unshared (sqlite3 *db,
+                         gchar **other_db_paths,
+                         const gchar *path)
+{
+    gchar *basename;
+    gchar *suffix;
+    gboolean shared;
+    guint i;
+
+    basename = g_path_get_basename (path);
+    suffix = g_strconcat (G_DIR_SEPARATOR_S, basename, NULL);
+    shared = is_file_name_used (db, suffix);
+
+    for (i = 0; !shared && other_db_paths[i] != NULL; i++) {
+        sqlite3 *other_db = NULL;
+
+        /* Libraries never opened have no books */
+        if (!g_file_test (other_db_paths[i], G_FILE_TEST_EXISTS))
+            continue;
+
+        if (sqlite3_open_v2 (other_db_paths[i], &other_db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+            sqlite3_busy_timeout (other_db, BUSY_TIMEOUT);
+            shared = is_file_name_used (other_db, suffix);
+        }
+        else
+            shared = TRUE;
+
+        sqlite3_close (other_db);
+    }
+
+    g_free (suffix);
+    g_free (basename);
+    return !shared;
+}
+
+static void
+purge_books_thread (GTask *task,
+                    BooksCollection *collection,
+                    PurgeJob *job,
+                    GCancellable *cancellable)
+{
+    const gchar *select_sql = "SELECT thumbnail, path FROM books WHERE id = ? AND removed";
+    const gchar *delete_sql = "DELETE FROM books WHERE id = ? AND removed";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *delete_stmt = NULL;
+    GArray *purged;
+    sqlite3 *db;
+    guint i;
+
+    purged = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    if (sqlite3_open (job->db_path, &db) != SQLITE_OK) {
+        sqlite3_close (db);
+        g_task_return_pointer (task, purged, (GDestroyNotify) g_array_unref);
+        return;
+    }
+
+    sqlite3_busy_timeout (db, BUSY_TIMEOUT);
+    sqlite3_prepare_v2 (db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_prepare_v2 (db, delete_sql, -1, &delete_stmt, NULL);
+
+    /*
+     * Short transactions let the main connection write in between. A book
+     * restored meanwhile is no longer removed and stays.
+     */
+    for (i = 0; i < job->ids->len; i += PURGE_BATCH_SIZE) {
+        GPtrArray *thumbnails;
+        GPtrArray *paths;
+        GPtrArray *unshared;
+        guint last;
+        guint j;
+
+        if (sqlite3_exec (db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+            break;
+
+        thumbnails = g_ptr_array_new_with_free_func (g_free);
+        paths = g_ptr_array_new_with_free_func (g_free);
+        unshared = g_ptr_array_new ();
+        last = MIN (i + PURGE_BATCH_SIZE, job->ids->len);
+
+        for (j = i; j < last; j++) {
+            gint64 id;
+            gchar *thumbnail;
+            gchar *path;
+
+            id = g_array_index (job->ids, guint32, j);
+
+            sqlite3_reset (select_stmt);
+            sqlite3_bind_int64 (select_stmt, 1, id);
+
+            if (sqlite3_step (select_stmt) != SQLITE_ROW)
+                continue;
+
+            thumbnail = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 0));
+            path = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+
+            sqlite3_reset (delete_stmt);
+            sqlite3_bind_int64 (delete_stmt, 1, id);
+
+            if (sqlite3_step (delete_stmt) == SQLITE_DONE && sqlite3_changes (db) > 0) {
+                g_array_append_val (purged, id);
+                g_ptr_array_add (thumbnails, thumbnail);
+                g_ptr_array_add (paths, path);
+            }
+            else {
+                g_free (thumbnail);
+                g_free (path);
+            }
+        }
+
+        sqlite3_reset (select_stmt);
+
+        /* Books are extracted by file name, copies elsewhere may still use it */
+        for (j = 0; j < paths->len; j++) {
+            if (is_extract_dir_unshared (db, job->other_db_paths, g_ptr_array_index (paths, j)))
+                g_ptr_array_add (unshared, g_ptr_array_index (paths, j));
+        }
+
+        if (sqlite3_exec (db, "COMMIT TRANSACTION", NULL, NULL, NULL) == SQLITE_OK) {
+            for (j = 0; j < thumbnails->len; j++)
+                books_thumbnail_remove (g_ptr_array_index (thumbnails, j));
+
+            for (j = 0; j < unshared->len; j++)
+                books_epub_remove_extracted (g_ptr_array_index (unshared, j));
+        }
+        else {
+            sqlite3_exec (db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+            g_array_set_size (purged, purged->len - thumbnails->len);
+        }
+
+        g_ptr_array_free (thumbnails, TRUE);
+        g_ptr_array_free (paths, TRUE);
+        g_ptr_array_free (unshared, TRUE);
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_finalize (delete_stmt);
+    sqlite3_close (db);
+
+    g_task_return_pointer (task, purged, (GDestroyNotify) g_array_unref);
+}
+
+static void
+free_verify_job (VerifyJob *job)
+{
+    g_free (job->db_path);
+    g_free (job);
+}
+
+static void
+free_verify_report (VerifyReport *report)
+{
+    g_object_unref (report->collection);
+    g_free (report->db_path);
+    g_free (report->problem);
+    g_free (report);
+}
+
+static gboolean
+deliver_verify_report (VerifyReport *report)
+{
+    BooksCollectionPrivate *priv;
+    guint i;
+
+    priv = report->collection->priv;
+
+    /* Another library has been opened meanwhile */
+    if (g_strcmp0 (report->db_path, priv->db_path))
+        return FALSE;
+
+    if (report->problem != NULL)
+        g_hash_table_insert (priv->damaged, g_memdup (&report->id, sizeof (gint64)), g_strdup (report->problem));
+    else
+        g_hash_table_remove (priv->damaged, &report->id);
+
+    for (i = 0; i < priv->ids->len; i++) {
+        if (g_array_index (priv->ids, gint64, i) == report->id) {
+            GtkTreePath *path;
+            GtkTreeIter iter;
+
+            path = gtk_tree_path_new_from_indices (i, -1);
+            iter.stamp = priv->stamp;
+            iter.user_data = GUINT_TO_POINTER (i);
+            gtk_tree_model_row_changed (GTK_TREE_MODEL (report->collection), path, &iter);
+            gtk_tree_path_free (path);
+            break;
+        }
+    }
+
+    return FALSE;
+}
+
+typedef struct {
+    gint64       id;
+    gchar       *path;
+    gint64       mtime;
+    gboolean     damaged;
+} PendingBook;
+
+static void
+free_pending_book (PendingBook *book)
+{
+    g_free (book->path);
+    g_free (book);
+}
+
+static void
+verify_books_thread (GTask *task,
+                     BooksCollection *collection,
+                     VerifyJob *job,
+                     GCancellable *cancellable)
+{
+    const gchar *select_sql = "SELECT books.id, books.path, books.mtime, verified.problem IS NOT NULL "
+                              "FROM books LEFT JOIN verified ON verified.book_id = books.id "
+                              "WHERE NOT books.removed AND books.mtime IS NOT NULL "
+                              "AND (verified.book_id IS NULL OR verified.mtime IS NOT books.mtime) "
+                              "ORDER BY books.id";
+    /* Nothing is recorded for a book changed or removed meanwhile */
+    const gchar *insert_sql = "INSERT OR REPLACE INTO verified (book_id, mtime, problem) "
+                              "SELECT id, mtime, ?3 FROM books WHERE id = ?1 AND mtime = ?2";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+    BooksVerifier *verifier;
+    GPtrArray *books;
+    sqlite3 *db;
+    guint i;
+
+    if (sqlite3_open (job->db_path, &db) != SQLITE_OK) {
+        sqlite3_close (db);
+        g_task_return_boolean (task, FALSE);
+        return;
+    }
+
+    sqlite3_busy_timeout (db, BUSY_TIMEOUT);
+
+    /* Read up front, a statement left open would hold back checkpoints */
+    books = g_ptr_array_new_with_free_func ((GDestroyNotify) free_pending_book);
+    sqlite3_prepare_v2 (db, select_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        PendingBook *book;
+
+        book = g_new0 (PendingBook, 1);
+        book->id = sqlite3_column_int64 (select_stmt, 0);
+        book->path = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+        book->mtime = sqlite3_column_int64 (select_stmt, 2);
+        book->damaged = sqlite3_column_int (select_stmt, 3);
+        g_ptr_array_add (books, book);
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_prepare_v2 (db, insert_sql, -1, &insert_stmt, NULL);
+    verifier = books_verifier_new (job->rate);
+
+    for (i = 0; i < books->len && !g_cancellable_is_cancelled (cancellable); i++) {
+        PendingBook *book;
+        GStatBuf buf;
+        GError *error = NULL;
+
+        book = g_ptr_array_index (books, i);
+
+        /* Changed files are checked once the scanner has picked them up */
+        if (g_stat (book->path, &buf) != 0 || buf.st_mtime != book->mtime)
+            continue;
+
+        if (!books_verifier_check (verifier, book->path, cancellable, &error) &&
+            error->domain == G_IO_ERROR) {
+            g_error_free (error);
+            continue;
+        }
+
+        sqlite3_reset (insert_stmt);
+        sqlite3_bind_int64 (insert_stmt, 1, book->id);
+        sqlite3_bind_int64 (insert_stmt, 2, book->mtime);
+
+        if (error != NULL)
+            sqlite3_bind_text (insert_stmt, 3, error->message, -1, SQLITE_TRANSIENT);
+        else
+            sqlite3_bind_null (insert_stmt, 3);
+
+        if (sqlite3_step (insert_stmt) == SQLITE_DONE && sqlite3_changes (db) > 0 &&
+            (error != NULL || book->damaged)) {
+            VerifyReport *report;
+
+            report = g_new0 (VerifyReport, 1);
+            report->collection = g_object_ref (collection);
+            report->db_path = g_strdup (job->db_path);
+            report->id = book->id;
+            report->problem = error != NULL ? g_strdup (error->message) : NULL;
+
+            g_main_context_invoke_full (NULL, G_PRIORITY_LOW,
+                                        (GSourceFunc) deliver_verify_report, report,
+                                        (GDestroyNotify) free_verify_report);
+        }
+
+        g_clear_error (&error);
+    }
+
+    books_verifier_free (verifier);
+    sqlite3_finalize (insert_stmt);
+    sqlite3_close (db);
+    g_ptr_array_free (books, TRUE);
+
+    g_task_return_boolean (task, TRUE);
+}
+
+typedef struct {
+    gint64       id;
+    gchar       *path;
+    gchar       *author;
+    gchar       *title;
+    gboolean     needs_series;
+    gchar       *content_hash;
+    gchar       *identifier;
+    gchar       *series;
+    gdouble      series_index;
+    gchar      **languages;
+    gchar      **subjects;
+    gint64       size;
+    gint64       mtime;
+} BackfillBook;
+
+static void
+free_backfill_book (BackfillBook *book)
+{
+    g_free (book->path);
+    g_free (book->author);
+    g_free (book->title);
+    g_free (book->content_hash);
+    g_free (book->identifier);
+    g_free (book->series);
+    g_strfreev (book->languages);
+    g_strfreev (book->subjects);
+    g_free (book);
+}
+
+/* Reads what @book lacks from its file, returns %FALSE if it is gone */
+static gboolean
+read_backfill_book (BackfillBook *book,
+                    gboolean needs_hash,
+                    gboolean needs_identifier)
+{
+    BooksEpub *epub;
+    GStatBuf buf;
+    guint i;
+
+    if (g_stat (book->path, &buf) != 0)
+        return FALSE;
+
+    book->size = buf.st_size;
+    book->mtime = buf.st_mtime;
+
+    if (needs_hash)
+        book->content_hash = books_content_hash_compute (book->path, NULL, NULL);
+
+    epub = books_epub_new ();
+
+    if (!books_epub_open (epub, book->path, NULL)) {
+        g_object_unref (epub);
+        return book->content_hash != NULL;
+    }
+
+    if (needs_identifier)
+        book->identifier = books_epub_get_identifier (epub);
+
+    if (book->needs_series)
+        book->series = books_epub_get_series (epub, &book->series_index);
+
+    book->languages = books_epub_get_meta_list (epub, "language");
+    book->subjects = books_epub_get_meta_list (epub, "subject");
+
+    for (i = 0; book->languages[i] != NULL; i++) {
+        gchar *language;
+
+        language = g_ascii_strdown (book->languages[i], -1);
+        g_free (book->languages[i]);
+        book->languages[i] = language;
+    }
+
+    g_object_unref (epub);
+    return TRUE;
+}
+
+static void
+insert_backfill_facets (sqlite3_stmt *insert_stmt,
+                        gint64 id,
+                        BooksFacetKind kind,
+                        gchar **values)
+{
+    guint i;
+
+    for (i = 0; values != NULL && values[i] != NULL; i++) {
+        sqlite3_reset (insert_stmt);
+        sqlite3_bind_int64 (insert_stmt, 1, id);
+        sqlite3_bind_int (insert_stmt, 2, kind);
+        sqlite3_bind_text (insert_stmt, 3, values[i], -1, NULL);
+        sqlite3_step (insert_stmt);
+    }
+}
+
+static void
+backfill_books_thread (GTask *task,
+                       BooksCollection *collection,
+                       const gchar *db_path,
+                       GCancellable *cancellable)
+{
+    const gchar *select_sql = "SELECT id, path, author, title, content_hash IS NULL, identifier IS NULL, "
+                              "       series IS NULL "
+                              "FROM books WHERE NOT removed AND id > (SELECT value FROM properties WHERE name = 'backfill') "
+                              "ORDER BY id LIMIT ?";
+    /* Only fills in, a book changed or removed meanwhile is left alone */
+    const gchar *update_sql = "UPDATE books SET content_hash = coalesce (content_hash, ?2), "
+                              "    identifier = coalesce (identifier, ?3), "
+                              "    series_index = CASE WHEN series IS NULL THEN ?5 ELSE series_index END, "
+                              "    series_key = CASE WHEN series IS NULL THEN ?6 ELSE series_key END, "
+                              "    search_key = CASE WHEN series IS NULL AND ?4 IS NOT NULL THEN ?7 ELSE search_key END, "
+                              "    series = coalesce (series, ?4), "
+                              "    size = coalesce (size, ?8), mtime = coalesce (mtime, ?9) "
+                              "WHERE id = ?1 AND path = ?10 AND NOT removed";
+    const gchar *insert_sql = "INSERT OR IGNORE INTO facets (book_id, kind, value) VALUES (?, ?, ?)";
+    const gchar *progress_sql = "UPDATE properties SET value = ? WHERE name = 'backfill'";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *update_stmt = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+    sqlite3_stmt *progress_stmt = NULL;
+    GArray *updated;
+    sqlite3 *db;
+    gboolean done = FALSE;
+
+    updated = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    if (sqlite3_open (db_path, &db) != SQLITE_OK) {
+        sqlite3_close (db);
+        g_task_return_pointer (task, updated, (GDestroyNotify) g_array_unref);
+        return;
+    }
+
+    sqlite3_busy_timeout (db, BUSY_TIMEOUT);
+    sqlite3_prepare_v2 (db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_prepare_v2 (db, update_sql, -1, &update_stmt, NULL);
+    sqlite3_prepare_v2 (db, insert_sql, -1, &insert_stmt, NULL);
+    sqlite3_prepare_v2 (db, progress_sql, -1, &progress_stmt, NULL);
+
+    while (!done) {
+        GPtrArray *books;
+        gint64 last_id = 0;
+        guint i;
+
+        /* Files are read outside of transactions, they may take a while */
+        books = g_ptr_array_new_with_free_func ((GDestroyNotify) free_backfill_book);
+        sqlite3_reset (select_stmt);
+        sqlite3_bind_int (select_stmt, 1, BACKFILL_BATCH_SIZE);
+
+        while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+            BackfillBook *book;
+
+            book = g_new0 (BackfillBook, 1);
+            book->id = sqlite3_column_int64 (select_stmt, 0);
+            book->path = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+            book->author = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 2));
+            book->title = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 3));
+            book->needs_series = sqlite3_column_int (select_stmt, 6);
+            last_id = book->id;
+
+            if (!read_backfill_book (book, sqlite3_column_int (select_stmt, 4), sqlite3_column_int (select_stmt, 5)))
+                book->path[0] = '\0';
+
+            g_ptr_array_add (books, book);
+        }
+
+        sqlite3_reset (select_stmt);
+        done = books->len < BACKFILL_BATCH_SIZE;
+
+        if (sqlite3_exec (db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+            g_ptr_array_free (books, TRUE);
+            break;
+        }
+
+        for (i = 0; i < books->len; i++) {
+            BackfillBook *book;
+            gchar *search_key = NULL;
+
+            book = g_ptr_array_index (books, i);
+
+            if (book->path[0] == '\0')
+                continue;
+
+            sqlite3_reset (update_stmt);
+            sqlite3_clear_bindings (update_stmt);
+            sqlite3_bind_int64 (update_stmt, 1, book->id);
+            sqlite3_bind_text (update_stmt, 2, book->content_hash, -1, NULL);
+            sqlite3_bind_text (update_stmt, 3, book->identifier, -1, NULL);
+            sqlite3_bind_int64 (update_stmt, 8, book->size);
+            sqlite3_bind_int64 (update_stmt, 9, book->mtime);
+            sqlite3_bind_text (update_stmt, 10, book->path, -1, NULL);
+
+            if (book->series != NULL) {
+                search_key = get_search_key (book->author, book->title, book->series);
+                sqlite3_bind_text (update_stmt, 4, book->series, -1, NULL);
+                sqlite3_bind_double (update_stmt, 5, book->series_index);
+                bind_series_key (update_stmt, 6, book->series);
+                sqlite3_bind_text (update_stmt, 7, search_key, -1, g_free);
+            }
+
+            if (sqlite3_step (update_stmt) != SQLITE_DONE || sqlite3_changes (db) == 0)
+                continue;
+
+            insert_backfill_facets (insert_stmt, book->id, BOOKS_FACET_LANGUAGE, book->languages);
+            insert_backfill_facets (insert_stmt, book->id, BOOKS_FACET_SUBJECT, book->subjects);
+
+            if (book->series != NULL) {
+                gchar *series[] = { book->series, NULL };
+
+                insert_backfill_facets (insert_stmt, book->id, BOOKS_FACET_SERIES, series);
+            }
+
+            g_array_append_val (updated, book->id);
+        }
+
+        if (last_id > 0) {
+            sqlite3_reset (progress_stmt);
+            sqlite3_bind_int64 (progress_stmt, 1, last_id);
+            sqlite3_step (progress_stmt);
+        }
+
+        /* Rows changed under the snapshot, see mark_changed */
+        sqlite3_exec (db, "UPDATE properties SET value = value + 1 WHERE name = 'generation'", NULL, NULL, NULL);
+
+        if (done)
+            sqlite3_exec (db, "DELETE FROM properties WHERE name = 'backfill'", NULL, NULL, NULL);
+
+        if (sqlite3_exec (db, "COMMIT TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+            sqlite3_exec (db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+            g_ptr_array_free (books, TRUE);
+            break;
+        }
+
+        g_ptr_array_free (books, TRUE);
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_finalize (update_stmt);
+    sqlite3_finalize (insert_stmt);
+    sqlite3_finalize (progress_stmt);
+    sqlite3_close (db);
+
+    g_task_return_pointer (task, updated, (GDestroyNotify) g_array_unref);
+}
+
+static void
+on_books_backfilled (BooksCollection *collection,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+    BooksCollectionPrivate *priv;
+    GArray *updated;
+    guint i;
+
+    priv = collection->priv;
+    updated = g_task_propagate_pointer (G_TASK (result), NULL);
+
+    if (updated == NULL)
+        return;
+
+    /* Books of a library closed meanwhile are not in memory anymore */
+    if (g_strcmp0 (g_task_get_task_data (G_TASK (result)), priv->db_path) || updated->len == 0) {
+        g_array_unref (updated);
+        return;
+    }
+
+    for (i = 0; i < updated->len; i++) {
+        gint64 id;
+        BooksRow *row;
+
+        id = g_array_index (updated, gint64, i);
+        row = g_hash_table_lookup (priv->rows, &id);
+
+        if (row != NULL)
+            forget_row (priv, row);
+
+        g_hash_table_add (priv->reimported, g_memdup (&id, sizeof (gint64)));
+    }
+
+    /* Search keys may include series now, the index is loaded again on demand */
+    books_search_index_free (priv->search_index);
+    priv->search_index = NULL;
+
+    mark_changed (collection);
+    refresh_model (collection);
+    g_array_unref (updated);
+}
+
+static void
+on_cover_loaded (BooksCoverCache *cache,
+                 const gchar *thumbnail,
+                 BooksCollection *collection)
+{
+    BooksCollectionPrivate *priv;
+    gint64 *id;
+    guint last;
+    guint i;
+
+    priv = collection->priv;
+    id = g_hash_table_lookup (priv->requested, thumbnail);
+
+    if (id == NULL)
+        return;
+
+    /* Rows scrolled far away since the request are picked up next time */
+    last = MIN (priv->visible_last + 1, priv->ids->len);
+
+    for (i = priv->visible_first; i < last; i++) {
+        if (g_array_index (priv->ids, gint64, i) == *id) {
+            GtkTreePath *path;
+            GtkTreeIter iter;
+
+            path = gtk_tree_path_new_from_indices (i, -1);
+            iter.stamp = priv->stamp;
+            iter.user_data = GUINT_TO_POINTER (i);
+            gtk_tree_model_row_changed (GTK_TREE_MODEL (collection), path, &iter);
+            gtk_tree_path_free (path);
+            break;
+        }
+    }
+
+    g_hash_table_remove (priv->requested, thumbnail);
+}
+
+/* Tells the views about books that became reachable or unreachable */
+static void
+update_offline (BooksCollection *collection,
+                BooksBitmap *offline)
+{
+    BooksCollectionPrivate *priv;
+    BooksBitmap *previous;
+    guint i;
+
+    priv = collection->priv;
+    previous = priv->offline;
+    priv->offline = offline;
+
+    if (books_bitmap_get_cardinality (previous) == 0 &&
+        books_bitmap_get_cardinality (offline) == 0) {
+        books_bitmap_free (previous);
+        return;
+    }
 
-enum {
-    PROP_0,
-    PROP_FILTER_TERM
-};
+    for (i = 0; i < priv->ids->len; i++) {
+        guint32 id;
 
-struct _BooksCollectionPrivate {
-    GtkListStore    *store;
-    GtkTreeModel    *sorted;
-    GtkTreeModel    *filtered;
-    sqlite3         *db;
-    gchar           *filter_term;
-    GdkPixbuf       *placeholder;
-};
+        id = (guint32) g_array_index (priv->ids, gint64, i);
 
-BooksCollection *
-books_collection_new (void)
-{
-    return BOOKS_COLLECTION (g_object_new (BOOKS_TYPE_COLLECTION, NULL));
+        if (books_bitmap_contains (previous, id) != books_bitmap_contains (offline, id)) {
+            GtkTreePath *path;
+            GtkTreeIter iter;
+
+            path = gtk_tree_path_new_from_indices (i, -1);
+            iter.stamp = priv->stamp;
+            iter.user_data = GUINT_TO_POINTER (i);
+            gtk_tree_model_row_changed (GTK_TREE_MODEL (collection), path, &iter);
+            gtk_tree_path_free (path);
+        }
+    }
+
+    books_bitmap_free (previous);
 }
 
-GtkTreeModel *
-books_collection_get_model (BooksCollection *collection)
+static void
+on_missing_books_found (BooksCollection *collection,
+                        GAsyncResult *result,
+                        gpointer user_data)
 {
-    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
-    return collection->priv->sorted;
+    MissingResult *found;
+    MissingCheck *check;
+    BooksBitmap *offline;
+    guint i;
+
+    found = g_task_propagate_pointer (G_TASK (result), NULL);
+    check = g_task_get_task_data (G_TASK (result));
+
+    if (found == NULL)
+        return;
+
+    /* Another library has been opened meanwhile */
+    if (g_strcmp0 (check->db_path, collection->priv->db_path)) {
+        free_missing_result (found);
+        return;
+    }
+
+    offline = books_bitmap_new ();
+
+    for (i = 0; i < found->offline->len; i++) {
+        gint64 id;
+
+        id = g_array_index (found->offline, gint64, i);
+
+        if (id >= 0 && id <= G_MAXUINT32)
+            books_bitmap_add (offline, (guint32) id);
+    }
+
+    update_offline (collection, offline);
+
+    if (found->missing[0] != NULL) {
+        books_collection_remove_paths (collection, (const gchar * const *) found->missing);
+        g_signal_emit (collection, collection_signals[BOOKS_REMOVED], 0, found->missing);
+    }
+
+    free_missing_result (found);
 }
 
-void
-books_collection_add_book (BooksCollection *collection,
-                           BooksEpub *epub,
-                           const gchar *path)
+static void
+on_books_purged (BooksCollection *collection,
+                 GAsyncResult *result,
+                 gpointer user_data)
 {
     BooksCollectionPrivate *priv;
-    GtkTreeIter iter;
-    gchar *markup;
-    const gchar *author;
-    const gchar *title;
-    const gchar *cover;
-    const gchar *empty = "";
-    const gchar *insert_sql = "INSERT INTO books (author, title, path, cover) VALUES (?, ?, ?, ?)";
-    sqlite3_stmt *insert_stmt = NULL;
-
-    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
+    PurgeJob *job;
+    GArray *purged;
+    guint i;
 
     priv = collection->priv;
-    author = books_epub_get_meta (epub, "creator");
-    title = books_epub_get_meta (epub, "title");
-    cover = books_epub_get_cover (epub);
-    markup = get_author_title_markup (author, title);
+    purged = g_task_propagate_pointer (G_TASK (result), NULL);
+    job = g_task_get_task_data (G_TASK (result));
 
-    if (author == NULL)
-        author = g_strdup ("n/a");
+    if (purged == NULL)
+        return;
 
-    gtk_list_store_append (priv->store, &iter);
-    gtk_list_store_set (priv->store, &iter,
-                        BOOKS_COLLECTION_AUTHOR_COLUMN, author,
-                        BOOKS_COLLECTION_TITLE_COLUMN, title,
-                        BOOKS_COLLECTION_PATH_COLUMN, path,
-                        BOOKS_COLLECTION_MARKUP_COLUMN, markup,
-                        -1);
+    /* Books of a library closed meanwhile are not in memory anymore */
+    if (g_strcmp0 (job->db_path, priv->db_path)) {
+        g_array_unref (purged);
+        return;
+    }
 
-    set_pixbuf_column_from_file (priv, &iter, cover);
+    for (i = 0; i < purged->len; i++) {
+        gint64 id;
 
-    sqlite3_prepare_v2 (priv->db, insert_sql, -1, &insert_stmt, NULL);
-    sqlite3_bind_text (insert_stmt, 1, author, strlen (author), NULL);
-    sqlite3_bind_text (insert_stmt, 2, title, strlen (title), NULL);
-    sqlite3_bind_text (insert_stmt, 3, path, strlen (path), NULL);
+        id = g_array_index (purged, gint64, i);
 
-    if (cover != NULL)
-        sqlite3_bind_text (insert_stmt, 4, cover, strlen (cover), NULL);
-    else
-        sqlite3_bind_text (insert_stmt, 4, empty, strlen (empty), NULL);
+        /* Taken by a book added meanwhile, see books_collection_add_book */
+        if (!books_bitmap_contains (priv->tombstones, (guint32) id))
+            continue;
 
-    sqlite3_step (insert_stmt);
-    sqlite3_finalize (insert_stmt);
-    g_free (markup);
+        books_bitmap_remove (priv->tombstones, (guint32) id);
+
+        if (priv->search_index != NULL)
+            books_search_index_remove (priv->search_index, id);
+
+        books_tags_forget_book (priv->tags, id);
+    }
+
+    g_array_unref (purged);
 }
 
-void
-books_collection_remove_book (BooksCollection *collection,
-                              GtkTreeIter *iter)
+static GtkTreeModelFlags
+books_collection_get_flags (GtkTreeModel *model)
+{
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint
+books_collection_get_n_columns (GtkTreeModel *model)
+{
+    return BOOKS_COLLECTION_N_COLUMNS;
+}
+
+static GType
+books_collection_get_column_type (GtkTreeModel *model,
+                                  gint index)
+{
+    g_return_val_if_fail (index >= 0 && index < BOOKS_COLLECTION_N_COLUMNS, G_TYPE_INVALID);
+
+    if (index == BOOKS_COLLECTION_ICON_COLUMN)
+        return GDK_TYPE_PIXBUF;
+
+    if (index == BOOKS_COLLECTION_AVAILABLE_COLUMN)
+        return G_TYPE_BOOLEAN;
+
+    return G_TYPE_STRING;
+}
+
+static gboolean
+books_collection_get_iter (GtkTreeModel *model,
+                           GtkTreeIter *iter,
+                           GtkTreePath *path)
 {
     BooksCollectionPrivate *priv;
-    GtkTreeIter filtered_iter;
-    GtkTreeIter real_iter;
-    gchar *path;
-    const gchar *remove_sql = "DELETE FROM books WHERE path=?";
-    sqlite3_stmt *remove_stmt = NULL;
+    gint index;
 
-    g_return_if_fail (BOOKS_IS_COLLECTION (collection));
-    priv = collection->priv;
+    priv = BOOKS_COLLECTION (model)->priv;
 
-    gtk_tree_model_get (priv->sorted, iter, BOOKS_COLLECTION_PATH_COLUMN, &path, -1);
-    gtk_tree_model_sort_convert_iter_to_child_iter (GTK_TREE_MODEL_SORT (priv->sorted), &filtered_iter, iter);
-    gtk_tree_model_filter_convert_iter_to_child_iter (GTK_TREE_MODEL_FILTER (priv->filtered), &real_iter, &filtered_iter);
-    gtk_list_store_remove (priv->store, &real_iter);
-    gtk_tree_model_filter_refilter (GTK_TREE_MODEL_FILTER (priv->filtered));
+    if (gtk_tree_path_get_depth (path) != 1)
+        return FALSE;
 
-    /*
-     * TODO: sqlite operations are noticeable. We should execute them
-     * asynchronously.
-     */
-    sqlite3_prepare_v2 (priv->db, remove_sql, -1, &remove_stmt, NULL);
-    sqlite3_bind_text (remove_stmt, 1, path, strlen (path), NULL);
-    sqlite3_step (remove_stmt);
-    sqlite3_finalize (remove_stmt);
+    index = gtk_tree_path_get_indices (path)[0];
+
+    if (index < 0 || index >= priv->ids->len)
+        return FALSE;
 
-    g_free (path);
+    iter->stamp = priv->stamp;
+    iter->user_data = GINT_TO_POINTER (index);
+    return TRUE;
 }
 
-BooksEpub *
-books_collection_get_book (BooksCollection *collection,
-                           GtkTreePath *path,
-                           GError **error)
+static GtkTreePath *
+books_collection_get_path (GtkTreeModel *model,
+                           GtkTreeIter *iter)
+{
+    g_return_val_if_fail (iter->stamp == BOOKS_COLLECTION (model)->priv->stamp, NULL);
+    return gtk_tree_path_new_from_indices (GPOINTER_TO_INT (iter->user_data), -1);
+}
+
+static void
+books_collection_get_value (GtkTreeModel *model,
+                            GtkTreeIter *iter,
+                            gint column,
+                            GValue *value)
 {
     BooksCollectionPrivate *priv;
-    GtkTreePath *filtered_path;
-    GtkTreePath *real_path;
-    GtkTreeIter iter;
+    BooksRow *row;
+    guint index;
 
-    g_return_val_if_fail (BOOKS_IS_COLLECTION (collection), NULL);
+    priv = BOOKS_COLLECTION (model)->priv;
+    index = GPOINTER_TO_UINT (iter->user_data);
 
-    priv = collection->priv;
-    filtered_path = gtk_tree_model_sort_convert_path_to_child_path (GTK_TREE_MODEL_SORT (priv->sorted),
-                                                                    path);
+    g_value_init (value, books_collection_get_column_type (model, column));
+    g_return_if_fail (iter->stamp == priv->stamp && index < priv->ids->len);
 
-    real_path = gtk_tree_model_filter_convert_path_to_child_path (GTK_TREE_MODEL_FILTER (priv->filtered),
-                                                                  filtered_path);
+    row = lookup_row (priv, index);
 
-    if (gtk_tree_model_get_iter (GTK_TREE_MODEL (priv->store), &iter, real_path)) {
-        BooksEpub *epub;
-        gchar *filename;
+    if (row == NULL)
+        return;
 
-        gtk_tree_model_get (GTK_TREE_MODEL (priv->store), &iter, BOOKS_COLLECTION_PATH_COLUMN, &filename, -1);
-        epub = books_epub_new ();
+    switch (column) {
+        case BOOKS_COLLECTION_AUTHOR_COLUMN:
+            g_value_set_string (value, row->author);
+            break;
 
-        if (books_epub_open (epub, filename, error))
-            return epub;
-        else
-            g_object_unref (epub);
+        case BOOKS_COLLECTION_TITLE_COLUMN:
+            g_value_set_string (value, row->title);
+            break;
 
-        g_free (filename);
-    }
+        case BOOKS_COLLECTION_MARKUP_COLUMN:
+            if (g_hash_table_contains (priv->damaged, &row->id))
+                g_value_take_string (value, g_markup_printf_escaped ("%s &#8212; <i>%s</i>\n<small>%s</small>",
+                                                                     row->author, row->title,
+                                                                     _("Damaged file")));
+            else
+                g_value_take_string (value, get_author_title_markup (row->author, row->title));
+            break;
 
-    return NULL;
+        case BOOKS_COLLECTION_PATH_COLUMN:
+            g_value_take_string (value, get_row_path (row));
+            break;
+
+        case BOOKS_COLLECTION_ICON_COLUMN:
+            {
+                GdkPixbuf *cover;
+
+                cover = books_cover_cache_lookup (priv->covers, row->thumbnail);
+                g_value_set_object (value, cover != NULL ? cover : priv->placeholder);
+            }
+            break;
+
+        case BOOKS_COLLECTION_SERIES_COLUMN:
+            g_value_set_string (value, row->series);
+            break;
+
+        case BOOKS_COLLECTION_PROBLEM_COLUMN:
+            {
+                const gchar *problem;
+
+                problem = g_hash_table_lookup (priv->damaged, &row->id);
+
+                if (problem != NULL)
+                    g_value_take_string (value, g_markup_escape_text (problem, -1));
+            }
+            break;
+
+        case BOOKS_COLLECTION_AVAILABLE_COLUMN:
+            g_value_set_boolean (value, !books_bitmap_contains (priv->offline,
+                                                                (guint32) g_array_index (priv->ids, gint64, index)));
+            break;
+    }
 }
 
-static void
-set_pixbuf_column_from_file (BooksCollectionPrivate *priv,
-                             GtkTreeIter *iter,
-                             const gchar *cover)
+static gboolean
+books_collection_iter_next (GtkTreeModel *model,
+                            GtkTreeIter *iter)
 {
-    GdkPixbuf *pixbuf = priv->placeholder;
+    BooksCollectionPrivate *priv;
+    guint index;
 
-    if (cover != NULL && strlen (cover) > 0) {
-        GError *error = NULL;
+    priv = BOOKS_COLLECTION (model)->priv;
+    index = GPOINTER_TO_UINT (iter->user_data) + 1;
 
-        pixbuf = gdk_pixbuf_new_from_file_at_size (cover, 64, -1, &error);
+    if (index >= priv->ids->len) {
+        iter->stamp = 0;
+        return FALSE;
+    }
 
-        if (error != NULL) {
-            g_printerr (_("Could not load cover image: %s\n"), error->message);
-            pixbuf = priv->placeholder;
-        }
+    iter->user_data = GUINT_TO_POINTER (index);
+    return TRUE;
+}
+
+static gboolean
+books_collection_iter_previous (GtkTreeModel *model,
+                                GtkTreeIter *iter)
+{
+    guint index;
+
+    index = GPOINTER_TO_UINT (iter->user_data);
+
+    if (index == 0) {
+        iter->stamp = 0;
+        return FALSE;
     }
 
-    gtk_list_store_set (priv->store, iter, BOOKS_COLLECTION_ICON_COLUMN, pixbuf, -1);
+    iter->user_data = GUINT_TO_POINTER (index - 1);
+    return TRUE;
 }
 
-static gchar *
-get_author_title_markup (const gchar *author,
-                         const gchar *title)
+static gboolean
+books_collection_iter_nth_child (GtkTreeModel *model,
+                                 GtkTreeIter *iter,
+                                 GtkTreeIter *parent,
+                                 gint n)
 {
-    return g_markup_printf_escaped ("%s &#8212; <i>%s</i>", author, title);
+    BooksCollectionPrivate *priv;
+
+    priv = BOOKS_COLLECTION (model)->priv;
+
+    if (parent != NULL || n < 0 || n >= priv->ids->len)
+        return FALSE;
+
+    iter->stamp = priv->stamp;
+    iter->user_data = GINT_TO_POINTER (n);
+    return TRUE;
+}
+
+static gboolean
+books_collection_iter_children (GtkTreeModel *model,
+                                GtkTreeIter *iter,
+                                GtkTreeIter *parent)
+{
+    return books_collection_iter_nth_child (model, iter, parent, 0);
+}
+
+static gboolean
+books_collection_iter_has_child (GtkTreeModel *model,
+                                 GtkTreeIter *iter)
+{
+    return FALSE;
+}
+
+static gint
+books_collection_iter_n_children (GtkTreeModel *model,
+                                  GtkTreeIter *iter)
+{
+    if (iter != NULL)
+        return 0;
+
+    return BOOKS_COLLECTION (model)->priv->ids->len;
+}
+
+static gboolean
+books_collection_iter_parent (GtkTreeModel *model,
+                              GtkTreeIter *iter,
+                              GtkTreeIter *child)
+{
+    return FALSE;
 }
 
 static void
-create_db (BooksCollectionPrivate *priv)
+books_collection_tree_model_init (GtkTreeModelIface *iface)
 {
-    gchar *config_path;
-    gchar *db_path;
-    gchar *db_error;
+    iface->get_flags = books_collection_get_flags;
+    iface->get_n_columns = books_collection_get_n_columns;
+    iface->get_column_type = books_collection_get_column_type;
+    iface->get_iter = books_collection_get_iter;
+    iface->get_path = books_collection_get_path;
+    iface->get_value = books_collection_get_value;
+    iface->iter_next = books_collection_iter_next;
+    iface->iter_previous = books_collection_iter_previous;
+    iface->iter_children = books_collection_iter_children;
+    iface->iter_has_child = books_collection_iter_has_child;
+    iface->iter_n_children = books_collection_iter_n_children;
+    iface->iter_nth_child = books_collection_iter_nth_child;
+    iface->iter_parent = books_collection_iter_parent;
+}
 
-    /* Make sure the path exists */
-    config_path = g_build_path (G_DIR_SEPARATOR_S, g_get_user_data_dir(), "books", NULL);
+static gboolean
+books_collection_get_sort_column_id (GtkTreeSortable *sortable,
+                                     gint *sort_column_id,
+                                     GtkSortType *order)
+{
+    BooksCollectionPrivate *priv;
 
-    if (!g_file_test (config_path, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
-        g_mkdir (config_path, 0700);
+    priv = BOOKS_COLLECTION (sortable)->priv;
 
-    db_path = g_build_filename (config_path, "meta.db", NULL);
-    g_assert (sqlite3_open (db_path, &priv->db) == SQLITE_OK);
+    if (sort_column_id != NULL)
+        *sort_column_id = priv->sort_column_id;
 
-    if (sqlite3_exec (priv->db,
-                      "CREATE TABLE IF NOT EXISTS books (author TEXT, title TEXT, path TEXT, cover TEXT)",
-                      NULL, NULL, &db_error)) {
-        g_warning (_("Could not create table: %s\n"), db_error);
-        sqlite3_free (db_error);
-    }
+    if (order != NULL)
+        *order = priv->sort_order;
 
-    g_free (db_path);
-    g_free (config_path);
+    return priv->sort_column_id != GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID &&
+           priv->sort_column_id != GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
 }
 
-static int
-test_missing_book (gpointer user_data,
-                   gint argc,
-                   gchar **argv,
-                   gchar **column)
+static void
+books_collection_set_sort_column_id (GtkTreeSortable *sortable,
+                                     gint sort_column_id,
+                                     GtkSortType order)
 {
-    GPtrArray *missing_books;
-    gchar *filename;
-    filename = argv[0];
-    missing_books = (GPtrArray *) user_data;
+    BooksCollectionPrivate *priv;
+
+    priv = BOOKS_COLLECTION (sortable)->priv;
+
+    if (priv->sort_column_id == sort_column_id && priv->sort_order == order)
+        return;
+
+    /* Apply pending changes first, reordering must not change the set */
+    refresh_model (BOOKS_COLLECTION (sortable));
 
-    if (!g_file_test (filename, G_FILE_TEST_EXISTS))
-        g_ptr_array_add (missing_books, g_strdup (filename));
+    priv->sort_column_id = sort_column_id;
+    priv->sort_order = order;
 
-    return 0;
+    resort_model (BOOKS_COLLECTION (sortable));
+    gtk_tree_sortable_sort_column_changed (sortable);
 }
 
 static void
-remove_missing_books_from_db (BooksCollectionPrivate *priv)
+books_collection_set_sort_func (GtkTreeSortable *sortable,
+                                gint sort_column_id,
+                                GtkTreeIterCompareFunc func,
+                                gpointer data,
+                                GDestroyNotify destroy)
 {
-    GPtrArray *missing_books;
-    guint i;
-    const gchar *delete_sql = "DELETE FROM books WHERE path=?";
-    sqlite3_stmt *delete_stmt = NULL;
+    g_warning ("Books are sorted by the database, custom sort functions are not supported");
+}
 
-    missing_books = g_ptr_array_new_with_free_func ((GDestroyNotify) g_free);
-    sqlite3_exec (priv->db, "SELECT path FROM books", test_missing_book, missing_books, NULL);
+static void
+books_collection_set_default_sort_func (GtkTreeSortable *sortable,
+                                        GtkTreeIterCompareFunc func,
+                                        gpointer data,
+                                        GDestroyNotify destroy)
+{
+    g_warning ("Books are sorted by the database, custom sort functions are not supported");
+}
 
-    sqlite3_prepare_v2 (priv->db, delete_sql, -1, &delete_stmt, NULL);
+static gboolean
+books_collection_has_default_sort_func (GtkTreeSortable *sortable)
+{
+    return FALSE;
+}
 
-    for (i = 0; i < missing_books->len; i++) {
-        gchar *filename;
+static void
+books_collection_tree_sortable_init (GtkTreeSortableIface *iface)
+{
+    iface->get_sort_column_id = books_collection_get_sort_column_id;
+    iface->set_sort_column_id = books_collection_set_sort_column_id;
+    iface->set_sort_func = books_collection_set_sort_func;
+    iface->set_default_sort_func = books_collection_set_default_sort_func;
+    iface->has_default_sort_func = books_collection_has_default_sort_func;
+}
 
-        filename = (gchar *) g_ptr_array_index (missing_books, i);
-        sqlite3_bind_text (delete_stmt, 1, filename, strlen (filename), NULL);
-        sqlite3_step (delete_stmt);
-        sqlite3_reset (delete_stmt);
-    }
+/* The default library keeps the snapshot name it always had */
+static gchar *
+get_snapshot_path (const gchar *db_path)
+{
+    gchar *checksum;
+    gchar *name;
+    gchar *path;
 
-    sqlite3_finalize (delete_stmt);
+    if (db_path == NULL)
+        return g_build_filename (g_get_user_cache_dir (), "books", "collection.snapshot", NULL);
 
-    if (missing_books->len > 0) {
-       GtkDialog *dialog;
-       GtkListStore *model;
+    checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, db_path, -1);
+    name = g_strconcat (checksum, ".snapshot", NULL);
+    path = g_build_filename (g_get_user_cache_dir (), "books", name, NULL);
 
-       model = gtk_list_store_new (1, G_TYPE_STRING);
+    g_free (name);
+    g_free (checksum);
+    return path;
+}
 
-       for (i = 0; i < missing_books->len; i++) {
-           gchar *filename;
-           GtkTreeIter iter;
+/*
+ * Reads the metadata that books imported by older versions lack from
+ * their files in the background, see migrate_to_v13.
+ */
+static void
+backfill_books (BooksCollection *collection)
+{
+    const gchar *select_sql = "SELECT 1 FROM properties WHERE name = 'backfill'";
+    sqlite3_stmt *select_stmt = NULL;
+    gboolean pending;
+    GTask *task;
 
-           filename = (gchar *) g_ptr_array_index (missing_books, i);
-           gtk_list_store_append (model, &iter);
-           gtk_list_store_set (model, &iter, 0, filename, -1);
-       }
+    sqlite3_prepare_v2 (collection->priv->db, select_sql, -1, &select_stmt, NULL);
+    pending = sqlite3_step (select_stmt) == SQLITE_ROW;
+    sqlite3_finalize (select_stmt);
 
-       dialog = books_removed_dialog_new (GTK_TREE_MODEL (model));
-       gtk_dialog_run (dialog);
-    }
+    if (!pending)
+        return;
 
-    g_ptr_array_free (missing_books, TRUE);
+    task = g_task_new (collection, NULL, (GAsyncReadyCallback) on_books_backfilled, NULL);
+    g_task_set_task_data (task, g_strdup (collection->priv->db_path), g_free);
+    g_task_set_priority (task, G_PRIORITY_LOW);
+    g_task_run_in_thread (task, (GTaskThreadFunc) backfill_books_thread);
+    g_object_unref (task);
 }
 
-static int
-insert_row_into_model (gpointer user_data,
-                       gint argc,
-                       gchar **argv,
-                       gchar **column)
+/*
+ * Opens the library in @db_path, the default one if %NULL. Only the ids
+ * of the books are read, the rest is paged in once the views ask for it.
+ * If nothing changed since the last run, both come from the snapshot
+ * instead, which holds all books in the order they were added.
+ */
+static GArray *
+open_library (BooksCollection *collection,
+              const gchar *db_path)
 {
     BooksCollectionPrivate *priv;
-    GtkTreeIter iter;
-    gchar *author;
-    gchar *title;
-    gchar *cover;
-    gchar *markup;
+    GArray *ids;
+
+    priv = collection->priv;
+    create_db (priv, db_path);
 
-    g_assert (argc == 4);
-    priv = (BooksCollectionPrivate *) user_data;
-    author = argv[0];
-    title = argv[1];
-    cover = argv[3];
-    markup = get_author_title_markup (author, title);
+    if (priv->facets == NULL)
+        priv->facets = books_facets_new (priv->db);
+    else
+        books_facets_set_database (priv->facets, priv->db);
+
+    priv->tags = books_tags_new (priv->db);
+    priv->tombstones = load_tombstones (priv);
+    priv->offline = books_bitmap_new ();
+    priv->damaged = load_damaged (priv);
+
+    priv->snapshot_path = get_snapshot_path (db_path);
+    priv->snapshot = books_snapshot_open (priv->snapshot_path, get_generation (priv));
+    priv->snapshot_dirty = priv->snapshot == NULL;
+
+    if (priv->snapshot != NULL && priv->search_term[0] == '\0' && priv->shelf_terms == NULL &&
+        priv->sort_column_id == GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID)
+        ids = books_snapshot_get_ids (priv->snapshot);
+    else
+        ids = select_ids (priv);
+
+    /* Removals that were neither undone nor purged before quitting */
+    books_collection_purge_removed_books (collection);
 
-    gtk_list_store_append (priv->store, &iter);
-    gtk_list_store_set (priv->store, &iter,
-                        BOOKS_COLLECTION_AUTHOR_COLUMN, author,
-                        BOOKS_COLLECTION_TITLE_COLUMN, title,
-                        BOOKS_COLLECTION_MARKUP_COLUMN, markup,
-                        BOOKS_COLLECTION_PATH_COLUMN, argv[2],
-                        -1);
+    backfill_books (collection);
 
-    set_pixbuf_column_from_file (priv, &iter, cover);
-    g_free (markup);
-    return 0;
+    return ids;
 }
 
+/* Releases everything that belongs to the open library */
 static void
-insert_books_from_db_into_model (BooksCollectionPrivate *priv)
+close_library (BooksCollectionPrivate *priv)
 {
-    gchar *db_error;
+    if (priv->db == NULL)
+        return;
 
-    if (sqlite3_exec (priv->db, "SELECT author, title, path, cover FROM books",
-                      insert_row_into_model, priv, &db_error)) {
-        g_warning (_("Could not select data: %s\n"), db_error);
-        sqlite3_free (db_error);
+    if (priv->refresh_source != 0) {
+        g_source_remove (priv->refresh_source);
+        priv->refresh_source = 0;
+    }
+
+    if (priv->snapshot_source != 0) {
+        g_source_remove (priv->snapshot_source);
+        priv->snapshot_source = 0;
+    }
+
+    /* Changes of the last seconds would otherwise miss the next start */
+    if (priv->snapshot_dirty) {
+        write_snapshot (priv->db_path, priv->snapshot_path);
+        priv->snapshot_dirty = FALSE;
     }
+
+    forget_all_rows (priv);
+    g_hash_table_remove_all (priv->requested);
+    g_hash_table_remove_all (priv->reimported);
+
+    books_snapshot_free (priv->snapshot);
+    books_tags_free (priv->tags);
+    books_bitmap_free (priv->tombstones);
+    books_bitmap_free (priv->offline);
+    g_hash_table_destroy (priv->damaged);
+    books_search_index_free (priv->search_index);
+    g_free (priv->snapshot_path);
+    priv->snapshot = NULL;
+    priv->tags = NULL;
+    priv->tombstones = NULL;
+    priv->offline = NULL;
+    priv->damaged = NULL;
+    priv->search_index = NULL;
+    priv->snapshot_path = NULL;
+
+    sqlite3_finalize (priv->page_stmt);
+    sqlite3_close (priv->db);
+    g_free (priv->db_path);
+    priv->page_stmt = NULL;
+    priv->db = NULL;
+    priv->db_path = NULL;
 }
 
-static gboolean
-row_visible (GtkTreeModel *model,
-             GtkTreeIter *iter,
-             BooksCollectionPrivate *priv)
+/*
+ * Shows the library in @db_path instead of the current one. The model
+ * stays the same, the rows of the old library are announced as deleted
+ * and the ones of the new library as inserted. Rows themselves are paged
+ * in again on demand.
+ */
+static void
+switch_library (BooksCollection *collection,
+                const gchar *db_path)
 {
-    gboolean visible;
-    gchar *lowered_author;
-    gchar *lowered_title;
-    gchar *lowered_term;
-    gchar *author;
-    gchar *title;
+    BooksCollectionPrivate *priv;
+    GArray *ids;
+    GtkTreeIter iter;
+    gboolean constructed;
+    guint i;
+
+    priv = collection->priv;
+    constructed = priv->db != NULL;
+
+    if (constructed && !g_strcmp0 (priv->library, db_path))
+        return;
+
+    close_library (priv);
+    g_free (priv->library);
+    priv->library = g_strdup (db_path);
 
-    if (priv->filter_term == NULL)
-        return TRUE;
+    /* Ids of the two libraries are unrelated, there is nothing to keep */
+    while (priv->ids->len > 0) {
+        GtkTreePath *path;
 
-    gtk_tree_model_get (model, iter,
-                        BOOKS_COLLECTION_AUTHOR_COLUMN, &author,
-                        BOOKS_COLLECTION_TITLE_COLUMN, &title,
-                        -1);
+        g_array_set_size (priv->ids, priv->ids->len - 1);
+        path = gtk_tree_path_new_from_indices (priv->ids->len, -1);
+        gtk_tree_model_row_deleted (GTK_TREE_MODEL (collection), path);
+        gtk_tree_path_free (path);
+    }
 
-    if (author == NULL || title == NULL)
-        return TRUE;
+    /* Values of the old library mean nothing in the new one */
+    g_free (priv->facet_value);
+    priv->facet_kind = BOOKS_FACET_AUTHOR;
+    priv->facet_value = NULL;
 
-    lowered_term = g_utf8_strdown (priv->filter_term, -1);
-    lowered_author = g_utf8_strdown (author, -1);
-    lowered_title = g_utf8_strdown (title, -1);
+    ids = open_library (collection, db_path);
 
-    visible = strstr (lowered_author, lowered_term) != NULL ||
-              strstr (lowered_title, lowered_term) != NULL;
+    g_array_free (priv->ids, TRUE);
+    priv->ids = ids;
+    iter.stamp = priv->stamp;
 
-    g_free (lowered_author);
-    g_free (lowered_title);
-    g_free (lowered_term);
-    g_free (author);
-    g_free (title);
+    /* Nobody is watching the first library being opened */
+    for (i = 0; constructed && i < ids->len; i++) {
+        GtkTreePath *path;
 
-    return visible;
+        path = gtk_tree_path_new_from_indices (i, -1);
+        iter.user_data = GUINT_TO_POINTER (i);
+        gtk_tree_model_row_inserted (GTK_TREE_MODEL (collection), path, &iter);
+        gtk_tree_path_free (path);
+    }
 }
 
 static void
 books_collection_dispose (GObject *object)
 {
+    BooksCollectionPrivate *priv;
+
+    priv = BOOKS_COLLECTION_GET_PRIVATE (object);
+
+    if (priv->refresh_source != 0) {
+        g_source_remove (priv->refresh_source);
+        priv->refresh_source = 0;
+    }
+
+    if (priv->snapshot_source != 0) {
+        g_source_remove (priv->snapshot_source);
+        priv->snapshot_source = 0;
+    }
+
+    /* Changes of the last seconds would otherwise miss the next start */
+    if (priv->snapshot_dirty) {
+        write_snapshot (priv->db_path, priv->snapshot_path);
+        priv->snapshot_dirty = FALSE;
+    }
+
+    /* Decoding may still be in progress and outlive us */
+    if (priv->covers != NULL) {
+        g_signal_handlers_disconnect_by_data (priv->covers, object);
+        g_clear_object (&priv->covers);
+    }
+
     G_OBJECT_CLASS (books_collection_parent_class)->dispose (object);
 }
 
@@ -379,8 +4515,20 @@ books_collection_finalize (GObject *object)
     BooksCollectionPrivate *priv;
 
     priv = BOOKS_COLLECTION_GET_PRIVATE (object);
+    close_library (priv);
+    g_free (priv->library);
+    g_hash_table_destroy (priv->rows);
+    g_hash_table_destroy (priv->reimported);
+    books_string_pool_free (priv->strings);
+    g_hash_table_destroy (priv->requested);
+    g_array_free (priv->ids, TRUE);
+    g_object_unref (priv->placeholder);
     g_free (priv->filter_term);
-    sqlite3_close (priv->db);
+    g_free (priv->search_term);
+    g_free (priv->facet_value);
+    books_facets_free (priv->facets);
+    books_listing_cache_free (priv->listings);
+    g_strfreev (priv->shelf_terms);
 
     G_OBJECT_CLASS (books_collection_parent_class)->finalize (object);
 }
@@ -397,11 +4545,42 @@ books_collection_set_property (GObject *object,
 
     switch (property_id) {
         case PROP_FILTER_TERM:
-            if (priv->filter_term != NULL)
+            {
+                gchar *search_term;
+                gchar *text;
+                gchar **shelf_terms;
+                gboolean narrowing;
+
+                text = split_filter_term (g_value_get_string (value), &shelf_terms);
+                search_term = books_search_index_normalize (text);
+                g_free (text);
+
+                /*
+                 * Books containing a longer term on the same shelves are
+                 * a subset of the ones shown now, unless the collection
+                 * changed in the meantime. Similar books are looked up
+                 * in the whole facet again, see filter_ids.
+                 */
+                narrowing = *search_term != '\0' && priv->refresh_source == 0 &&
+                            strstr (search_term, priv->search_term) != NULL &&
+                            equal_terms (shelf_terms, priv->shelf_terms);
+
                 g_free (priv->filter_term);
+                g_free (priv->search_term);
+                g_strfreev (priv->shelf_terms);
+                priv->filter_term = g_strdup (g_value_get_string (value));
+                priv->search_term = search_term;
+                priv->shelf_terms = shelf_terms;
+
+                if (narrowing)
+                    update_ids (BOOKS_COLLECTION (object), filter_visible (priv, filter_ids (priv, priv->ids)));
+                else
+                    refresh_model (BOOKS_COLLECTION (object));
+            }
+            break;
 
-            priv->filter_term = g_strdup (g_value_get_string (value));
-            gtk_tree_model_filter_refilter (GTK_TREE_MODEL_FILTER (priv->filtered));
+        case PROP_LIBRARY:
+            switch_library (BOOKS_COLLECTION (object), g_value_get_string (value));
             break;
 
         default:
@@ -425,6 +4604,10 @@ books_collection_get_property(GObject *object,
             g_value_set_string (value, priv->filter_term);
             break;
 
+        case PROP_LIBRARY:
+            g_value_set_string (value, priv->library);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -450,6 +4633,22 @@ books_collection_class_init (BooksCollectionClass *klass)
                                                           NULL,
                                                           G_PARAM_READWRITE));
 
+    g_object_class_install_property (object_class,
+                                     PROP_LIBRARY,
+                                     g_param_spec_string ("library",
+                                                          "Library database",
+                                                          "Database file of the library, NULL for the default one",
+                                                          NULL,
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+
+    collection_signals[BOOKS_REMOVED] =
+        g_signal_new ("books-removed",
+                      G_OBJECT_CLASS_TYPE (klass),
+                      G_SIGNAL_RUN_LAST,
+                      0, NULL, NULL,
+                      g_cclosure_marshal_VOID__BOXED,
+                      G_TYPE_NONE, 1, G_TYPE_STRV);
+
     g_type_class_add_private (klass, sizeof(BooksCollectionPrivate));
 }
 
@@ -462,6 +4661,26 @@ books_collection_init (BooksCollection *collection)
 
     collection->priv = priv = BOOKS_COLLECTION_GET_PRIVATE (collection);
     priv->filter_term = NULL;
+    priv->search_term = g_strdup ("");
+    priv->search_index = NULL;
+    priv->stamp = g_random_int ();
+    priv->sort_column_id = GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
+    priv->sort_order = GTK_SORT_ASCENDING;
+    priv->refresh_source = 0;
+    priv->rows = g_hash_table_new (g_int64_hash, g_int64_equal);
+    g_queue_init (&priv->lru);
+    priv->strings = books_string_pool_new ();
+    priv->reimported = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+
+    priv->covers = books_cover_cache_new (COVER_CACHE_SIZE);
+    priv->requested = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    priv->visible_first = 0;
+    priv->visible_last = 0;
+    g_signal_connect (priv->covers, "cover-loaded", G_CALLBACK (on_cover_loaded), collection);
+
+    priv->offline = NULL;
+    priv->damaged = NULL;
+    priv->listings = books_listing_cache_new ();
 
     /* Create pixbuf for unknown cover image */
     stream = g_resources_open_stream ("/com/github/matze/books/ui/book-cover.png", 0, &error);
@@ -480,24 +4699,12 @@ books_collection_init (BooksCollection *collection)
 
     g_input_stream_close (stream, NULL, NULL);
 
-    /* Create model */
-    priv->store = gtk_list_store_new (BOOKS_COLLECTION_N_COLUMNS,
-                                      G_TYPE_STRING,
-                                      G_TYPE_STRING,
-                                      G_TYPE_STRING,
-                                      G_TYPE_STRING,
-                                      GDK_TYPE_PIXBUF);
-
-    priv->filtered = gtk_tree_model_filter_new (GTK_TREE_MODEL (priv->store), NULL);
-
-    gtk_tree_model_filter_set_visible_func (GTK_TREE_MODEL_FILTER (priv->filtered),
-                                            (GtkTreeModelFilterVisibleFunc) row_visible,
-                                            priv, NULL);
-
-    priv->sorted = gtk_tree_model_sort_new_with_model (priv->filtered);
-
-    /* Create database */
-    create_db (priv);
-    remove_missing_books_from_db (priv);
-    insert_books_from_db_into_model (priv);
+    /* The database is opened once the library property is set */
+    priv->db = NULL;
+    priv->facets = NULL;
+    priv->facet_kind = BOOKS_FACET_AUTHOR;
+    priv->facet_value = NULL;
+    priv->shelf_terms = NULL;
+    priv->snapshot_source = 0;
+    priv->ids = g_array_new (FALSE, FALSE, sizeof (gint64));
 }
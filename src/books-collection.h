@@ -4,6 +4,10 @@
 #include <gtk/gtk.h>
 #include <books-epub.h>
 
+#include "books-annotations.h"
+#include "books-facets.h"
+#include "books-libraries.h"
+
 G_BEGIN_DECLS
 
 #define BOOKS_TYPE_COLLECTION             (books_collection_get_type())
@@ -28,27 +32,119 @@ struct _BooksCollectionClass {
     GObjectClass parent_class;
 };
 
+typedef struct {
+    goffset size;
+    gint64  mtime;
+} BooksFileStamp;
+
+/* A file that is a copy or another edition of a book in the collection */
+typedef struct {
+    gint64   id;
+    gchar   *existing_path;
+    gchar   *path;
+    gchar   *content_hash;
+    gboolean exact;
+} BooksDuplicate;
+
+/* Where reading of a book stopped */
+typedef struct {
+    guint    index;
+    gchar   *fragment;
+    gdouble  fraction;
+} BooksPosition;
+
 enum {
     BOOKS_COLLECTION_AUTHOR_COLUMN,
     BOOKS_COLLECTION_TITLE_COLUMN,
     BOOKS_COLLECTION_MARKUP_COLUMN,
     BOOKS_COLLECTION_PATH_COLUMN,
     BOOKS_COLLECTION_ICON_COLUMN,
+    BOOKS_COLLECTION_SERIES_COLUMN,
+    BOOKS_COLLECTION_AVAILABLE_COLUMN,
+    BOOKS_COLLECTION_PROBLEM_COLUMN,     /* markup, NULL unless damaged */
     BOOKS_COLLECTION_N_COLUMNS
 };
 
-BooksCollection *books_collection_new           (void);
+BooksCollection *books_collection_new           (const gchar        *library);
 GtkTreeModel    *books_collection_get_model     (BooksCollection    *collection);
+const gchar     *books_collection_get_database  (BooksCollection    *collection);
 void             books_collection_add_book      (BooksCollection    *collection,
                                                  BooksEpub          *epub,
-                                                 const gchar        *path);
+                                                 const gchar        *path,
+                                                 const gchar        *content_hash);
+BooksDuplicate  *books_collection_add_unique_book
+                                                (BooksCollection    *collection,
+                                                 BooksEpub          *epub,
+                                                 const gchar        *path,
+                                                 const gchar        *content_hash);
+void             books_collection_merge_book    (BooksCollection    *collection,
+                                                 gint64              id,
+                                                 const gchar        *path,
+                                                 const gchar        *content_hash);
+void             books_collection_skip_file     (BooksCollection    *collection,
+                                                 const gchar        *path,
+                                                 const gchar        *content_hash);
 void             books_collection_remove_book   (BooksCollection    *collection,
                                                  GtkTreeIter        *iter);
+void             books_collection_remove_books  (BooksCollection    *collection,
+                                                 GArray             *ids);
+void             books_collection_restore_books (BooksCollection    *collection,
+                                                 GArray             *ids);
+void             books_collection_purge_removed_books
+                                                (BooksCollection    *collection);
+void             books_collection_remove_path   (BooksCollection    *collection,
+                                                 const gchar        *path);
+void             books_collection_remove_paths  (BooksCollection    *collection,
+                                                 const gchar * const *paths);
+void             books_collection_check_missing_books
+                                                (BooksCollection    *collection,
+                                                 BooksLibraryLocation location);
+void             books_collection_verify_books  (BooksCollection    *collection,
+                                                 guint64             bytes_per_second,
+                                                 GCancellable       *cancellable);
+void             books_collection_remove_folder (BooksCollection    *collection,
+                                                 const gchar        *folder);
+void             books_collection_rename_path   (BooksCollection    *collection,
+                                                 const gchar        *old_path,
+                                                 const gchar        *new_path);
+GHashTable      *books_collection_get_file_stamps
+                                                (BooksCollection    *collection);
+GHashTable      *books_collection_get_content_hashes
+                                                (BooksCollection    *collection);
+void             books_collection_request_covers
+                                                (BooksCollection    *collection,
+                                                 GtkTreePath        *start,
+                                                 GtkTreePath        *end);
+GtkTreeModel    *books_collection_get_facets    (BooksCollection    *collection);
+void             books_collection_set_facet     (BooksCollection    *collection,
+                                                 BooksFacetKind      kind,
+                                                 const gchar        *value);
+gchar          **books_collection_get_shelves   (BooksCollection    *collection);
+void             books_collection_add_to_shelf  (BooksCollection    *collection,
+                                                 GArray             *ids,
+                                                 const gchar        *shelf);
+void             books_collection_remove_from_shelf
+                                                (BooksCollection    *collection,
+                                                 GArray             *ids,
+                                                 const gchar        *shelf);
+gint64           books_collection_get_book_id   (BooksCollection    *collection,
+                                                 GtkTreePath        *path);
+gboolean         books_collection_get_position  (BooksCollection    *collection,
+                                                 const gchar        *path,
+                                                 BooksPosition      *position);
+void             books_collection_set_position  (BooksCollection    *collection,
+                                                 const gchar        *path,
+                                                 const BooksPosition *position);
+BooksAnnotations *books_collection_get_annotations
+                                                (BooksCollection    *collection,
+                                                 const gchar        *path);
 BooksEpub       *books_collection_get_book      (BooksCollection    *collection,
                                                  GtkTreePath        *path,
                                                  GError            **error);
 GType            books_collection_get_type      (void);
 
+void             books_duplicate_free           (BooksDuplicate     *duplicate);
+
 G_END_DECLS
 
 #endif
@@ -0,0 +1,54 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "books-content-hash.h"
+
+/*
+ * Files are identified by a checksum of their contents, so copies of a
+ * book are recognized regardless of name and location.
+ */
+
+/* Bytes read from the file at once */
+#define READ_SIZE   (64 * 1024)
+
+/**
+ * Returns the SHA-1 of the contents of @path as hex string, reading it
+ * once from start to end. Free with g_free().
+ */
+gchar *
+books_content_hash_compute (const gchar *path,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+    GFile *file;
+    GFileInputStream *stream;
+    GChecksum *checksum;
+    guchar *buffer;
+    gssize length;
+    gchar *hash = NULL;
+
+    file = g_file_new_for_path (path);
+    stream = g_file_read (file, cancellable, error);
+    g_object_unref (file);
+
+    if (stream == NULL)
+        return NULL;
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    buffer = g_malloc (READ_SIZE);
+
+    while ((length = g_input_stream_read (G_INPUT_STREAM (stream), buffer, READ_SIZE,
+                                          cancellable, error)) > 0)
+        g_checksum_update (checksum, buffer, length);
+
+    if (length == 0)
+        hash = g_strdup (g_checksum_get_string (checksum));
+
+    g_input_stream_close (G_INPUT_STREAM (stream), NULL, NULL);
+    g_object_unref (stream);
+    g_checksum_free (checksum);
+    g_free (buffer);
+
+    return hash;
+}
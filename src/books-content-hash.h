@@ -0,0 +1,14 @@
+#ifndef BOOKS_CONTENT_HASH_H
+#define BOOKS_CONTENT_HASH_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+gchar           *books_content_hash_compute     (const gchar        *path,
+                                                 GCancellable       *cancellable,
+                                                 GError            **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,287 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "books-cover-cache.h"
+#include "books-thumbnail.h"
+
+
+G_DEFINE_TYPE(BooksCoverCache, books_cover_cache, G_TYPE_OBJECT)
+
+#define BOOKS_COVER_CACHE_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_COVER_CACHE, BooksCoverCachePrivate))
+
+/* Number of threads decoding covers concurrently */
+#define DECODE_THREADS          2
+
+enum {
+    COVER_LOADED,
+    LAST_SIGNAL
+};
+
+static guint cover_cache_signals[LAST_SIGNAL] = { 0 };
+
+struct _BooksCoverCachePrivate {
+    GHashTable  *entries;
+    GQueue       lru;
+    gsize        size;
+    gsize        max_size;
+
+    GHashTable  *pending;
+    GThreadPool *pool;
+    gint         epoch;
+};
+
+typedef struct {
+    gchar       *thumbnail;
+    GdkPixbuf   *pixbuf;
+    gsize        size;
+    GList        link;
+} CacheEntry;
+
+typedef struct {
+    BooksCoverCache *cache;
+    gchar           *thumbnail;
+    gchar           *cover;
+    GdkPixbuf       *pixbuf;
+    gint             epoch;
+    gboolean         skipped;
+} DecodeJob;
+
+
+BooksCoverCache *
+books_cover_cache_new (gsize max_size)
+{
+    BooksCoverCache *cache;
+
+    cache = BOOKS_COVER_CACHE (g_object_new (BOOKS_TYPE_COVER_CACHE, NULL));
+    cache->priv->max_size = max_size;
+
+    return cache;
+}
+
+/**
+ * Returns the decoded thumbnail or %NULL if it has not been decoded yet or
+ * could not be decoded at all. Never starts decoding by itself.
+ */
+GdkPixbuf *
+books_cover_cache_lookup (BooksCoverCache *cache,
+                          const gchar *thumbnail)
+{
+    BooksCoverCachePrivate *priv;
+    CacheEntry *entry;
+
+    g_return_val_if_fail (BOOKS_IS_COVER_CACHE (cache), NULL);
+
+    if (thumbnail == NULL)
+        return NULL;
+
+    priv = cache->priv;
+    entry = g_hash_table_lookup (priv->entries, thumbnail);
+
+    if (entry == NULL)
+        return NULL;
+
+    g_queue_unlink (&priv->lru, &entry->link);
+    g_queue_push_head_link (&priv->lru, &entry->link);
+
+    return entry->pixbuf;
+}
+
+/**
+ * Starts a new round of requests. Pending covers that are not requested
+ * again before a worker gets to them are dropped, e.g. because they have
+ * been scrolled out of view.
+ */
+void
+books_cover_cache_begin_requests (BooksCoverCache *cache)
+{
+    g_return_if_fail (BOOKS_IS_COVER_CACHE (cache));
+    g_atomic_int_inc (&cache->priv->epoch);
+}
+
+/**
+ * Queues loading @thumbnail. If it does not exist yet, e.g. because the
+ * thumbnail directory has been cleaned, it is recreated from @cover.
+ */
+void
+books_cover_cache_request (BooksCoverCache *cache,
+                           const gchar *thumbnail,
+                           const gchar *cover)
+{
+    BooksCoverCachePrivate *priv;
+    DecodeJob *job;
+
+    g_return_if_fail (BOOKS_IS_COVER_CACHE (cache));
+
+    if (thumbnail == NULL)
+        return;
+
+    priv = cache->priv;
+
+    if (g_hash_table_contains (priv->entries, thumbnail))
+        return;
+
+    job = g_hash_table_lookup (priv->pending, thumbnail);
+
+    if (job != NULL) {
+        g_atomic_int_set (&job->epoch, g_atomic_int_get (&priv->epoch));
+        return;
+    }
+
+    job = g_new0 (DecodeJob, 1);
+    job->cache = g_object_ref (cache);
+    job->thumbnail = g_strdup (thumbnail);
+    job->cover = g_strdup (cover);
+    job->epoch = g_atomic_int_get (&priv->epoch);
+
+    g_hash_table_insert (priv->pending, job->thumbnail, job);
+    g_thread_pool_push (priv->pool, job, NULL);
+}
+
+static void
+free_entry (CacheEntry *entry)
+{
+    g_free (entry->thumbnail);
+
+    if (entry->pixbuf != NULL)
+        g_object_unref (entry->pixbuf);
+
+    g_free (entry);
+}
+
+static void
+insert_entry (BooksCoverCachePrivate *priv,
+              const gchar *thumbnail,
+              GdkPixbuf *pixbuf)
+{
+    CacheEntry *entry;
+
+    entry = g_new0 (CacheEntry, 1);
+    entry->thumbnail = g_strdup (thumbnail);
+    entry->pixbuf = pixbuf;
+    entry->link.data = entry;
+
+    /* Failed covers are remembered as well, so they are not retried */
+    entry->size = sizeof (CacheEntry);
+
+    if (pixbuf != NULL)
+        entry->size += gdk_pixbuf_get_rowstride (pixbuf) * gdk_pixbuf_get_height (pixbuf);
+
+    g_hash_table_insert (priv->entries, entry->thumbnail, entry);
+    g_queue_push_head_link (&priv->lru, &entry->link);
+    priv->size += entry->size;
+
+    while (priv->size > priv->max_size && priv->lru.length > 1) {
+        CacheEntry *oldest;
+
+        oldest = g_queue_peek_tail (&priv->lru);
+        g_queue_unlink (&priv->lru, &oldest->link);
+        g_hash_table_remove (priv->entries, oldest->thumbnail);
+        priv->size -= oldest->size;
+        free_entry (oldest);
+    }
+}
+
+static gboolean
+finish_decode (DecodeJob *job)
+{
+    BooksCoverCache *cache;
+    BooksCoverCachePrivate *priv;
+
+    cache = job->cache;
+    priv = cache->priv;
+    g_hash_table_remove (priv->pending, job->thumbnail);
+
+    if (!job->skipped) {
+        insert_entry (priv, job->thumbnail, job->pixbuf);
+
+        if (job->pixbuf != NULL)
+            g_signal_emit (cache, cover_cache_signals[COVER_LOADED], 0, job->thumbnail);
+    }
+    else if (job->pixbuf != NULL) {
+        g_object_unref (job->pixbuf);
+    }
+
+    g_free (job->thumbnail);
+    g_free (job->cover);
+    g_free (job);
+    g_object_unref (cache);
+
+    return FALSE;
+}
+
+static void
+decode_cover (DecodeJob *job,
+              BooksCoverCache *cache)
+{
+    gchar *path;
+
+    job->skipped = g_atomic_int_get (&job->epoch) != g_atomic_int_get (&cache->priv->epoch);
+
+    if (!job->skipped) {
+        path = books_thumbnail_get_path (job->thumbnail, 1);
+        job->pixbuf = gdk_pixbuf_new_from_file (path, NULL);
+
+        if (job->pixbuf == NULL && job->cover != NULL &&
+            books_thumbnail_create (job->cover, job->thumbnail, NULL))
+            job->pixbuf = gdk_pixbuf_new_from_file (path, NULL);
+
+        g_free (path);
+    }
+
+    g_main_context_invoke (NULL, (GSourceFunc) finish_decode, job);
+}
+
+static void
+books_cover_cache_finalize (GObject *object)
+{
+    BooksCoverCachePrivate *priv;
+    GList *link;
+
+    priv = BOOKS_COVER_CACHE_GET_PRIVATE (object);
+
+    /* Pending jobs hold a reference, the pool is idle at this point */
+    g_thread_pool_free (priv->pool, TRUE, TRUE);
+    g_hash_table_destroy (priv->pending);
+    g_hash_table_destroy (priv->entries);
+
+    while ((link = g_queue_pop_head_link (&priv->lru)) != NULL)
+        free_entry (link->data);
+
+    G_OBJECT_CLASS (books_cover_cache_parent_class)->finalize (object);
+}
+
+static void
+books_cover_cache_class_init (BooksCoverCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->finalize = books_cover_cache_finalize;
+
+    cover_cache_signals[COVER_LOADED] =
+        g_signal_new ("cover-loaded",
+                      G_OBJECT_CLASS_TYPE (klass),
+                      G_SIGNAL_RUN_LAST,
+                      0, NULL, NULL,
+                      g_cclosure_marshal_VOID__STRING,
+                      G_TYPE_NONE, 1, G_TYPE_STRING);
+
+    g_type_class_add_private (klass, sizeof(BooksCoverCachePrivate));
+}
+
+static void
+books_cover_cache_init (BooksCoverCache *cache)
+{
+    BooksCoverCachePrivate *priv;
+
+    cache->priv = priv = BOOKS_COVER_CACHE_GET_PRIVATE (cache);
+
+    priv->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->pending = g_hash_table_new (g_str_hash, g_str_equal);
+    priv->size = 0;
+    priv->max_size = 0;
+    priv->epoch = 0;
+    g_queue_init (&priv->lru);
+
+    priv->pool = g_thread_pool_new ((GFunc) decode_cover, cache, DECODE_THREADS, FALSE, NULL);
+}
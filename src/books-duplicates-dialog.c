@@ -0,0 +1,253 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib/gi18n.h>
+
+#include "books-duplicates-dialog.h"
+
+
+G_DEFINE_TYPE(BooksDuplicatesDialog, books_duplicates_dialog, GTK_TYPE_DIALOG)
+
+#define BOOKS_DUPLICATES_DIALOG_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_DUPLICATES_DIALOG, BooksDuplicatesDialogPrivate))
+
+enum {
+    MERGE_COLUMN,
+    PATH_COLUMN,
+    EXISTING_PATH_COLUMN,
+    MATCH_COLUMN,
+    ID_COLUMN,
+    HASH_COLUMN,
+    N_COLUMNS
+};
+
+struct _BooksDuplicatesDialogPrivate {
+    BooksCollection *collection;
+    GtkListStore    *store;
+    GtkTreeView     *view;
+};
+
+GtkDialog *
+books_duplicates_dialog_new (BooksCollection *collection,
+                             GPtrArray *duplicates)
+{
+    BooksDuplicatesDialog *dialog;
+    BooksDuplicatesDialogPrivate *priv;
+    guint i;
+
+    dialog = BOOKS_DUPLICATES_DIALOG (g_object_new (BOOKS_TYPE_DUPLICATES_DIALOG, NULL));
+    priv = dialog->priv;
+    priv->collection = g_object_ref (collection);
+
+    for (i = 0; i < duplicates->len; i++) {
+        BooksDuplicate *duplicate;
+        GtkTreeIter iter;
+
+        duplicate = g_ptr_array_index (duplicates, i);
+        gtk_list_store_append (priv->store, &iter);
+        gtk_list_store_set (priv->store, &iter,
+                            MERGE_COLUMN, FALSE,
+                            PATH_COLUMN, duplicate->path,
+                            EXISTING_PATH_COLUMN, duplicate->existing_path,
+                            MATCH_COLUMN, duplicate->exact ? _("Identical") : _("Same identifier"),
+                            ID_COLUMN, duplicate->id,
+                            HASH_COLUMN, duplicate->content_hash,
+                            -1);
+    }
+
+    return GTK_DIALOG (dialog);
+}
+
+static void
+books_duplicates_dialog_dispose (GObject *object)
+{
+    BooksDuplicatesDialogPrivate *priv;
+
+    priv = BOOKS_DUPLICATES_DIALOG_GET_PRIVATE (object);
+    g_clear_object (&priv->collection);
+    g_clear_object (&priv->store);
+
+    G_OBJECT_CLASS (books_duplicates_dialog_parent_class)->dispose (object);
+}
+
+static void
+books_duplicates_dialog_class_init (BooksDuplicatesDialogClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->dispose = books_duplicates_dialog_dispose;
+
+    g_type_class_add_private (klass, sizeof(BooksDuplicatesDialogPrivate));
+}
+
+static gboolean
+apply_choice (GtkTreeModel *model,
+              GtkTreePath *path,
+              GtkTreeIter *iter,
+              BooksDuplicatesDialog *dialog)
+{
+    gboolean merge;
+    gchar *file_path;
+    gchar *hash;
+    gint64 id;
+
+    gtk_tree_model_get (model, iter,
+                        MERGE_COLUMN, &merge,
+                        PATH_COLUMN, &file_path,
+                        ID_COLUMN, &id,
+                        HASH_COLUMN, &hash,
+                        -1);
+
+    if (merge)
+        books_collection_merge_book (dialog->priv->collection, id, file_path, hash);
+    else
+        books_collection_skip_file (dialog->priv->collection, file_path, hash);
+
+    g_free (file_path);
+    g_free (hash);
+    return FALSE;
+}
+
+static gboolean
+clear_choice (GtkTreeModel *model,
+              GtkTreePath *path,
+              GtkTreeIter *iter,
+              gpointer user_data)
+{
+    gtk_list_store_set (GTK_LIST_STORE (model), iter, MERGE_COLUMN, FALSE, -1);
+    return FALSE;
+}
+
+static void
+response_handler (GtkDialog *dialog,
+                  gint res_id)
+{
+    BooksDuplicatesDialogPrivate *priv;
+
+    priv = BOOKS_DUPLICATES_DIALOG (dialog)->priv;
+
+    /* Closing the window decides nothing, the next scan asks again */
+    if (res_id == GTK_RESPONSE_REJECT)
+        gtk_tree_model_foreach (GTK_TREE_MODEL (priv->store), clear_choice, NULL);
+
+    if (res_id == GTK_RESPONSE_REJECT || res_id == GTK_RESPONSE_APPLY)
+        gtk_tree_model_foreach (GTK_TREE_MODEL (priv->store),
+                                (GtkTreeModelForeachFunc) apply_choice, dialog);
+
+    gtk_widget_destroy (GTK_WIDGET (dialog));
+}
+
+static void
+on_merge_toggled (GtkCellRendererToggle *renderer,
+                  gchar *path,
+                  BooksDuplicatesDialogPrivate *priv)
+{
+    GtkTreeIter iter;
+    gboolean merge;
+
+    if (!gtk_tree_model_get_iter_from_string (GTK_TREE_MODEL (priv->store), &iter, path))
+        return;
+
+    gtk_tree_model_get (GTK_TREE_MODEL (priv->store), &iter, MERGE_COLUMN, &merge, -1);
+    gtk_list_store_set (priv->store, &iter, MERGE_COLUMN, !merge, -1);
+}
+
+static void
+append_path_column (GtkTreeView *view,
+                    const gchar *title,
+                    gint column_id)
+{
+    GtkCellRenderer *renderer;
+    GtkTreeViewColumn *column;
+
+    renderer = gtk_cell_renderer_text_new ();
+
+    g_object_set (renderer,
+                  "ellipsize-set", TRUE,
+                  "ellipsize", PANGO_ELLIPSIZE_START,
+                  NULL);
+
+    column = gtk_tree_view_column_new_with_attributes (title, renderer,
+                                                       "text", column_id,
+                                                       NULL);
+    gtk_tree_view_column_set_expand (column, TRUE);
+    gtk_tree_view_append_column (view, column);
+}
+
+static void
+books_duplicates_dialog_init (BooksDuplicatesDialog *dialog)
+{
+    BooksDuplicatesDialogPrivate *priv;
+    GtkWidget *content_area;
+    GtkWidget *label;
+    GtkWidget *scroll;
+    GtkCellRenderer *renderer;
+    GtkTreeViewColumn *column;
+
+    dialog->priv = priv = BOOKS_DUPLICATES_DIALOG_GET_PRIVATE (dialog);
+
+    priv->collection = NULL;
+    priv->store = gtk_list_store_new (N_COLUMNS,
+                                      G_TYPE_BOOLEAN, G_TYPE_STRING, G_TYPE_STRING,
+                                      G_TYPE_STRING, G_TYPE_INT64, G_TYPE_STRING);
+    priv->view = GTK_TREE_VIEW (gtk_tree_view_new_with_model (GTK_TREE_MODEL (priv->store)));
+
+    gtk_dialog_add_buttons (GTK_DIALOG (dialog),
+                            _("_Skip All"), GTK_RESPONSE_REJECT,
+                            GTK_STOCK_APPLY, GTK_RESPONSE_APPLY,
+                            NULL);
+
+    gtk_window_set_title (GTK_WINDOW (dialog), _("Duplicate Books"));
+    gtk_window_set_destroy_with_parent (GTK_WINDOW (dialog), TRUE);
+    gtk_window_set_default_size (GTK_WINDOW (dialog), 640, 320);
+
+    content_area = gtk_dialog_get_content_area (GTK_DIALOG (dialog));
+
+    gtk_container_set_border_width (GTK_CONTAINER (dialog), 5);
+    gtk_box_set_spacing (GTK_BOX (content_area), 2);
+    gtk_container_set_border_width (GTK_CONTAINER (content_area), 5);
+    gtk_box_set_spacing (GTK_BOX (content_area), 6);
+
+    g_signal_connect (dialog,
+                      "response",
+                      G_CALLBACK (response_handler),
+                      NULL);
+
+    renderer = gtk_cell_renderer_toggle_new ();
+    column = gtk_tree_view_column_new_with_attributes (_("Merge"), renderer,
+                                                       "active", MERGE_COLUMN,
+                                                       NULL);
+    gtk_tree_view_append_column (priv->view, column);
+
+    g_signal_connect (renderer, "toggled",
+                      G_CALLBACK (on_merge_toggled), priv);
+
+    append_path_column (priv->view, _("Book"), PATH_COLUMN);
+    append_path_column (priv->view, _("Already in Collection"), EXISTING_PATH_COLUMN);
+
+    column = gtk_tree_view_column_new_with_attributes (_("Match"), gtk_cell_renderer_text_new (),
+                                                       "text", MATCH_COLUMN,
+                                                       NULL);
+    gtk_tree_view_append_column (priv->view, column);
+
+    label = gtk_label_new (_("The following books are already in your collection. "
+                             "Merged books keep their entry but refer to the new file, "
+                             "all others are skipped:"));
+    gtk_label_set_line_wrap (GTK_LABEL (label), TRUE);
+    gtk_widget_set_halign (label, GTK_ALIGN_START);
+
+    scroll = gtk_scrolled_window_new (NULL, NULL);
+    gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (scroll),
+                                    GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_container_add (GTK_CONTAINER (scroll), GTK_WIDGET (priv->view));
+
+    gtk_box_pack_start (GTK_BOX (content_area),
+                        label, FALSE, FALSE, 0);
+
+    gtk_box_pack_start (GTK_BOX (content_area),
+                        scroll, TRUE, TRUE, 0);
+
+    gtk_widget_show (GTK_WIDGET (label));
+    gtk_widget_show (GTK_WIDGET (priv->view));
+    gtk_widget_show (scroll);
+}
@@ -0,0 +1,38 @@
+#ifndef BOOKS_DUPLICATES_DIALOG_H
+#define BOOKS_DUPLICATES_DIALOG_H
+
+#include <gtk/gtk.h>
+
+#include "books-collection.h"
+
+G_BEGIN_DECLS
+
+#define BOOKS_TYPE_DUPLICATES_DIALOG             (books_duplicates_dialog_get_type())
+#define BOOKS_DUPLICATES_DIALOG(obj)             (G_TYPE_CHECK_INSTANCE_CAST((obj), BOOKS_TYPE_DUPLICATES_DIALOG, BooksDuplicatesDialog))
+#define BOOKS_IS_DUPLICATES_DIALOG(obj)          (G_TYPE_CHECK_INSTANCE_TYPE((obj), BOOKS_TYPE_DUPLICATES_DIALOG))
+#define BOOKS_DUPLICATES_DIALOG_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST((klass), BOOKS_TYPE_DUPLICATES_DIALOG, BooksDuplicatesDialogClass))
+#define BOOKS_IS_DUPLICATES_DIALOG_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE((klass), BOOKS_TYPE_DUPLICATES_DIALOG))
+#define BOOKS_DUPLICATES_DIALOG_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS((obj), BOOKS_TYPE_DUPLICATES_DIALOG, BooksDuplicatesDialogClass))
+
+
+typedef struct _BooksDuplicatesDialog           BooksDuplicatesDialog;
+typedef struct _BooksDuplicatesDialogClass      BooksDuplicatesDialogClass;
+typedef struct _BooksDuplicatesDialogPrivate    BooksDuplicatesDialogPrivate;
+
+struct _BooksDuplicatesDialog {
+    GtkDialog parent;
+
+    BooksDuplicatesDialogPrivate *priv;
+};
+
+struct _BooksDuplicatesDialogClass {
+    GtkDialogClass parent_class;
+};
+
+GtkDialog   *books_duplicates_dialog_new    (BooksCollection *collection,
+                                             GPtrArray       *duplicates);
+GType        books_duplicates_dialog_get_type (void);
+
+G_END_DECLS
+
+#endif
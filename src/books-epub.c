@@ -1,24 +1,38 @@
 
+#include <string.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <libxml/parser.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
+#include <glib/gstdio.h>
 #include "books-epub.h"
 
 G_DEFINE_TYPE(BooksEpub, books_epub, G_TYPE_OBJECT)
 
+/* Largest archive member read into memory, covers are far smaller */
+#define MAX_ENTRY_SIZE      (32 * 1024 * 1024)
+
 #define BOOKS_EPUB_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_EPUB, BooksEpubPrivate))
 
+/* Counts the open books using each extraction directory */
+G_LOCK_DEFINE_STATIC (extracted);
+static GHashTable *extracted_in_use = NULL;
+
 static GError   *extract_archive            (BooksEpubPrivate *priv,
                                              const gchar *pathname,
                                              const gchar *path);
 static gchar    *get_content                (BooksEpubPrivate *priv, const gchar *filename);
 static gchar    *get_opf_path               (BooksEpubPrivate *priv);
+static gchar    *parse_opf_path             (const gchar *container_data);
+static xmlXPathContext *new_opf_context     (xmlDoc *tree);
+static gchar    *find_cover_href            (xmlXPathContext *context);
 static gchar    *get_cover_path             (BooksEpubPrivate *priv);
 static gchar    *get_content_filename       (BooksEpubPrivate *priv, const gchar *filename);
 static void      populate_document_spine    (BooksEpubPrivate *priv);
 static gchar    *remove_uri_anchor          (const gchar *uri);
+static gchar    *get_extract_dir            (const gchar *filename);
+static void      release_extract_dir        (const gchar *path);
 
 GQuark
 books_epub_error_quark (void)
@@ -50,26 +64,30 @@ books_epub_open (BooksEpub *epub,
                  GError **error)
 {
     BooksEpubPrivate *priv;
-    gchar *basename;
     gchar *opf_data;
+    guint count;
     GError *tmp_error = NULL;
 
     g_return_val_if_fail (BOOKS_IS_EPUB (epub) && filename != NULL, FALSE);
 
     priv = epub->priv;
 
-    if (priv->path != NULL)
+    if (priv->path != NULL) {
+        release_extract_dir (priv->path);
         g_free (priv->path);
+    }
 
-    basename = g_path_get_basename (filename);
+    priv->path = get_extract_dir (filename);
 
-    priv->path = g_build_path (G_DIR_SEPARATOR_S,
-                               g_get_user_cache_dir(),
-                               "books",
-                               basename,
-                               NULL);
+    /* Registered first, so a purge cannot delete the files while in use */
+    G_LOCK (extracted);
 
-    g_free (basename);
+    if (extracted_in_use == NULL)
+        extracted_in_use = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    count = GPOINTER_TO_UINT (g_hash_table_lookup (extracted_in_use, priv->path));
+    g_hash_table_insert (extracted_in_use, g_strdup (priv->path), GUINT_TO_POINTER (count + 1));
+    G_UNLOCK (extracted);
 
     if (!g_file_test (priv->path, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
         tmp_error = extract_archive (priv, filename, priv->path);
@@ -80,19 +98,18 @@ books_epub_open (BooksEpub *epub,
     }
 
     priv->opf_path = get_opf_path (priv);
+
+    if (priv->opf_path == NULL) {
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_NO_META_DATA,
+                     "`%s' does not contain a package document", filename);
+        return FALSE;
+    }
+
     priv->opf_prefix = g_path_get_dirname (priv->opf_path);
     opf_data = get_content (priv, priv->opf_path);
     priv->opf_tree = xmlParseDoc ((const xmlChar*) opf_data);
     g_free (opf_data);
-    priv->opf_xpath_context = xmlXPathNewContext (priv->opf_tree);
-
-    xmlXPathRegisterNs (priv->opf_xpath_context,
-                        (const xmlChar *) "dc",
-                        (const xmlChar *) "http://purl.org/dc/elements/1.1/");
-
-    xmlXPathRegisterNs (priv->opf_xpath_context,
-                        (const xmlChar *) "pkg",
-                        (const xmlChar *) "http://www.idpf.org/2007/opf");
+    priv->opf_xpath_context = new_opf_context (priv->opf_tree);
 
     populate_document_spine (priv);
     priv->cover_path = get_cover_path (priv);
@@ -137,6 +154,36 @@ books_epub_set_uri (BooksEpub *epub,
     g_free (normalized_uri);
 }
 
+/**
+ * Returns the position of the current document in the spine.
+ */
+guint
+books_epub_get_index (BooksEpub *epub)
+{
+    BooksEpubPrivate *priv;
+
+    g_return_val_if_fail (BOOKS_IS_EPUB (epub), 0);
+    priv = epub->priv;
+    return priv->current != NULL ? g_list_position (priv->documents, priv->current) : 0;
+}
+
+/**
+ * Makes the document at @index of the spine the current one, if there is
+ * one.
+ */
+void
+books_epub_set_index (BooksEpub *epub,
+                      guint index)
+{
+    GList *result;
+
+    g_return_if_fail (BOOKS_IS_EPUB (epub));
+    result = g_list_nth (epub->priv->documents, index);
+
+    if (result != NULL)
+        epub->priv->current = result;
+}
+
 void
 books_epub_next (BooksEpub *epub)
 {
@@ -199,6 +246,281 @@ books_epub_get_meta (BooksEpub *epub,
     return value;
 }
 
+/**
+ * Returns the values of all @key elements, e.g. every subject of the
+ * book, as %NULL-terminated array. Free with g_strfreev().
+ */
+gchar **
+books_epub_get_meta_list (BooksEpub *epub,
+                          const gchar *key)
+{
+    BooksEpubPrivate *priv;
+    xmlXPathObject *object;
+    GPtrArray *values;
+    gchar *expression;
+    gint i;
+
+    g_return_val_if_fail (BOOKS_IS_EPUB (epub), NULL);
+
+    priv = epub->priv;
+    values = g_ptr_array_new ();
+    expression = g_strdup_printf ("//pkg:package/pkg:metadata/dc:%s", key);
+    object = xmlXPathEvalExpression ((const xmlChar *) expression, priv->opf_xpath_context);
+
+    for (i = 0; object != NULL && !xmlXPathNodeSetIsEmpty (object->nodesetval) &&
+                i < object->nodesetval->nodeNr; i++) {
+        xmlChar *content;
+
+        content = xmlNodeGetContent (object->nodesetval->nodeTab[i]);
+        g_strstrip ((gchar *) content);
+
+        if (*content != '\0')
+            g_ptr_array_add (values, g_strdup ((const gchar *) content));
+
+        xmlFree (content);
+    }
+
+    if (object != NULL)
+        xmlXPathFreeObject (object);
+
+    g_free (expression);
+    g_ptr_array_add (values, NULL);
+    return (gchar **) g_ptr_array_free (values, FALSE);
+}
+
+static gchar *
+evaluate_string (BooksEpubPrivate *priv,
+                 const gchar *expression)
+{
+    xmlXPathObject *object;
+    xmlChar *string;
+    gchar *result = NULL;
+
+    object = xmlXPathEvalExpression ((const xmlChar *) expression, priv->opf_xpath_context);
+
+    if (object == NULL)
+        return NULL;
+
+    string = xmlXPathCastToString (object);
+
+    if (string != NULL && *string != '\0')
+        result = g_strdup ((const gchar *) string);
+
+    xmlFree (string);
+    xmlXPathFreeObject (object);
+    return result;
+}
+
+/**
+ * Returns the name of the first author as it should be sorted, e.g.
+ * "Tolkien, J. R. R.", or %NULL if the book does not specify it. Free
+ * with g_free().
+ */
+gchar *
+books_epub_get_author_sort (BooksEpub *epub)
+{
+    BooksEpubPrivate *priv;
+    gchar *file_as;
+    gchar *id;
+
+    g_return_val_if_fail (BOOKS_IS_EPUB (epub), NULL);
+
+    priv = epub->priv;
+
+    /* EPUB 2 stores it as attribute of the creator */
+    file_as = evaluate_string (priv, "//pkg:package/pkg:metadata/dc:creator[1]/@pkg:file-as");
+
+    if (file_as != NULL)
+        return file_as;
+
+    /* EPUB 3 refines the creator with a separate meta element */
+    id = evaluate_string (priv, "//pkg:package/pkg:metadata/dc:creator[1]/@id");
+
+    if (id != NULL) {
+        gchar *expression;
+
+        expression = g_strdup_printf ("//pkg:package/pkg:metadata/pkg:meta"
+                                      "[@refines='#%s' and @property='file-as']", id);
+        file_as = evaluate_string (priv, expression);
+        g_free (expression);
+        g_free (id);
+    }
+
+    return file_as;
+}
+
+/*
+ * Returns @value as ISBN-13 without separators or %NULL if it is not a
+ * valid ISBN. ISBN-10 are converted, so both forms of a book compare
+ * equal.
+ */
+static gchar *
+normalize_isbn (const gchar *value)
+{
+    gchar digits[14];
+    const gchar *c;
+    guint length = 0;
+    guint sum = 0;
+    guint i;
+
+    if (!g_ascii_strncasecmp (value, "urn:isbn:", 9))
+        value += 9;
+    else if (!g_ascii_strncasecmp (value, "isbn:", 5))
+        value += 5;
+
+    for (c = value; *c != '\0'; c++) {
+        if (*c == '-' || *c == ' ')
+            continue;
+
+        /* Only the check digit of an ISBN-10 may be an X */
+        if (length < 13 && (g_ascii_isdigit (*c) || (length == 9 && (*c == 'X' || *c == 'x'))))
+            digits[length++] = g_ascii_toupper (*c);
+        else
+            return NULL;
+    }
+
+    digits[length] = '\0';
+
+    if (length == 10) {
+        for (i = 0; i < 10; i++)
+            sum += (10 - i) * (digits[i] == 'X' ? 10 : digits[i] - '0');
+
+        if (sum % 11 != 0)
+            return NULL;
+
+        memmove (digits + 3, digits, 9);
+        memcpy (digits, "978", 3);
+    }
+    else if (length != 13 || strchr (digits, 'X') != NULL) {
+        return NULL;
+    }
+
+    for (i = 0, sum = 0; i < 12; i++)
+        sum += (digits[i] - '0') * (i % 2 ? 3 : 1);
+
+    sum = (10 - sum % 10) % 10;
+
+    if (length == 13 && (guint) (digits[12] - '0') != sum)
+        return NULL;
+
+    digits[12] = '0' + sum;
+    digits[13] = '\0';
+
+    return g_strdup (digits);
+}
+
+/**
+ * Returns an identifier that is shared by different files of the same
+ * book, i.e. the ISBN if there is one and the package identifier
+ * otherwise, or %NULL. Free with g_free().
+ */
+gchar *
+books_epub_get_identifier (BooksEpub *epub)
+{
+    BooksEpubPrivate *priv;
+    xmlXPathObject *object;
+    gchar *identifier = NULL;
+    gint i;
+
+    g_return_val_if_fail (BOOKS_IS_EPUB (epub), NULL);
+
+    priv = epub->priv;
+    object = xmlXPathEvalExpression ((const xmlChar *) "//pkg:package/pkg:metadata/dc:identifier",
+                                     priv->opf_xpath_context);
+
+    if (object == NULL)
+        return NULL;
+
+    for (i = 0; !xmlXPathNodeSetIsEmpty (object->nodesetval) &&
+                i < object->nodesetval->nodeNr && identifier == NULL; i++) {
+        xmlChar *content;
+        gchar *isbn;
+
+        content = xmlNodeGetContent (object->nodesetval->nodeTab[i]);
+        isbn = normalize_isbn (g_strstrip ((gchar *) content));
+
+        if (isbn != NULL) {
+            identifier = g_strconcat ("isbn:", isbn, NULL);
+            g_free (isbn);
+        }
+
+        xmlFree (content);
+    }
+
+    xmlXPathFreeObject (object);
+
+    if (identifier == NULL) {
+        gchar *unique;
+
+        unique = evaluate_string (priv, "//pkg:package/pkg:metadata/dc:identifier"
+                                        "[@id=/pkg:package/@unique-identifier]");
+
+        if (unique != NULL) {
+            identifier = g_ascii_strdown (g_strstrip (unique), -1);
+            g_free (unique);
+        }
+    }
+
+    return identifier;
+}
+
+/**
+ * Returns the name of the series the book belongs to or %NULL if it does
+ * not belong to one. @index is set to its position in the series or 0 if
+ * that is unknown. Free with g_free().
+ */
+gchar *
+books_epub_get_series (BooksEpub *epub,
+                       gdouble *index)
+{
+    BooksEpubPrivate *priv;
+    gchar *series;
+    gchar *position;
+    gchar *refines;
+    gchar *expression;
+
+    g_return_val_if_fail (BOOKS_IS_EPUB (epub), NULL);
+
+    priv = epub->priv;
+    *index = 0.0;
+
+    /* EPUB 3 refines a collection with its type and position */
+    refines = evaluate_string (priv, "//pkg:package/pkg:metadata/pkg:meta"
+                                     "[@property='collection-type' and normalize-space(.)='series']/@refines");
+
+    if (refines != NULL && refines[0] == '#') {
+        expression = g_strdup_printf ("//pkg:package/pkg:metadata/pkg:meta"
+                                      "[@property='belongs-to-collection' and @id='%s']", refines + 1);
+        series = evaluate_string (priv, expression);
+        g_free (expression);
+
+        expression = g_strdup_printf ("//pkg:package/pkg:metadata/pkg:meta"
+                                      "[@refines='%s' and @property='group-position']", refines);
+        position = evaluate_string (priv, expression);
+        g_free (expression);
+    }
+    else {
+        /* Calibre writes it in the EPUB 2 style, also into EPUB 3 books */
+        series = evaluate_string (priv, "//pkg:package/pkg:metadata/pkg:meta"
+                                        "[@name='calibre:series']/@content");
+        position = evaluate_string (priv, "//pkg:package/pkg:metadata/pkg:meta"
+                                          "[@name='calibre:series_index']/@content");
+    }
+
+    g_free (refines);
+
+    if (series != NULL && *g_strstrip (series) == '\0') {
+        g_free (series);
+        series = NULL;
+    }
+
+    if (series != NULL && position != NULL)
+        *index = MAX (g_ascii_strtod (position, NULL), 0.0);
+
+    g_free (position);
+    return series;
+}
+
 static gchar *
 remove_uri_anchor (const gchar *uri)
 {
@@ -267,7 +589,7 @@ extract_archive (BooksEpubPrivate *priv,
     if (result != ARCHIVE_OK) {
         g_set_error (&error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
                      "`%s' is not a valid EPUB archive", filename);
-        return FALSE;
+        goto extract_archive_cleanup;
     }
 
     for (;;) {
@@ -322,6 +644,98 @@ extract_archive_cleanup:
     return error;
 }
 
+/* Books are extracted below the cache directory by their file name */
+static gchar *
+get_extract_dir (const gchar *filename)
+{
+    gchar *basename;
+    gchar *path;
+
+    basename = g_path_get_basename (filename);
+    path = g_build_path (G_DIR_SEPARATOR_S,
+                         g_get_user_cache_dir(),
+                         "books",
+                         basename,
+                         NULL);
+
+    g_free (basename);
+    return path;
+}
+
+static void
+release_extract_dir (const gchar *path)
+{
+    guint count;
+
+    G_LOCK (extracted);
+    count = GPOINTER_TO_UINT (g_hash_table_lookup (extracted_in_use, path));
+
+    if (count > 1)
+        g_hash_table_insert (extracted_in_use, g_strdup (path), GUINT_TO_POINTER (count - 1));
+    else
+        g_hash_table_remove (extracted_in_use, path);
+
+    G_UNLOCK (extracted);
+}
+
+/* Deletes @path and everything below it without following links */
+static void
+remove_tree (const gchar *path)
+{
+    GDir *dir;
+    const gchar *name;
+
+    if (g_file_test (path, G_FILE_TEST_IS_DIR) && !g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+        dir = g_dir_open (path, 0, NULL);
+
+        while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+            gchar *child;
+
+            child = g_build_filename (path, name, NULL);
+            remove_tree (child);
+            g_free (child);
+        }
+
+        if (dir != NULL)
+            g_dir_close (dir);
+    }
+
+    g_remove (path);
+}
+
+/**
+ * Deletes the files books_epub_open() extracted the book @filename to,
+ * unless a book using them is open in this process. Books of the same
+ * file name share them, the caller has to make sure none is left in any
+ * library. Can be called from any thread.
+ */
+void
+books_epub_remove_extracted (const gchar *filename)
+{
+    gchar *basename;
+    gchar *path;
+
+    g_return_if_fail (filename != NULL);
+
+    /* Thumbnails live next to the extracted books */
+    basename = g_path_get_basename (filename);
+
+    if (!g_strcmp0 (basename, "thumbnails") || basename[0] == '.' || basename[0] == G_DIR_SEPARATOR) {
+        g_free (basename);
+        return;
+    }
+
+    g_free (basename);
+    path = get_extract_dir (filename);
+    G_LOCK (extracted);
+
+    if (extracted_in_use == NULL || !g_hash_table_contains (extracted_in_use, path))
+        remove_tree (path);
+
+    G_UNLOCK (extracted);
+    g_free (path);
+}
+
 static gchar *
 get_content (BooksEpubPrivate *priv,
              const gchar *filename)
@@ -356,15 +770,16 @@ get_content_filename (BooksEpubPrivate *priv,
 }
 
 static gchar *
-get_opf_path (BooksEpubPrivate *priv)
+parse_opf_path (const gchar *container_data)
 {
-    gchar *container_data;
     xmlDoc *tree;
     xmlXPathContext *context;
     xmlXPathObject *object;
     gchar *path = NULL;
 
-    container_data = get_content (priv, "META-INF/container.xml");
+    if (container_data == NULL)
+        return NULL;
+
     tree = xmlParseDoc ((const xmlChar *) container_data);
 
     if (tree == NULL)
@@ -381,22 +796,52 @@ get_opf_path (BooksEpubPrivate *priv)
 
     if (object == NULL) {
         g_error ("Could not evaluate xpath expression");
-        goto get_opf_path_cleanup;
+        goto parse_opf_path_cleanup;
     }
 
-    if (object->nodesetval != NULL)
+    if (!xmlXPathNodeSetIsEmpty (object->nodesetval))
         path = g_strdup ((const gchar *) xmlGetProp (object->nodesetval->nodeTab[0],
                                                      (const xmlChar *) "full-path"));
 
-get_opf_path_cleanup:
+parse_opf_path_cleanup:
     xmlXPathFreeObject (object);
     xmlXPathFreeContext (context);
     xmlFreeDoc (tree);
-    xmlCleanupParser ();
 
     return path;
 }
 
+static gchar *
+get_opf_path (BooksEpubPrivate *priv)
+{
+    gchar *container_data;
+    gchar *path;
+
+    container_data = get_content (priv, "META-INF/container.xml");
+    path = parse_opf_path (container_data);
+    g_free (container_data);
+
+    return path;
+}
+
+static xmlXPathContext *
+new_opf_context (xmlDoc *tree)
+{
+    xmlXPathContext *context;
+
+    context = xmlXPathNewContext (tree);
+
+    xmlXPathRegisterNs (context,
+                        (const xmlChar *) "dc",
+                        (const xmlChar *) "http://purl.org/dc/elements/1.1/");
+
+    xmlXPathRegisterNs (context,
+                        (const xmlChar *) "pkg",
+                        (const xmlChar *) "http://www.idpf.org/2007/opf");
+
+    return context;
+}
+
 static gchar *
 get_document_item (xmlXPathContext *context, gchar *item_id)
 {
@@ -457,18 +902,19 @@ populate_document_spine (BooksEpubPrivate *priv)
     xmlXPathFreeObject (object);
 }
 
+/* Returns the unescaped href of the cover relative to the package document */
 static gchar *
-get_cover_path (BooksEpubPrivate *priv)
+find_cover_href (xmlXPathContext *context)
 {
     gchar *cover_id = NULL;
-    gchar *path = NULL;
+    gchar *href = NULL;
     const gchar *meta_cover_expr = "//pkg:package/pkg:metadata/pkg:meta[@name='cover']";
     const gchar *cover_item_expr = "//pkg:package/pkg:manifest/pkg:item[@id='%s']";
 
     xmlXPathObject *object;
 
     /* First, get the cover id from the meta data */
-    object = xmlXPathEvalExpression ((const xmlChar *) meta_cover_expr, priv->opf_xpath_context);
+    object = xmlXPathEvalExpression ((const xmlChar *) meta_cover_expr, context);
 
     if (!xmlXPathNodeSetIsEmpty (object->nodesetval)) {
         xmlNode *node;
@@ -483,19 +929,16 @@ get_cover_path (BooksEpubPrivate *priv)
         gchar *expr;
 
         expr = g_strdup_printf (cover_item_expr, cover_id);
-        object = xmlXPathEvalExpression ((const xmlChar *) expr, priv->opf_xpath_context);
+        object = xmlXPathEvalExpression ((const xmlChar *) expr, context);
 
         if (!xmlXPathNodeSetIsEmpty (object->nodesetval)) {
             xmlNode *node;
-            gchar *href;
-            gchar *unescaped;
+            gchar *escaped;
 
             node = object->nodesetval->nodeTab[0];
-            href = (gchar *) xmlGetProp (node, (const xmlChar *) "href");
-            unescaped = g_uri_unescape_segment (href, NULL, NULL);
-            path = get_content_filename (priv, unescaped);
-            g_free (href);
-            g_free (unescaped);
+            escaped = (gchar *) xmlGetProp (node, (const xmlChar *) "href");
+            href = g_uri_unescape_segment (escaped, NULL, NULL);
+            g_free (escaped);
         }
 
         xmlXPathFreeObject (object);
@@ -504,9 +947,218 @@ get_cover_path (BooksEpubPrivate *priv)
 
     g_free (cover_id);
 
+    return href;
+}
+
+static gchar *
+get_cover_path (BooksEpubPrivate *priv)
+{
+    gchar *href;
+    gchar *path = NULL;
+
+    href = find_cover_href (priv->opf_xpath_context);
+
+    if (href != NULL)
+        path = get_content_filename (priv, href);
+
+    g_free (href);
     return path;
 }
 
+/*
+ * Reads the member @name of the archive at @filename into memory. The data
+ * is zero-terminated, so that XML documents can be parsed right away.
+ * Members larger than MAX_ENTRY_SIZE are refused, the thumbnailer reads
+ * whatever files the file manager shows.
+ */
+static gchar *
+read_archive_entry (const gchar *filename,
+                    const gchar *name,
+                    gsize *length,
+                    GError **error)
+{
+    struct archive *arch;
+    struct archive_entry *entry;
+    gchar *data = NULL;
+    gint result;
+
+    arch = archive_read_new ();
+    archive_read_support_filter_all (arch);
+    archive_read_support_format_zip (arch);
+
+    if (archive_read_open_filename (arch, filename, 10240) != ARCHIVE_OK) {
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                     "`%s' is not a valid EPUB archive", filename);
+        goto read_archive_entry_cleanup;
+    }
+
+    /* Headers of the other members are skipped without decompressing them */
+    while ((result = archive_read_next_header (arch, &entry)) == ARCHIVE_OK) {
+        GByteArray *array;
+        guint8 buffer[16384];
+        gssize n_read;
+
+        if (g_strcmp0 (archive_entry_pathname (entry), name) != 0)
+            continue;
+
+        if (archive_entry_size_is_set (entry) && archive_entry_size (entry) > MAX_ENTRY_SIZE) {
+            g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                         "`%s' in `%s' is too large", name, filename);
+            goto read_archive_entry_cleanup;
+        }
+
+        array = g_byte_array_new ();
+
+        /* The stored size may be missing or wrong */
+        while ((n_read = archive_read_data (arch, buffer, sizeof (buffer))) > 0) {
+            if (array->len + (gsize) n_read > MAX_ENTRY_SIZE) {
+                g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                             "`%s' in `%s' is too large", name, filename);
+                g_byte_array_free (array, TRUE);
+                goto read_archive_entry_cleanup;
+            }
+
+            g_byte_array_append (array, buffer, (guint) n_read);
+        }
+
+        if (n_read < 0) {
+            g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                         "`%s' is corrupted: %s", filename, archive_error_string (arch));
+            g_byte_array_free (array, TRUE);
+            goto read_archive_entry_cleanup;
+        }
+
+        *length = array->len;
+        g_byte_array_append (array, (const guint8 *) "", 1);
+        data = (gchar *) g_byte_array_free (array, FALSE);
+        goto read_archive_entry_cleanup;
+    }
+
+    if (result == ARCHIVE_EOF)
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_NO_META_DATA,
+                     "`%s' does not contain `%s'", filename, name);
+    else
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                     "`%s' is corrupted: %s", filename, archive_error_string (arch));
+
+read_archive_entry_cleanup:
+    archive_read_close (arch);
+    archive_read_free (arch);
+    return data;
+}
+
+/* Resolves @href relative to @opf_path into the name of an archive member */
+static gchar *
+get_entry_name (const gchar *opf_path,
+                const gchar *href)
+{
+    GPtrArray *segments;
+    gchar *dir;
+    gchar *joined;
+    gchar **parts;
+    gchar *name;
+    guint i;
+
+    dir = g_path_get_dirname (opf_path);
+    joined = g_strconcat (dir, "/", href, NULL);
+    parts = g_strsplit (joined, "/", -1);
+    segments = g_ptr_array_new ();
+
+    for (i = 0; parts[i] != NULL; i++) {
+        if (*parts[i] == '\0' || g_strcmp0 (parts[i], ".") == 0)
+            continue;
+
+        if (g_strcmp0 (parts[i], "..") == 0) {
+            if (segments->len > 0)
+                g_ptr_array_remove_index (segments, segments->len - 1);
+
+            continue;
+        }
+
+        g_ptr_array_add (segments, parts[i]);
+    }
+
+    g_ptr_array_add (segments, NULL);
+    name = g_strjoinv ("/", (gchar **) segments->pdata);
+
+    g_ptr_array_free (segments, TRUE);
+    g_strfreev (parts);
+    g_free (joined);
+    g_free (dir);
+
+    return name;
+}
+
+/**
+ * Reads the cover image of the book at @filename straight from the
+ * archive, without extracting it like books_epub_open() does. Returns
+ * %NULL and sets @error if there is no cover.
+ */
+GBytes *
+books_epub_read_cover (const gchar *filename,
+                       GError **error)
+{
+    gchar *container_data;
+    gchar *opf_path = NULL;
+    gchar *opf_data = NULL;
+    gchar *href = NULL;
+    gchar *name;
+    gchar *data;
+    xmlDoc *tree;
+    xmlXPathContext *context;
+    gsize length;
+    GBytes *cover = NULL;
+
+    g_return_val_if_fail (filename != NULL, NULL);
+
+    container_data = read_archive_entry (filename, "META-INF/container.xml", &length, error);
+
+    if (container_data == NULL)
+        return NULL;
+
+    opf_path = parse_opf_path (container_data);
+
+    if (opf_path == NULL) {
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_NO_META_DATA,
+                     "`%s' does not contain a package document", filename);
+        goto read_cover_cleanup;
+    }
+
+    opf_data = read_archive_entry (filename, opf_path, &length, error);
+
+    if (opf_data == NULL)
+        goto read_cover_cleanup;
+
+    tree = xmlParseDoc ((const xmlChar *) opf_data);
+
+    if (tree != NULL) {
+        context = new_opf_context (tree);
+        href = find_cover_href (context);
+        xmlXPathFreeContext (context);
+        xmlFreeDoc (tree);
+    }
+
+    if (href == NULL) {
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_NO_META_DATA,
+                     "`%s' does not have a cover", filename);
+        goto read_cover_cleanup;
+    }
+
+    name = get_entry_name (opf_path, href);
+    data = read_archive_entry (filename, name, &length, error);
+    g_free (name);
+
+    if (data != NULL)
+        cover = g_bytes_new_take (data, length);
+
+read_cover_cleanup:
+    g_free (href);
+    g_free (opf_data);
+    g_free (opf_path);
+    g_free (container_data);
+    return cover;
+}
+
 static void
 books_epub_dispose (GObject *object)
 {
@@ -525,8 +1177,10 @@ books_epub_finalize (GObject *object)
         priv->documents = NULL;
     }
 
-    if (priv->path != NULL)
+    if (priv->path != NULL) {
+        release_extract_dir (priv->path);
         g_free (priv->path);
+    }
 
     if (priv->cover_path != NULL)
         g_free (priv->cover_path);
@@ -541,7 +1195,6 @@ books_epub_finalize (GObject *object)
 
     if (priv->opf_tree != NULL) {
         xmlFreeDoc (priv->opf_tree);
-        xmlCleanupParser ();
         priv->opf_tree = NULL;
     }
 
@@ -583,6 +1236,9 @@ static void books_epub_class_init(BooksEpubClass *klass)
     gobject_class->finalize = books_epub_finalize;
 
     g_type_class_add_private(klass, sizeof(BooksEpubPrivate));
+
+    /* Books are opened from worker threads, libxml2 must be set up before */
+    xmlInitParser ();
 }
 
 static void books_epub_init(BooksEpub *self)
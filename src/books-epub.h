@@ -39,10 +39,26 @@ gboolean        books_epub_open         (BooksEpub      *epub,
                                          GError       **error);
 const gchar   * books_epub_get_meta     (BooksEpub      *epub,
                                          gchar          *key);
+gchar        ** books_epub_get_meta_list
+                                        (BooksEpub      *epub,
+                                         const gchar    *key);
+gchar         * books_epub_get_author_sort
+                                        (BooksEpub      *epub);
+gchar         * books_epub_get_identifier
+                                        (BooksEpub      *epub);
+gchar         * books_epub_get_series   (BooksEpub      *epub,
+                                         gdouble        *index);
 const gchar   * books_epub_get_uri      (BooksEpub      *epub);
 void            books_epub_set_uri      (BooksEpub      *epub,
                                          const gchar    *uri);
 const gchar   * books_epub_get_cover    (BooksEpub      *epub);
+GBytes        * books_epub_read_cover   (const gchar    *filename,
+                                         GError        **error);
+void            books_epub_remove_extracted
+                                        (const gchar    *filename);
+guint           books_epub_get_index    (BooksEpub      *epub);
+void            books_epub_set_index    (BooksEpub      *epub,
+                                         guint           index);
 void            books_epub_next         (BooksEpub      *epub);
 void            books_epub_previous     (BooksEpub      *epub);
 gboolean        books_epub_is_first     (BooksEpub      *epub);
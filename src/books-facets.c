@@ -0,0 +1,308 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+#include "books-facets.h"
+
+/*
+ * Facets are the values books can be narrowed down by, e.g. authors or
+ * subjects. meta.db keeps the number of books per value in facet_counts,
+ * maintained by triggers on every insert and delete. Values whose count
+ * changed are logged to a temporary table, so the tree model below is
+ * updated in proportion to the change and not to the library size.
+ */
+
+static const gchar *kind_names[] = {
+    N_("Authors"),
+    N_("Languages"),
+    N_("Subjects"),
+    N_("Series")
+};
+
+struct _BooksFacets {
+    sqlite3         *db;
+    GtkTreeStore    *store;
+    GtkTreeIter      kinds[BOOKS_FACET_N_KINDS];
+
+    /* Maps "kind:value" to the row of the value */
+    GHashTable      *rows;
+};
+
+
+static gchar *
+get_row_key (gint kind,
+             const gchar *value)
+{
+    return g_strdup_printf ("%i:%s", kind, value);
+}
+
+static gchar *
+get_label (const gchar *value,
+           gint count)
+{
+    return g_markup_printf_escaped ("%s <small>(%i)</small>", value, count);
+}
+
+static void
+insert_value (BooksFacets *facets,
+              gint kind,
+              const gchar *value,
+              gint count)
+{
+    GtkTreeIter iter;
+    gchar *label;
+    gchar *sort_key;
+
+    label = get_label (value, count);
+    sort_key = g_utf8_collate_key (value, -1);
+
+    gtk_tree_store_insert_with_values (facets->store, &iter, &facets->kinds[kind], -1,
+                                       BOOKS_FACETS_LABEL_COLUMN, label,
+                                       BOOKS_FACETS_KIND_COLUMN, kind,
+                                       BOOKS_FACETS_VALUE_COLUMN, value,
+                                       BOOKS_FACETS_SORT_KEY_COLUMN, sort_key,
+                                       -1);
+
+    g_hash_table_insert (facets->rows, get_row_key (kind, value), gtk_tree_iter_copy (&iter));
+    g_free (sort_key);
+    g_free (label);
+}
+
+static gint
+compare_rows (GtkTreeModel *model,
+              GtkTreeIter *a,
+              GtkTreeIter *b,
+              gpointer user_data)
+{
+    gint kind_a;
+    gint kind_b;
+    gchar *key_a;
+    gchar *key_b;
+    gint result;
+
+    gtk_tree_model_get (model, a, BOOKS_FACETS_KIND_COLUMN, &kind_a, BOOKS_FACETS_SORT_KEY_COLUMN, &key_a, -1);
+    gtk_tree_model_get (model, b, BOOKS_FACETS_KIND_COLUMN, &kind_b, BOOKS_FACETS_SORT_KEY_COLUMN, &key_b, -1);
+
+    /* The kinds themselves stay in the order of BooksFacetKind */
+    if (kind_a != kind_b || key_a == NULL || key_b == NULL)
+        result = kind_a - kind_b;
+    else
+        result = strcmp (key_a, key_b);
+
+    g_free (key_a);
+    g_free (key_b);
+    return result;
+}
+
+static void
+load_values (BooksFacets *facets,
+             sqlite3 *db)
+{
+    sqlite3_stmt *select_stmt = NULL;
+    gchar *db_error = NULL;
+
+    facets->db = db;
+
+    /* Temporary triggers only exist for this connection */
+    sqlite3_exec (db,
+                  "CREATE TEMP TABLE IF NOT EXISTS changed_facets (kind INTEGER, value TEXT, "
+                  "                                                PRIMARY KEY (kind, value));"
+                  "CREATE TEMP TRIGGER IF NOT EXISTS facet_counts_inserted AFTER INSERT ON main.facet_counts BEGIN "
+                  "    INSERT OR IGNORE INTO changed_facets VALUES (new.kind, new.value); "
+                  "END;"
+                  "CREATE TEMP TRIGGER IF NOT EXISTS facet_counts_updated AFTER UPDATE ON main.facet_counts BEGIN "
+                  "    INSERT OR IGNORE INTO changed_facets VALUES (new.kind, new.value); "
+                  "END;"
+                  "CREATE TEMP TRIGGER IF NOT EXISTS facet_counts_deleted AFTER DELETE ON main.facet_counts BEGIN "
+                  "    INSERT OR IGNORE INTO changed_facets VALUES (old.kind, old.value); "
+                  "END",
+                  NULL, NULL, &db_error);
+
+    if (db_error != NULL) {
+        g_warning (_("Could not update database: %s\n"), db_error);
+        sqlite3_free (db_error);
+    }
+
+    sqlite3_prepare_v2 (db, "SELECT kind, value, count FROM facet_counts", -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gint kind;
+
+        kind = sqlite3_column_int (select_stmt, 0);
+
+        if (kind >= 0 && kind < BOOKS_FACET_N_KINDS)
+            insert_value (facets, kind,
+                          (const gchar *) sqlite3_column_text (select_stmt, 1),
+                          sqlite3_column_int (select_stmt, 2));
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_exec (db, "DELETE FROM changed_facets", NULL, NULL, NULL);
+}
+
+/**
+ * Loads all facets of the database @db, which must stay open as long as
+ * the facets are used.
+ */
+BooksFacets *
+books_facets_new (sqlite3 *db)
+{
+    BooksFacets *facets;
+    gint i;
+
+    facets = g_new0 (BooksFacets, 1);
+    facets->rows = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) gtk_tree_iter_free);
+    facets->store = gtk_tree_store_new (BOOKS_FACETS_N_COLUMNS,
+                                        G_TYPE_STRING, G_TYPE_INT, G_TYPE_STRING, G_TYPE_STRING);
+
+    for (i = 0; i < BOOKS_FACET_N_KINDS; i++) {
+        gchar *label;
+
+        label = g_markup_printf_escaped ("<b>%s</b>", _(kind_names[i]));
+        gtk_tree_store_insert_with_values (facets->store, &facets->kinds[i], NULL, -1,
+                                           BOOKS_FACETS_LABEL_COLUMN, label,
+                                           BOOKS_FACETS_KIND_COLUMN, i,
+                                           -1);
+        g_free (label);
+    }
+
+    load_values (facets, db);
+
+    /* Sorted once now, later insertions find their place on their own */
+    gtk_tree_sortable_set_sort_func (GTK_TREE_SORTABLE (facets->store), BOOKS_FACETS_SORT_KEY_COLUMN,
+                                     compare_rows, NULL, NULL);
+    gtk_tree_sortable_set_sort_column_id (GTK_TREE_SORTABLE (facets->store), BOOKS_FACETS_SORT_KEY_COLUMN,
+                                          GTK_SORT_ASCENDING);
+
+    return facets;
+}
+
+/**
+ * Replaces the values by the ones of @db, keeping the model, so views
+ * do not have to be set up again.
+ */
+void
+books_facets_set_database (BooksFacets *facets,
+                           sqlite3 *db)
+{
+    gint i;
+
+    g_return_if_fail (facets != NULL);
+
+    g_hash_table_remove_all (facets->rows);
+
+    for (i = 0; i < BOOKS_FACET_N_KINDS; i++) {
+        GtkTreeIter child;
+
+        while (gtk_tree_model_iter_children (GTK_TREE_MODEL (facets->store), &child, &facets->kinds[i]))
+            gtk_tree_store_remove (facets->store, &child);
+    }
+
+    load_values (facets, db);
+}
+
+void
+books_facets_free (BooksFacets *facets)
+{
+    if (facets == NULL)
+        return;
+
+    g_hash_table_destroy (facets->rows);
+    g_object_unref (facets->store);
+    g_free (facets);
+}
+
+/**
+ * Returns a tree with one top-level row per #BooksFacetKind and its
+ * values below, labeled with the number of books.
+ */
+GtkTreeModel *
+books_facets_get_model (BooksFacets *facets)
+{
+    g_return_val_if_fail (facets != NULL, NULL);
+    return GTK_TREE_MODEL (facets->store);
+}
+
+typedef struct {
+    gint     kind;
+    gchar   *value;
+    gint     count;
+} FacetChange;
+
+static void
+apply_change (FacetChange *change,
+              BooksFacets *facets)
+{
+    GtkTreeIter *iter;
+    gchar *key;
+
+    key = get_row_key (change->kind, change->value);
+    iter = g_hash_table_lookup (facets->rows, key);
+
+    if (change->count <= 0) {
+        if (iter != NULL) {
+            gtk_tree_store_remove (facets->store, iter);
+            g_hash_table_remove (facets->rows, key);
+        }
+    }
+    else if (iter != NULL) {
+        gchar *label;
+
+        label = get_label (change->value, change->count);
+        gtk_tree_store_set (facets->store, iter, BOOKS_FACETS_LABEL_COLUMN, label, -1);
+        g_free (label);
+    }
+    else {
+        insert_value (facets, change->kind, change->value, change->count);
+    }
+
+    g_free (key);
+}
+
+static void
+free_change (FacetChange *change)
+{
+    g_free (change->value);
+    g_free (change);
+}
+
+/**
+ * Applies the counts that changed since the last update.
+ */
+void
+books_facets_update (BooksFacets *facets)
+{
+    const gchar *select_sql = "SELECT c.kind, c.value, f.count FROM changed_facets c "
+                              "LEFT JOIN facet_counts f ON f.kind = c.kind AND f.value = c.value";
+    sqlite3_stmt *select_stmt = NULL;
+    GPtrArray *changes;
+
+    g_return_if_fail (facets != NULL);
+
+    changes = g_ptr_array_new_with_free_func ((GDestroyNotify) free_change);
+    sqlite3_prepare_v2 (facets->db, select_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        FacetChange *change;
+
+        change = g_new0 (FacetChange, 1);
+        change->kind = sqlite3_column_int (select_stmt, 0);
+        change->value = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+        change->count = sqlite3_column_int (select_stmt, 2);
+
+        if (change->kind >= 0 && change->kind < BOOKS_FACET_N_KINDS)
+            g_ptr_array_add (changes, change);
+        else
+            free_change (change);
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_exec (facets->db, "DELETE FROM changed_facets", NULL, NULL, NULL);
+
+    /* Removing a selected row may well lead to another update */
+    g_ptr_array_foreach (changes, (GFunc) apply_change, facets);
+    g_ptr_array_unref (changes);
+}
@@ -0,0 +1,37 @@
+#ifndef BOOKS_FACETS_H
+#define BOOKS_FACETS_H
+
+#include <gtk/gtk.h>
+#include <sqlite3.h>
+
+G_BEGIN_DECLS
+
+/* Stored in meta.db, never renumber */
+typedef enum {
+    BOOKS_FACET_AUTHOR = 0,
+    BOOKS_FACET_LANGUAGE = 1,
+    BOOKS_FACET_SUBJECT = 2,
+    BOOKS_FACET_SERIES = 3,
+    BOOKS_FACET_N_KINDS
+} BooksFacetKind;
+
+enum {
+    BOOKS_FACETS_LABEL_COLUMN,
+    BOOKS_FACETS_KIND_COLUMN,
+    BOOKS_FACETS_VALUE_COLUMN,
+    BOOKS_FACETS_SORT_KEY_COLUMN,
+    BOOKS_FACETS_N_COLUMNS
+};
+
+typedef struct _BooksFacets BooksFacets;
+
+BooksFacets     *books_facets_new               (sqlite3            *db);
+void             books_facets_free              (BooksFacets        *facets);
+GtkTreeModel    *books_facets_get_model         (BooksFacets        *facets);
+void             books_facets_update            (BooksFacets        *facets);
+void             books_facets_set_database      (BooksFacets        *facets,
+                                                 sqlite3            *db);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,198 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "books-libraries.h"
+
+/*
+ * A library is a database of its own together with the folders scanned
+ * into it. The default library, named "", lives in meta.db and uses the
+ * library-folders key. Further ones are registered in the libraries key
+ * as (name, database, folders) and the library key selects the one shown.
+ */
+
+
+/**
+ * Returns the names of all libraries, the default one first. Free with
+ * g_strfreev().
+ */
+gchar **
+books_libraries_get_names (GSettings *settings)
+{
+    GVariantIter *iter;
+    GPtrArray *names;
+    const gchar *name;
+
+    g_return_val_if_fail (G_IS_SETTINGS (settings), NULL);
+
+    names = g_ptr_array_new ();
+    g_ptr_array_add (names, g_strdup (""));
+    g_settings_get (settings, "libraries", "a(ssas)", &iter);
+
+    while (g_variant_iter_next (iter, "(&s&sas)", &name, NULL, NULL)) {
+        if (*name != '\0')
+            g_ptr_array_add (names, g_strdup (name));
+    }
+
+    g_variant_iter_free (iter);
+    g_ptr_array_add (names, NULL);
+    return (gchar **) g_ptr_array_free (names, FALSE);
+}
+
+/**
+ * Returns the name of the library shown, "" if it is the default one or
+ * no longer registered. Free with g_free().
+ */
+gchar *
+books_libraries_get_active (GSettings *settings)
+{
+    gchar **names;
+    gchar *name;
+    guint i;
+
+    g_return_val_if_fail (G_IS_SETTINGS (settings), NULL);
+
+    name = g_settings_get_string (settings, "library");
+    names = books_libraries_get_names (settings);
+
+    for (i = 0; names[i] != NULL && g_strcmp0 (names[i], name); i++)
+        ;
+
+    if (names[i] == NULL) {
+        g_free (name);
+        name = g_strdup ("");
+    }
+
+    g_strfreev (names);
+    return name;
+}
+
+/* Returns the entry of @name in @libraries or %NULL */
+static GVariant *
+lookup_library (GVariant *libraries,
+                const gchar *name)
+{
+    GVariantIter iter;
+    GVariant *library;
+
+    g_variant_iter_init (&iter, libraries);
+
+    while ((library = g_variant_iter_next_value (&iter)) != NULL) {
+        const gchar *library_name;
+
+        g_variant_get_child (library, 0, "&s", &library_name);
+
+        if (!g_strcmp0 (library_name, name))
+            return library;
+
+        g_variant_unref (library);
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the database file of the default library. Free with g_free().
+ */
+gchar *
+books_libraries_get_default_database (void)
+{
+    return g_build_filename (g_get_user_data_dir (), "books", "meta.db", NULL);
+}
+
+/**
+ * Returns the database file of the library @name, %NULL for the default
+ * one. Free with g_free().
+ */
+gchar *
+books_libraries_get_database (GSettings *settings,
+                              const gchar *name)
+{
+    GVariant *libraries;
+    GVariant *library;
+    gchar *database = NULL;
+
+    g_return_val_if_fail (G_IS_SETTINGS (settings), NULL);
+
+    if (name == NULL || *name == '\0')
+        return NULL;
+
+    libraries = g_settings_get_value (settings, "libraries");
+    library = lookup_library (libraries, name);
+
+    if (library != NULL) {
+        g_variant_get_child (library, 1, "s", &database);
+        g_variant_unref (library);
+    }
+
+    g_variant_unref (libraries);
+    return database;
+}
+
+/**
+ * Returns the folders scanned into the library @name. Free with
+ * g_strfreev().
+ */
+gchar **
+books_libraries_get_folders (GSettings *settings,
+                             const gchar *name)
+{
+    GVariant *libraries;
+    GVariant *library;
+    gchar **folders = NULL;
+
+    g_return_val_if_fail (G_IS_SETTINGS (settings), NULL);
+
+    if (name == NULL || *name == '\0')
+        return g_settings_get_strv (settings, "library-folders");
+
+    libraries = g_settings_get_value (settings, "libraries");
+    library = lookup_library (libraries, name);
+
+    if (library != NULL) {
+        g_variant_get_child (library, 2, "^as", &folders);
+        g_variant_unref (library);
+    }
+
+    g_variant_unref (libraries);
+    return folders != NULL ? folders : g_new0 (gchar *, 1);
+}
+
+/**
+ * Replaces the folders scanned into the library @name.
+ */
+void
+books_libraries_set_folders (GSettings *settings,
+                             const gchar *name,
+                             const gchar * const *folders)
+{
+    GVariantBuilder builder;
+    GVariantIter iter;
+    GVariant *libraries;
+    const gchar *library_name;
+    const gchar *database;
+    GVariant *library_folders;
+
+    g_return_if_fail (G_IS_SETTINGS (settings));
+
+    if (name == NULL || *name == '\0') {
+        g_settings_set_strv (settings, "library-folders", folders);
+        return;
+    }
+
+    libraries = g_settings_get_value (settings, "libraries");
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssas)"));
+    g_variant_iter_init (&iter, libraries);
+
+    while (g_variant_iter_next (&iter, "(&s&s@as)", &library_name, &database, &library_folders)) {
+        if (!g_strcmp0 (library_name, name))
+            g_variant_builder_add (&builder, "(ss^as)", library_name, database, folders);
+        else
+            g_variant_builder_add (&builder, "(ss@as)", library_name, database, library_folders);
+
+        g_variant_unref (library_folders);
+    }
+
+    g_settings_set_value (settings, "libraries", g_variant_builder_end (&builder));
+    g_variant_unref (libraries);
+}
@@ -0,0 +1,28 @@
+#ifndef BOOKS_LIBRARIES_H
+#define BOOKS_LIBRARIES_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    BOOKS_LIBRARY_LOCATION_AUTO,
+    BOOKS_LIBRARY_LOCATION_LOCAL,
+    BOOKS_LIBRARY_LOCATION_REMOTE
+} BooksLibraryLocation;
+
+gchar          **books_libraries_get_names      (GSettings          *settings);
+gchar           *books_libraries_get_default_database
+                                                (void);
+gchar           *books_libraries_get_active     (GSettings          *settings);
+gchar           *books_libraries_get_database   (GSettings          *settings,
+                                                 const gchar        *name);
+gchar          **books_libraries_get_folders    (GSettings          *settings,
+                                                 const gchar        *name);
+void             books_libraries_set_folders    (GSettings          *settings,
+                                                 const gchar        *name,
+                                                 const gchar * const *folders);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,241 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "books-listing-cache.h"
+
+/*
+ * Looks up files on slow, remote file systems. Each directory is read
+ * once with all its names instead of asking for every file, and the
+ * result is kept for a while, including the failure to read it. A
+ * directory that cannot be read or is empty tells nothing about the
+ * books in it, the share may just not be mounted, so they count as
+ * unreachable rather than missing. Safe to use from several threads.
+ */
+
+/* Microseconds a directory listing stays valid */
+#define LISTING_TTL         (5 * 60 * G_USEC_PER_SEC)
+
+/* Microseconds until an unreadable directory is tried again */
+#define UNREACHABLE_TTL     (30 * G_USEC_PER_SEC)
+
+typedef struct {
+    gint64       time;
+
+    /* Names in the directory, %NULL if it could not be read */
+    GHashTable  *names;
+
+    /* Whether the directory is on a remote file system */
+    gboolean     remote;
+    gboolean     remote_known;
+} Listing;
+
+struct _BooksListingCache {
+    GMutex       lock;
+
+    /* Maps directories to listings */
+    GHashTable  *listings;
+};
+
+
+static void
+free_listing (Listing *listing)
+{
+    if (listing->names != NULL)
+        g_hash_table_destroy (listing->names);
+
+    g_free (listing);
+}
+
+BooksListingCache *
+books_listing_cache_new (void)
+{
+    BooksListingCache *cache;
+
+    cache = g_new0 (BooksListingCache, 1);
+    g_mutex_init (&cache->lock);
+    cache->listings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_listing);
+
+    return cache;
+}
+
+void
+books_listing_cache_free (BooksListingCache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    g_hash_table_destroy (cache->listings);
+    g_mutex_clear (&cache->lock);
+    g_free (cache);
+}
+
+static GHashTable *
+read_directory (const gchar *directory,
+                GCancellable *cancellable)
+{
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+    GHashTable *names;
+    GFile *file;
+    GError *error = NULL;
+
+    file = g_file_new_for_path (directory);
+    enumerator = g_file_enumerate_children (file, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            cancellable, NULL);
+    g_object_unref (file);
+
+    if (enumerator == NULL)
+        return NULL;
+
+    names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    while ((info = g_file_enumerator_next_file (enumerator, cancellable, &error)) != NULL) {
+        g_hash_table_add (names, g_strdup (g_file_info_get_name (info)));
+        g_object_unref (info);
+    }
+
+    g_object_unref (enumerator);
+
+    /* A listing cut short would make the rest look missing */
+    if (error != NULL || g_hash_table_size (names) == 0) {
+        g_clear_error (&error);
+        g_hash_table_destroy (names);
+        return NULL;
+    }
+
+    return names;
+}
+
+/* Returns the listing of @directory, reading it if it is too old. Locked. */
+static Listing *
+get_listing (BooksListingCache *cache,
+             const gchar *directory,
+             GCancellable *cancellable)
+{
+    Listing *listing;
+    GHashTable *names;
+    gint64 now;
+
+    now = g_get_monotonic_time ();
+    listing = g_hash_table_lookup (cache->listings, directory);
+
+    if (listing != NULL &&
+        now - listing->time < (listing->names != NULL ? LISTING_TTL : UNREACHABLE_TTL))
+        return listing;
+
+    /* Other directories may be looked up meanwhile */
+    g_mutex_unlock (&cache->lock);
+    names = read_directory (directory, cancellable);
+    g_mutex_lock (&cache->lock);
+
+    listing = g_hash_table_lookup (cache->listings, directory);
+
+    if (listing == NULL) {
+        listing = g_new0 (Listing, 1);
+        g_hash_table_insert (cache->listings, g_strdup (directory), listing);
+    }
+    else if (listing->names != NULL) {
+        g_hash_table_destroy (listing->names);
+    }
+
+    listing->time = now;
+    listing->names = names;
+    return listing;
+}
+
+/**
+ * Tells whether the file @path exists, reading its directory only if
+ * there is no recent listing of it. May block on the network.
+ */
+BooksFileState
+books_listing_cache_lookup (BooksListingCache *cache,
+                            const gchar *path,
+                            GCancellable *cancellable)
+{
+    Listing *listing;
+    BooksFileState state;
+    gchar *directory;
+    gchar *name;
+
+    g_return_val_if_fail (cache != NULL && path != NULL, BOOKS_FILE_UNREACHABLE);
+
+    directory = g_path_get_dirname (path);
+    name = g_path_get_basename (path);
+
+    g_mutex_lock (&cache->lock);
+    listing = get_listing (cache, directory, cancellable);
+
+    if (listing->names == NULL)
+        state = BOOKS_FILE_UNREACHABLE;
+    else if (g_hash_table_contains (listing->names, name))
+        state = BOOKS_FILE_PRESENT;
+    else
+        state = BOOKS_FILE_MISSING;
+
+    g_mutex_unlock (&cache->lock);
+
+    g_free (name);
+    g_free (directory);
+    return state;
+}
+
+/**
+ * Returns %TRUE if @directory is on a remote file system. Directories
+ * that exist but whose file system cannot be determined count as remote,
+ * local ones hardly ever fail. The answer is kept as long as the listing.
+ */
+gboolean
+books_listing_cache_is_remote (BooksListingCache *cache,
+                               const gchar *directory)
+{
+    Listing *listing;
+    GFileInfo *info;
+    GFile *file;
+    gboolean remote;
+    GError *error = NULL;
+
+    g_return_val_if_fail (cache != NULL && directory != NULL, TRUE);
+
+    g_mutex_lock (&cache->lock);
+    listing = g_hash_table_lookup (cache->listings, directory);
+
+    if (listing != NULL && listing->remote_known) {
+        remote = listing->remote;
+        g_mutex_unlock (&cache->lock);
+        return remote;
+    }
+
+    g_mutex_unlock (&cache->lock);
+
+    file = g_file_new_for_path (directory);
+    info = g_file_query_filesystem_info (file, G_FILE_ATTRIBUTE_FILESYSTEM_REMOTE, NULL, &error);
+
+    if (info != NULL) {
+        remote = g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_FILESYSTEM_REMOTE);
+        g_object_unref (info);
+    }
+    else {
+        remote = !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+        g_error_free (error);
+    }
+
+    g_object_unref (file);
+
+    g_mutex_lock (&cache->lock);
+    listing = g_hash_table_lookup (cache->listings, directory);
+
+    /* Outdated, so the next lookup reads the directory */
+    if (listing == NULL) {
+        listing = g_new0 (Listing, 1);
+        listing->time = g_get_monotonic_time () - LISTING_TTL;
+        g_hash_table_insert (cache->listings, g_strdup (directory), listing);
+    }
+
+    listing->remote = remote;
+    listing->remote_known = TRUE;
+    g_mutex_unlock (&cache->lock);
+
+    return remote;
+}
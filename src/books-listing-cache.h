@@ -0,0 +1,26 @@
+#ifndef BOOKS_LISTING_CACHE_H
+#define BOOKS_LISTING_CACHE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    BOOKS_FILE_PRESENT,
+    BOOKS_FILE_MISSING,
+    BOOKS_FILE_UNREACHABLE
+} BooksFileState;
+
+typedef struct _BooksListingCache BooksListingCache;
+
+BooksListingCache *books_listing_cache_new      (void);
+void              books_listing_cache_free      (BooksListingCache  *cache);
+BooksFileState    books_listing_cache_lookup    (BooksListingCache  *cache,
+                                                 const gchar        *path,
+                                                 GCancellable       *cancellable);
+gboolean          books_listing_cache_is_remote (BooksListingCache  *cache,
+                                                 const gchar        *directory);
+
+G_END_DECLS
+
+#endif
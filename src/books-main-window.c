@@ -9,16 +9,40 @@
 #include "books-main-window.h"
 #include "books-window.h"
 #include "books-collection.h"
+#include "books-content-hash.h"
+#include "books-duplicates-dialog.h"
+#include "books-libraries.h"
+#include "books-opds-server.h"
 #include "books-preferences-dialog.h"
+#include "books-removed-dialog.h"
+#include "books-scanner.h"
 
 
 G_DEFINE_TYPE(BooksMainWindow, books_main_window, GTK_TYPE_WINDOW)
 
 #define BOOKS_MAIN_WINDOW_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_MAIN_WINDOW, BooksMainWindowPrivate))
 
+/* Pause in typing after which the filter is applied */
+#define FILTER_DELAY_MS     150
+
+/* Seconds a removal can be undone before the books are deleted */
+#define UNDO_TIMEOUT        30
+
+/* Seconds after start or switching libraries before books are verified */
+#define VERIFY_DELAY        120
+
+/*
+ * The icon view lays out every item and reads each row to measure it, so
+ * it would page in the whole library. Larger libraries start in the list,
+ * which measures one row. Switching to symbols still lays out all items.
+ */
+#define MAX_ICON_VIEW_BOOKS 5000
+
 static void action_quit                 (GtkAction *, BooksMainWindow *window);
 static void action_add_book             (GtkAction *, BooksMainWindow *window);
 static void action_remove_selected_book (GtkAction *, BooksMainWindow *window);
+static void action_add_to_shelf         (GtkAction *, BooksMainWindow *window);
+static void action_remove_from_shelf    (GtkAction *, BooksMainWindow *window);
 static void action_info                 (GtkAction *, BooksMainWindow *window);
 static void action_preferences          (GtkAction *, BooksMainWindow *window);
 
@@ -29,32 +53,64 @@ struct _BooksMainWindowPrivate {
     GtkContainer    *list_scroll;
     GtkContainer    *icon_scroll;
     GtkActionGroup  *action_group;
+    GtkActionGroup  *library_group;
+    guint            library_merge_id;
     GtkEntry        *filter_entry;
+    GtkWidget       *info_bar;
+    GtkWidget       *info_label;
+    GtkWidget       *undo_bar;
+    GtkWidget       *undo_label;
+    GtkListStore    *removed_store;
 
     GtkWidget       *view;
     GtkTreeView     *tree_view;
     GtkIconView     *icon_view;
+    GtkTreeView     *facet_view;
 
     gint             width;
     gint             height;
+    guint            cover_source;
+    guint            filter_source;
+    guint            undo_source;
+    guint            verify_source;
+    GCancellable    *verify_cancellable;
+
+    /* Books of the last removal, until it is undone or purged */
+    GArray          *removed_ids;
+
+    /* Name of the library shown, "" for the default one */
+    gchar           *library;
 
     BooksCollection *collection;
+    BooksScanner    *scanner;
+
+    /* Catalog for e-readers, NULL unless sharing is turned on */
+    BooksOpdsServer *opds_server;
 };
 
 static GtkActionEntry action_entries[] = {
     { "Books", NULL, N_("Books") },
     { "Edit",  NULL, N_("Edit") },
     { "View",  NULL, N_("View") },
+    { "Library", NULL, N_("Library") },
     { "Help",  NULL, N_("Help") },
 
     { "BookAdd", GTK_STOCK_ADD, N_("Add Books..."), "<control>O",
       N_("Add a book to the collection"),
       G_CALLBACK (action_add_book) },
 
-    { "BookRemove", GTK_STOCK_REMOVE, N_("Remove Book"), "Delete",
-      N_("Remove selected book from the collection"),
+    { "BookRemove", GTK_STOCK_REMOVE, N_("Remove Books"), "Delete",
+      N_("Remove selected books from the collection"),
       G_CALLBACK (action_remove_selected_book) },
 
+    { "ShelfAdd", NULL, N_("Add to Shelf..."), "<control>T",
+      N_("Put selected books on a shelf"),
+      G_CALLBACK (action_add_to_shelf) },
+
+    { "ShelfRemove", NULL, N_("Remove from Shelf..."), "",
+      N_("Take selected books off a shelf"),
+      G_CALLBACK (action_remove_from_shelf) },
+
     { "BookPreferences", GTK_STOCK_PREFERENCES, N_("Preferences"), "",
       N_("Preferences"),
       G_CALLBACK (action_preferences) },
@@ -73,6 +129,11 @@ enum {
     VIEW_LIST
 };
 
+enum {
+    INFO_RESPONSE_DETAILS = 1,
+    INFO_RESPONSE_UNDO
+};
+
 static GtkRadioActionEntry view_entries[] = {
     /* Same terminology as in Nautilus */
     { "ViewIcon", GTK_STOCK_REMOVE, N_("Symbols"), "<control>1",
@@ -83,8 +144,25 @@ static GtkRadioActionEntry view_entries[] = {
       VIEW_LIST },
 };
 
+/* Values are the sort column ids of the collection */
+static GtkRadioActionEntry sort_entries[] = {
+    { "SortNone", NULL, N_("Unsorted"), NULL,
+      N_("Show books in the order they were added"),
+      GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID },
+    { "SortAuthor", NULL, N_("By Author"), NULL,
+      N_("Sort books by author and title"),
+      BOOKS_COLLECTION_AUTHOR_COLUMN },
+    { "SortTitle", NULL, N_("By Title"), NULL,
+      N_("Sort books by title"),
+      BOOKS_COLLECTION_TITLE_COLUMN },
+    { "SortSeries", NULL, N_("By Series"), NULL,
+      N_("Sort books by series and their position in it"),
+      BOOKS_COLLECTION_SERIES_COLUMN },
+};
+
 static gint n_action_entries = G_N_ELEMENTS (action_entries);
 static gint n_view_entries = G_N_ELEMENTS (view_entries);
+static gint n_sort_entries = G_N_ELEMENTS (sort_entries);
 
 GtkWidget *
 books_main_window_new (void)
@@ -92,6 +170,36 @@ books_main_window_new (void)
     return GTK_WIDGET (g_object_new (BOOKS_TYPE_MAIN_WINDOW, NULL));
 }
 
+static gboolean
+update_visible_covers (BooksMainWindowPrivate *priv)
+{
+    GtkTreePath *start;
+    GtkTreePath *end;
+
+    priv->cover_source = 0;
+
+    /* The list does not show covers */
+    if (priv->view != GTK_WIDGET (priv->icon_view))
+        return FALSE;
+
+    if (gtk_icon_view_get_visible_range (priv->icon_view, &start, &end)) {
+        books_collection_request_covers (priv->collection, start, end);
+        gtk_tree_path_free (start);
+        gtk_tree_path_free (end);
+    }
+
+    return FALSE;
+}
+
+static void
+schedule_cover_update (GtkAdjustment *adjustment,
+                       BooksMainWindowPrivate *priv)
+{
+    /* After the icon view has laid out and drawn the new range */
+    if (priv->cover_source == 0)
+        priv->cover_source = g_idle_add_full (G_PRIORITY_LOW, (GSourceFunc) update_visible_covers, priv, NULL);
+}
+
 static void
 action_view_changed (GtkRadioAction *action,
                      GtkRadioAction *current,
@@ -104,28 +212,118 @@ action_view_changed (GtkRadioAction *action,
     if (!g_strcmp0 (gtk_action_get_name (GTK_ACTION (current)), "ViewIcon")) {
         gtk_widget_show (GTK_WIDGET (priv->icon_scroll));
         gtk_widget_hide (GTK_WIDGET (priv->list_scroll));
+        priv->view = GTK_WIDGET (priv->icon_view);
+        schedule_cover_update (NULL, priv);
     }
     else {
         gtk_widget_show (GTK_WIDGET (priv->list_scroll));
         gtk_widget_hide (GTK_WIDGET (priv->icon_scroll));
+        priv->view = GTK_WIDGET (priv->tree_view);
     }
 }
 
 static void
-import_book (gchar *path,
-             BooksMainWindowPrivate *priv)
+action_sort_changed (GtkRadioAction *action,
+                     GtkRadioAction *current,
+                     BooksMainWindow *window)
+{
+    GtkTreeSortable *sortable;
+    gint sort_column_id;
+
+    sortable = GTK_TREE_SORTABLE (books_collection_get_model (window->priv->collection));
+    gtk_tree_sortable_get_sort_column_id (sortable, &sort_column_id, NULL);
+
+    /* Keeps the direction chosen with a header click of the list */
+    if (sort_column_id != gtk_radio_action_get_current_value (current))
+        gtk_tree_sortable_set_sort_column_id (sortable,
+                                              gtk_radio_action_get_current_value (current),
+                                              GTK_SORT_ASCENDING);
+}
+
+static void
+on_sort_column_changed (GtkTreeSortable *sortable,
+                        BooksMainWindowPrivate *priv)
+{
+    GtkAction *action;
+    gint sort_column_id;
+
+    gtk_tree_sortable_get_sort_column_id (sortable, &sort_column_id, NULL);
+    action = gtk_action_group_get_action (priv->action_group, "SortNone");
+    gtk_radio_action_set_current_value (GTK_RADIO_ACTION (action), sort_column_id);
+}
+
+static void
+on_facet_selection_changed (GtkTreeSelection *selection,
+                            BooksMainWindowPrivate *priv)
+{
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    BooksFacetKind kind = BOOKS_FACET_AUTHOR;
+    gchar *value = NULL;
+
+    /* Selecting a kind itself shows all books again */
+    if (gtk_tree_selection_get_selected (selection, &model, &iter))
+        gtk_tree_model_get (model, &iter,
+                            BOOKS_FACETS_KIND_COLUMN, &kind,
+                            BOOKS_FACETS_VALUE_COLUMN, &value,
+                            -1);
+
+    books_collection_set_facet (priv->collection, kind, value);
+    g_free (value);
+}
+
+static void
+show_duplicates (BooksMainWindow *window,
+                 GPtrArray *duplicates)
+{
+    GtkDialog *dialog;
+
+    dialog = books_duplicates_dialog_new (window->priv->collection, duplicates);
+    gtk_window_set_transient_for (GTK_WINDOW (dialog), GTK_WINDOW (window));
+    gtk_widget_show (GTK_WIDGET (dialog));
+}
+
+static void
+on_duplicates_found (BooksScanner *scanner,
+                     GPtrArray *duplicates,
+                     BooksMainWindow *window)
+{
+    show_duplicates (window, duplicates);
+}
+
+static void
+import_book (const gchar *path,
+             BooksMainWindowPrivate *priv,
+             GPtrArray *duplicates)
 {
     BooksEpub *epub;
+    BooksDuplicate *duplicate;
+    gchar *content_hash;
     GError *error = NULL;
 
+    content_hash = books_content_hash_compute (path, NULL, &error);
+
+    if (content_hash == NULL) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        return;
+    }
+
     epub = books_epub_new ();
 
-    if (books_epub_open (epub, path, &error))
-        books_collection_add_book (priv->collection, epub, path);
-    else
+    if (books_epub_open (epub, path, &error)) {
+        duplicate = books_collection_add_unique_book (priv->collection, epub, path, content_hash);
+
+        if (duplicate != NULL)
+            g_ptr_array_add (duplicates, duplicate);
+    }
+    else {
         g_printerr ("%s\n", error->message);
+        g_error_free (error);
+    }
 
     g_object_unref (epub);
+    g_free (content_hash);
 }
 
 static void
@@ -148,30 +346,89 @@ action_add_book (GtkAction *action,
     gtk_file_chooser_set_filter (GTK_FILE_CHOOSER (chooser), filter);
 
     if (gtk_dialog_run (GTK_DIALOG (chooser)) == GTK_RESPONSE_ACCEPT) {
-        BooksMainWindowPrivate *priv;
+        GPtrArray *duplicates;
         GSList *filenames;
+        GSList *it;
 
-        priv = window->priv;
+        duplicates = g_ptr_array_new_with_free_func ((GDestroyNotify) books_duplicate_free);
         filenames = gtk_file_chooser_get_filenames (GTK_FILE_CHOOSER (chooser));
-        g_slist_foreach (filenames, (GFunc) import_book, priv);
+
+        for (it = filenames; it != NULL; it = g_slist_next (it))
+            import_book (it->data, window->priv, duplicates);
+
+        if (duplicates->len > 0)
+            show_duplicates (window, duplicates);
+
+        g_ptr_array_unref (duplicates);
         g_slist_free_full (filenames, g_free);
     }
 
     gtk_widget_destroy (chooser);
 }
 
+/*
+ * Returns the ids of the selected books. Paths would become invalid once
+ * the books are changed.
+ */
+static GArray *
+get_selected_ids (BooksMainWindowPrivate *priv)
+{
+    GList *paths;
+    GList *it;
+    GArray *ids;
+
+    if (priv->view == GTK_WIDGET (priv->tree_view))
+        paths = gtk_tree_selection_get_selected_rows (gtk_tree_view_get_selection (priv->tree_view), NULL);
+    else
+        paths = gtk_icon_view_get_selected_items (priv->icon_view);
+
+    ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    for (it = g_list_first (paths); it != NULL; it = g_list_next (it)) {
+        gint64 id;
+
+        id = books_collection_get_book_id (priv->collection, it->data);
+
+        if (id >= 0)
+            g_array_append_val (ids, id);
+    }
+
+    g_list_free_full (paths, (GDestroyNotify) gtk_tree_path_free);
+    return ids;
+}
+
+/*
+ * Ends the undo period of the last removal. Its books are restored if
+ * @undo is %TRUE and deleted for good otherwise.
+ */
 static void
-remove_book_from_icon_view (GtkIconView *icon_view,
-                            GtkTreePath *path,
-                            BooksMainWindowPrivate *priv)
+finish_removal (BooksMainWindowPrivate *priv,
+                gboolean undo)
 {
-    GtkTreeModel *model;
-    GtkTreeIter iter;
+    if (priv->undo_source != 0) {
+        g_source_remove (priv->undo_source);
+        priv->undo_source = 0;
+    }
 
-    model = books_collection_get_model (priv->collection);
+    if (priv->removed_ids == NULL)
+        return;
+
+    if (undo)
+        books_collection_restore_books (priv->collection, priv->removed_ids);
+    else
+        books_collection_purge_removed_books (priv->collection);
+
+    g_array_free (priv->removed_ids, TRUE);
+    priv->removed_ids = NULL;
+    gtk_widget_hide (priv->undo_bar);
+}
 
-    if (gtk_tree_model_get_iter (model, &iter, path))
-        books_collection_remove_book (priv->collection, &iter);
+static gboolean
+on_undo_timeout (BooksMainWindowPrivate *priv)
+{
+    priv->undo_source = 0;
+    finish_removal (priv, FALSE);
+    return FALSE;
 }
 
 static void
@@ -179,21 +436,114 @@ action_remove_selected_book (GtkAction *action,
                              BooksMainWindow *window)
 {
     BooksMainWindowPrivate *priv;
-    GtkTreeSelection *selection;
-    GtkTreeModel *model;
-    GtkTreeIter iter;
+    GArray *ids;
+    gchar *message;
 
     priv = window->priv;
+    ids = get_selected_ids (priv);
+
+    if (ids->len == 0) {
+        g_array_free (ids, TRUE);
+        return;
+    }
+
+    /* Only the last removal can be undone */
+    finish_removal (priv, FALSE);
+
+    books_collection_remove_books (priv->collection, ids);
+    priv->removed_ids = ids;
 
-    if (priv->view == GTK_WIDGET (priv->tree_view)) {
-        selection = gtk_tree_view_get_selection (priv->tree_view);
+    message = g_strdup_printf (ngettext ("%i book removed.", "%i books removed.", ids->len), ids->len);
+    gtk_label_set_text (GTK_LABEL (priv->undo_label), message);
+    gtk_widget_show (priv->undo_bar);
+    g_free (message);
+
+    priv->undo_source = g_timeout_add_seconds (UNDO_TIMEOUT, (GSourceFunc) on_undo_timeout, priv);
+}
 
-        if (gtk_tree_selection_get_selected (selection, &model, &iter))
-            books_collection_remove_book (priv->collection, &iter);
+/*
+ * Asks for the name of a shelf, offering the existing ones. Returns
+ * %NULL if the dialog was cancelled.
+ */
+static gchar *
+ask_for_shelf (BooksMainWindow *window,
+               const gchar *title,
+               const gchar *button)
+{
+    GtkWidget *dialog;
+    GtkWidget *content_area;
+    GtkWidget *combo;
+    gchar **shelves;
+    gchar *shelf = NULL;
+    guint i;
+
+    dialog = gtk_dialog_new_with_buttons (title, GTK_WINDOW (window),
+                                          GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                          GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                                          button, GTK_RESPONSE_ACCEPT,
+                                          NULL);
+
+    gtk_dialog_set_default_response (GTK_DIALOG (dialog), GTK_RESPONSE_ACCEPT);
+
+    combo = gtk_combo_box_text_new_with_entry ();
+    shelves = books_collection_get_shelves (window->priv->collection);
+
+    for (i = 0; shelves[i] != NULL; i++)
+        gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), shelves[i]);
+
+    g_strfreev (shelves);
+    gtk_entry_set_activates_default (GTK_ENTRY (gtk_bin_get_child (GTK_BIN (combo))), TRUE);
+
+    content_area = gtk_dialog_get_content_area (GTK_DIALOG (dialog));
+    gtk_container_set_border_width (GTK_CONTAINER (content_area), 12);
+    gtk_box_pack_start (GTK_BOX (content_area), combo, FALSE, FALSE, 0);
+    gtk_widget_show (combo);
+
+    if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT) {
+        shelf = g_strstrip (gtk_combo_box_text_get_active_text (GTK_COMBO_BOX_TEXT (combo)));
+
+        if (*shelf == '\0') {
+            g_free (shelf);
+            shelf = NULL;
+        }
     }
-    else {
-        gtk_icon_view_selected_foreach (priv->icon_view, (GtkIconViewForeachFunc) remove_book_from_icon_view, priv);
+
+    gtk_widget_destroy (dialog);
+    return shelf;
+}
+
+static void
+action_add_to_shelf (GtkAction *action,
+                     BooksMainWindow *window)
+{
+    GArray *ids;
+    gchar *shelf;
+
+    ids = get_selected_ids (window->priv);
+
+    if (ids->len > 0 && (shelf = ask_for_shelf (window, _("Add to Shelf"), GTK_STOCK_ADD)) != NULL) {
+        books_collection_add_to_shelf (window->priv->collection, ids, shelf);
+        g_free (shelf);
     }
+
+    g_array_free (ids, TRUE);
+}
+
+static void
+action_remove_from_shelf (GtkAction *action,
+                          BooksMainWindow *window)
+{
+    GArray *ids;
+    gchar *shelf;
+
+    ids = get_selected_ids (window->priv);
+
+    if (ids->len > 0 && (shelf = ask_for_shelf (window, _("Remove from Shelf"), GTK_STOCK_REMOVE)) != NULL) {
+        books_collection_remove_from_shelf (window->priv->collection, ids, shelf);
+        g_free (shelf);
+    }
+
+    g_array_free (ids, TRUE);
 }
 
 static void
@@ -240,18 +590,38 @@ open_selected_book (BooksMainWindowPrivate *priv,
                     GtkTreePath *path)
 {
     BooksEpub *epub;
+    GtkTreeModel *model;
+    GtkTreeIter iter;
     GError *error = NULL;
 
     epub = books_collection_get_book (priv->collection, path, &error);
 
     if (epub != NULL) {
         GtkWidget *book_window;
+        gchar *filename;
+
+        model = books_collection_get_model (priv->collection);
+        gtk_tree_model_get_iter (model, &iter, path);
+        gtk_tree_model_get (model, &iter, BOOKS_COLLECTION_PATH_COLUMN, &filename, -1);
 
         book_window = books_window_new ();
-        books_window_set_epub (BOOKS_WINDOW (book_window), epub);
+        books_window_set_book (BOOKS_WINDOW (book_window), epub, priv->collection, filename);
+        g_free (filename);
         gtk_widget_set_size_request (book_window, 594, 841);
         gtk_widget_show_all (book_window);
     }
+    else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_HOST_UNREACHABLE)) {
+        GtkWidget *dialog;
+
+        dialog = gtk_message_dialog_new (GTK_WINDOW (gtk_widget_get_toplevel (priv->view)),
+                                         GTK_DIALOG_DESTROY_WITH_PARENT,
+                                         GTK_MESSAGE_WARNING, GTK_BUTTONS_CLOSE,
+                                         "%s", error->message);
+        g_signal_connect (dialog, "response", G_CALLBACK (gtk_widget_destroy), NULL);
+        gtk_widget_show (dialog);
+    }
+
+    g_clear_error (&error);
 }
 
 static void
@@ -271,6 +641,25 @@ on_item_activated (GtkIconView *icon_view,
     open_selected_book (priv, path);
 }
 
+static gboolean
+apply_filter (BooksMainWindowPrivate *priv)
+{
+    priv->filter_source = 0;
+    g_object_set (priv->collection, "filter-term", gtk_entry_get_text (priv->filter_entry), NULL);
+    return FALSE;
+}
+
+static void
+on_filter_changed (GtkEntry *entry,
+                   BooksMainWindowPrivate *priv)
+{
+    /* Filter once the user pauses typing, not on every keystroke */
+    if (priv->filter_source != 0)
+        g_source_remove (priv->filter_source);
+
+    priv->filter_source = g_timeout_add (FILTER_DELAY_MS, (GSourceFunc) apply_filter, priv);
+}
+
 static void
 on_window_resize (GtkContainer *container,
                   BooksMainWindowPrivate *priv)
@@ -291,6 +680,312 @@ on_window_resize (GtkContainer *container,
     }
 }
 
+static void
+on_books_removed (BooksCollection *collection,
+                  gchar **paths,
+                  BooksMainWindow *window)
+{
+    BooksMainWindowPrivate *priv;
+    gchar *message;
+    guint i;
+
+    priv = window->priv;
+
+    for (i = 0; paths[i] != NULL; i++) {
+        GtkTreeIter iter;
+
+        gtk_list_store_append (priv->removed_store, &iter);
+        gtk_list_store_set (priv->removed_store, &iter, 0, paths[i], -1);
+    }
+
+    i = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (priv->removed_store), NULL);
+    message = g_strdup_printf (ngettext ("%i book could not be found and was removed from your collection.",
+                                         "%i books could not be found and were removed from your collection.",
+                                         i), i);
+
+    gtk_label_set_text (GTK_LABEL (priv->info_label), message);
+    gtk_widget_show (priv->info_bar);
+    g_free (message);
+}
+
+static void
+on_info_bar_response (GtkInfoBar *info_bar,
+                      gint response_id,
+                      BooksMainWindow *window)
+{
+    BooksMainWindowPrivate *priv;
+
+    priv = window->priv;
+
+    if (response_id == INFO_RESPONSE_DETAILS) {
+        GtkDialog *dialog;
+
+        dialog = books_removed_dialog_new (GTK_TREE_MODEL (priv->removed_store));
+        gtk_window_set_transient_for (GTK_WINDOW (dialog), GTK_WINDOW (window));
+        gtk_widget_show (GTK_WIDGET (dialog));
+
+        /* The dialog holds its own reference to the current list */
+        g_object_unref (priv->removed_store);
+        priv->removed_store = gtk_list_store_new (1, G_TYPE_STRING);
+    }
+    else {
+        gtk_list_store_clear (priv->removed_store);
+    }
+
+    gtk_widget_hide (GTK_WIDGET (info_bar));
+}
+
+static void
+on_undo_bar_response (GtkInfoBar *info_bar,
+                      gint response_id,
+                      BooksMainWindowPrivate *priv)
+{
+    finish_removal (priv, response_id == INFO_RESPONSE_UNDO);
+}
+
+/* Libraries on disks that are not mounted cannot be opened */
+static gboolean
+is_library_available (const gchar *database)
+{
+    gchar *folder;
+    gboolean available;
+
+    if (database == NULL)
+        return TRUE;
+
+    folder = g_path_get_dirname (database);
+    available = g_file_test (folder, G_FILE_TEST_IS_DIR);
+    g_free (folder);
+
+    return available;
+}
+
+static void
+on_library_action_toggled (GtkToggleAction *action,
+                           BooksMainWindowPrivate *priv)
+{
+    if (gtk_toggle_action_get_active (action))
+        g_settings_set_string (priv->settings, "library", g_object_get_data (G_OBJECT (action), "library"));
+}
+
+/*
+ * Lists the registered libraries in the library menu, the default one
+ * first, and marks the one shown.
+ */
+static void
+update_library_actions (BooksMainWindowPrivate *priv)
+{
+    GSList *group = NULL;
+    gchar **names;
+    guint i;
+
+    if (priv->library_group != NULL) {
+        gtk_ui_manager_remove_ui (priv->manager, priv->library_merge_id);
+        gtk_ui_manager_remove_action_group (priv->manager, priv->library_group);
+        g_object_unref (priv->library_group);
+    }
+
+    priv->library_group = gtk_action_group_new ("LibraryActions");
+    priv->library_merge_id = gtk_ui_manager_new_merge_id (priv->manager);
+    gtk_ui_manager_insert_action_group (priv->manager, priv->library_group, -1);
+
+    names = books_libraries_get_names (priv->settings);
+
+    for (i = 0; names[i] != NULL; i++) {
+        GtkRadioAction *action;
+        gchar *action_name;
+
+        action_name = g_strdup_printf ("Library%u", i);
+        action = gtk_radio_action_new (action_name, *names[i] != '\0' ? names[i] : _("Default Library"),
+                                       NULL, NULL, i);
+
+        gtk_radio_action_set_group (action, group);
+        group = gtk_radio_action_get_group (action);
+
+        /* Marked before connecting, this is no request to switch */
+        if (!g_strcmp0 (names[i], priv->library))
+            gtk_toggle_action_set_active (GTK_TOGGLE_ACTION (action), TRUE);
+
+        g_object_set_data_full (G_OBJECT (action), "library", g_strdup (names[i]), g_free);
+        g_signal_connect (action, "toggled",
+                          G_CALLBACK (on_library_action_toggled), priv);
+
+        gtk_action_group_add_action (priv->library_group, GTK_ACTION (action));
+        gtk_ui_manager_add_ui (priv->manager, priv->library_merge_id,
+                               "/MenuBar/LibraryMenu/Libraries", action_name, action_name,
+                               GTK_UI_MANAGER_MENUITEM, FALSE);
+
+        g_object_unref (action);
+        g_free (action_name);
+    }
+
+    g_strfreev (names);
+}
+
+static gboolean
+check_missing_books (BooksMainWindow *window)
+{
+    BooksMainWindowPrivate *priv;
+
+    priv = window->priv;
+    books_collection_check_missing_books (priv->collection,
+                                          g_settings_get_enum (priv->settings, "library-location"));
+    return FALSE;
+}
+
+static gboolean
+start_verification (BooksMainWindowPrivate *priv)
+{
+    guint rate;
+
+    priv->verify_source = 0;
+    rate = g_settings_get_uint (priv->settings, "verify-rate");
+
+    if (rate > 0) {
+        priv->verify_cancellable = g_cancellable_new ();
+        books_collection_verify_books (priv->collection, (guint64) rate * 1024, priv->verify_cancellable);
+    }
+
+    return FALSE;
+}
+
+static void
+stop_verification (BooksMainWindowPrivate *priv)
+{
+    if (priv->verify_source != 0) {
+        g_source_remove (priv->verify_source);
+        priv->verify_source = 0;
+    }
+
+    if (priv->verify_cancellable != NULL) {
+        g_cancellable_cancel (priv->verify_cancellable);
+        g_clear_object (&priv->verify_cancellable);
+    }
+}
+
+/* Verifying waits until starting up or switching has settled down */
+static void
+schedule_verification (BooksMainWindowPrivate *priv)
+{
+    stop_verification (priv);
+    priv->verify_source = g_timeout_add_seconds_full (G_PRIORITY_LOW, VERIFY_DELAY,
+                                                      (GSourceFunc) start_verification, priv, NULL);
+}
+
+static void
+stop_opds_server (BooksMainWindowPrivate *priv)
+{
+    if (priv->opds_server != NULL) {
+        books_opds_server_stop (priv->opds_server);
+        g_clear_object (&priv->opds_server);
+    }
+}
+
+static void
+update_opds_server (BooksMainWindowPrivate *priv)
+{
+    GError *error = NULL;
+    guint16 port;
+
+    stop_opds_server (priv);
+
+    if (!g_settings_get_boolean (priv->settings, "opds-server"))
+        return;
+
+    g_settings_get (priv->settings, "opds-port", "q", &port);
+    priv->opds_server = books_opds_server_new ();
+    books_opds_server_set_database (priv->opds_server, books_collection_get_database (priv->collection));
+
+    if (!books_opds_server_start (priv->opds_server, port, &error)) {
+        g_warning ("Could not share the library on port %u: %s", port, error->message);
+        g_error_free (error);
+        g_clear_object (&priv->opds_server);
+    }
+}
+
+static void
+on_opds_settings_changed (GSettings *settings,
+                          const gchar *key,
+                          BooksMainWindow *window)
+{
+    update_opds_server (window->priv);
+}
+
+/*
+ * Shows the library selected in the settings. The views are detached
+ * meanwhile, every row of both libraries changes and nobody has to
+ * follow that row by row.
+ */
+static void
+apply_library (BooksMainWindow *window)
+{
+    BooksMainWindowPrivate *priv;
+    GtkTreeModel *model;
+    gchar *library;
+    gchar *database;
+
+    priv = window->priv;
+    library = books_libraries_get_active (priv->settings);
+
+    if (!g_strcmp0 (library, priv->library)) {
+        update_library_actions (priv);
+        g_free (library);
+        return;
+    }
+
+    database = books_libraries_get_database (priv->settings, library);
+
+    if (!is_library_available (database)) {
+        GtkWidget *dialog;
+
+        dialog = gtk_message_dialog_new (GTK_WINDOW (window), GTK_DIALOG_DESTROY_WITH_PARENT,
+                                         GTK_MESSAGE_WARNING, GTK_BUTTONS_CLOSE,
+                                         _("The library “%s” is not available."), library);
+        gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog),
+                                                  _("The folder of %s could not be found."), database);
+        g_signal_connect (dialog, "response", G_CALLBACK (gtk_widget_destroy), NULL);
+        gtk_widget_show (dialog);
+
+        /* Reverting runs through here again and marks the shown library */
+        g_settings_set_string (priv->settings, "library", priv->library);
+        g_free (database);
+        g_free (library);
+        return;
+    }
+
+    /* Removed books belong to the library they were removed from */
+    finish_removal (priv, FALSE);
+
+    model = books_collection_get_model (priv->collection);
+    gtk_tree_view_set_model (priv->tree_view, NULL);
+    gtk_icon_view_set_model (priv->icon_view, NULL);
+
+    g_object_set (priv->collection, "library", database, NULL);
+
+    if (priv->opds_server != NULL)
+        books_opds_server_set_database (priv->opds_server, books_collection_get_database (priv->collection));
+
+    gtk_tree_view_set_model (priv->tree_view, model);
+    gtk_icon_view_set_model (priv->icon_view, model);
+
+    g_free (priv->library);
+    priv->library = library;
+    update_library_actions (priv);
+    schedule_cover_update (NULL, priv);
+    check_missing_books (window);
+    schedule_verification (priv);
+
+    g_free (database);
+}
+
+static void
+on_library_settings_changed (GSettings *settings,
+                             const gchar *key,
+                             BooksMainWindow *window)
+{
+    apply_library (window);
+}
+
 static void
 books_main_window_dispose (GObject *object)
 {
@@ -300,6 +995,25 @@ books_main_window_dispose (GObject *object)
 
     g_settings_set (priv->settings, "main-window-size",
                     "(ii)", priv->width, priv->height);
+    g_signal_handlers_disconnect_by_data (priv->settings, object);
+
+    g_clear_object (&priv->scanner);
+    g_clear_object (&priv->removed_store);
+    g_clear_object (&priv->library_group);
+
+    if (priv->cover_source != 0) {
+        g_source_remove (priv->cover_source);
+        priv->cover_source = 0;
+    }
+
+    if (priv->filter_source != 0) {
+        g_source_remove (priv->filter_source);
+        priv->filter_source = 0;
+    }
+
+    stop_verification (priv);
+    stop_opds_server (priv);
+    finish_removal (priv, FALSE);
 
     G_OBJECT_CLASS (books_main_window_parent_class)->dispose (object);
 }
@@ -307,6 +1021,11 @@ books_main_window_dispose (GObject *object)
 static void
 books_main_window_finalize (GObject *object)
 {
+    BooksMainWindowPrivate *priv;
+
+    priv = BOOKS_MAIN_WINDOW_GET_PRIVATE (object);
+    g_free (priv->library);
+
     G_OBJECT_CLASS (books_main_window_parent_class)->finalize (object);
 }
 
@@ -333,12 +1052,20 @@ books_main_window_init (BooksMainWindow *window)
     GtkTreeModel        *model;
     GtkTreeViewColumn   *author_column;
     GtkTreeViewColumn   *title_column;
+    GtkTreeViewColumn   *series_column;
     GtkCellRenderer     *renderer;
     GtkTreeSelection    *selection;
     GtkContainer        *scroll_box;
+    GtkWidget           *paned;
+    GtkWidget           *facet_scroll;
+    GtkAdjustment       *vadjustment;
+    GList               *cells;
+    GList               *it;
     GBytes              *bytes;
+    gchar               *database;
     gsize                size;
     const gchar         *ui_data;
+    gint                 view;
     GError              *error = NULL;
 
     window->priv = priv = BOOKS_MAIN_WINDOW_GET_PRIVATE (window);
@@ -348,16 +1075,42 @@ books_main_window_init (BooksMainWindow *window)
     g_settings_get (priv->settings, "main-window-size", "(ii)", &priv->width, &priv->height);
     gtk_window_set_default_size (GTK_WINDOW (window), priv->width, priv->height);
 
-    /* Create book collection */
-    priv->collection = books_collection_new ();
+    /* Create book collection and watch the library folders */
+    priv->library = books_libraries_get_active (priv->settings);
+    database = books_libraries_get_database (priv->settings, priv->library);
+
+    if (!is_library_available (database)) {
+        g_free (priv->library);
+        g_free (database);
+        priv->library = g_strdup ("");
+        database = NULL;
+    }
+
+    priv->collection = books_collection_new (database);
+    g_free (database);
+    priv->scanner = books_scanner_new (priv->collection);
+    priv->cover_source = 0;
+    priv->filter_source = 0;
+    priv->undo_source = 0;
+    priv->verify_source = 0;
+    priv->verify_cancellable = NULL;
+    priv->removed_ids = NULL;
+    priv->opds_server = NULL;
+
+    model = books_collection_get_model (priv->collection);
+    view = gtk_tree_model_iter_n_children (model, NULL) > MAX_ICON_VIEW_BOOKS ? VIEW_LIST : VIEW_ICONS;
 
     /* Create actions */
     priv->action_group = gtk_action_group_new ("MainActions");
     gtk_action_group_set_translation_domain (priv->action_group, GETTEXT_PACKAGE);
     gtk_action_group_add_actions (priv->action_group, action_entries, n_action_entries, window);
     gtk_action_group_add_radio_actions (priv->action_group,
-                                        view_entries, n_view_entries, VIEW_ICONS,
+                                        view_entries, n_view_entries, view,
                                         G_CALLBACK (action_view_changed), window);
+    gtk_action_group_add_radio_actions (priv->action_group,
+                                        sort_entries, n_sort_entries,
+                                        GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID,
+                                        G_CALLBACK (action_sort_changed), window);
 
     priv->manager = gtk_ui_manager_new ();
     bytes = g_resources_lookup_data ("/com/github/matze/books/ui/books.xml", 0, &error);
@@ -378,6 +1131,9 @@ books_main_window_init (BooksMainWindow *window)
 
     g_bytes_unref (bytes);
 
+    priv->library_group = NULL;
+    update_library_actions (priv);
+
     accel_group = gtk_ui_manager_get_accel_group (priv->manager);
     gtk_window_add_accel_group (GTK_WINDOW (window), accel_group);
 
@@ -406,14 +1162,45 @@ books_main_window_init (BooksMainWindow *window)
     priv->filter_entry = GTK_ENTRY (gtk_entry_new ());
 #endif
 
-    g_object_bind_property (priv->filter_entry, "text",
-                            priv->collection, "filter-term",
-                            0);
+    gtk_widget_set_tooltip_text (GTK_WIDGET (priv->filter_entry),
+                                 _("Filter by author and title. Narrow down to shelves with "
+                                   "shelf:name, shelf:one,other or -shelf:name."));
+
+    g_signal_connect (priv->filter_entry, "changed",
+                      G_CALLBACK (on_filter_changed), priv);
+
+    /* Create info bar for notifications that must not block */
+    priv->info_bar = gtk_info_bar_new_with_buttons (_("Details"), INFO_RESPONSE_DETAILS,
+                                                    GTK_STOCK_CLOSE, GTK_RESPONSE_CLOSE,
+                                                    NULL);
+    gtk_info_bar_set_message_type (GTK_INFO_BAR (priv->info_bar), GTK_MESSAGE_INFO);
+    gtk_widget_set_no_show_all (priv->info_bar, TRUE);
+
+    priv->info_label = gtk_label_new (NULL);
+    gtk_label_set_line_wrap (GTK_LABEL (priv->info_label), TRUE);
+    gtk_widget_set_halign (priv->info_label, GTK_ALIGN_START);
+    gtk_widget_show (priv->info_label);
+    gtk_container_add (GTK_CONTAINER (gtk_info_bar_get_content_area (GTK_INFO_BAR (priv->info_bar))),
+                       priv->info_label);
+
+    priv->removed_store = gtk_list_store_new (1, G_TYPE_STRING);
+
+    /* Removals are only final once this bar goes away */
+    priv->undo_bar = gtk_info_bar_new_with_buttons (_("_Undo"), INFO_RESPONSE_UNDO,
+                                                    GTK_STOCK_CLOSE, GTK_RESPONSE_CLOSE,
+                                                    NULL);
+    gtk_info_bar_set_message_type (GTK_INFO_BAR (priv->undo_bar), GTK_MESSAGE_INFO);
+    gtk_widget_set_no_show_all (priv->undo_bar, TRUE);
+
+    priv->undo_label = gtk_label_new (NULL);
+    gtk_widget_set_halign (priv->undo_label, GTK_ALIGN_START);
+    gtk_widget_show (priv->undo_label);
+    gtk_container_add (GTK_CONTAINER (gtk_info_bar_get_content_area (GTK_INFO_BAR (priv->undo_bar))),
+                       priv->undo_label);
 
     /* Create book view */
     scroll_box = GTK_CONTAINER (gtk_box_new (GTK_ORIENTATION_VERTICAL, 0));
 
-    model = books_collection_get_model (priv->collection);
     priv->tree_view = GTK_TREE_VIEW (gtk_tree_view_new_with_model (model));
     g_object_ref (priv->tree_view);
     gtk_widget_set_vexpand (GTK_WIDGET (priv->tree_view), TRUE);
@@ -422,39 +1209,102 @@ books_main_window_init (BooksMainWindow *window)
 
     author_column = gtk_tree_view_column_new_with_attributes (_("Author"), renderer,
             "text", BOOKS_COLLECTION_AUTHOR_COLUMN,
+            "sensitive", BOOKS_COLLECTION_AVAILABLE_COLUMN,
             NULL);
 
     gtk_tree_view_column_set_sort_column_id (author_column, BOOKS_COLLECTION_AUTHOR_COLUMN);
+    gtk_tree_view_column_set_sizing (author_column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width (author_column, 250);
+    gtk_tree_view_column_set_resizable (author_column, TRUE);
     gtk_tree_view_append_column (priv->tree_view, author_column);
 
     title_column = gtk_tree_view_column_new_with_attributes (_("Title"), renderer,
             "text", BOOKS_COLLECTION_TITLE_COLUMN,
+            "sensitive", BOOKS_COLLECTION_AVAILABLE_COLUMN,
             NULL);
 
     gtk_tree_view_column_set_sort_column_id (title_column, BOOKS_COLLECTION_TITLE_COLUMN);
+    gtk_tree_view_column_set_sizing (title_column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width (title_column, 400);
+    gtk_tree_view_column_set_resizable (title_column, TRUE);
     gtk_tree_view_append_column (priv->tree_view, title_column);
 
+    series_column = gtk_tree_view_column_new_with_attributes (_("Series"), renderer,
+            "text", BOOKS_COLLECTION_SERIES_COLUMN,
+            "sensitive", BOOKS_COLLECTION_AVAILABLE_COLUMN,
+            NULL);
+
+    gtk_tree_view_column_set_sort_column_id (series_column, BOOKS_COLLECTION_SERIES_COLUMN);
+    gtk_tree_view_column_set_sizing (series_column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width (series_column, 200);
+    gtk_tree_view_column_set_resizable (series_column, TRUE);
+    gtk_tree_view_append_column (priv->tree_view, series_column);
+
+    /* Both views share the model, so the sort items apply to the list as well */
+    g_signal_connect (model, "sort-column-changed",
+                      G_CALLBACK (on_sort_column_changed), priv);
+
+    /* Rows are measured once instead of fetching every book from the model */
+    gtk_tree_view_set_fixed_height_mode (priv->tree_view, TRUE);
+    gtk_tree_view_set_tooltip_column (priv->tree_view, BOOKS_COLLECTION_PROBLEM_COLUMN);
+
     selection = gtk_tree_view_get_selection (priv->tree_view);
-    gtk_tree_selection_set_mode (selection, GTK_SELECTION_SINGLE);
+    gtk_tree_selection_set_mode (selection, GTK_SELECTION_MULTIPLE);
 
     /* Create icon view */
     priv->icon_view = GTK_ICON_VIEW (gtk_icon_view_new_with_model (model));
     g_object_ref (priv->icon_view);
 
     gtk_widget_set_vexpand (GTK_WIDGET (priv->icon_view), TRUE);
-    priv->view = GTK_WIDGET (priv->icon_view);
+    priv->view = view == VIEW_ICONS ? GTK_WIDGET (priv->icon_view) : GTK_WIDGET (priv->tree_view);
 
     gtk_icon_view_set_markup_column (priv->icon_view, BOOKS_COLLECTION_MARKUP_COLUMN);
     gtk_icon_view_set_pixbuf_column (priv->icon_view, BOOKS_COLLECTION_ICON_COLUMN);
+    gtk_icon_view_set_selection_mode (priv->icon_view, GTK_SELECTION_MULTIPLE);
+    gtk_icon_view_set_tooltip_column (priv->icon_view, BOOKS_COLLECTION_PROBLEM_COLUMN);
+
+    /* Books on an unreachable share are dimmed */
+    cells = gtk_cell_layout_get_cells (GTK_CELL_LAYOUT (priv->icon_view));
+
+    for (it = cells; it != NULL; it = g_list_next (it))
+        gtk_cell_layout_add_attribute (GTK_CELL_LAYOUT (priv->icon_view), it->data,
+                                       "sensitive", BOOKS_COLLECTION_AVAILABLE_COLUMN);
+
+    g_list_free (cells);
 
     priv->list_scroll = GTK_CONTAINER (gtk_scrolled_window_new (NULL, NULL));
     priv->icon_scroll = GTK_CONTAINER (gtk_scrolled_window_new (NULL, NULL));
 
+    /* Create facet side bar */
+    priv->facet_view = GTK_TREE_VIEW (gtk_tree_view_new_with_model (books_collection_get_facets (priv->collection)));
+    gtk_tree_view_set_headers_visible (priv->facet_view, FALSE);
+    gtk_tree_view_set_enable_search (priv->facet_view, TRUE);
+    gtk_tree_view_set_search_column (priv->facet_view, BOOKS_FACETS_VALUE_COLUMN);
+
+    renderer = gtk_cell_renderer_text_new ();
+    g_object_set (renderer, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+    gtk_tree_view_insert_column_with_attributes (priv->facet_view, -1, NULL, renderer,
+                                                 "markup", BOOKS_FACETS_LABEL_COLUMN,
+                                                 NULL);
+
+    facet_scroll = gtk_scrolled_window_new (NULL, NULL);
+    gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (facet_scroll),
+                                    GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_size_request (facet_scroll, 180, -1);
+
+    paned = gtk_paned_new (GTK_ORIENTATION_HORIZONTAL);
+
     /* Layout widgets */
     gtk_container_add (GTK_CONTAINER (window), priv->main_box);
     gtk_container_add (GTK_CONTAINER (priv->main_box), menubar);
     gtk_container_add (GTK_CONTAINER (priv->main_box), toolbar);
-    gtk_container_add (GTK_CONTAINER (priv->main_box), GTK_WIDGET (scroll_box));
+    gtk_container_add (GTK_CONTAINER (priv->main_box), priv->info_bar);
+    gtk_container_add (GTK_CONTAINER (priv->main_box), priv->undo_bar);
+    gtk_container_add (GTK_CONTAINER (priv->main_box), paned);
+
+    gtk_paned_pack1 (GTK_PANED (paned), facet_scroll, FALSE, FALSE);
+    gtk_paned_pack2 (GTK_PANED (paned), GTK_WIDGET (scroll_box), TRUE, FALSE);
+    gtk_container_add (GTK_CONTAINER (facet_scroll), GTK_WIDGET (priv->facet_view));
 
     gtk_container_add (GTK_CONTAINER (filter_item), GTK_WIDGET (priv->filter_entry));
 
@@ -468,8 +1318,10 @@ books_main_window_init (BooksMainWindow *window)
     gtk_widget_show (priv->main_box);
     gtk_widget_show_all (toolbar);
     gtk_widget_show_all (menubar);
+    gtk_widget_show (paned);
+    gtk_widget_show_all (facet_scroll);
     gtk_widget_show (GTK_WIDGET (scroll_box));
-    gtk_widget_show (GTK_WIDGET (priv->icon_scroll));
+    gtk_widget_show (view == VIEW_ICONS ? GTK_WIDGET (priv->icon_scroll) : GTK_WIDGET (priv->list_scroll));
     gtk_widget_show (GTK_WIDGET (priv->icon_view));
     gtk_widget_show (GTK_WIDGET (priv->tree_view));
 
@@ -480,6 +1332,50 @@ books_main_window_init (BooksMainWindow *window)
     g_signal_connect (priv->icon_view, "item-activated",
                       G_CALLBACK (on_item_activated), priv);
 
+    g_signal_connect (gtk_tree_view_get_selection (priv->facet_view), "changed",
+                      G_CALLBACK (on_facet_selection_changed), priv);
+
     g_signal_connect (window, "check-resize",
                       G_CALLBACK (on_window_resize), priv);
+
+    g_signal_connect (priv->info_bar, "response",
+                      G_CALLBACK (on_info_bar_response), window);
+
+    g_signal_connect (priv->undo_bar, "response",
+                      G_CALLBACK (on_undo_bar_response), priv);
+
+    g_signal_connect (priv->settings, "changed::library",
+                      G_CALLBACK (on_library_settings_changed), window);
+
+    g_signal_connect (priv->settings, "changed::libraries",
+                      G_CALLBACK (on_library_settings_changed), window);
+
+    g_signal_connect (priv->settings, "changed::opds-server",
+                      G_CALLBACK (on_opds_settings_changed), window);
+
+    g_signal_connect (priv->settings, "changed::opds-port",
+                      G_CALLBACK (on_opds_settings_changed), window);
+
+    g_signal_connect (priv->collection, "books-removed",
+                      G_CALLBACK (on_books_removed), window);
+
+    g_signal_connect (priv->scanner, "duplicates-found",
+                      G_CALLBACK (on_duplicates_found), window);
+
+    /* Scrolling as well as books coming and going change the visible covers */
+    vadjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (priv->icon_scroll));
+
+    g_signal_connect (vadjustment, "value-changed",
+                      G_CALLBACK (schedule_cover_update), priv);
+
+    g_signal_connect (vadjustment, "changed",
+                      G_CALLBACK (schedule_cover_update), priv);
+
+    /*
+     * Lower priority than redrawing, so the library is only checked for
+     * missing books once the window has been painted.
+     */
+    g_idle_add_full (G_PRIORITY_LOW, (GSourceFunc) check_missing_books, window, NULL);
+    schedule_verification (priv);
+    update_opds_server (priv);
 }
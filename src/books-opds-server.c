@@ -0,0 +1,1392 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "books-opds-server.h"
+#include "books-thumbnail.h"
+
+/*
+ * Serves the library as an OPDS catalog to e-readers on the network. Every
+ * client gets a thread of its own with a read-only connection to the
+ * database, nothing runs in the main loop but accepting. A page of a feed
+ * is read into memory in one short query and then written in chunks. It
+ * carries an ETag made from its rows, so an unchanged page costs no more
+ * than the query. Books are sent straight from the file to the socket by
+ * the kernel.
+ */
+
+G_DEFINE_TYPE(BooksOpdsServer, books_opds_server, G_TYPE_OBJECT)
+
+#define BOOKS_OPDS_SERVER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_OPDS_SERVER, BooksOpdsServerPrivate))
+
+/* Clients served at the same time, further ones wait */
+#define MAX_CLIENTS         256
+
+/* Seconds an idle connection is kept open */
+#define CLIENT_TIMEOUT      30
+
+/* Milliseconds to wait for the other connections to release the database */
+#define BUSY_TIMEOUT        5000
+
+/* Books in one page of a feed */
+#define PAGE_SIZE           50
+
+/* Bytes of a feed collected before they are sent as a chunk */
+#define CHUNK_SIZE          (16 * 1024)
+
+/* Bytes handed to the kernel at once when sending a file */
+#define SEND_SIZE           (1024 * 1024)
+
+#define MAX_LINE_LENGTH     8192
+#define MAX_HEADERS         64
+
+#define CATALOG_TYPE        "application/atom+xml;profile=opds-catalog;kind=acquisition"
+#define EPUB_TYPE           "application/epub+zip"
+#define ACQUISITION_REL     "http://opds-spec.org/acquisition"
+#define THUMBNAIL_REL       "http://opds-spec.org/image/thumbnail"
+
+struct _BooksOpdsServerPrivate {
+    GSocketService  *service;
+    gint             stopped;
+
+    /* Database of the library shown, read by the client threads */
+    GMutex           lock;
+    gchar           *db_path;
+};
+
+typedef struct {
+    gchar       *method;
+    gchar       *path;
+    gchar       *query;
+    gchar       *range;
+    gchar       *if_range;
+    gchar       *if_none_match;
+    gboolean     chunked;
+    gboolean     keep_alive;
+    gboolean     bad;
+} Request;
+
+typedef struct {
+    BooksOpdsServer     *server;
+    GSocketConnection   *connection;
+    GOutputStream       *output;
+    sqlite3             *db;
+    gchar               *db_path;
+} Client;
+
+/* A response body of unknown length, sent in chunks where possible */
+typedef struct {
+    Client      *client;
+    GString     *buffer;
+    gboolean     chunked;
+    gboolean     failed;
+} Body;
+
+typedef enum {
+    RANGE_NONE,
+    RANGE_VALID,
+    RANGE_INVALID
+} RangeResult;
+
+
+BooksOpdsServer *
+books_opds_server_new (void)
+{
+    return BOOKS_OPDS_SERVER (g_object_new (BOOKS_TYPE_OPDS_SERVER, NULL));
+}
+
+/**
+ * Serves the library in @db_path from now on, %NULL to serve none.
+ * Requests already running finish with the previous one.
+ */
+void
+books_opds_server_set_database (BooksOpdsServer *server,
+                                const gchar *db_path)
+{
+    BooksOpdsServerPrivate *priv;
+
+    g_return_if_fail (BOOKS_IS_OPDS_SERVER (server));
+
+    priv = server->priv;
+    g_mutex_lock (&priv->lock);
+    g_free (priv->db_path);
+    priv->db_path = g_strdup (db_path);
+    g_mutex_unlock (&priv->lock);
+}
+
+static gchar *
+read_line (GDataInputStream *input)
+{
+    gchar *line;
+    gsize length;
+
+    line = g_data_input_stream_read_line (input, &length, NULL, NULL);
+
+    if (line == NULL)
+        return NULL;
+
+    /* Nobody sends lines this long in good faith */
+    if (length > MAX_LINE_LENGTH) {
+        g_free (line);
+        return NULL;
+    }
+
+    if (length > 0 && line[length - 1] == '\r')
+        line[length - 1] = '\0';
+
+    return line;
+}
+
+static void
+clear_request (Request *request)
+{
+    g_free (request->method);
+    g_free (request->path);
+    g_free (request->query);
+    g_free (request->range);
+    g_free (request->if_range);
+    g_free (request->if_none_match);
+}
+
+static void
+parse_request_line (Request *request,
+                    const gchar *line)
+{
+    gchar **parts;
+    gchar *query;
+
+    parts = g_strsplit (line, " ", 3);
+
+    if (g_strv_length (parts) != 3 || !g_str_has_prefix (parts[2], "HTTP/1.")) {
+        request->bad = TRUE;
+        g_strfreev (parts);
+        return;
+    }
+
+    request->method = g_strdup (parts[0]);
+    request->path = g_strdup (parts[1]);
+    query = strchr (request->path, '?');
+
+    if (query != NULL) {
+        request->query = g_strdup (query + 1);
+        *query = '\0';
+    }
+
+    /* HTTP/1.0 knows neither chunks nor persistent connections by default */
+    request->chunked = !strcmp (parts[2], "HTTP/1.1");
+    request->keep_alive = request->chunked;
+    g_strfreev (parts);
+}
+
+static void
+parse_header (Request *request,
+              gchar *line)
+{
+    gchar *value;
+
+    value = strchr (line, ':');
+
+    if (value == NULL) {
+        request->bad = TRUE;
+        return;
+    }
+
+    *value = '\0';
+    value = g_strstrip (value + 1);
+
+    if (!g_ascii_strcasecmp (line, "Connection")) {
+        gchar *tokens;
+
+        tokens = g_ascii_strdown (value, -1);
+
+        if (strstr (tokens, "close") != NULL)
+            request->keep_alive = FALSE;
+        else if (strstr (tokens, "keep-alive") != NULL)
+            request->keep_alive = TRUE;
+
+        g_free (tokens);
+    }
+    else if (!g_ascii_strcasecmp (line, "Range")) {
+        g_free (request->range);
+        request->range = g_strdup (value);
+    }
+    else if (!g_ascii_strcasecmp (line, "If-Range")) {
+        g_free (request->if_range);
+        request->if_range = g_strdup (value);
+    }
+    else if (!g_ascii_strcasecmp (line, "If-None-Match")) {
+        g_free (request->if_none_match);
+        request->if_none_match = g_strdup (value);
+    }
+}
+
+/*
+ * Reads the next request of the connection. Returns %FALSE once the client
+ * has gone away or stayed silent for too long. Requests that make no sense
+ * are marked bad instead.
+ */
+static gboolean
+read_request (GDataInputStream *input,
+              Request *request)
+{
+    gchar *line;
+    guint n_headers = 0;
+
+    memset (request, 0, sizeof (Request));
+    line = read_line (input);
+
+    /* Some clients send an empty line after the previous request */
+    if (line != NULL && *line == '\0') {
+        g_free (line);
+        line = read_line (input);
+    }
+
+    if (line == NULL)
+        return FALSE;
+
+    parse_request_line (request, line);
+    g_free (line);
+
+    while ((line = read_line (input)) != NULL && *line != '\0') {
+        if (++n_headers > MAX_HEADERS)
+            request->bad = TRUE;
+        else
+            parse_header (request, line);
+
+        g_free (line);
+    }
+
+    if (line == NULL) {
+        clear_request (request);
+        return FALSE;
+    }
+
+    g_free (line);
+    return TRUE;
+}
+
+static gchar *
+get_http_date (void)
+{
+    static const gchar *days[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+    static const gchar *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    GDateTime *now;
+    gchar *date;
+
+    /* Names must not be translated, so strftime is of no use */
+    now = g_date_time_new_now_utc ();
+    date = g_strdup_printf ("%s, %02i %s %04i %02i:%02i:%02i GMT",
+                            days[g_date_time_get_day_of_week (now) - 1],
+                            g_date_time_get_day_of_month (now),
+                            months[g_date_time_get_month (now) - 1],
+                            g_date_time_get_year (now),
+                            g_date_time_get_hour (now),
+                            g_date_time_get_minute (now),
+                            g_date_time_get_second (now));
+
+    g_date_time_unref (now);
+    return date;
+}
+
+static gboolean
+write_all (Client *client,
+           const gchar *data,
+           gsize length)
+{
+    return g_output_stream_write_all (client->output, data, length, NULL, NULL, NULL);
+}
+
+/* @headers are complete lines, each ending with CR LF */
+static gboolean
+send_headers (Client *client,
+              Request *request,
+              const gchar *status,
+              const gchar *headers)
+{
+    GString *head;
+    gchar *date;
+    gboolean success;
+
+    date = get_http_date ();
+    head = g_string_new (NULL);
+    g_string_append_printf (head, "HTTP/1.1 %s\r\nDate: %s\r\nServer: books\r\n", status, date);
+
+    if (!request->keep_alive)
+        g_string_append (head, "Connection: close\r\n");
+
+    if (headers != NULL)
+        g_string_append (head, headers);
+
+    g_string_append (head, "\r\n");
+    success = write_all (client, head->str, head->len);
+
+    g_string_free (head, TRUE);
+    g_free (date);
+    return success;
+}
+
+static gboolean
+send_error (Client *client,
+            Request *request,
+            const gchar *status,
+            const gchar *headers)
+{
+    gchar *all_headers;
+    gchar *body;
+    gboolean success;
+
+    body = g_strdup_printf ("%s\n", status);
+    all_headers = g_strdup_printf ("%sContent-Type: text/plain; charset=utf-8\r\nContent-Length: %u\r\n",
+                                   headers != NULL ? headers : "", (guint) strlen (body));
+
+    success = send_headers (client, request, status, all_headers);
+
+    if (success && strcmp (request->method, "HEAD"))
+        success = write_all (client, body, strlen (body));
+
+    g_free (all_headers);
+    g_free (body);
+    return success;
+}
+
+static gboolean
+matches_etag (const gchar *header,
+              const gchar *etag)
+{
+    return header != NULL && (!strcmp (header, "*") || strstr (header, etag) != NULL);
+}
+
+static gboolean
+send_not_modified (Client *client,
+                   Request *request,
+                   const gchar *etag)
+{
+    gchar *headers;
+    gboolean success;
+
+    headers = g_strdup_printf ("ETag: %s\r\n", etag);
+    success = send_headers (client, request, "304 Not Modified", headers);
+    g_free (headers);
+
+    return success;
+}
+
+/* Opens the database of the library shown, again if it has been switched */
+static sqlite3 *
+get_database (Client *client)
+{
+    BooksOpdsServerPrivate *priv;
+    gchar *db_path;
+
+    priv = client->server->priv;
+    g_mutex_lock (&priv->lock);
+    db_path = g_strdup (priv->db_path);
+    g_mutex_unlock (&priv->lock);
+
+    if (client->db != NULL && g_strcmp0 (db_path, client->db_path)) {
+        sqlite3_close (client->db);
+        client->db = NULL;
+    }
+
+    if (client->db == NULL && db_path != NULL) {
+        if (sqlite3_open_v2 (db_path, &client->db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+            sqlite3_busy_timeout (client->db, BUSY_TIMEOUT);
+        }
+        else {
+            g_warning ("Could not open %s to serve the catalog", db_path);
+            sqlite3_close (client->db);
+            client->db = NULL;
+        }
+    }
+
+    g_free (client->db_path);
+    client->db_path = db_path;
+    return client->db;
+}
+
+static void
+flush_body (Body *body)
+{
+    if (body->failed || body->buffer->len == 0)
+        return;
+
+    if (body->chunked) {
+        gchar *size;
+
+        size = g_strdup_printf ("%" G_GSIZE_MODIFIER "x\r\n", body->buffer->len);
+        g_string_prepend (body->buffer, size);
+        g_string_append (body->buffer, "\r\n");
+        g_free (size);
+    }
+
+    body->failed = !write_all (body->client, body->buffer->str, body->buffer->len);
+    g_string_truncate (body->buffer, 0);
+}
+
+/* Like g_markup_printf_escaped, the string arguments are escaped */
+static void
+append_body (Body *body,
+             const gchar *format,
+             ...)
+{
+    va_list args;
+    gchar *text;
+
+    va_start (args, format);
+    text = g_markup_vprintf_escaped (format, args);
+    va_end (args);
+
+    g_string_append (body->buffer, text);
+    g_free (text);
+
+    if (body->buffer->len >= CHUNK_SIZE)
+        flush_body (body);
+}
+
+static gboolean
+finish_body (Body *body)
+{
+    flush_body (body);
+
+    if (body->chunked && !body->failed)
+        body->failed = !write_all (body->client, "0\r\n\r\n", 5);
+
+    g_string_free (body->buffer, TRUE);
+    return !body->failed;
+}
+
+/* Position in the title order, see read_page */
+typedef struct {
+    gboolean     before;
+    gboolean     at_end;
+    GBytes      *title_key;
+    gint64       id;
+} Cursor;
+
+typedef struct {
+    gint64       id;
+    gchar       *author;
+    gchar       *title;
+    gint64       size;
+    gint64       mtime;
+    GBytes      *title_key;
+} Entry;
+
+/* A page of the feed, read up front so no transaction waits for the client */
+typedef struct {
+    GPtrArray   *entries;
+    gint64       n_books;
+    gint64       updated;
+    gboolean     has_previous;
+    gboolean     has_next;
+    gchar       *etag;
+} Page;
+
+static void
+free_entry (Entry *entry)
+{
+    g_free (entry->author);
+    g_free (entry->title);
+    g_bytes_unref (entry->title_key);
+    g_free (entry);
+}
+
+static void
+free_page (Page *page)
+{
+    g_ptr_array_free (page->entries, TRUE);
+    g_free (page->etag);
+    g_free (page);
+}
+
+static gint64
+count_books (sqlite3 *db)
+{
+    const gchar *count_sql = "SELECT count(*) FROM books WHERE NOT removed";
+    sqlite3_stmt *count_stmt = NULL;
+    gint64 n_books = 0;
+
+    sqlite3_prepare_v2 (db, count_sql, -1, &count_stmt, NULL);
+
+    if (sqlite3_step (count_stmt) == SQLITE_ROW)
+        n_books = sqlite3_column_int64 (count_stmt, 0);
+
+    sqlite3_finalize (count_stmt);
+    return n_books;
+}
+
+/*
+ * Reads the page next to @cursor, the first one if %NULL. Pages start
+ * after or end before the sort key of a book instead of at an offset, so
+ * a page deep into the library costs no more than the first. Fetching one
+ * more row than shown tells whether there is another page.
+ */
+static GPtrArray *
+select_entries (sqlite3 *db,
+                const Cursor *cursor,
+                gboolean *more)
+{
+    sqlite3_stmt *select_stmt = NULL;
+    GPtrArray *entries;
+    const gchar *condition = "";
+    const gchar *order = "";
+    gchar *select_sql;
+
+    if (cursor != NULL && cursor->before) {
+        order = " DESC";
+
+        if (!cursor->at_end)
+            condition = "AND (title_key < ?2 OR (title_key = ?2 AND id < ?3)) ";
+    }
+    else if (cursor != NULL) {
+        condition = "AND (title_key > ?2 OR (title_key = ?2 AND id > ?3)) ";
+    }
+
+    select_sql = g_strdup_printf ("SELECT id, author, title, size, mtime, title_key FROM books "
+                                  "WHERE NOT removed %sORDER BY title_key%s, id%s LIMIT ?1",
+                                  condition, order, order);
+
+    sqlite3_prepare_v2 (db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_int (select_stmt, 1, PAGE_SIZE + 1);
+
+    if (cursor != NULL && !cursor->at_end) {
+        sqlite3_bind_blob (select_stmt, 2, g_bytes_get_data (cursor->title_key, NULL),
+                           (gint) g_bytes_get_size (cursor->title_key), SQLITE_STATIC);
+        sqlite3_bind_int64 (select_stmt, 3, cursor->id);
+    }
+
+    entries = g_ptr_array_new_with_free_func ((GDestroyNotify) free_entry);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        Entry *entry;
+
+        entry = g_new0 (Entry, 1);
+        entry->id = sqlite3_column_int64 (select_stmt, 0);
+        entry->author = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 1));
+        entry->title = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 2));
+        entry->size = sqlite3_column_int64 (select_stmt, 3);
+        entry->mtime = sqlite3_column_int64 (select_stmt, 4);
+        entry->title_key = g_bytes_new (sqlite3_column_blob (select_stmt, 5),
+                                        sqlite3_column_bytes (select_stmt, 5));
+        g_ptr_array_add (entries, entry);
+    }
+
+    sqlite3_finalize (select_stmt);
+    g_free (select_sql);
+
+    *more = entries->len > PAGE_SIZE;
+
+    if (*more)
+        g_ptr_array_remove_index (entries, PAGE_SIZE);
+
+    /* Read backwards from the cursor, shown forwards */
+    if (cursor != NULL && cursor->before) {
+        guint i;
+
+        for (i = 0; i < entries->len / 2; i++) {
+            gpointer entry;
+
+            entry = entries->pdata[i];
+            entries->pdata[i] = entries->pdata[entries->len - 1 - i];
+            entries->pdata[entries->len - 1 - i] = entry;
+        }
+    }
+
+    return entries;
+}
+
+/*
+ * Reads everything a page shows in one read transaction, which ends before
+ * anything is sent. The ETag is a hash of it, so an unchanged page is
+ * answered without writing the feed. Also notes when the newest book of
+ * the page was changed.
+ */
+static Page *
+read_page (sqlite3 *db,
+           const Cursor *cursor)
+{
+    GChecksum *checksum;
+    Page *page;
+    gboolean more;
+    guint i;
+
+    page = g_new0 (Page, 1);
+
+    /* Count and rows agree, whatever the main window writes meanwhile */
+    sqlite3_exec (db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    page->n_books = count_books (db);
+    page->entries = select_entries (db, cursor, &more);
+    sqlite3_exec (db, "COMMIT TRANSACTION", NULL, NULL, NULL);
+
+    if (cursor != NULL && cursor->before) {
+        page->has_previous = more;
+        page->has_next = !cursor->at_end;
+    }
+    else {
+        page->has_previous = cursor != NULL;
+        page->has_next = more;
+    }
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    g_checksum_update (checksum, (const guchar *) &page->n_books, sizeof (page->n_books));
+    g_checksum_update (checksum, (const guchar *) &page->has_previous, sizeof (page->has_previous));
+    g_checksum_update (checksum, (const guchar *) &page->has_next, sizeof (page->has_next));
+
+    for (i = 0; i < page->entries->len; i++) {
+        Entry *entry;
+        gchar *fields;
+
+        entry = g_ptr_array_index (page->entries, i);
+        fields = g_strdup_printf ("%" G_GINT64_FORMAT "\n%s\n%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n",
+                                  entry->id,
+                                  entry->author != NULL ? entry->author : "",
+                                  entry->title != NULL ? entry->title : "",
+                                  entry->size, entry->mtime);
+        g_checksum_update (checksum, (const guchar *) fields, -1);
+        g_free (fields);
+
+        page->updated = MAX (page->updated, entry->mtime);
+    }
+
+    page->etag = g_strdup_printf ("\"%s\"", g_checksum_get_string (checksum));
+    g_checksum_free (checksum);
+
+    return page;
+}
+
+/* Cursors are the title key in hex and the id, e.g. "4a6f.17" */
+static gchar *
+format_cursor (const Entry *entry)
+{
+    const guchar *data;
+    GString *cursor;
+    gsize length;
+    gsize i;
+
+    data = g_bytes_get_data (entry->title_key, &length);
+    cursor = g_string_sized_new (2 * length + 24);
+
+    for (i = 0; i < length; i++)
+        g_string_append_printf (cursor, "%02x", data[i]);
+
+    g_string_append_printf (cursor, ".%" G_GINT64_FORMAT, entry->id);
+    return g_string_free (cursor, FALSE);
+}
+
+static gboolean
+parse_cursor (const gchar *value,
+              Cursor *cursor)
+{
+    const gchar *dot;
+    GByteArray *key;
+    gchar *end;
+    gsize length;
+    gsize i;
+
+    /* Nothing to end before is the end of the list */
+    if (cursor->before && *value == '\0') {
+        cursor->at_end = TRUE;
+        return TRUE;
+    }
+
+    dot = strchr (value, '.');
+
+    if (dot == NULL || (dot - value) % 2 != 0 || !g_ascii_isdigit (dot[1]))
+        return FALSE;
+
+    errno = 0;
+    cursor->id = g_ascii_strtoll (dot + 1, &end, 10);
+
+    if (*end != '\0' || errno == ERANGE)
+        return FALSE;
+
+    length = (gsize) (dot - value) / 2;
+    key = g_byte_array_sized_new ((guint) length);
+
+    for (i = 0; i < length; i++) {
+        gint high;
+        gint low;
+        guint8 byte;
+
+        high = g_ascii_xdigit_value (value[2 * i]);
+        low = g_ascii_xdigit_value (value[2 * i + 1]);
+
+        if (high < 0 || low < 0) {
+            g_byte_array_unref (key);
+            return FALSE;
+        }
+
+        byte = (guint8) (high << 4 | low);
+        g_byte_array_append (key, &byte, 1);
+    }
+
+    cursor->title_key = g_byte_array_free_to_bytes (key);
+    return TRUE;
+}
+
+/* Returns %FALSE for the first page, also if the cursor is garbled */
+static gboolean
+get_cursor (const gchar *query,
+            Cursor *cursor)
+{
+    gchar **params;
+    gboolean found = FALSE;
+    guint i;
+
+    if (query == NULL)
+        return FALSE;
+
+    params = g_strsplit (query, "&", -1);
+
+    for (i = 0; params[i] != NULL && !found; i++) {
+        if (g_str_has_prefix (params[i], "after=")) {
+            cursor->before = FALSE;
+            found = parse_cursor (params[i] + 6, cursor);
+        }
+        else if (g_str_has_prefix (params[i], "before=")) {
+            cursor->before = TRUE;
+            found = parse_cursor (params[i] + 7, cursor);
+        }
+    }
+
+    g_strfreev (params);
+    return found;
+}
+
+static gchar *
+format_timestamp (gint64 time)
+{
+    GDateTime *date_time;
+    gchar *timestamp;
+
+    date_time = g_date_time_new_from_unix_utc (time);
+    timestamp = g_date_time_format (date_time, "%Y-%m-%dT%H:%M:%SZ");
+    g_date_time_unref (date_time);
+
+    return timestamp;
+}
+
+static void
+write_feed (Body *body,
+            Page *page,
+            const gchar *query)
+{
+    gchar *timestamp;
+    guint i;
+
+    timestamp = format_timestamp (page->updated);
+
+    append_body (body,
+                 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                 "<feed xmlns=\"http://www.w3.org/2005/Atom\" "
+                 "xmlns:opensearch=\"http://a9.com/-/spec/opensearch/1.1/\">\n"
+                 "  <id>urn:books:catalog</id>\n"
+                 "  <title>%s</title>\n"
+                 "  <updated>%s</updated>\n"
+                 "  <opensearch:totalResults>%" G_GINT64_FORMAT "</opensearch:totalResults>\n"
+                 "  <opensearch:itemsPerPage>%i</opensearch:itemsPerPage>\n",
+                 _("Books"), timestamp, page->n_books, PAGE_SIZE);
+
+    append_body (body,
+                 "  <link rel=\"self\" href=\"/opds%s%s\" type=\"" CATALOG_TYPE "\"/>\n"
+                 "  <link rel=\"start\" href=\"/opds\" type=\"" CATALOG_TYPE "\"/>\n"
+                 "  <link rel=\"first\" href=\"/opds\" type=\"" CATALOG_TYPE "\"/>\n"
+                 "  <link rel=\"last\" href=\"/opds?before=\" type=\"" CATALOG_TYPE "\"/>\n",
+                 query != NULL ? "?" : "", query != NULL ? query : "");
+
+    g_free (timestamp);
+
+    /* Past either end there is nothing to start from but the other end */
+    if (page->has_previous) {
+        gchar *cursor;
+
+        cursor = page->entries->len > 0 ? format_cursor (g_ptr_array_index (page->entries, 0)) : g_strdup ("");
+        append_body (body, "  <link rel=\"previous\" href=\"/opds?before=%s\" type=\"" CATALOG_TYPE "\"/>\n",
+                     cursor);
+        g_free (cursor);
+    }
+
+    if (page->has_next && page->entries->len > 0) {
+        gchar *cursor;
+
+        cursor = format_cursor (g_ptr_array_index (page->entries, page->entries->len - 1));
+        append_body (body, "  <link rel=\"next\" href=\"/opds?after=%s\" type=\"" CATALOG_TYPE "\"/>\n",
+                     cursor);
+        g_free (cursor);
+    }
+
+    for (i = 0; i < page->entries->len && !body->failed; i++) {
+        Entry *entry;
+
+        entry = g_ptr_array_index (page->entries, i);
+        timestamp = format_timestamp (entry->mtime);
+
+        append_body (body,
+                     "  <entry>\n"
+                     "    <id>urn:books:book:%" G_GINT64_FORMAT "</id>\n"
+                     "    <title>%s</title>\n"
+                     "    <updated>%s</updated>\n"
+                     "    <author><name>%s</name></author>\n"
+                     "    <link rel=\"" ACQUISITION_REL "\" href=\"/opds/books/%" G_GINT64_FORMAT "/file\" "
+                     "type=\"" EPUB_TYPE "\" length=\"%" G_GINT64_FORMAT "\"/>\n"
+                     "    <link rel=\"" THUMBNAIL_REL "\" href=\"/opds/books/%" G_GINT64_FORMAT "/thumbnail\" "
+                     "type=\"image/png\"/>\n"
+                     "  </entry>\n",
+                     entry->id, entry->title != NULL ? entry->title : "", timestamp,
+                     entry->author != NULL ? entry->author : "",
+                     entry->id, entry->size, entry->id);
+
+        g_free (timestamp);
+    }
+
+    append_body (body, "</feed>\n");
+}
+
+static gboolean
+serve_catalog (Client *client,
+               Request *request)
+{
+    sqlite3 *db;
+    GString *headers;
+    Page *page;
+    Cursor cursor = { 0 };
+    gboolean paged;
+    gboolean success = TRUE;
+
+    db = get_database (client);
+
+    if (db == NULL)
+        return send_error (client, request, "503 Service Unavailable", NULL);
+
+    paged = get_cursor (request->query, &cursor);
+    page = read_page (db, paged ? &cursor : NULL);
+
+    if (cursor.title_key != NULL)
+        g_bytes_unref (cursor.title_key);
+
+    if (matches_etag (request->if_none_match, page->etag)) {
+        success = send_not_modified (client, request, page->etag);
+        free_page (page);
+        return success;
+    }
+
+    /* Without chunks the end of the feed is the end of the connection */
+    if (!request->chunked)
+        request->keep_alive = FALSE;
+
+    headers = g_string_new ("Content-Type: " CATALOG_TYPE "; charset=utf-8\r\n"
+                            "Cache-Control: no-cache\r\n");
+    g_string_append_printf (headers, "ETag: %s\r\n", page->etag);
+
+    if (request->chunked)
+        g_string_append (headers, "Transfer-Encoding: chunked\r\n");
+
+    success = send_headers (client, request, "200 OK", headers->str);
+    g_string_free (headers, TRUE);
+
+    if (success && strcmp (request->method, "HEAD")) {
+        Body body;
+
+        body.client = client;
+        body.buffer = g_string_sized_new (CHUNK_SIZE + 1024);
+        body.chunked = request->chunked;
+        body.failed = FALSE;
+
+        write_feed (&body, page, paged ? request->query : NULL);
+        success = finish_body (&body);
+    }
+
+    free_page (page);
+    return success;
+}
+
+/*
+ * Parses a single byte range, e.g. "bytes=0-499", "bytes=500-" or the
+ * last bytes "bytes=-500". Several ranges are answered with the whole
+ * file, which is allowed.
+ */
+static RangeResult
+parse_range (const gchar *value,
+             goffset size,
+             goffset *first,
+             goffset *last)
+{
+    const gchar *spec;
+    gchar *end;
+    guint64 start;
+    guint64 stop;
+
+    if (!g_str_has_prefix (value, "bytes=") || strchr (value, ',') != NULL)
+        return RANGE_NONE;
+
+    spec = value + 6;
+
+    if (*spec == '-') {
+        guint64 suffix;
+
+        /* g_ascii_strtoull() would also take signs and white space */
+        if (!g_ascii_isdigit (spec[1]))
+            return RANGE_NONE;
+
+        suffix = g_ascii_strtoull (spec + 1, &end, 10);
+
+        if (*end != '\0')
+            return RANGE_NONE;
+
+        if (suffix == 0 || size == 0)
+            return RANGE_INVALID;
+
+        *first = size - (goffset) MIN (suffix, (guint64) size);
+        *last = size - 1;
+        return RANGE_VALID;
+    }
+
+    if (!g_ascii_isdigit (*spec))
+        return RANGE_NONE;
+
+    start = g_ascii_strtoull (spec, &end, 10);
+
+    if (*end != '-')
+        return RANGE_NONE;
+
+    /* Offsets beyond any file, they must not turn negative as goffset */
+    if (start > G_MAXINT64 || (goffset) start >= size)
+        return RANGE_INVALID;
+
+    spec = end + 1;
+    *first = (goffset) start;
+    *last = size - 1;
+
+    if (*spec == '\0')
+        return RANGE_VALID;
+
+    if (!g_ascii_isdigit (*spec))
+        return RANGE_NONE;
+
+    stop = g_ascii_strtoull (spec, &end, 10);
+
+    if (*end != '\0' || stop < start)
+        return RANGE_NONE;
+
+    /* A last byte past the end means up to the end */
+    if (stop < (guint64) size)
+        *last = (goffset) stop;
+
+    return RANGE_VALID;
+}
+
+static gboolean
+send_file_range (Client *client,
+                 gint fd,
+                 goffset offset,
+                 goffset length)
+{
+#ifdef __linux__
+    GSocket *socket;
+
+    /* Headers went out unbuffered, so the file follows them on the socket */
+    socket = g_socket_connection_get_socket (client->connection);
+
+    while (length > 0) {
+        off_t position;
+        gssize sent;
+
+        position = (off_t) offset;
+        sent = sendfile (g_socket_get_fd (socket), fd, &position, (gsize) MIN (length, SEND_SIZE));
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+
+        /* Sockets of GIO never block, wait until the client reads again */
+        if (sent < 0 && errno == EAGAIN) {
+            if (!g_socket_condition_wait (socket, G_IO_OUT, NULL, NULL))
+                return FALSE;
+
+            continue;
+        }
+
+        /* Errors and files shrinking meanwhile end the connection */
+        if (sent <= 0)
+            return FALSE;
+
+        offset += sent;
+        length -= sent;
+    }
+
+    return TRUE;
+#else
+    gchar *buffer;
+    gboolean success = TRUE;
+
+    if (lseek (fd, offset, SEEK_SET) < 0)
+        return FALSE;
+
+    buffer = g_malloc (CHUNK_SIZE);
+
+    while (success && length > 0) {
+        gssize n_read;
+
+        n_read = read (fd, buffer, (gsize) MIN (length, CHUNK_SIZE));
+        success = n_read > 0 && write_all (client, buffer, n_read);
+        length -= n_read;
+    }
+
+    g_free (buffer);
+    return success;
+#endif
+}
+
+static gboolean
+serve_file (Client *client,
+            Request *request,
+            const gchar *path,
+            const gchar *content_type,
+            const gchar *disposition)
+{
+    struct stat buf;
+    GString *headers;
+    RangeResult range = RANGE_NONE;
+    gchar *etag;
+    goffset first = 0;
+    goffset last = 0;
+    gboolean success;
+    gint fd;
+
+    fd = g_open (path, O_RDONLY, 0);
+
+    if (fd < 0)
+        return send_error (client, request, "404 Not Found", NULL);
+
+    if (fstat (fd, &buf) < 0) {
+        close (fd);
+        return send_error (client, request, "404 Not Found", NULL);
+    }
+
+    etag = g_strdup_printf ("\"%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x\"",
+                            (gint64) buf.st_size, (gint64) buf.st_mtime);
+
+    if (matches_etag (request->if_none_match, etag)) {
+        success = send_not_modified (client, request, etag);
+        g_free (etag);
+        close (fd);
+        return success;
+    }
+
+    /* A range of another version of the file would be garbage */
+    if (request->range != NULL && (request->if_range == NULL || !strcmp (request->if_range, etag)))
+        range = parse_range (request->range, buf.st_size, &first, &last);
+
+    headers = g_string_new (NULL);
+    g_string_append_printf (headers, "Content-Type: %s\r\nAccept-Ranges: bytes\r\nETag: %s\r\n",
+                            content_type, etag);
+
+    if (disposition != NULL)
+        g_string_append_printf (headers, "Content-Disposition: %s\r\n", disposition);
+
+    if (range == RANGE_INVALID) {
+        g_string_append_printf (headers, "Content-Range: bytes */%" G_GINT64_FORMAT "\r\n",
+                                (gint64) buf.st_size);
+        success = send_error (client, request, "416 Range Not Satisfiable", headers->str);
+    }
+    else {
+        if (range == RANGE_NONE) {
+            first = 0;
+            last = buf.st_size - 1;
+        }
+        else {
+            g_string_append_printf (headers, "Content-Range: bytes %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT
+                                    "/%" G_GINT64_FORMAT "\r\n",
+                                    (gint64) first, (gint64) last, (gint64) buf.st_size);
+        }
+
+        g_string_append_printf (headers, "Content-Length: %" G_GINT64_FORMAT "\r\n",
+                                (gint64) (last - first + 1));
+
+        success = send_headers (client, request,
+                                range == RANGE_VALID ? "206 Partial Content" : "200 OK",
+                                headers->str);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise (fd, first, last - first + 1, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        if (success && strcmp (request->method, "HEAD") && last >= first)
+            success = send_file_range (client, fd, first, last - first + 1);
+    }
+
+    g_string_free (headers, TRUE);
+    g_free (etag);
+    close (fd);
+    return success;
+}
+
+static gboolean
+serve_book (Client *client,
+            Request *request,
+            gint64 id,
+            gboolean thumbnail)
+{
+    const gchar *select_sql = "SELECT path, size, mtime, thumbnail FROM books WHERE id = ? AND NOT removed";
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3 *db;
+    gchar *path = NULL;
+    gchar *name = NULL;
+    gboolean success;
+
+    db = get_database (client);
+
+    if (db == NULL)
+        return send_error (client, request, "503 Service Unavailable", NULL);
+
+    sqlite3_prepare_v2 (db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_int64 (select_stmt, 1, id);
+
+    if (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        path = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 0));
+        name = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 3));
+
+        /* Books imported before thumbnails existed */
+        if (name == NULL && path != NULL)
+            name = books_thumbnail_get_name (path,
+                                             sqlite3_column_int64 (select_stmt, 1),
+                                             sqlite3_column_int64 (select_stmt, 2));
+    }
+
+    sqlite3_finalize (select_stmt);
+
+    if (path == NULL) {
+        success = send_error (client, request, "404 Not Found", NULL);
+    }
+    else if (thumbnail) {
+        gchar *thumbnail_path;
+
+        /* E-readers have dense screens, the larger one is preferred */
+        thumbnail_path = books_thumbnail_get_path (name, 2);
+
+        if (!g_file_test (thumbnail_path, G_FILE_TEST_EXISTS)) {
+            g_free (thumbnail_path);
+            thumbnail_path = books_thumbnail_get_path (name, 1);
+        }
+
+        success = serve_file (client, request, thumbnail_path, "image/png", NULL);
+        g_free (thumbnail_path);
+    }
+    else {
+        gchar *basename;
+        gchar *escaped;
+        gchar *disposition;
+
+        basename = g_path_get_basename (path);
+        escaped = g_uri_escape_string (basename, NULL, FALSE);
+        disposition = g_strdup_printf ("attachment; filename*=UTF-8''%s", escaped);
+
+        success = serve_file (client, request, path, EPUB_TYPE, disposition);
+
+        g_free (disposition);
+        g_free (escaped);
+        g_free (basename);
+    }
+
+    g_free (path);
+    g_free (name);
+    return success;
+}
+
+/* Returns %FALSE if the connection cannot be used any longer */
+static gboolean
+handle_request (Client *client,
+                Request *request)
+{
+    gint64 id;
+    gchar kind[16];
+
+    if (request->bad) {
+        request->keep_alive = FALSE;
+
+        if (request->method == NULL)
+            request->method = g_strdup ("GET");
+
+        send_error (client, request, "400 Bad Request", NULL);
+        return FALSE;
+    }
+
+    if (strcmp (request->method, "GET") && strcmp (request->method, "HEAD")) {
+        /* A body may follow that nobody is going to read */
+        request->keep_alive = FALSE;
+        send_error (client, request, "405 Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return FALSE;
+    }
+
+    if (!strcmp (request->path, "/") || !strcmp (request->path, "/opds"))
+        return serve_catalog (client, request);
+
+    if (sscanf (request->path, "/opds/books/%" G_GINT64_FORMAT "/%15s", &id, kind) == 2) {
+        if (!strcmp (kind, "file"))
+            return serve_book (client, request, id, FALSE);
+
+        if (!strcmp (kind, "thumbnail"))
+            return serve_book (client, request, id, TRUE);
+    }
+
+    return send_error (client, request, "404 Not Found", NULL);
+}
+
+static gboolean
+on_run (GThreadedSocketService *service,
+        GSocketConnection *connection,
+        GObject *source_object,
+        BooksOpdsServer *server)
+{
+    GDataInputStream *input;
+    Client client;
+
+    client.server = server;
+    client.connection = connection;
+    client.output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+    client.db = NULL;
+    client.db_path = NULL;
+
+    /* Idle and stalled clients give their thread back eventually */
+    g_socket_set_timeout (g_socket_connection_get_socket (connection), CLIENT_TIMEOUT);
+
+    input = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+    g_data_input_stream_set_newline_type (input, G_DATA_STREAM_NEWLINE_TYPE_LF);
+    g_filter_input_stream_set_close_base_stream (G_FILTER_INPUT_STREAM (input), FALSE);
+
+    while (!g_atomic_int_get (&server->priv->stopped)) {
+        Request request;
+        gboolean keep_alive;
+
+        if (!read_request (input, &request))
+            break;
+
+        keep_alive = handle_request (&client, &request) && request.keep_alive;
+        clear_request (&request);
+
+        if (!keep_alive)
+            break;
+    }
+
+    g_object_unref (input);
+    g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+
+    if (client.db != NULL)
+        sqlite3_close (client.db);
+
+    g_free (client.db_path);
+    return TRUE;
+}
+
+/**
+ * Listens on @port of all interfaces. Call books_opds_server_stop() before
+ * dropping the last reference, running clients keep the server alive.
+ */
+gboolean
+books_opds_server_start (BooksOpdsServer *server,
+                         guint16 port,
+                         GError **error)
+{
+    BooksOpdsServerPrivate *priv;
+
+    g_return_val_if_fail (BOOKS_IS_OPDS_SERVER (server), FALSE);
+    g_return_val_if_fail (server->priv->service == NULL, FALSE);
+
+    priv = server->priv;
+    priv->service = g_threaded_socket_service_new (MAX_CLIENTS);
+
+    if (!g_socket_listener_add_inet_port (G_SOCKET_LISTENER (priv->service), port, NULL, error)) {
+        g_clear_object (&priv->service);
+        return FALSE;
+    }
+
+    g_atomic_int_set (&priv->stopped, 0);
+    g_signal_connect_data (priv->service, "run",
+                           G_CALLBACK (on_run), g_object_ref (server),
+                           (GClosureNotify) g_object_unref, 0);
+
+    g_socket_service_start (priv->service);
+    return TRUE;
+}
+
+/**
+ * Stops accepting clients. Connected ones are closed after their current
+ * request.
+ */
+void
+books_opds_server_stop (BooksOpdsServer *server)
+{
+    BooksOpdsServerPrivate *priv;
+
+    g_return_if_fail (BOOKS_IS_OPDS_SERVER (server));
+
+    priv = server->priv;
+
+    if (priv->service == NULL)
+        return;
+
+    g_atomic_int_set (&priv->stopped, 1);
+    g_socket_service_stop (priv->service);
+    g_socket_listener_close (G_SOCKET_LISTENER (priv->service));
+
+    /* Freed with the last client, which releases the server as well */
+    g_clear_object (&priv->service);
+}
+
+static void
+books_opds_server_dispose (GObject *object)
+{
+    books_opds_server_stop (BOOKS_OPDS_SERVER (object));
+
+    G_OBJECT_CLASS (books_opds_server_parent_class)->dispose (object);
+}
+
+static void
+books_opds_server_finalize (GObject *object)
+{
+    BooksOpdsServerPrivate *priv;
+
+    priv = BOOKS_OPDS_SERVER_GET_PRIVATE (object);
+    g_mutex_clear (&priv->lock);
+    g_free (priv->db_path);
+
+    G_OBJECT_CLASS (books_opds_server_parent_class)->finalize (object);
+}
+
+static void
+books_opds_server_class_init (BooksOpdsServerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->dispose = books_opds_server_dispose;
+    object_class->finalize = books_opds_server_finalize;
+
+    g_type_class_add_private (klass, sizeof(BooksOpdsServerPrivate));
+}
+
+static void
+books_opds_server_init (BooksOpdsServer *server)
+{
+    BooksOpdsServerPrivate *priv;
+
+    server->priv = priv = BOOKS_OPDS_SERVER_GET_PRIVATE (server);
+
+    priv->service = NULL;
+    priv->stopped = 0;
+    priv->db_path = NULL;
+    g_mutex_init (&priv->lock);
+}
@@ -0,0 +1,41 @@
+#ifndef BOOKS_OPDS_SERVER_H
+#define BOOKS_OPDS_SERVER_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define BOOKS_TYPE_OPDS_SERVER             (books_opds_server_get_type())
+#define BOOKS_OPDS_SERVER(obj)             (G_TYPE_CHECK_INSTANCE_CAST((obj), BOOKS_TYPE_OPDS_SERVER, BooksOpdsServer))
+#define BOOKS_IS_OPDS_SERVER(obj)          (G_TYPE_CHECK_INSTANCE_TYPE((obj), BOOKS_TYPE_OPDS_SERVER))
+#define BOOKS_OPDS_SERVER_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST((klass), BOOKS_TYPE_OPDS_SERVER, BooksOpdsServerClass))
+#define BOOKS_IS_OPDS_SERVER_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE((klass), BOOKS_TYPE_OPDS_SERVER))
+#define BOOKS_OPDS_SERVER_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS((obj), BOOKS_TYPE_OPDS_SERVER, BooksOpdsServerClass))
+
+
+typedef struct _BooksOpdsServer           BooksOpdsServer;
+typedef struct _BooksOpdsServerClass      BooksOpdsServerClass;
+typedef struct _BooksOpdsServerPrivate    BooksOpdsServerPrivate;
+
+struct _BooksOpdsServer {
+    GObject parent;
+
+    BooksOpdsServerPrivate *priv;
+};
+
+struct _BooksOpdsServerClass {
+    GObjectClass parent_class;
+};
+
+BooksOpdsServer *books_opds_server_new          (void);
+void             books_opds_server_set_database (BooksOpdsServer    *server,
+                                                 const gchar        *db_path);
+gboolean         books_opds_server_start        (BooksOpdsServer    *server,
+                                                 guint16             port,
+                                                 GError            **error);
+void             books_opds_server_stop         (BooksOpdsServer    *server);
+GType            books_opds_server_get_type     (void);
+
+G_END_DECLS
+
+#endif
@@ -5,6 +5,7 @@
 #include <glib/gi18n.h>
 
 #include "books-preferences-dialog.h"
+#include "books-libraries.h"
 
 
 G_DEFINE_TYPE(BooksPreferencesDialog, books_preferences_dialog, GTK_TYPE_DIALOG)
@@ -15,6 +16,8 @@ struct _BooksPreferencesDialogPrivate {
     GSettings *settings;
 
     GtkWidget *notebook;
+    GtkTreeView *folder_view;
+    GtkListStore *folder_store;
 };
 
 static GtkWidget *preferences_dialog = NULL;
@@ -40,6 +43,11 @@ books_show_preferences_dialog (BooksMainWindow *parent)
 static void
 books_preferences_dialog_dispose (GObject *object)
 {
+    BooksPreferencesDialogPrivate *priv;
+
+    priv = BOOKS_PREFERENCES_DIALOG_GET_PRIVATE (object);
+    g_clear_object (&priv->settings);
+
     G_OBJECT_CLASS (books_preferences_dialog_parent_class)->dispose (object);
 }
 
@@ -76,6 +84,108 @@ on_books_button_toggled (GtkToggleButton *button,
         g_settings_set_enum (settings, "style-sheet", BOOKS_STYLE_SHEET_BOOKS);
 }
 
+static void
+populate_folder_store (BooksPreferencesDialogPrivate *priv)
+{
+    gchar **folders;
+    gchar *library;
+    guint i;
+
+    gtk_list_store_clear (priv->folder_store);
+    library = books_libraries_get_active (priv->settings);
+    folders = books_libraries_get_folders (priv->settings, library);
+    g_free (library);
+
+    for (i = 0; folders[i] != NULL; i++) {
+        GtkTreeIter iter;
+
+        gtk_list_store_append (priv->folder_store, &iter);
+        gtk_list_store_set (priv->folder_store, &iter, 0, folders[i], -1);
+    }
+
+    g_strfreev (folders);
+}
+
+static void
+store_library_folders (BooksPreferencesDialogPrivate *priv)
+{
+    GPtrArray *folders;
+    GtkTreeIter iter;
+    gchar *library;
+    gboolean valid;
+
+    folders = g_ptr_array_new_with_free_func (g_free);
+    valid = gtk_tree_model_get_iter_first (GTK_TREE_MODEL (priv->folder_store), &iter);
+
+    while (valid) {
+        gchar *folder;
+
+        gtk_tree_model_get (GTK_TREE_MODEL (priv->folder_store), &iter, 0, &folder, -1);
+        g_ptr_array_add (folders, folder);
+        valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (priv->folder_store), &iter);
+    }
+
+    g_ptr_array_add (folders, NULL);
+    library = books_libraries_get_active (priv->settings);
+    books_libraries_set_folders (priv->settings, library, (const gchar * const *) folders->pdata);
+    g_ptr_array_free (folders, TRUE);
+    g_free (library);
+}
+
+/* Folders are edited for the library shown in the main window */
+static void
+on_library_changed (GSettings *settings,
+                    const gchar *key,
+                    BooksPreferencesDialogPrivate *priv)
+{
+    populate_folder_store (priv);
+}
+
+static void
+on_add_folder_clicked (GtkButton *button,
+                       BooksPreferencesDialog *dialog)
+{
+    BooksPreferencesDialogPrivate *priv;
+    GtkWidget *chooser;
+
+    priv = dialog->priv;
+    chooser = gtk_file_chooser_dialog_new (_("Add Library Folder"), GTK_WINDOW (dialog),
+                                           GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                           GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                                           GTK_STOCK_ADD, GTK_RESPONSE_ACCEPT,
+                                           NULL);
+
+    if (gtk_dialog_run (GTK_DIALOG (chooser)) == GTK_RESPONSE_ACCEPT) {
+        GtkTreeIter iter;
+        gchar *folder;
+
+        folder = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (chooser));
+        gtk_list_store_append (priv->folder_store, &iter);
+        gtk_list_store_set (priv->folder_store, &iter, 0, folder, -1);
+        store_library_folders (priv);
+        g_free (folder);
+    }
+
+    gtk_widget_destroy (chooser);
+}
+
+static void
+on_remove_folder_clicked (GtkButton *button,
+                          BooksPreferencesDialog *dialog)
+{
+    BooksPreferencesDialogPrivate *priv;
+    GtkTreeSelection *selection;
+    GtkTreeIter iter;
+
+    priv = dialog->priv;
+    selection = gtk_tree_view_get_selection (priv->folder_view);
+
+    if (gtk_tree_selection_get_selected (selection, NULL, &iter)) {
+        gtk_list_store_remove (priv->folder_store, &iter);
+        store_library_folders (priv);
+    }
+}
+
 static void
 books_preferences_dialog_init (BooksPreferencesDialog *dialog)
 {
@@ -83,6 +193,9 @@ books_preferences_dialog_init (BooksPreferencesDialog *dialog)
     GtkBuilder *builder;
     GtkToggleButton *publisher_button;
     GtkToggleButton *books_button;
+    GtkWidget *add_folder_button;
+    GtkWidget *remove_folder_button;
+    GtkTreeViewColumn *folder_column;
     GError *error = NULL;
 
     static gchar *objects[] = {
@@ -144,6 +257,34 @@ books_preferences_dialog_init (BooksPreferencesDialog *dialog)
                       G_CALLBACK (on_books_button_toggled),
                       priv->settings);
 
+    /* Library folders */
+    priv->folder_store = gtk_list_store_new (1, G_TYPE_STRING);
+    priv->folder_view = GTK_TREE_VIEW (gtk_builder_get_object (builder, "folder-view"));
+    gtk_tree_view_set_model (priv->folder_view, GTK_TREE_MODEL (priv->folder_store));
+    g_object_unref (priv->folder_store);
+
+    folder_column = gtk_tree_view_column_new_with_attributes (_("Folder"), gtk_cell_renderer_text_new (),
+                                                              "text", 0,
+                                                              NULL);
+    gtk_tree_view_append_column (priv->folder_view, folder_column);
+    populate_folder_store (priv);
+
+    g_signal_connect (priv->settings, "changed::library",
+                      G_CALLBACK (on_library_changed), priv);
+
+    add_folder_button = GTK_WIDGET (gtk_builder_get_object (builder, "add-folder-button"));
+    remove_folder_button = GTK_WIDGET (gtk_builder_get_object (builder, "remove-folder-button"));
+
+    g_signal_connect (add_folder_button,
+                      "clicked",
+                      G_CALLBACK (on_add_folder_clicked),
+                      dialog);
+
+    g_signal_connect (remove_folder_button,
+                      "clicked",
+                      G_CALLBACK (on_remove_folder_clicked),
+                      dialog);
+
     g_object_unref (builder);
 }
 
@@ -51,7 +51,7 @@ books_removed_dialog_dispose (GObject *object)
     BooksRemovedDialogPrivate *priv;
 
     priv = BOOKS_REMOVED_DIALOG_GET_PRIVATE (object);
-    g_object_unref (priv->model);
+    g_clear_object (&priv->model);
 
     G_OBJECT_CLASS (books_removed_dialog_parent_class)->dispose (object);
 }
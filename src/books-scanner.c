@@ -0,0 +1,742 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "books-scanner.h"
+#include "books-content-hash.h"
+#include "books-epub.h"
+#include "books-libraries.h"
+#include "books-thumbnail.h"
+
+
+G_DEFINE_TYPE(BooksScanner, books_scanner, G_TYPE_OBJECT)
+
+#define BOOKS_SCANNER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_SCANNER, BooksScannerPrivate))
+
+/* Number of imported books handed to the main thread at once */
+#define BATCH_SIZE          32
+
+/* Monitor events are collected for this long before they are applied */
+#define PENDING_TIMEOUT_MS  500
+
+#define SCAN_ATTRIBUTES G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+                        G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+                        G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+                        G_FILE_ATTRIBUTE_TIME_MODIFIED
+
+enum {
+    PENDING_SCAN,
+    PENDING_REMOVE
+};
+
+enum {
+    DUPLICATES_FOUND,
+    LAST_SIGNAL
+};
+
+static guint scanner_signals[LAST_SIGNAL] = { 0 };
+
+struct _BooksScannerPrivate {
+    GSettings       *settings;
+    BooksCollection *collection;
+    GCancellable    *cancellable;
+    GHashTable      *monitors;
+    GHashTable      *pending;
+    guint            pending_source;
+    gboolean         scanning;
+
+    /* Duplicates found by the running scan, announced when it finishes */
+    GPtrArray       *duplicates;
+};
+
+typedef struct {
+    gchar       *path;
+    gchar       *content_hash;
+    BooksEpub   *epub;
+} ScanResult;
+
+typedef struct {
+    BooksScanner *scanner;
+    GCancellable *cancellable;
+    GPtrArray    *results;
+} ScanBatch;
+
+typedef struct {
+    gchar       **roots;
+    gboolean      full;
+    GCancellable *cancellable;
+    GHashTable   *stamps;
+    GHashTable   *hashes;
+    GHashTable   *seen;
+    GPtrArray    *batch;
+    GPtrArray    *directories;
+    GPtrArray    *missing;
+} ScanJob;
+
+static void start_scan      (BooksScanner *scanner, gchar **roots, gboolean full);
+static void add_monitor     (BooksScanner *scanner, const gchar *path);
+
+
+BooksScanner *
+books_scanner_new (BooksCollection *collection)
+{
+    BooksScanner *scanner;
+
+    scanner = BOOKS_SCANNER (g_object_new (BOOKS_TYPE_SCANNER, NULL));
+    scanner->priv->collection = g_object_ref (collection);
+    books_scanner_rescan (scanner);
+
+    g_signal_connect_swapped (collection, "notify::library",
+                              G_CALLBACK (books_scanner_rescan), scanner);
+
+    return scanner;
+}
+
+void
+books_scanner_rescan (BooksScanner *scanner)
+{
+    BooksScannerPrivate *priv;
+    gchar *library;
+
+    g_return_if_fail (BOOKS_IS_SCANNER (scanner));
+    priv = scanner->priv;
+
+    /* A running scan of the previous folder set is useless now */
+    g_cancellable_cancel (priv->cancellable);
+    g_object_unref (priv->cancellable);
+    priv->cancellable = g_cancellable_new ();
+
+    /* Events of the old folders may refer to another library */
+    if (priv->pending_source != 0) {
+        g_source_remove (priv->pending_source);
+        priv->pending_source = 0;
+    }
+
+    g_hash_table_remove_all (priv->pending);
+    g_hash_table_remove_all (priv->monitors);
+    g_ptr_array_set_size (priv->duplicates, 0);
+
+    library = books_libraries_get_active (priv->settings);
+    start_scan (scanner, books_libraries_get_folders (priv->settings, library), TRUE);
+    g_free (library);
+}
+
+static gboolean
+is_epub_filename (const gchar *filename)
+{
+    gsize length;
+
+    length = strlen (filename);
+    return length > 5 && !g_ascii_strcasecmp (filename + length - 5, ".epub");
+}
+
+static void
+free_scan_result (ScanResult *result)
+{
+    g_free (result->path);
+    g_free (result->content_hash);
+
+    if (result->epub != NULL)
+        g_object_unref (result->epub);
+
+    g_free (result);
+}
+
+static void
+free_scan_batch (ScanBatch *batch)
+{
+    g_object_unref (batch->scanner);
+    g_object_unref (batch->cancellable);
+    g_ptr_array_free (batch->results, TRUE);
+    g_free (batch);
+}
+
+static void
+free_scan_job (ScanJob *job)
+{
+    g_strfreev (job->roots);
+    g_object_unref (job->cancellable);
+    g_hash_table_destroy (job->stamps);
+    g_hash_table_destroy (job->hashes);
+    g_hash_table_destroy (job->seen);
+    g_ptr_array_free (job->batch, TRUE);
+    g_ptr_array_free (job->directories, TRUE);
+    g_ptr_array_free (job->missing, TRUE);
+    g_free (job);
+}
+
+static gboolean
+deliver_batch (ScanBatch *batch)
+{
+    BooksScannerPrivate *priv;
+    guint i;
+
+    priv = batch->scanner->priv;
+
+    /* Books of a replaced scan may belong to another library */
+    if (g_cancellable_is_cancelled (batch->cancellable))
+        return FALSE;
+
+    for (i = 0; i < batch->results->len; i++) {
+        ScanResult *result;
+        BooksDuplicate *duplicate;
+
+        result = g_ptr_array_index (batch->results, i);
+
+        /* Replaces the entry of a changed book */
+        duplicate = books_collection_add_unique_book (priv->collection, result->epub,
+                                                      result->path, result->content_hash);
+
+        if (duplicate != NULL)
+            g_ptr_array_add (priv->duplicates, duplicate);
+    }
+
+    return FALSE;
+}
+
+static void
+flush_batch (BooksScanner *scanner,
+             ScanJob *job)
+{
+    ScanBatch *batch;
+
+    if (job->batch->len == 0)
+        return;
+
+    batch = g_new0 (ScanBatch, 1);
+    batch->scanner = g_object_ref (scanner);
+    batch->cancellable = g_object_ref (job->cancellable);
+    batch->results = job->batch;
+    job->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) free_scan_result);
+
+    /*
+     * Same priority as the task completion so that batches are always
+     * delivered before the scan is considered finished.
+     */
+    g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+                                (GSourceFunc) deliver_batch, batch,
+                                (GDestroyNotify) free_scan_batch);
+}
+
+static void
+scan_file (BooksScanner *scanner,
+           ScanJob *job,
+           GFile *file,
+           GFileInfo *info)
+{
+    BooksFileStamp *stamp;
+    BooksEpub *epub;
+    ScanResult *result;
+    gchar *path;
+    gchar *content_hash;
+    goffset size;
+    gint64 mtime;
+    GError *error = NULL;
+
+    if (!is_epub_filename (g_file_info_get_name (info)))
+        return;
+
+    path = g_file_get_path (file);
+    size = g_file_info_get_size (info);
+    mtime = (gint64) g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    stamp = g_hash_table_lookup (job->stamps, path);
+    g_hash_table_add (job->seen, g_strdup (path));
+
+    /* Unchanged books are neither opened nor parsed again */
+    if (stamp != NULL && stamp->size == size && stamp->mtime == mtime) {
+        g_free (path);
+        return;
+    }
+
+    content_hash = books_content_hash_compute (path, NULL, &error);
+
+    if (content_hash == NULL) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_free (path);
+        return;
+    }
+
+    /* Copies of known books are neither extracted nor parsed */
+    if (stamp == NULL && g_hash_table_contains (job->hashes, content_hash)) {
+        result = g_new0 (ScanResult, 1);
+        result->path = path;
+        result->content_hash = content_hash;
+        g_ptr_array_add (job->batch, result);
+
+        if (job->batch->len >= BATCH_SIZE)
+            flush_batch (scanner, job);
+
+        return;
+    }
+
+    epub = books_epub_new ();
+
+    if (books_epub_open (epub, path, &error)) {
+        const gchar *cover;
+
+        /* Scaled here once, the views only ever load the thumbnails */
+        cover = books_epub_get_cover (epub);
+
+        if (cover != NULL) {
+            gchar *thumbnail;
+
+            thumbnail = books_thumbnail_get_name (path, size, mtime);
+
+            /* The file manager may have asked the thumbnailer already */
+            if (!books_thumbnail_exists (thumbnail) &&
+                !books_thumbnail_create (cover, thumbnail, &error)) {
+                g_printerr ("%s\n", error->message);
+                g_clear_error (&error);
+            }
+
+            g_free (thumbnail);
+        }
+
+        g_hash_table_add (job->hashes, g_strdup (content_hash));
+
+        result = g_new0 (ScanResult, 1);
+        result->path = path;
+        result->content_hash = content_hash;
+        result->epub = epub;
+        g_ptr_array_add (job->batch, result);
+
+        if (job->batch->len >= BATCH_SIZE)
+            flush_batch (scanner, job);
+    }
+    else {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_object_unref (epub);
+        g_free (content_hash);
+        g_free (path);
+    }
+}
+
+static void
+scan_directory (BooksScanner *scanner,
+                ScanJob *job,
+                GFile *directory,
+                GCancellable *cancellable)
+{
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+
+    enumerator = g_file_enumerate_children (directory, SCAN_ATTRIBUTES,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            cancellable, NULL);
+
+    if (enumerator == NULL)
+        return;
+
+    g_ptr_array_add (job->directories, g_file_get_path (directory));
+
+    while ((info = g_file_enumerator_next_file (enumerator, cancellable, NULL)) != NULL) {
+        GFile *child;
+
+        child = g_file_get_child (directory, g_file_info_get_name (info));
+
+        switch (g_file_info_get_file_type (info)) {
+            case G_FILE_TYPE_DIRECTORY:
+                scan_directory (scanner, job, child, cancellable);
+                break;
+
+            case G_FILE_TYPE_REGULAR:
+                scan_file (scanner, job, child, info);
+                break;
+
+            default:
+                break;
+        }
+
+        g_object_unref (child);
+        g_object_unref (info);
+    }
+
+    g_object_unref (enumerator);
+}
+
+static void
+collect_missing_books (ScanJob *job)
+{
+    GHashTableIter iter;
+    gchar *path;
+    guint i;
+
+    g_hash_table_iter_init (&iter, job->stamps);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *) &path, NULL)) {
+        if (g_hash_table_contains (job->seen, path))
+            continue;
+
+        for (i = 0; job->roots[i] != NULL; i++) {
+            gchar *prefix;
+            gboolean below;
+
+            prefix = g_strconcat (job->roots[i], G_DIR_SEPARATOR_S, NULL);
+            below = g_str_has_prefix (path, prefix);
+            g_free (prefix);
+
+            if (below) {
+                g_ptr_array_add (job->missing, g_strdup (path));
+                break;
+            }
+        }
+    }
+}
+
+static void
+scan_thread (GTask *task,
+             BooksScanner *scanner,
+             ScanJob *job,
+             GCancellable *cancellable)
+{
+    guint i;
+
+    for (i = 0; job->roots[i] != NULL && !g_cancellable_is_cancelled (cancellable); i++) {
+        GFile *root;
+        GFileInfo *info;
+
+        root = g_file_new_for_path (job->roots[i]);
+        info = g_file_query_info (root, SCAN_ATTRIBUTES,
+                                  G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                  cancellable, NULL);
+
+        if (info != NULL) {
+            if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+                scan_directory (scanner, job, root, cancellable);
+            else if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR)
+                scan_file (scanner, job, root, info);
+
+            g_object_unref (info);
+        }
+
+        g_object_unref (root);
+    }
+
+    flush_batch (scanner, job);
+
+    /* Only a complete walk can tell which books have disappeared */
+    if (job->full && !g_cancellable_is_cancelled (cancellable))
+        collect_missing_books (job);
+
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+remove_monitors_below (BooksScanner *scanner,
+                       const gchar *path)
+{
+    GHashTableIter iter;
+    gchar *prefix;
+    gchar *directory;
+
+    prefix = g_strconcat (path, G_DIR_SEPARATOR_S, NULL);
+    g_hash_table_iter_init (&iter, scanner->priv->monitors);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *) &directory, NULL)) {
+        if (!g_strcmp0 (directory, path) || g_str_has_prefix (directory, prefix))
+            g_hash_table_iter_remove (&iter);
+    }
+
+    g_free (prefix);
+}
+
+static gboolean
+process_pending (BooksScanner *scanner)
+{
+    BooksScannerPrivate *priv;
+    GHashTableIter iter;
+    GPtrArray *roots;
+    gchar *path;
+    gpointer action;
+
+    priv = scanner->priv;
+
+    /* Try again once the running scan has delivered its results */
+    if (priv->scanning)
+        return TRUE;
+
+    priv->pending_source = 0;
+    roots = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, priv->pending);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *) &path, &action)) {
+        if (GPOINTER_TO_INT (action) == PENDING_SCAN) {
+            g_ptr_array_add (roots, g_strdup (path));
+        }
+        else if (g_hash_table_contains (priv->monitors, path)) {
+            remove_monitors_below (scanner, path);
+            books_collection_remove_folder (priv->collection, path);
+        }
+        else {
+            books_collection_remove_path (priv->collection, path);
+        }
+    }
+
+    g_hash_table_remove_all (priv->pending);
+    g_ptr_array_add (roots, NULL);
+
+    if (roots->len > 1)
+        start_scan (scanner, (gchar **) g_ptr_array_free (roots, FALSE), FALSE);
+    else
+        g_ptr_array_free (roots, TRUE);
+
+    return FALSE;
+}
+
+static void
+schedule_pending (BooksScanner *scanner,
+                  GFile *file,
+                  gint action)
+{
+    BooksScannerPrivate *priv;
+
+    priv = scanner->priv;
+    g_hash_table_insert (priv->pending, g_file_get_path (file), GINT_TO_POINTER (action));
+
+    if (priv->pending_source == 0)
+        priv->pending_source = g_timeout_add (PENDING_TIMEOUT_MS, (GSourceFunc) process_pending, scanner);
+}
+
+static void
+on_monitor_changed (GFileMonitor *monitor,
+                    GFile *file,
+                    GFile *other_file,
+                    GFileMonitorEvent event,
+                    BooksScanner *scanner)
+{
+    BooksScannerPrivate *priv;
+
+    priv = scanner->priv;
+
+    switch (event) {
+        case G_FILE_MONITOR_EVENT_CREATED:
+        case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+            schedule_pending (scanner, file, PENDING_SCAN);
+            break;
+
+        case G_FILE_MONITOR_EVENT_DELETED:
+            schedule_pending (scanner, file, PENDING_REMOVE);
+            break;
+
+        case G_FILE_MONITOR_EVENT_MOVED:
+            if (other_file == NULL) {
+                /* The monitored directory itself went away */
+                schedule_pending (scanner, file, PENDING_REMOVE);
+            }
+            else {
+                gchar *old_path;
+                gchar *new_path;
+
+                /*
+                 * Renames are applied right away, so the rescan of the new
+                 * location finds matching stamps and parses nothing.
+                 */
+                old_path = g_file_get_path (file);
+                new_path = g_file_get_path (other_file);
+                books_collection_rename_path (priv->collection, old_path, new_path);
+                remove_monitors_below (scanner, old_path);
+                schedule_pending (scanner, other_file, PENDING_SCAN);
+                g_free (old_path);
+                g_free (new_path);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void
+add_monitor (BooksScanner *scanner,
+             const gchar *path)
+{
+    BooksScannerPrivate *priv;
+    GFileMonitor *monitor;
+    GFile *directory;
+
+    priv = scanner->priv;
+
+    if (g_hash_table_contains (priv->monitors, path))
+        return;
+
+    directory = g_file_new_for_path (path);
+    monitor = g_file_monitor_directory (directory, G_FILE_MONITOR_SEND_MOVED, NULL, NULL);
+
+    if (monitor != NULL) {
+        g_signal_connect (monitor, "changed",
+                          G_CALLBACK (on_monitor_changed), scanner);
+        g_hash_table_insert (priv->monitors, g_strdup (path), monitor);
+    }
+
+    g_object_unref (directory);
+}
+
+static void
+free_monitor (GFileMonitor *monitor)
+{
+    g_file_monitor_cancel (monitor);
+    g_object_unref (monitor);
+}
+
+static void
+on_scan_finished (BooksScanner *scanner,
+                  GAsyncResult *result,
+                  gpointer user_data)
+{
+    BooksScannerPrivate *priv;
+    ScanJob *job;
+    guint i;
+
+    priv = scanner->priv;
+
+    /* The scan that replaced this one is still running */
+    if (g_cancellable_is_cancelled (g_task_get_cancellable (G_TASK (result))))
+        return;
+
+    priv->scanning = FALSE;
+    job = g_task_get_task_data (G_TASK (result));
+
+    if (job->missing->len > 0) {
+        g_ptr_array_add (job->missing, NULL);
+        books_collection_remove_paths (priv->collection, (const gchar * const *) job->missing->pdata);
+    }
+
+    for (i = 0; i < job->directories->len; i++)
+        add_monitor (scanner, g_ptr_array_index (job->directories, i));
+
+    if (priv->duplicates->len > 0) {
+        GPtrArray *duplicates;
+
+        duplicates = priv->duplicates;
+        priv->duplicates = g_ptr_array_new_with_free_func ((GDestroyNotify) books_duplicate_free);
+        g_signal_emit (scanner, scanner_signals[DUPLICATES_FOUND], 0, duplicates);
+        g_ptr_array_unref (duplicates);
+    }
+}
+
+static void
+start_scan (BooksScanner *scanner,
+            gchar **roots,
+            gboolean full)
+{
+    BooksScannerPrivate *priv;
+    ScanJob *job;
+    GTask *task;
+
+    priv = scanner->priv;
+
+    job = g_new0 (ScanJob, 1);
+    job->roots = roots;
+    job->full = full;
+    job->cancellable = g_object_ref (priv->cancellable);
+    job->stamps = books_collection_get_file_stamps (priv->collection);
+    job->hashes = books_collection_get_content_hashes (priv->collection);
+    job->seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    job->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) free_scan_result);
+    job->directories = g_ptr_array_new_with_free_func (g_free);
+    job->missing = g_ptr_array_new_with_free_func (g_free);
+
+    task = g_task_new (scanner, priv->cancellable,
+                       (GAsyncReadyCallback) on_scan_finished, NULL);
+    g_task_set_task_data (task, job, (GDestroyNotify) free_scan_job);
+    g_task_run_in_thread (task, (GTaskThreadFunc) scan_thread);
+    g_object_unref (task);
+
+    priv->scanning = TRUE;
+}
+
+static void
+on_library_folders_changed (GSettings *settings,
+                            const gchar *key,
+                            BooksScanner *scanner)
+{
+    books_scanner_rescan (scanner);
+}
+
+static void
+books_scanner_dispose (GObject *object)
+{
+    BooksScannerPrivate *priv;
+
+    priv = BOOKS_SCANNER_GET_PRIVATE (object);
+
+    if (priv->pending_source != 0) {
+        g_source_remove (priv->pending_source);
+        priv->pending_source = 0;
+    }
+
+    if (priv->cancellable != NULL)
+        g_cancellable_cancel (priv->cancellable);
+
+    g_hash_table_remove_all (priv->monitors);
+    g_clear_object (&priv->settings);
+
+    if (priv->collection != NULL) {
+        g_signal_handlers_disconnect_by_data (priv->collection, object);
+        g_clear_object (&priv->collection);
+    }
+
+    G_OBJECT_CLASS (books_scanner_parent_class)->dispose (object);
+}
+
+static void
+books_scanner_finalize (GObject *object)
+{
+    BooksScannerPrivate *priv;
+
+    priv = BOOKS_SCANNER_GET_PRIVATE (object);
+    g_object_unref (priv->cancellable);
+    g_hash_table_destroy (priv->monitors);
+    g_hash_table_destroy (priv->pending);
+    g_ptr_array_unref (priv->duplicates);
+
+    G_OBJECT_CLASS (books_scanner_parent_class)->finalize (object);
+}
+
+static void
+books_scanner_class_init (BooksScannerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->dispose = books_scanner_dispose;
+    object_class->finalize = books_scanner_finalize;
+
+    /* Passes a GPtrArray of BooksDuplicate, owned by the scanner */
+    scanner_signals[DUPLICATES_FOUND] =
+        g_signal_new ("duplicates-found",
+                      G_OBJECT_CLASS_TYPE (klass),
+                      G_SIGNAL_RUN_LAST,
+                      0, NULL, NULL,
+                      g_cclosure_marshal_VOID__POINTER,
+                      G_TYPE_NONE, 1, G_TYPE_POINTER);
+
+    g_type_class_add_private (klass, sizeof(BooksScannerPrivate));
+}
+
+static void
+books_scanner_init (BooksScanner *scanner)
+{
+    BooksScannerPrivate *priv;
+
+    scanner->priv = priv = BOOKS_SCANNER_GET_PRIVATE (scanner);
+
+    priv->collection = NULL;
+    priv->cancellable = g_cancellable_new ();
+    priv->monitors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_monitor);
+    priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    priv->pending_source = 0;
+    priv->scanning = FALSE;
+    priv->duplicates = g_ptr_array_new_with_free_func ((GDestroyNotify) books_duplicate_free);
+
+    priv->settings = g_settings_new ("com.github.matze.books");
+
+    g_signal_connect (priv->settings, "changed::library-folders",
+                      G_CALLBACK (on_library_folders_changed), scanner);
+
+    g_signal_connect (priv->settings, "changed::libraries",
+                      G_CALLBACK (on_library_folders_changed), scanner);
+}
@@ -0,0 +1,38 @@
+#ifndef BOOKS_SCANNER_H
+#define BOOKS_SCANNER_H
+
+#include <gio/gio.h>
+
+#include "books-collection.h"
+
+G_BEGIN_DECLS
+
+#define BOOKS_TYPE_SCANNER             (books_scanner_get_type())
+#define BOOKS_SCANNER(obj)             (G_TYPE_CHECK_INSTANCE_CAST((obj), BOOKS_TYPE_SCANNER, BooksScanner))
+#define BOOKS_IS_SCANNER(obj)          (G_TYPE_CHECK_INSTANCE_TYPE((obj), BOOKS_TYPE_SCANNER))
+#define BOOKS_SCANNER_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST((klass), BOOKS_TYPE_SCANNER, BooksScannerClass))
+#define BOOKS_IS_SCANNER_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE((klass), BOOKS_TYPE_SCANNER))
+#define BOOKS_SCANNER_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS((obj), BOOKS_TYPE_SCANNER, BooksScannerClass))
+
+
+typedef struct _BooksScanner           BooksScanner;
+typedef struct _BooksScannerClass      BooksScannerClass;
+typedef struct _BooksScannerPrivate    BooksScannerPrivate;
+
+struct _BooksScanner {
+    GObject parent;
+
+    BooksScannerPrivate *priv;
+};
+
+struct _BooksScannerClass {
+    GObjectClass parent_class;
+};
+
+BooksScanner    *books_scanner_new              (BooksCollection    *collection);
+void             books_scanner_rescan           (BooksScanner       *scanner);
+GType            books_scanner_get_type         (void);
+
+G_END_DECLS
+
+#endif
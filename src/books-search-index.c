@@ -0,0 +1,334 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "books-search-index.h"
+
+/*
+ * Trigram index over normalized search keys. Every three consecutive
+ * characters of a key map to the ids of all books containing them, which
+ * finds books sharing most trigrams with a term without looking at every
+ * key, e.g. "dostoyevsky" for "dostoevsky".
+ *
+ * Removing a book only forgets its key. The stale postings are skipped
+ * while matching and dropped by the next rebuild.
+ */
+
+/* Rebuild postings once they are mostly stale */
+#define MIN_STALE_FOR_REBUILD   1024
+
+struct _BooksSearchIndex {
+    GHashTable  *keys;
+    GHashTable  *postings;
+    guint        stale;
+};
+
+typedef void (*TrigramFunc) (const gchar *trigram, gpointer user_data);
+
+
+static void
+foreach_trigram (const gchar *text,
+                 TrigramFunc func,
+                 gpointer user_data)
+{
+    const gchar *first;
+
+    for (first = text; *first != '\0'; first = g_utf8_next_char (first)) {
+        const gchar *second;
+        const gchar *third;
+        const gchar *end;
+        gchar *trigram;
+
+        second = g_utf8_next_char (first);
+
+        if (*second == '\0')
+            break;
+
+        third = g_utf8_next_char (second);
+
+        if (*third == '\0')
+            break;
+
+        /* Trigrams never span the fields of a key */
+        if (*first == '\n' || *second == '\n' || *third == '\n')
+            continue;
+
+        end = g_utf8_next_char (third);
+        trigram = g_strndup (first, end - first);
+        func (trigram, user_data);
+        g_free (trigram);
+    }
+}
+
+static void
+add_to_set (const gchar *trigram,
+            GHashTable *set)
+{
+    if (!g_hash_table_contains (set, trigram))
+        g_hash_table_add (set, g_strdup (trigram));
+}
+
+static GHashTable *
+get_trigram_set (const gchar *text)
+{
+    GHashTable *set;
+
+    set = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    foreach_trigram (text, (TrigramFunc) add_to_set, set);
+
+    return set;
+}
+
+static void
+add_postings (BooksSearchIndex *index,
+              gint64 id,
+              const gchar *key)
+{
+    GHashTable *trigrams;
+    GHashTableIter iter;
+    gchar *trigram;
+
+    trigrams = get_trigram_set (key);
+    g_hash_table_iter_init (&iter, trigrams);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *) &trigram, NULL)) {
+        GArray *ids;
+
+        ids = g_hash_table_lookup (index->postings, trigram);
+
+        if (ids == NULL) {
+            ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+            g_hash_table_insert (index->postings, g_strdup (trigram), ids);
+        }
+
+        g_array_append_val (ids, id);
+    }
+
+    g_hash_table_destroy (trigrams);
+}
+
+static void
+rebuild_postings (BooksSearchIndex *index)
+{
+    GHashTableIter iter;
+    gint64 *id;
+    gchar *key;
+
+    g_hash_table_remove_all (index->postings);
+    g_hash_table_iter_init (&iter, index->keys);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &key))
+        add_postings (index, *id, key);
+
+    index->stale = 0;
+}
+
+static void
+free_postings (GArray *ids)
+{
+    g_array_free (ids, TRUE);
+}
+
+BooksSearchIndex *
+books_search_index_new (void)
+{
+    BooksSearchIndex *index;
+
+    index = g_new0 (BooksSearchIndex, 1);
+    index->keys = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+    index->postings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_postings);
+    index->stale = 0;
+
+    return index;
+}
+
+void
+books_search_index_free (BooksSearchIndex *index)
+{
+    if (index == NULL)
+        return;
+
+    g_hash_table_destroy (index->keys);
+    g_hash_table_destroy (index->postings);
+    g_free (index);
+}
+
+/**
+ * Adds the normalized @key of book @id, replacing a previous key.
+ */
+void
+books_search_index_add (BooksSearchIndex *index,
+                        gint64 id,
+                        const gchar *key)
+{
+    gint64 *stored_id;
+
+    g_return_if_fail (index != NULL && key != NULL);
+
+    if (g_hash_table_contains (index->keys, &id))
+        books_search_index_remove (index, id);
+
+    stored_id = g_new (gint64, 1);
+    *stored_id = id;
+    g_hash_table_insert (index->keys, stored_id, g_strdup (key));
+    add_postings (index, id, key);
+}
+
+void
+books_search_index_remove (BooksSearchIndex *index,
+                           gint64 id)
+{
+    g_return_if_fail (index != NULL);
+
+    if (!g_hash_table_remove (index->keys, &id))
+        return;
+
+    index->stale++;
+
+    if (index->stale >= MIN_STALE_FOR_REBUILD && index->stale > g_hash_table_size (index->keys))
+        rebuild_postings (index);
+}
+
+const gchar *
+books_search_index_get_key (BooksSearchIndex *index,
+                            gint64 id)
+{
+    g_return_val_if_fail (index != NULL, NULL);
+    return g_hash_table_lookup (index->keys, &id);
+}
+
+/**
+ * Decomposes, strips accents and case folds @text, so that "Émile" and
+ * "emile" compare equal with a plain strstr(). Keys and terms have to be
+ * normalized this way.
+ */
+gchar *
+books_search_index_normalize (const gchar *text)
+{
+    GString *stripped;
+    gchar *decomposed;
+    gchar *folded;
+    const gchar *c;
+
+    decomposed = g_utf8_normalize (text != NULL ? text : "", -1, G_NORMALIZE_NFKD);
+
+    if (decomposed == NULL)
+        return g_strdup ("");
+
+    stripped = g_string_sized_new (strlen (decomposed));
+
+    for (c = decomposed; *c != '\0'; c = g_utf8_next_char (c)) {
+        gunichar ch;
+
+        ch = g_utf8_get_char (c);
+
+        if (g_unichar_type (ch) != G_UNICODE_NON_SPACING_MARK)
+            g_string_append_unichar (stripped, ch);
+    }
+
+    folded = g_utf8_casefold (stripped->str, stripped->len);
+    g_string_free (stripped, TRUE);
+    g_free (decomposed);
+
+    return folded;
+}
+
+static gint
+compare_matches (const BooksSearchMatch *a,
+                 const BooksSearchMatch *b)
+{
+    if (a->score != b->score)
+        return a->score < b->score ? 1 : -1;
+
+    return a->id < b->id ? -1 : (a->id > b->id ? 1 : 0);
+}
+
+/**
+ * Returns the books sharing at least @threshold of the trigrams of the
+ * normalized @term as an array of #BooksSearchMatch, best matches first.
+ * Terms shorter than three characters match nothing.
+ */
+GArray *
+books_search_index_match (BooksSearchIndex *index,
+                          const gchar *term,
+                          gdouble threshold)
+{
+    GHashTable *trigrams;
+    GHashTable *counts;
+    GHashTableIter iter;
+    GArray *matches;
+    gchar *trigram;
+    gint64 *id;
+    gpointer count;
+    guint n_trigrams;
+
+    g_return_val_if_fail (index != NULL && term != NULL, NULL);
+
+    matches = g_array_new (FALSE, FALSE, sizeof (BooksSearchMatch));
+    trigrams = get_trigram_set (term);
+    n_trigrams = g_hash_table_size (trigrams);
+
+    if (n_trigrams == 0) {
+        g_hash_table_destroy (trigrams);
+        return matches;
+    }
+
+    /* Keys point into the posting lists, which are not modified meanwhile */
+    counts = g_hash_table_new (g_int64_hash, g_int64_equal);
+    g_hash_table_iter_init (&iter, trigrams);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *) &trigram, NULL)) {
+        GArray *ids;
+        guint i;
+
+        ids = g_hash_table_lookup (index->postings, trigram);
+
+        if (ids == NULL)
+            continue;
+
+        for (i = 0; i < ids->len; i++) {
+            id = &g_array_index (ids, gint64, i);
+            count = g_hash_table_lookup (counts, id);
+            g_hash_table_insert (counts, id, GUINT_TO_POINTER (GPOINTER_TO_UINT (count) + 1));
+        }
+    }
+
+    g_hash_table_iter_init (&iter, counts);
+
+    while (g_hash_table_iter_next (&iter, (gpointer *) &id, &count)) {
+        BooksSearchMatch match;
+        GHashTableIter trigram_iter;
+        const gchar *key;
+        guint found = 0;
+
+        if ((gdouble) GPOINTER_TO_UINT (count) / n_trigrams < threshold)
+            continue;
+
+        key = g_hash_table_lookup (index->keys, id);
+
+        if (key == NULL)
+            continue;
+
+        /* Stale postings of a reused id must not count, check the key itself */
+        g_hash_table_iter_init (&trigram_iter, trigrams);
+
+        while (g_hash_table_iter_next (&trigram_iter, (gpointer *) &trigram, NULL)) {
+            if (strstr (key, trigram) != NULL)
+                found++;
+        }
+
+        match.id = *id;
+        match.score = (gdouble) found / n_trigrams;
+
+        if (match.score >= threshold)
+            g_array_append_val (matches, match);
+    }
+
+    g_array_sort (matches, (GCompareFunc) compare_matches);
+    g_hash_table_destroy (counts);
+    g_hash_table_destroy (trigrams);
+
+    return matches;
+}
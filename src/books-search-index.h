@@ -0,0 +1,31 @@
+#ifndef BOOKS_SEARCH_INDEX_H
+#define BOOKS_SEARCH_INDEX_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BooksSearchIndex BooksSearchIndex;
+
+typedef struct {
+    gint64  id;
+    gdouble score;
+} BooksSearchMatch;
+
+BooksSearchIndex *books_search_index_new        (void);
+void              books_search_index_free       (BooksSearchIndex   *index);
+void              books_search_index_add        (BooksSearchIndex   *index,
+                                                 gint64              id,
+                                                 const gchar        *key);
+void              books_search_index_remove     (BooksSearchIndex   *index,
+                                                 gint64              id);
+const gchar      *books_search_index_get_key    (BooksSearchIndex   *index,
+                                                 gint64              id);
+GArray           *books_search_index_match      (BooksSearchIndex   *index,
+                                                 const gchar        *term,
+                                                 gdouble             threshold);
+gchar            *books_search_index_normalize  (const gchar        *text);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,607 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <sqlite3.h>
+#include <gio/gio.h>
+
+#include "books-libraries.h"
+#include "books-search-index.h"
+#include "books-search-provider.h"
+#include "books-thumbnail.h"
+
+/*
+ * Answers searches of GNOME Shell over D-Bus without starting the user
+ * interface. The search keys stored with the books go into the trigram
+ * index once, which narrows down a term to the few books containing all
+ * of its trigrams. Only their keys are compared and only the books shown
+ * are read from the database. The index is loaded again when the
+ * application has changed the library, which SQLite tells cheaply.
+ */
+
+#define BUS_NAME            "com.github.matze.books.SearchProvider"
+#define OBJECT_PATH         "/com/github/matze/books/SearchProvider"
+
+/* Seconds without calls until the provider exits */
+#define INACTIVITY_TIMEOUT  60
+
+/* Milliseconds to wait for the application to release the database */
+#define BUSY_TIMEOUT        5000
+
+/* More results are of no use in the shell, refining finds the others */
+#define MAX_RESULTS         50
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='org.gnome.Shell.SearchProvider2'>"
+    "    <method name='GetInitialResultSet'>"
+    "      <arg type='as' name='terms' direction='in'/>"
+    "      <arg type='as' name='results' direction='out'/>"
+    "    </method>"
+    "    <method name='GetSubsearchResultSet'>"
+    "      <arg type='as' name='previous_results' direction='in'/>"
+    "      <arg type='as' name='terms' direction='in'/>"
+    "      <arg type='as' name='results' direction='out'/>"
+    "    </method>"
+    "    <method name='GetResultMetas'>"
+    "      <arg type='as' name='identifiers' direction='in'/>"
+    "      <arg type='aa{sv}' name='metas' direction='out'/>"
+    "    </method>"
+    "    <method name='ActivateResult'>"
+    "      <arg type='s' name='identifier' direction='in'/>"
+    "      <arg type='as' name='terms' direction='in'/>"
+    "      <arg type='u' name='timestamp' direction='in'/>"
+    "    </method>"
+    "    <method name='LaunchSearch'>"
+    "      <arg type='as' name='terms' direction='in'/>"
+    "      <arg type='u' name='timestamp' direction='in'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+typedef struct {
+    GMainLoop        *loop;
+    GSettings        *settings;
+    guint             timeout_source;
+    gint              status;
+
+    /* Database of the library shown and the index of its search keys */
+    sqlite3          *db;
+    gchar            *db_path;
+    gint64            version;
+    BooksSearchIndex *index;
+
+    /* Ids of all indexed books in title order */
+    GArray           *ids;
+} Provider;
+
+
+static gboolean
+on_inactivity_timeout (Provider *provider)
+{
+    provider->timeout_source = 0;
+    g_main_loop_quit (provider->loop);
+    return FALSE;
+}
+
+static void
+reset_inactivity_timeout (Provider *provider)
+{
+    if (provider->timeout_source != 0)
+        g_source_remove (provider->timeout_source);
+
+    provider->timeout_source = g_timeout_add_seconds (INACTIVITY_TIMEOUT,
+                                                      (GSourceFunc) on_inactivity_timeout,
+                                                      provider);
+}
+
+static void
+close_library (Provider *provider)
+{
+    if (provider->db != NULL) {
+        sqlite3_close (provider->db);
+        provider->db = NULL;
+    }
+
+    books_search_index_free (provider->index);
+    provider->index = NULL;
+
+    if (provider->ids != NULL) {
+        g_array_free (provider->ids, TRUE);
+        provider->ids = NULL;
+    }
+
+    g_free (provider->db_path);
+    provider->db_path = NULL;
+}
+
+/*
+ * Changes with every commit of another connection. SQLite before 3.8.8
+ * does not know data_version, then the generation of the snapshot is the
+ * best guess.
+ */
+static gint64
+get_version (sqlite3 *db)
+{
+    const gchar *generation_sql = "SELECT value FROM properties WHERE name = 'generation'";
+    sqlite3_stmt *stmt = NULL;
+    gint64 version = 0;
+
+    sqlite3_prepare_v2 (db, "PRAGMA data_version", -1, &stmt, NULL);
+
+    if (sqlite3_step (stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64 (stmt, 0);
+        sqlite3_finalize (stmt);
+        return version;
+    }
+
+    sqlite3_finalize (stmt);
+    sqlite3_prepare_v2 (db, generation_sql, -1, &stmt, NULL);
+
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+        version = sqlite3_column_int64 (stmt, 0);
+
+    sqlite3_finalize (stmt);
+    return version;
+}
+
+static void
+load_index (Provider *provider)
+{
+    const gchar *select_sql = "SELECT id, search_key FROM books "
+                              "WHERE NOT removed AND search_key IS NOT NULL ORDER BY title_key";
+    sqlite3_stmt *select_stmt = NULL;
+
+    books_search_index_free (provider->index);
+    provider->index = books_search_index_new ();
+
+    if (provider->ids != NULL)
+        g_array_free (provider->ids, TRUE);
+
+    provider->ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    sqlite3_prepare_v2 (provider->db, select_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        gint64 id;
+
+        id = sqlite3_column_int64 (select_stmt, 0);
+        books_search_index_add (provider->index, id, (const gchar *) sqlite3_column_text (select_stmt, 1));
+        g_array_append_val (provider->ids, id);
+    }
+
+    sqlite3_finalize (select_stmt);
+}
+
+/* Follows switching libraries and changes made by the application */
+static gboolean
+update_library (Provider *provider)
+{
+    gchar *library;
+    gchar *db_path;
+    gint64 version;
+
+    library = books_libraries_get_active (provider->settings);
+    db_path = books_libraries_get_database (provider->settings, library);
+    g_free (library);
+
+    if (db_path == NULL)
+        db_path = books_libraries_get_default_database ();
+
+    if (g_strcmp0 (db_path, provider->db_path))
+        close_library (provider);
+
+    if (provider->db == NULL) {
+        if (sqlite3_open_v2 (db_path, &provider->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+            sqlite3_close (provider->db);
+            provider->db = NULL;
+            g_free (db_path);
+            return FALSE;
+        }
+
+        sqlite3_busy_timeout (provider->db, BUSY_TIMEOUT);
+        provider->db_path = db_path;
+    }
+    else {
+        g_free (db_path);
+    }
+
+    version = get_version (provider->db);
+
+    if (provider->index == NULL || version != provider->version) {
+        load_index (provider);
+        provider->version = version;
+    }
+
+    return TRUE;
+}
+
+/* Returns the terms in the form of the search keys, empty ones dropped */
+static GPtrArray *
+normalize_terms (const gchar * const *terms)
+{
+    GPtrArray *normalized;
+    guint i;
+
+    normalized = g_ptr_array_new_with_free_func (g_free);
+
+    for (i = 0; terms[i] != NULL; i++) {
+        gchar *term;
+
+        term = books_search_index_normalize (terms[i]);
+
+        if (*term != '\0')
+            g_ptr_array_add (normalized, term);
+        else
+            g_free (term);
+    }
+
+    return normalized;
+}
+
+static gboolean
+matches_terms (Provider *provider,
+               gint64 id,
+               GPtrArray *terms)
+{
+    const gchar *key;
+    guint i;
+
+    key = books_search_index_get_key (provider->index, id);
+
+    if (key == NULL)
+        return FALSE;
+
+    for (i = 0; i < terms->len; i++) {
+        if (strstr (key, g_ptr_array_index (terms, i)) == NULL)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gint
+compare_keys (const gint64 *a,
+              const gint64 *b,
+              Provider *provider)
+{
+    return g_strcmp0 (books_search_index_get_key (provider->index, *a),
+                      books_search_index_get_key (provider->index, *b));
+}
+
+/* Sorts the found books by author and title and turns them into identifiers */
+static gchar **
+get_identifiers (Provider *provider,
+                 GArray *found)
+{
+    gchar **identifiers;
+    guint i;
+
+    g_array_sort_with_data (found, (GCompareDataFunc) compare_keys, provider);
+    identifiers = g_new0 (gchar *, found->len + 1);
+
+    for (i = 0; i < found->len; i++)
+        identifiers[i] = g_strdup_printf ("%" G_GINT64_FORMAT, g_array_index (found, gint64, i));
+
+    return identifiers;
+}
+
+static void
+add_candidate (Provider *provider,
+               gint64 id,
+               GPtrArray *terms,
+               GArray *found)
+{
+    if (found->len < MAX_RESULTS && matches_terms (provider, id, terms))
+        g_array_append_val (found, id);
+}
+
+static gchar **
+search_library (Provider *provider,
+                const gchar * const *terms)
+{
+    GPtrArray *normalized;
+    GArray *found;
+    const gchar *longest = NULL;
+    gchar **identifiers;
+    guint i;
+
+    if (!update_library (provider))
+        return g_new0 (gchar *, 1);
+
+    normalized = normalize_terms (terms);
+    found = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    for (i = 0; i < normalized->len; i++) {
+        const gchar *term;
+
+        term = g_ptr_array_index (normalized, i);
+
+        if (longest == NULL || g_utf8_strlen (term, -1) > g_utf8_strlen (longest, -1))
+            longest = term;
+    }
+
+    /* Books with all trigrams of a term are candidates for containing it */
+    if (longest != NULL && g_utf8_strlen (longest, -1) >= 3) {
+        GArray *matches;
+
+        matches = books_search_index_match (provider->index, longest, 1.0);
+
+        for (i = 0; i < matches->len && found->len < MAX_RESULTS; i++)
+            add_candidate (provider, g_array_index (matches, BooksSearchMatch, i).id, normalized, found);
+
+        g_array_free (matches, TRUE);
+    }
+    else if (longest != NULL) {
+        for (i = 0; i < provider->ids->len && found->len < MAX_RESULTS; i++)
+            add_candidate (provider, g_array_index (provider->ids, gint64, i), normalized, found);
+    }
+
+    identifiers = get_identifiers (provider, found);
+    g_array_free (found, TRUE);
+    g_ptr_array_free (normalized, TRUE);
+
+    return identifiers;
+}
+
+static gchar **
+refine_search (Provider *provider,
+               const gchar * const *previous,
+               const gchar * const *terms)
+{
+    GPtrArray *normalized;
+    GArray *found;
+    gchar **identifiers;
+    guint i;
+
+    /* A full list may have left out books matching the longer terms */
+    if (g_strv_length ((gchar **) previous) >= MAX_RESULTS || !update_library (provider))
+        return search_library (provider, terms);
+
+    normalized = normalize_terms (terms);
+    found = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+    for (i = 0; previous[i] != NULL; i++)
+        add_candidate (provider, g_ascii_strtoll (previous[i], NULL, 10), normalized, found);
+
+    identifiers = get_identifiers (provider, found);
+    g_array_free (found, TRUE);
+    g_ptr_array_free (normalized, TRUE);
+
+    return identifiers;
+}
+
+static GVariant *
+get_result_metas (Provider *provider,
+                  const gchar * const *identifiers)
+{
+    const gchar *select_sql = "SELECT author, title, path, size, mtime, thumbnail FROM books WHERE id = ?";
+    sqlite3_stmt *select_stmt = NULL;
+    GVariantBuilder metas;
+    guint i;
+
+    g_variant_builder_init (&metas, G_VARIANT_TYPE ("aa{sv}"));
+
+    if (provider->db == NULL)
+        return g_variant_builder_end (&metas);
+
+    sqlite3_prepare_v2 (provider->db, select_sql, -1, &select_stmt, NULL);
+
+    for (i = 0; identifiers[i] != NULL; i++) {
+        const gchar *author;
+        const gchar *title;
+        gchar *name;
+
+        sqlite3_reset (select_stmt);
+        sqlite3_bind_int64 (select_stmt, 1, g_ascii_strtoll (identifiers[i], NULL, 10));
+
+        if (sqlite3_step (select_stmt) != SQLITE_ROW)
+            continue;
+
+        author = (const gchar *) sqlite3_column_text (select_stmt, 0);
+        title = (const gchar *) sqlite3_column_text (select_stmt, 1);
+
+        g_variant_builder_open (&metas, G_VARIANT_TYPE ("a{sv}"));
+        g_variant_builder_add (&metas, "{sv}", "id", g_variant_new_string (identifiers[i]));
+        g_variant_builder_add (&metas, "{sv}", "name", g_variant_new_string (title != NULL ? title : ""));
+        g_variant_builder_add (&metas, "{sv}", "description", g_variant_new_string (author != NULL ? author : ""));
+
+        name = g_strdup ((const gchar *) sqlite3_column_text (select_stmt, 5));
+
+        /* Books imported before thumbnails existed */
+        if (name == NULL && sqlite3_column_text (select_stmt, 2) != NULL)
+            name = books_thumbnail_get_name ((const gchar *) sqlite3_column_text (select_stmt, 2),
+                                             sqlite3_column_int64 (select_stmt, 3),
+                                             sqlite3_column_int64 (select_stmt, 4));
+
+        /* Without a cover the shell shows the application icon */
+        if (name != NULL) {
+            gchar *thumbnail_path;
+
+            thumbnail_path = books_thumbnail_get_path (name, 2);
+
+            if (g_file_test (thumbnail_path, G_FILE_TEST_EXISTS)) {
+                GFile *file;
+                GIcon *icon;
+                gchar *icon_name;
+
+                file = g_file_new_for_path (thumbnail_path);
+                icon = g_file_icon_new (file);
+                icon_name = g_icon_to_string (icon);
+                g_variant_builder_add (&metas, "{sv}", "gicon", g_variant_new_string (icon_name));
+                g_free (icon_name);
+                g_object_unref (icon);
+                g_object_unref (file);
+            }
+
+            g_free (thumbnail_path);
+            g_free (name);
+        }
+
+        g_variant_builder_close (&metas);
+    }
+
+    sqlite3_finalize (select_stmt);
+    return g_variant_builder_end (&metas);
+}
+
+/* Starts the application, with the book at @path if not %NULL */
+static void
+launch_books (const gchar *path)
+{
+    gchar *argv[] = { BINDIR G_DIR_SEPARATOR_S "books", (gchar *) path, NULL };
+    GError *error = NULL;
+
+    if (!g_spawn_async (NULL, argv, NULL, 0, NULL, NULL, NULL, &error)) {
+        g_warning ("Could not start books: %s", error->message);
+        g_error_free (error);
+    }
+}
+
+static void
+activate_result (Provider *provider,
+                 const gchar *identifier)
+{
+    const gchar *select_sql = "SELECT path FROM books WHERE id = ?";
+    sqlite3_stmt *select_stmt = NULL;
+
+    if (provider->db == NULL)
+        return;
+
+    sqlite3_prepare_v2 (provider->db, select_sql, -1, &select_stmt, NULL);
+    sqlite3_bind_int64 (select_stmt, 1, g_ascii_strtoll (identifier, NULL, 10));
+
+    if (sqlite3_step (select_stmt) == SQLITE_ROW)
+        launch_books ((const gchar *) sqlite3_column_text (select_stmt, 0));
+
+    sqlite3_finalize (select_stmt);
+}
+
+static void
+handle_method_call (GDBusConnection *connection,
+                    const gchar *sender,
+                    const gchar *object_path,
+                    const gchar *interface_name,
+                    const gchar *method_name,
+                    GVariant *parameters,
+                    GDBusMethodInvocation *invocation,
+                    Provider *provider)
+{
+    reset_inactivity_timeout (provider);
+
+    if (!g_strcmp0 (method_name, "GetInitialResultSet")) {
+        const gchar **terms;
+        gchar **results;
+
+        g_variant_get (parameters, "(^a&s)", &terms);
+        results = search_library (provider, terms);
+        g_dbus_method_invocation_return_value (invocation, g_variant_new ("(^as)", results));
+        g_strfreev (results);
+        g_free (terms);
+    }
+    else if (!g_strcmp0 (method_name, "GetSubsearchResultSet")) {
+        const gchar **previous;
+        const gchar **terms;
+        gchar **results;
+
+        g_variant_get (parameters, "(^a&s^a&s)", &previous, &terms);
+        results = refine_search (provider, previous, terms);
+        g_dbus_method_invocation_return_value (invocation, g_variant_new ("(^as)", results));
+        g_strfreev (results);
+        g_free (previous);
+        g_free (terms);
+    }
+    else if (!g_strcmp0 (method_name, "GetResultMetas")) {
+        const gchar **identifiers;
+
+        g_variant_get (parameters, "(^a&s)", &identifiers);
+        g_dbus_method_invocation_return_value (invocation,
+                                               g_variant_new ("(@aa{sv})", get_result_metas (provider, identifiers)));
+        g_free (identifiers);
+    }
+    else if (!g_strcmp0 (method_name, "ActivateResult")) {
+        const gchar *identifier;
+
+        g_variant_get (parameters, "(&sasu)", &identifier, NULL, NULL);
+        activate_result (provider, identifier);
+        g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+    else if (!g_strcmp0 (method_name, "LaunchSearch")) {
+        launch_books (NULL);
+        g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+    (GDBusInterfaceMethodCallFunc) handle_method_call,
+    NULL,
+    NULL
+};
+
+static void
+on_bus_acquired (GDBusConnection *connection,
+                 const gchar *name,
+                 Provider *provider)
+{
+    GDBusNodeInfo *info;
+    GError *error = NULL;
+
+    info = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+    g_dbus_connection_register_object (connection, OBJECT_PATH, info->interfaces[0],
+                                       &interface_vtable, provider, NULL, &error);
+
+    if (error != NULL) {
+        g_warning ("Could not register the search provider: %s", error->message);
+        g_error_free (error);
+        provider->status = 1;
+        g_main_loop_quit (provider->loop);
+    }
+
+    g_dbus_node_info_unref (info);
+}
+
+static void
+on_name_lost (GDBusConnection *connection,
+              const gchar *name,
+              Provider *provider)
+{
+    g_warning ("Could not own %s on the session bus", name);
+    provider->status = 1;
+    g_main_loop_quit (provider->loop);
+}
+
+/**
+ * Serves searches on the session bus until nobody asked for a while.
+ * Returns the exit status.
+ */
+gint
+books_search_provider_run (void)
+{
+    Provider provider;
+    guint owner_id;
+
+    memset (&provider, 0, sizeof (Provider));
+    provider.loop = g_main_loop_new (NULL, FALSE);
+    provider.settings = g_settings_new ("com.github.matze.books");
+    provider.version = -1;
+
+    owner_id = g_bus_own_name (G_BUS_TYPE_SESSION, BUS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE,
+                               (GBusAcquiredCallback) on_bus_acquired, NULL,
+                               (GBusNameLostCallback) on_name_lost,
+                               &provider, NULL);
+
+    reset_inactivity_timeout (&provider);
+    g_main_loop_run (provider.loop);
+
+    g_bus_unown_name (owner_id);
+
+    if (provider.timeout_source != 0)
+        g_source_remove (provider.timeout_source);
+
+    close_library (&provider);
+    g_object_unref (provider.settings);
+    g_main_loop_unref (provider.loop);
+
+    return provider.status;
+}
@@ -0,0 +1,12 @@
+#ifndef BOOKS_SEARCH_PROVIDER_H
+#define BOOKS_SEARCH_PROVIDER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gint             books_search_provider_run      (void);
+
+G_END_DECLS
+
+#endif
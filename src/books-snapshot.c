@@ -0,0 +1,303 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <sqlite3.h>
+
+#include "books-snapshot.h"
+#include "books-thumbnail.h"
+
+/*
+ * A snapshot is a binary copy of everything the views display, written
+ * after the collection changed and mapped at startup instead of querying
+ * meta.db. It is laid out as
+ *
+ *   SnapshotHeader
+ *   SnapshotRow[n_rows]    sorted by id
+ *   string table           NUL-terminated strings, rows refer to offsets
+ *
+ * in host byte order. It is only used if its generation matches the one
+ * stored in meta.db, i.e. if no change happened since it was written.
+ */
+
+#define SNAPSHOT_MAGIC          "BOOKSNP2"
+#define SNAPSHOT_BYTE_ORDER     0x01020304
+
+typedef struct {
+    gchar   magic[8];
+    guint32 byte_order;
+    guint32 n_rows;
+    gint64  generation;
+} SnapshotHeader;
+
+typedef struct {
+    gint64  id;
+    guint32 author;
+    guint32 title;
+    guint32 path;
+    guint32 cover;
+    guint32 thumbnail;
+    guint32 series;
+    gdouble series_index;
+} SnapshotRow;
+
+struct _BooksSnapshot {
+    GMappedFile         *file;
+    const SnapshotRow   *rows;
+    guint                n_rows;
+    const gchar         *strings;
+    gsize                strings_size;
+};
+
+
+/**
+ * Maps the snapshot in @filename. Returns %NULL if it does not exist, is
+ * damaged or does not belong to @generation of the database.
+ */
+BooksSnapshot *
+books_snapshot_open (const gchar *filename,
+                     gint64 generation)
+{
+    BooksSnapshot *snapshot;
+    GMappedFile *file;
+    const SnapshotHeader *header;
+    const gchar *contents;
+    gsize length;
+    gsize strings_offset;
+    guint i;
+
+    file = g_mapped_file_new (filename, FALSE, NULL);
+
+    if (file == NULL)
+        return NULL;
+
+    contents = g_mapped_file_get_contents (file);
+    length = g_mapped_file_get_length (file);
+    header = (const SnapshotHeader *) contents;
+
+    if (length < sizeof (SnapshotHeader) ||
+        memcmp (header->magic, SNAPSHOT_MAGIC, sizeof (header->magic)) ||
+        header->byte_order != SNAPSHOT_BYTE_ORDER ||
+        header->generation != generation)
+        goto open_snapshot_invalid;
+
+    strings_offset = sizeof (SnapshotHeader) + (gsize) header->n_rows * sizeof (SnapshotRow);
+
+    /* The string table must end with a terminator, so no string runs over */
+    if (strings_offset >= length || contents[length - 1] != '\0')
+        goto open_snapshot_invalid;
+
+    snapshot = g_new0 (BooksSnapshot, 1);
+    snapshot->file = file;
+    snapshot->rows = (const SnapshotRow *) (contents + sizeof (SnapshotHeader));
+    snapshot->n_rows = header->n_rows;
+    snapshot->strings = contents + strings_offset;
+    snapshot->strings_size = length - strings_offset;
+
+    for (i = 0; i < snapshot->n_rows; i++) {
+        const SnapshotRow *row;
+
+        row = &snapshot->rows[i];
+
+        if (row->author >= snapshot->strings_size || row->title >= snapshot->strings_size ||
+            row->path >= snapshot->strings_size || row->cover >= snapshot->strings_size ||
+            row->thumbnail >= snapshot->strings_size || row->series >= snapshot->strings_size ||
+            (i > 0 && row->id <= snapshot->rows[i - 1].id)) {
+            g_free (snapshot);
+            goto open_snapshot_invalid;
+        }
+    }
+
+    return snapshot;
+
+open_snapshot_invalid:
+    g_mapped_file_unref (file);
+    return NULL;
+}
+
+void
+books_snapshot_free (BooksSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+
+    g_mapped_file_unref (snapshot->file);
+    g_free (snapshot);
+}
+
+/**
+ * Returns the ids of all books in ascending order.
+ */
+GArray *
+books_snapshot_get_ids (BooksSnapshot *snapshot)
+{
+    GArray *ids;
+    guint i;
+
+    g_return_val_if_fail (snapshot != NULL, NULL);
+
+    ids = g_array_sized_new (FALSE, FALSE, sizeof (gint64), snapshot->n_rows);
+
+    for (i = 0; i < snapshot->n_rows; i++)
+        g_array_append_val (ids, snapshot->rows[i].id);
+
+    return ids;
+}
+
+/**
+ * Fills @row with strings pointing into the snapshot, which are valid
+ * until it is freed.
+ */
+gboolean
+books_snapshot_lookup (BooksSnapshot *snapshot,
+                       gint64 id,
+                       BooksSnapshotRow *row)
+{
+    guint low;
+    guint high;
+
+    g_return_val_if_fail (snapshot != NULL && row != NULL, FALSE);
+
+    low = 0;
+    high = snapshot->n_rows;
+
+    while (low < high) {
+        const SnapshotRow *candidate;
+        guint middle;
+
+        middle = low + (high - low) / 2;
+        candidate = &snapshot->rows[middle];
+
+        if (candidate->id < id)
+            low = middle + 1;
+        else if (candidate->id > id)
+            high = middle;
+        else {
+            row->author = snapshot->strings + candidate->author;
+            row->title = snapshot->strings + candidate->title;
+            row->path = snapshot->strings + candidate->path;
+            row->cover = snapshot->strings + candidate->cover;
+            row->thumbnail = snapshot->strings + candidate->thumbnail;
+            row->series = candidate->series != 0 ? snapshot->strings + candidate->series : NULL;
+            row->series_index = candidate->series_index;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static guint32
+add_string (GString *strings,
+            const gchar *string)
+{
+    guint32 offset;
+
+    /* Offset 0 is the empty string */
+    if (string == NULL || *string == '\0')
+        return 0;
+
+    offset = strings->len;
+    g_string_append_len (strings, string, strlen (string) + 1);
+    return offset;
+}
+
+/**
+ * Writes a snapshot of the database at @db_path to @filename. Uses its
+ * own connection and can be called from any thread.
+ */
+gboolean
+books_snapshot_write (const gchar *db_path,
+                      const gchar *filename,
+                      GError **error)
+{
+    SnapshotHeader header;
+    GArray *rows;
+    GString *strings;
+    GString *contents;
+    sqlite3 *db;
+    sqlite3_stmt *select_stmt = NULL;
+    gchar *dirname;
+    gboolean success;
+
+    if (sqlite3_open_v2 (db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                     "Could not open `%s': %s", db_path, sqlite3_errmsg (db));
+        sqlite3_close (db);
+        return FALSE;
+    }
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, SNAPSHOT_MAGIC, sizeof (header.magic));
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+
+    rows = g_array_new (FALSE, FALSE, sizeof (SnapshotRow));
+    strings = g_string_new_len ("", 1);
+
+    /* Generation and rows have to be read from the same state */
+    sqlite3_exec (db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    sqlite3_prepare_v2 (db, "SELECT value FROM properties WHERE name = 'generation'", -1, &select_stmt, NULL);
+
+    if (sqlite3_step (select_stmt) == SQLITE_ROW)
+        header.generation = sqlite3_column_int64 (select_stmt, 0);
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_prepare_v2 (db, "SELECT id, author, title, path, cover, thumbnail, size, mtime, series, series_index "
+                        "FROM books WHERE NOT removed ORDER BY id",
+                        -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        SnapshotRow row;
+        const gchar *path;
+
+        path = (const gchar *) sqlite3_column_text (select_stmt, 3);
+
+        memset (&row, 0, sizeof (row));
+        row.id = sqlite3_column_int64 (select_stmt, 0);
+        row.author = add_string (strings, (const gchar *) sqlite3_column_text (select_stmt, 1));
+        row.title = add_string (strings, (const gchar *) sqlite3_column_text (select_stmt, 2));
+        row.path = add_string (strings, path);
+        row.cover = add_string (strings, (const gchar *) sqlite3_column_text (select_stmt, 4));
+
+        if (sqlite3_column_type (select_stmt, 5) != SQLITE_NULL)
+            row.thumbnail = add_string (strings, (const gchar *) sqlite3_column_text (select_stmt, 5));
+        else {
+            gchar *thumbnail;
+
+            thumbnail = books_thumbnail_get_name (path,
+                                                  sqlite3_column_int64 (select_stmt, 6),
+                                                  sqlite3_column_int64 (select_stmt, 7));
+            row.thumbnail = add_string (strings, thumbnail);
+            g_free (thumbnail);
+        }
+
+        row.series = add_string (strings, (const gchar *) sqlite3_column_text (select_stmt, 8));
+        row.series_index = sqlite3_column_double (select_stmt, 9);
+        g_array_append_val (rows, row);
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_exec (db, "COMMIT TRANSACTION", NULL, NULL, NULL);
+    sqlite3_close (db);
+
+    header.n_rows = rows->len;
+
+    /* Replaced atomically, readers never see a partially written file */
+    dirname = g_path_get_dirname (filename);
+    g_mkdir_with_parents (dirname, 0700);
+
+    contents = g_string_sized_new (sizeof (header) + rows->len * sizeof (SnapshotRow) + strings->len);
+    g_string_append_len (contents, (const gchar *) &header, sizeof (header));
+    g_string_append_len (contents, rows->data, rows->len * sizeof (SnapshotRow));
+    g_string_append_len (contents, strings->str, strings->len);
+
+    success = g_file_set_contents (filename, contents->str, contents->len, error);
+
+    g_string_free (contents, TRUE);
+    g_free (dirname);
+    g_string_free (strings, TRUE);
+    g_array_free (rows, TRUE);
+
+    return success;
+}
@@ -0,0 +1,33 @@
+#ifndef BOOKS_SNAPSHOT_H
+#define BOOKS_SNAPSHOT_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BooksSnapshot BooksSnapshot;
+
+typedef struct {
+    const gchar *author;
+    const gchar *title;
+    const gchar *path;
+    const gchar *cover;
+    const gchar *thumbnail;
+    const gchar *series;
+    gdouble      series_index;
+} BooksSnapshotRow;
+
+BooksSnapshot   *books_snapshot_open            (const gchar        *filename,
+                                                 gint64              generation);
+void             books_snapshot_free            (BooksSnapshot      *snapshot);
+GArray          *books_snapshot_get_ids         (BooksSnapshot      *snapshot);
+gboolean         books_snapshot_lookup          (BooksSnapshot      *snapshot,
+                                                 gint64              id,
+                                                 BooksSnapshotRow   *row);
+gboolean         books_snapshot_write           (const gchar        *db_path,
+                                                 const gchar        *filename,
+                                                 GError            **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,99 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "books-string-pool.h"
+
+/*
+ * Shared copies of strings that repeat across many books, such as
+ * authors, series and folders. Every distinct string is stored once and
+ * counted, it goes away with the last row that uses it. Unlike
+ * g_intern_string, nothing is kept after switching libraries.
+ */
+
+typedef struct {
+    guint        count;
+    gchar        string[1];
+} Entry;
+
+struct _BooksStringPool {
+    /* Maps the stored strings to the entries holding them */
+    GHashTable  *strings;
+};
+
+
+BooksStringPool *
+books_string_pool_new (void)
+{
+    BooksStringPool *pool;
+
+    pool = g_new0 (BooksStringPool, 1);
+    pool->strings = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+    return pool;
+}
+
+void
+books_string_pool_free (BooksStringPool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    g_hash_table_destroy (pool->strings);
+    g_free (pool);
+}
+
+/**
+ * Returns the pooled copy of @string, which stays valid until it is
+ * released as often as it was acquired. %NULL is passed through.
+ */
+const gchar *
+books_string_pool_acquire (BooksStringPool *pool,
+                           const gchar *string)
+{
+    Entry *entry;
+    gsize length;
+
+    g_return_val_if_fail (pool != NULL, NULL);
+
+    if (string == NULL)
+        return NULL;
+
+    entry = g_hash_table_lookup (pool->strings, string);
+
+    if (entry == NULL) {
+        /* Count and characters share one allocation */
+        length = strlen (string);
+        entry = g_malloc (G_STRUCT_OFFSET (Entry, string) + length + 1);
+        entry->count = 0;
+        memcpy (entry->string, string, length + 1);
+        g_hash_table_insert (pool->strings, entry->string, entry);
+    }
+
+    entry->count++;
+    return entry->string;
+}
+
+void
+books_string_pool_release (BooksStringPool *pool,
+                           const gchar *string)
+{
+    Entry *entry;
+
+    g_return_if_fail (pool != NULL);
+
+    if (string == NULL)
+        return;
+
+    entry = g_hash_table_lookup (pool->strings, string);
+
+    if (entry == NULL) {
+        g_warning ("%s is not in the string pool", string);
+        return;
+    }
+
+    if (--entry->count == 0)
+        g_hash_table_remove (pool->strings, entry->string);
+}
@@ -0,0 +1,19 @@
+#ifndef BOOKS_STRING_POOL_H
+#define BOOKS_STRING_POOL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BooksStringPool BooksStringPool;
+
+BooksStringPool *books_string_pool_new          (void);
+void             books_string_pool_free         (BooksStringPool    *pool);
+const gchar     *books_string_pool_acquire      (BooksStringPool    *pool,
+                                                 const gchar        *string);
+void             books_string_pool_release      (BooksStringPool    *pool,
+                                                 const gchar        *string);
+
+G_END_DECLS
+
+#endif
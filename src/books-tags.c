@@ -0,0 +1,404 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "books-tags.h"
+
+/*
+ * Tags, shown as shelves, are stored in the tags and book_tags tables and
+ * mirrored as one bitmap of book ids per tag. Any combination of tags is
+ * then a few bitmap operations instead of a query. Names are compared
+ * case-insensitively and a tag exists as long as it holds books.
+ */
+
+typedef struct {
+    gint64       id;
+    gchar       *name;
+    BooksBitmap *books;
+} Tag;
+
+struct _BooksTags {
+    sqlite3     *db;
+
+    /* Maps casefolded names to tags */
+    GHashTable  *tags;
+};
+
+
+static void
+free_tag (Tag *tag)
+{
+    g_free (tag->name);
+    books_bitmap_free (tag->books);
+    g_free (tag);
+}
+
+/* Book ids are rowids, which stay far below 2^32 in practice */
+static gboolean
+fits_bitmap (gint64 book_id)
+{
+    return book_id >= 0 && book_id <= G_MAXUINT32;
+}
+
+static Tag *
+lookup_tag (BooksTags *tags,
+            const gchar *name)
+{
+    Tag *tag;
+    gchar *key;
+
+    key = g_utf8_casefold (name, -1);
+    tag = g_hash_table_lookup (tags->tags, key);
+    g_free (key);
+
+    return tag;
+}
+
+static Tag *
+insert_tag (BooksTags *tags,
+            gint64 id,
+            const gchar *name)
+{
+    Tag *tag;
+
+    tag = g_new0 (Tag, 1);
+    tag->id = id;
+    tag->name = g_strdup (name);
+    tag->books = books_bitmap_new ();
+
+    g_hash_table_insert (tags->tags, g_utf8_casefold (name, -1), tag);
+    return tag;
+}
+
+BooksTags *
+books_tags_new (sqlite3 *db)
+{
+    const gchar *tags_sql = "SELECT id, name FROM tags";
+    const gchar *books_sql = "SELECT tag_id, book_id FROM book_tags";
+    sqlite3_stmt *select_stmt = NULL;
+    BooksTags *tags;
+    GHashTable *by_id;
+
+    tags = g_new0 (BooksTags, 1);
+    tags->db = db;
+    tags->tags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_tag);
+    by_id = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+    sqlite3_prepare_v2 (db, tags_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        Tag *tag;
+
+        tag = insert_tag (tags, sqlite3_column_int64 (select_stmt, 0),
+                          (const gchar *) sqlite3_column_text (select_stmt, 1));
+        g_hash_table_insert (by_id, &tag->id, tag);
+    }
+
+    sqlite3_finalize (select_stmt);
+    sqlite3_prepare_v2 (db, books_sql, -1, &select_stmt, NULL);
+
+    while (sqlite3_step (select_stmt) == SQLITE_ROW) {
+        Tag *tag;
+        gint64 tag_id;
+        gint64 book_id;
+
+        tag_id = sqlite3_column_int64 (select_stmt, 0);
+        book_id = sqlite3_column_int64 (select_stmt, 1);
+        tag = g_hash_table_lookup (by_id, &tag_id);
+
+        if (tag != NULL && fits_bitmap (book_id))
+            books_bitmap_add (tag->books, (guint32) book_id);
+    }
+
+    sqlite3_finalize (select_stmt);
+    g_hash_table_destroy (by_id);
+
+    return tags;
+}
+
+void
+books_tags_free (BooksTags *tags)
+{
+    if (tags == NULL)
+        return;
+
+    g_hash_table_destroy (tags->tags);
+    g_free (tags);
+}
+
+static gint
+compare_names (const gchar **a,
+               const gchar **b)
+{
+    return g_utf8_collate (*a, *b);
+}
+
+static gchar **
+collect_names (GPtrArray *names)
+{
+    g_ptr_array_sort (names, (GCompareFunc) compare_names);
+    g_ptr_array_add (names, NULL);
+    return (gchar **) g_ptr_array_free (names, FALSE);
+}
+
+/**
+ * Returns the names of all tags in locale order. Free with g_strfreev().
+ */
+gchar **
+books_tags_get_names (BooksTags *tags)
+{
+    GHashTableIter iter;
+    GPtrArray *names;
+    Tag *tag;
+
+    g_return_val_if_fail (tags != NULL, NULL);
+
+    names = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, tags->tags);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &tag))
+        g_ptr_array_add (names, g_strdup (tag->name));
+
+    return collect_names (names);
+}
+
+/**
+ * Returns the names of the tags of @book_id. Free with g_strfreev().
+ */
+gchar **
+books_tags_get_book_tags (BooksTags *tags,
+                          gint64 book_id)
+{
+    GHashTableIter iter;
+    GPtrArray *names;
+    Tag *tag;
+
+    g_return_val_if_fail (tags != NULL, NULL);
+
+    names = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, tags->tags);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &tag)) {
+        if (fits_bitmap (book_id) && books_bitmap_contains (tag->books, (guint32) book_id))
+            g_ptr_array_add (names, g_strdup (tag->name));
+    }
+
+    return collect_names (names);
+}
+
+/**
+ * Tags @book_ids with @name, creating the tag if it does not exist yet.
+ */
+void
+books_tags_add (BooksTags *tags,
+                const gchar *name,
+                GArray *book_ids)
+{
+    const gchar *tag_sql = "INSERT INTO tags (name) VALUES (?)";
+    const gchar *insert_sql = "INSERT OR IGNORE INTO book_tags (tag_id, book_id) VALUES (?, ?)";
+    sqlite3_stmt *insert_stmt = NULL;
+    Tag *tag;
+    guint i;
+
+    g_return_if_fail (tags != NULL && name != NULL);
+
+    if (book_ids->len == 0)
+        return;
+
+    sqlite3_exec (tags->db, "SAVEPOINT add_tag", NULL, NULL, NULL);
+    tag = lookup_tag (tags, name);
+
+    if (tag == NULL) {
+        sqlite3_prepare_v2 (tags->db, tag_sql, -1, &insert_stmt, NULL);
+        sqlite3_bind_text (insert_stmt, 1, name, strlen (name), NULL);
+        sqlite3_step (insert_stmt);
+        sqlite3_finalize (insert_stmt);
+
+        tag = insert_tag (tags, sqlite3_last_insert_rowid (tags->db), name);
+    }
+
+    sqlite3_prepare_v2 (tags->db, insert_sql, -1, &insert_stmt, NULL);
+
+    for (i = 0; i < book_ids->len; i++) {
+        gint64 book_id;
+
+        book_id = g_array_index (book_ids, gint64, i);
+
+        if (!fits_bitmap (book_id))
+            continue;
+
+        sqlite3_reset (insert_stmt);
+        sqlite3_bind_int64 (insert_stmt, 1, tag->id);
+        sqlite3_bind_int64 (insert_stmt, 2, book_id);
+        sqlite3_step (insert_stmt);
+
+        books_bitmap_add (tag->books, (guint32) book_id);
+    }
+
+    sqlite3_finalize (insert_stmt);
+    sqlite3_exec (tags->db, "RELEASE add_tag", NULL, NULL, NULL);
+}
+
+static void
+delete_tag (BooksTags *tags,
+            Tag *tag)
+{
+    const gchar *delete_sql = "DELETE FROM tags WHERE id = ?";
+    sqlite3_stmt *delete_stmt = NULL;
+
+    sqlite3_prepare_v2 (tags->db, delete_sql, -1, &delete_stmt, NULL);
+    sqlite3_bind_int64 (delete_stmt, 1, tag->id);
+    sqlite3_step (delete_stmt);
+    sqlite3_finalize (delete_stmt);
+}
+
+/**
+ * Removes the tag @name from @book_ids. The tag is deleted once it holds
+ * no books anymore.
+ */
+void
+books_tags_remove (BooksTags *tags,
+                   const gchar *name,
+                   GArray *book_ids)
+{
+    const gchar *remove_sql = "DELETE FROM book_tags WHERE tag_id = ? AND book_id = ?";
+    sqlite3_stmt *remove_stmt = NULL;
+    Tag *tag;
+    guint i;
+
+    g_return_if_fail (tags != NULL && name != NULL);
+
+    tag = lookup_tag (tags, name);
+
+    if (tag == NULL)
+        return;
+
+    sqlite3_exec (tags->db, "SAVEPOINT remove_tag", NULL, NULL, NULL);
+    sqlite3_prepare_v2 (tags->db, remove_sql, -1, &remove_stmt, NULL);
+
+    for (i = 0; i < book_ids->len; i++) {
+        gint64 book_id;
+
+        book_id = g_array_index (book_ids, gint64, i);
+
+        if (!fits_bitmap (book_id))
+            continue;
+
+        sqlite3_reset (remove_stmt);
+        sqlite3_bind_int64 (remove_stmt, 1, tag->id);
+        sqlite3_bind_int64 (remove_stmt, 2, book_id);
+        sqlite3_step (remove_stmt);
+
+        books_bitmap_remove (tag->books, (guint32) book_id);
+    }
+
+    sqlite3_finalize (remove_stmt);
+
+    if (books_bitmap_get_cardinality (tag->books) == 0) {
+        gchar *key;
+
+        delete_tag (tags, tag);
+        key = g_utf8_casefold (name, -1);
+        g_hash_table_remove (tags->tags, key);
+        g_free (key);
+    }
+
+    sqlite3_exec (tags->db, "RELEASE remove_tag", NULL, NULL, NULL);
+}
+
+/**
+ * Drops @book_id from all tags after it has been removed from the
+ * collection. Its rows in book_tags are deleted by a trigger.
+ */
+void
+books_tags_forget_book (BooksTags *tags,
+                        gint64 book_id)
+{
+    GHashTableIter iter;
+    Tag *tag;
+
+    g_return_if_fail (tags != NULL);
+
+    if (!fits_bitmap (book_id))
+        return;
+
+    g_hash_table_iter_init (&iter, tags->tags);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &tag)) {
+        if (!books_bitmap_contains (tag->books, (guint32) book_id))
+            continue;
+
+        books_bitmap_remove (tag->books, (guint32) book_id);
+
+        if (books_bitmap_get_cardinality (tag->books) == 0) {
+            delete_tag (tags, tag);
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+
+/**
+ * Evaluates @terms, which all have to be satisfied. A term is a comma
+ * separated list of tag names of which a book needs at least one, or none
+ * if it starts with "-". Sets @included to the books satisfying the
+ * positive terms or to %NULL if there are none, and @excluded to the
+ * books ruled out by the negated ones or to %NULL. Free both with
+ * books_bitmap_free(). Returns %FALSE if there are no terms at all.
+ */
+gboolean
+books_tags_match (BooksTags *tags,
+                  gchar **terms,
+                  BooksBitmap **included,
+                  BooksBitmap **excluded)
+{
+    guint i;
+
+    g_return_val_if_fail (tags != NULL, FALSE);
+
+    *included = NULL;
+    *excluded = NULL;
+
+    if (terms == NULL || terms[0] == NULL)
+        return FALSE;
+
+    for (i = 0; terms[i] != NULL; i++) {
+        BooksBitmap *any;
+        gboolean negated;
+        gchar **names;
+        guint j;
+
+        negated = terms[i][0] == '-';
+        names = g_strsplit (negated ? terms[i] + 1 : terms[i], ",", -1);
+        any = books_bitmap_new ();
+
+        for (j = 0; names[j] != NULL; j++) {
+            Tag *tag;
+
+            tag = lookup_tag (tags, g_strstrip (names[j]));
+
+            if (tag != NULL)
+                books_bitmap_or (any, tag->books);
+        }
+
+        g_strfreev (names);
+
+        if (negated && *excluded != NULL) {
+            books_bitmap_or (*excluded, any);
+            books_bitmap_free (any);
+        }
+        else if (negated) {
+            *excluded = any;
+        }
+        else if (*included != NULL) {
+            books_bitmap_and (*included, any);
+            books_bitmap_free (any);
+        }
+        else {
+            *included = any;
+        }
+    }
+
+    return TRUE;
+}
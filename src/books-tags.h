@@ -0,0 +1,33 @@
+#ifndef BOOKS_TAGS_H
+#define BOOKS_TAGS_H
+
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "books-bitmap.h"
+
+G_BEGIN_DECLS
+
+typedef struct _BooksTags BooksTags;
+
+BooksTags       *books_tags_new                 (sqlite3            *db);
+void             books_tags_free                (BooksTags          *tags);
+gchar          **books_tags_get_names           (BooksTags          *tags);
+gchar          **books_tags_get_book_tags       (BooksTags          *tags,
+                                                 gint64              book_id);
+void             books_tags_add                 (BooksTags          *tags,
+                                                 const gchar        *name,
+                                                 GArray             *book_ids);
+void             books_tags_remove              (BooksTags          *tags,
+                                                 const gchar        *name,
+                                                 GArray             *book_ids);
+void             books_tags_forget_book         (BooksTags          *tags,
+                                                 gint64              book_id);
+gboolean         books_tags_match               (BooksTags          *tags,
+                                                 gchar             **terms,
+                                                 BooksBitmap       **included,
+                                                 BooksBitmap       **excluded);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,210 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <glib/gstdio.h>
+
+#include "books-thumbnail.h"
+
+/*
+ * Thumbnails are pre-scaled covers stored as small PNGs below the user
+ * cache directory. They are generated once when a book is imported, so
+ * that showing a cover never touches the original, possibly huge, image.
+ */
+
+static gchar *
+get_thumbnail_dir (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "books", "thumbnails", NULL);
+}
+
+/**
+ * Returns the name of the thumbnail of the book at @path. The name
+ * changes whenever the file does, which makes stale thumbnails unused.
+ */
+gchar *
+books_thumbnail_get_name (const gchar *path,
+                          goffset size,
+                          gint64 mtime)
+{
+    gchar *key;
+    gchar *name;
+
+    key = g_strdup_printf ("%s:%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                           path, (gint64) size, mtime);
+    name = g_compute_checksum_for_string (G_CHECKSUM_MD5, key, -1);
+    g_free (key);
+
+    return name;
+}
+
+gchar *
+books_thumbnail_get_path (const gchar *name,
+                          gint scale)
+{
+    gchar *dir;
+    gchar *filename;
+    gchar *path;
+
+    dir = get_thumbnail_dir ();
+
+    if (scale > 1)
+        filename = g_strdup_printf ("%s@%ix.png", name, scale);
+    else
+        filename = g_strdup_printf ("%s.png", name);
+
+    path = g_build_filename (dir, filename, NULL);
+    g_free (filename);
+    g_free (dir);
+
+    return path;
+}
+
+static gboolean
+save_thumbnail (GdkPixbuf *pixbuf,
+                const gchar *name,
+                gint scale,
+                GError **error)
+{
+    gchar *path;
+    gchar *tmp_path;
+    gboolean success;
+
+    /* Readers on other threads must never see a half-written file */
+    path = books_thumbnail_get_path (name, scale);
+    tmp_path = g_strconcat (path, ".tmp", NULL);
+    success = gdk_pixbuf_save (pixbuf, tmp_path, "png", error, NULL);
+
+    if (success && g_rename (tmp_path, path) != 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Could not rename `%s'", tmp_path);
+        success = FALSE;
+    }
+
+    if (!success)
+        g_unlink (tmp_path);
+
+    g_free (tmp_path);
+    g_free (path);
+
+    return success;
+}
+
+static gboolean
+save_thumbnails (GdkPixbuf *large,
+                 const gchar *name,
+                 GError **error)
+{
+    GdkPixbuf *small;
+    gchar *dir;
+    gint height;
+    gboolean success;
+
+    dir = get_thumbnail_dir ();
+    g_mkdir_with_parents (dir, 0700);
+    g_free (dir);
+
+    /* The 1x version is scaled from 2x */
+    height = MAX (1, (gdk_pixbuf_get_height (large) + 1) / 2);
+    small = gdk_pixbuf_scale_simple (large, BOOKS_THUMBNAIL_WIDTH, height, GDK_INTERP_BILINEAR);
+
+    success = save_thumbnail (large, name, 2, error) &&
+              save_thumbnail (small, name, 1, error);
+
+    g_object_unref (small);
+
+    return success;
+}
+
+/**
+ * Creates the 1x and 2x thumbnails of the @cover image. Can be called
+ * from any thread.
+ */
+gboolean
+books_thumbnail_create (const gchar *cover,
+                        const gchar *name,
+                        GError **error)
+{
+    GdkPixbuf *large;
+    gboolean success;
+
+    g_return_val_if_fail (cover != NULL && name != NULL, FALSE);
+
+    /* The original is decoded only once */
+    large = gdk_pixbuf_new_from_file_at_size (cover, 2 * BOOKS_THUMBNAIL_WIDTH, -1, error);
+
+    if (large == NULL)
+        return FALSE;
+
+    success = save_thumbnails (large, name, error);
+    g_object_unref (large);
+
+    return success;
+}
+
+/**
+ * Creates the thumbnails from a @cover that is already decoded, e.g. by
+ * the thumbnailer of the file manager.
+ */
+gboolean
+books_thumbnail_create_from_pixbuf (GdkPixbuf *cover,
+                                    const gchar *name,
+                                    GError **error)
+{
+    GdkPixbuf *large;
+    gint height;
+    gboolean success;
+
+    g_return_val_if_fail (GDK_IS_PIXBUF (cover) && name != NULL, FALSE);
+
+    height = gdk_pixbuf_get_height (cover) * 2 * BOOKS_THUMBNAIL_WIDTH / gdk_pixbuf_get_width (cover);
+    large = gdk_pixbuf_scale_simple (cover, 2 * BOOKS_THUMBNAIL_WIDTH, MAX (1, height), GDK_INTERP_BILINEAR);
+
+    success = save_thumbnails (large, name, error);
+    g_object_unref (large);
+
+    return success;
+}
+
+/**
+ * Returns %TRUE if both thumbnails called @name were created before.
+ */
+gboolean
+books_thumbnail_exists (const gchar *name)
+{
+    gchar *path;
+    gboolean exists;
+
+    g_return_val_if_fail (name != NULL, FALSE);
+
+    path = books_thumbnail_get_path (name, 1);
+    exists = g_file_test (path, G_FILE_TEST_EXISTS);
+    g_free (path);
+
+    if (!exists)
+        return FALSE;
+
+    path = books_thumbnail_get_path (name, 2);
+    exists = g_file_test (path, G_FILE_TEST_EXISTS);
+    g_free (path);
+
+    return exists;
+}
+
+void
+books_thumbnail_remove (const gchar *name)
+{
+    gchar *path;
+
+    if (name == NULL)
+        return;
+
+    path = books_thumbnail_get_path (name, 1);
+    g_unlink (path);
+    g_free (path);
+
+    path = books_thumbnail_get_path (name, 2);
+    g_unlink (path);
+    g_free (path);
+}
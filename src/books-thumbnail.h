@@ -0,0 +1,28 @@
+#ifndef BOOKS_THUMBNAIL_H
+#define BOOKS_THUMBNAIL_H
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+/* Width of thumbnails at scale 1, height follows the aspect ratio */
+#define BOOKS_THUMBNAIL_WIDTH   64
+
+gchar           *books_thumbnail_get_name       (const gchar        *path,
+                                                 goffset             size,
+                                                 gint64              mtime);
+gchar           *books_thumbnail_get_path       (const gchar        *name,
+                                                 gint                scale);
+gboolean         books_thumbnail_create         (const gchar        *cover,
+                                                 const gchar        *name,
+                                                 GError            **error);
+gboolean         books_thumbnail_create_from_pixbuf
+                                                (GdkPixbuf          *cover,
+                                                 const gchar        *name,
+                                                 GError            **error);
+gboolean         books_thumbnail_exists         (const gchar        *name);
+void             books_thumbnail_remove         (const gchar        *name);
+
+G_END_DECLS
+
+#endif
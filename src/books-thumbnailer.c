@@ -0,0 +1,204 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <locale.h>
+
+#include <gio/gio.h>
+#include <glib/gi18n.h>
+
+#include "books-epub.h"
+#include "books-thumbnail.h"
+
+/*
+ * Thumbnailer for file managers, following the freedesktop.org thumbnail
+ * specification. It shares the thumbnails of the library view, so a cover
+ * is decoded once no matter whether the file manager or the library sees
+ * the book first.
+ */
+
+static gint thumbnail_size = 128;
+static gchar **arguments = NULL;
+
+static GOptionEntry entries[] = {
+    { "size", 's', 0, G_OPTION_ARG_INT, &thumbnail_size,
+      N_("Largest width or height of the thumbnail"), N_("SIZE") },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &arguments,
+      NULL, N_("BOOK OUTPUT") },
+    { NULL }
+};
+
+
+/* Loads the thumbnail of the library if it is large enough */
+static GdkPixbuf *
+load_cached (const gchar *name)
+{
+    GdkPixbuf *pixbuf;
+    gchar *path;
+
+    path = books_thumbnail_get_path (name, 2);
+    pixbuf = gdk_pixbuf_new_from_file (path, NULL);
+    g_free (path);
+
+    if (pixbuf != NULL &&
+        MAX (gdk_pixbuf_get_width (pixbuf), gdk_pixbuf_get_height (pixbuf)) < thumbnail_size) {
+        g_object_unref (pixbuf);
+        pixbuf = NULL;
+    }
+
+    return pixbuf;
+}
+
+static GdkPixbuf *
+decode_cover (const gchar *path,
+              const gchar *name,
+              GError **error)
+{
+    GBytes *cover;
+    GInputStream *stream;
+    GdkPixbuf *pixbuf;
+    GError *tmp_error = NULL;
+
+    cover = books_epub_read_cover (path, error);
+
+    if (cover == NULL)
+        return NULL;
+
+    /* Large enough for both the file manager and the library view */
+    stream = g_memory_input_stream_new_from_bytes (cover);
+    pixbuf = gdk_pixbuf_new_from_stream_at_scale (stream,
+                                                  MAX (thumbnail_size, 2 * BOOKS_THUMBNAIL_WIDTH), -1,
+                                                  TRUE, NULL, error);
+    g_object_unref (stream);
+    g_bytes_unref (cover);
+
+    if (pixbuf != NULL && !books_thumbnail_exists (name) &&
+        !books_thumbnail_create_from_pixbuf (pixbuf, name, &tmp_error)) {
+        g_printerr ("%s\n", tmp_error->message);
+        g_error_free (tmp_error);
+    }
+
+    return pixbuf;
+}
+
+static GdkPixbuf *
+scale_to_size (GdkPixbuf *pixbuf)
+{
+    gint width;
+    gint height;
+    gdouble scale;
+
+    width = gdk_pixbuf_get_width (pixbuf);
+    height = gdk_pixbuf_get_height (pixbuf);
+
+    if (width <= thumbnail_size && height <= thumbnail_size)
+        return g_object_ref (pixbuf);
+
+    scale = MIN ((gdouble) thumbnail_size / width, (gdouble) thumbnail_size / height);
+
+    return gdk_pixbuf_scale_simple (pixbuf,
+                                    MAX (1, (gint) (width * scale + 0.5)),
+                                    MAX (1, (gint) (height * scale + 0.5)),
+                                    GDK_INTERP_BILINEAR);
+}
+
+static gboolean
+create_thumbnail (const gchar *input,
+                  const gchar *output,
+                  GError **error)
+{
+    GFile *file;
+    GFileInfo *info;
+    GdkPixbuf *pixbuf = NULL;
+    GdkPixbuf *thumbnail;
+    gchar *path;
+    gchar *name;
+    gboolean success = FALSE;
+
+    file = g_file_new_for_commandline_arg (input);
+    path = g_file_get_path (file);
+
+    if (path == NULL) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                     "`%s' is not a local file", input);
+        g_object_unref (file);
+        return FALSE;
+    }
+
+    info = g_file_query_info (file,
+                              G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                              G_FILE_QUERY_INFO_NONE, NULL, error);
+
+    if (info == NULL)
+        goto create_thumbnail_cleanup;
+
+    /* Named like the scanner does, the library view finds it as well */
+    name = books_thumbnail_get_name (path, g_file_info_get_size (info),
+                                     (gint64) g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
+
+    pixbuf = load_cached (name);
+
+    if (pixbuf == NULL)
+        pixbuf = decode_cover (path, name, error);
+
+    if (pixbuf != NULL) {
+        thumbnail = scale_to_size (pixbuf);
+        success = gdk_pixbuf_save (thumbnail, output, "png", error, NULL);
+        g_object_unref (thumbnail);
+        g_object_unref (pixbuf);
+    }
+
+    g_free (name);
+    g_object_unref (info);
+
+create_thumbnail_cleanup:
+    g_free (path);
+    g_object_unref (file);
+    return success;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+    GOptionContext *context;
+    gchar *locale_dir;
+    gint status = 0;
+    GError *error = NULL;
+
+    locale_dir = g_build_filename (DATADIR,
+                                   "locale",
+                                   NULL);
+    setlocale (LC_ALL, "");
+    bindtextdomain (GETTEXT_PACKAGE, locale_dir);
+    bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+    textdomain (GETTEXT_PACKAGE);
+    g_free (locale_dir);
+
+    context = g_option_context_new (NULL);
+    g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_option_context_free (context);
+        return 1;
+    }
+
+    g_option_context_free (context);
+
+    if (arguments == NULL || g_strv_length (arguments) != 2 || thumbnail_size <= 0) {
+        g_printerr (_("Usage: %s [-s SIZE] BOOK OUTPUT\n"), g_get_prgname ());
+        g_strfreev (arguments);
+        return 1;
+    }
+
+    if (!create_thumbnail (arguments[0], arguments[1], &error)) {
+        g_printerr ("%s: %s\n", arguments[0], error->message);
+        g_error_free (error);
+        status = 1;
+    }
+
+    g_strfreev (arguments);
+    return status;
+}
@@ -0,0 +1,322 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <libxml/parser.h>
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "books-epub.h"
+#include "books-verifier.h"
+
+/*
+ * Checks books in the background before they are opened: every entry of
+ * the archive is decompressed, so the CRCs are compared, and the package
+ * document named by the container has to parse. Reading is slowed down
+ * to a budget of bytes per second and done with idle I/O priority where
+ * the system has one, so it does not get in the way of reading.
+ */
+
+/* Bytes decompressed at once */
+#define READ_SIZE           (64 * 1024)
+
+/* Larger metadata files are not kept for parsing */
+#define MAX_METADATA_SIZE   (1024 * 1024)
+
+/* Longest sleep before cancellation is checked again, in microseconds */
+#define MAX_SLEEP           (100 * 1000)
+
+#define CONTAINER_PATH      "META-INF/container.xml"
+
+struct _BooksVerifier {
+    /* Bytes per second, 0 for no limit */
+    guint64      rate;
+
+    /* Bytes read since start */
+    gint64       start;
+    guint64      spent;
+};
+
+#if defined (__linux__) && defined (SYS_ioprio_set)
+
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   (3 << 13)
+
+/* Returns the previous priority, the thread goes back to the pool afterwards */
+static gint
+lower_io_priority (void)
+{
+    gint previous;
+
+    previous = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE);
+    return previous;
+}
+
+static void
+restore_io_priority (gint previous)
+{
+    if (previous >= 0)
+        syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, previous);
+}
+
+#else
+
+static gint
+lower_io_priority (void)
+{
+    return -1;
+}
+
+static void
+restore_io_priority (gint previous)
+{
+}
+
+#endif
+
+BooksVerifier *
+books_verifier_new (guint64 bytes_per_second)
+{
+    BooksVerifier *verifier;
+
+    verifier = g_new0 (BooksVerifier, 1);
+    verifier->rate = bytes_per_second;
+    verifier->start = g_get_monotonic_time ();
+
+    return verifier;
+}
+
+void
+books_verifier_free (BooksVerifier *verifier)
+{
+    g_free (verifier);
+}
+
+/*
+ * Accounts for @bytes just read and sleeps until they fit the budget.
+ * Time spent elsewhere is not saved up for a burst later. Returns %FALSE
+ * once @cancellable is cancelled.
+ */
+static gboolean
+throttle (BooksVerifier *verifier,
+          guint64 bytes,
+          GCancellable *cancellable)
+{
+    gint64 due;
+    gint64 now;
+
+    if (verifier->rate == 0)
+        return !g_cancellable_is_cancelled (cancellable);
+
+    verifier->spent += bytes;
+    due = verifier->start + (gint64) (verifier->spent * G_USEC_PER_SEC / verifier->rate);
+    now = g_get_monotonic_time ();
+
+    if (due <= now) {
+        verifier->start = now;
+        verifier->spent = 0;
+    }
+
+    while (due > now && !g_cancellable_is_cancelled (cancellable)) {
+        g_usleep (MIN (due - now, MAX_SLEEP));
+        now = g_get_monotonic_time ();
+    }
+
+    return !g_cancellable_is_cancelled (cancellable);
+}
+
+static gboolean
+is_metadata (const gchar *name)
+{
+    return g_strcmp0 (name, CONTAINER_PATH) == 0 || g_str_has_suffix (name, ".opf");
+}
+
+static gchar *
+get_rootfile_path (xmlDoc *container)
+{
+    xmlXPathContext *context;
+    xmlXPathObject *object;
+    gchar *path = NULL;
+
+    context = xmlXPathNewContext (container);
+    xmlXPathRegisterNs (context,
+                        (const xmlChar *) "c",
+                        (const xmlChar *) "urn:oasis:names:tc:opendocument:xmlns:container");
+
+    object = xmlXPathEvalExpression ((const xmlChar *) "//c:container/c:rootfiles/c:rootfile", context);
+
+    if (object != NULL && object->nodesetval != NULL && object->nodesetval->nodeNr > 0) {
+        xmlChar *value;
+
+        value = xmlGetProp (object->nodesetval->nodeTab[0], (const xmlChar *) "full-path");
+        path = g_strdup ((const gchar *) value);
+        xmlFree (value);
+    }
+
+    xmlXPathFreeObject (object);
+    xmlXPathFreeContext (context);
+    return path;
+}
+
+static xmlDoc *
+parse_metadata (GByteArray *data)
+{
+    return xmlReadMemory ((const gchar *) data->data, data->len, NULL, NULL,
+                          XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+}
+
+static gboolean
+check_package (GHashTable *metadata,
+               GError **error)
+{
+    GByteArray *data;
+    xmlDoc *container;
+    xmlDoc *package;
+    xmlNode *root;
+    gchar *opf_path;
+
+    data = g_hash_table_lookup (metadata, CONTAINER_PATH);
+    container = data != NULL ? parse_metadata (data) : NULL;
+
+    if (container == NULL) {
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_NO_META_DATA,
+                     _("The container file is missing or broken."));
+        return FALSE;
+    }
+
+    opf_path = get_rootfile_path (container);
+    xmlFreeDoc (container);
+
+    data = opf_path != NULL ? g_hash_table_lookup (metadata, opf_path) : NULL;
+    package = data != NULL ? parse_metadata (data) : NULL;
+    root = package != NULL ? xmlDocGetRootElement (package) : NULL;
+
+    if (root == NULL || xmlStrcmp (root->name, (const xmlChar *) "package")) {
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_NO_META_DATA,
+                     _("The package document %s is missing or broken."),
+                     opf_path != NULL ? opf_path : "");
+        xmlFreeDoc (package);
+        g_free (opf_path);
+        return FALSE;
+    }
+
+    xmlFreeDoc (package);
+    g_free (opf_path);
+    return TRUE;
+}
+
+/**
+ * Reads all of @path and returns %TRUE if it is a sound EPUB file.
+ * Otherwise @error says what is wrong with it, unless it has the
+ * %G_IO_ERROR domain: then the file could not be checked at all.
+ */
+gboolean
+books_verifier_check (BooksVerifier *verifier,
+                      const gchar *path,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+    struct archive *arch;
+    struct archive_entry *entry;
+    GHashTable *metadata;
+    guchar *buffer;
+    gint64 consumed = 0;
+    gint priority;
+    gint result;
+    gint fd;
+    gboolean success = FALSE;
+
+    g_return_val_if_fail (verifier != NULL && path != NULL, FALSE);
+
+    fd = g_open (path, O_RDONLY, 0);
+
+    if (fd < 0) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                     "Could not open %s", path);
+        return FALSE;
+    }
+
+    priority = lower_io_priority ();
+    arch = archive_read_new ();
+    archive_read_support_format_zip (arch);
+    metadata = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_byte_array_unref);
+    buffer = g_malloc (READ_SIZE);
+
+    if (archive_read_open_fd (arch, fd, READ_SIZE) != ARCHIVE_OK) {
+        g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                     _("The file is not a ZIP archive: %s"), archive_error_string (arch));
+        goto check_cleanup;
+    }
+
+    while ((result = archive_read_next_header (arch, &entry)) != ARCHIVE_EOF) {
+        GByteArray *data = NULL;
+        gssize length;
+
+        if (result < ARCHIVE_WARN) {
+            g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                         _("The archive is corrupted: %s"), archive_error_string (arch));
+            goto check_cleanup;
+        }
+
+        if (is_metadata (archive_entry_pathname (entry)) &&
+            archive_entry_size (entry) <= MAX_METADATA_SIZE) {
+            data = g_byte_array_new ();
+            g_hash_table_insert (metadata, g_strdup (archive_entry_pathname (entry)), data);
+        }
+
+        /* Decompressing to the end of an entry compares its CRC */
+        do {
+            gint64 total;
+
+            length = archive_read_data (arch, buffer, READ_SIZE);
+
+            if (length > 0 && data != NULL && data->len + length <= MAX_METADATA_SIZE)
+                g_byte_array_append (data, buffer, length);
+
+            total = archive_filter_bytes (arch, -1);
+
+            if (!throttle (verifier, total - consumed, cancellable)) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled");
+                goto check_cleanup;
+            }
+
+            consumed = total;
+        } while (length > 0);
+
+        if (length < 0) {
+            g_set_error (error, BOOKS_EPUB_ERROR, BOOKS_EPUB_ERROR_INVALID_ARCHIVE_FORMAT,
+                         _("%s is corrupted: %s"), archive_entry_pathname (entry),
+                         archive_error_string (arch));
+            goto check_cleanup;
+        }
+    }
+
+    success = check_package (metadata, error);
+
+check_cleanup:
+    archive_read_close (arch);
+    archive_read_free (arch);
+
+#ifdef POSIX_FADV_DONTNEED
+    /* Keep the page cache for what is being read */
+    posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    close (fd);
+    restore_io_priority (priority);
+    g_hash_table_destroy (metadata);
+    g_free (buffer);
+
+    return success;
+}
@@ -0,0 +1,19 @@
+#ifndef BOOKS_VERIFIER_H
+#define BOOKS_VERIFIER_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BooksVerifier BooksVerifier;
+
+BooksVerifier   *books_verifier_new             (guint64             bytes_per_second);
+void             books_verifier_free            (BooksVerifier      *verifier);
+gboolean         books_verifier_check           (BooksVerifier      *verifier,
+                                                 const gchar        *path,
+                                                 GCancellable       *cancellable,
+                                                 GError            **error);
+
+G_END_DECLS
+
+#endif
@@ -2,6 +2,8 @@
 #include "config.h"
 #endif
 
+#include <string.h>
+#include <glib/gi18n.h>
 #include <webkit/webkit.h>
 
 #include "books-window.h"
@@ -13,6 +15,18 @@ G_DEFINE_TYPE(BooksWindow, books_window, GTK_TYPE_WINDOW)
 
 #define BOOKS_WINDOW_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), BOOKS_TYPE_WINDOW, BooksWindowPrivate))
 
+/* Seconds scrolling is collected before the position is written */
+#define SAVE_POSITION_DELAY     3
+
+/* NodeFilter.SHOW_TEXT */
+#define SHOW_TEXT               4
+
+#define ANNOTATION_CLASS        "books-annotation"
+
+/* Inline, the style sheets of the book are disabled */
+#define HIGHLIGHT_STYLE         "background-color: #fce94f;"
+#define NOTE_STYLE              "background-color: #fce94f; border-bottom: 1px dotted #8f5902;"
+
 
 struct _BooksWindowPrivate {
     GSettings *settings;
@@ -22,11 +36,31 @@ struct _BooksWindowPrivate {
     GtkWidget *html_view;
     GtkWidget *go_forward_item;
     GtkWidget *go_back_item;
+    GtkWidget *highlight_item;
+    GtkWidget *note_item;
+    GtkWidget *unhighlight_item;
     BooksEpub *epub;
     gchar     *css_uri;
+
+    /* Keeps the reading position of the book at path */
+    BooksCollection *collection;
+    gchar     *path;
+    guint      save_source;
+
+    /* Scroll offset to restore once the document is laid out, or -1 */
+    gdouble    restore_fraction;
+
+    BooksAnnotations *annotations;
 };
 
-static void load_web_view_content       (BooksWindowPrivate *priv);
+/* Overlapping annotations are shown as one */
+typedef struct {
+    guint    start;
+    guint    end;
+    GString *note;
+} Segment;
+
+static void load_web_view_content       (BooksWindowPrivate *priv, const gchar *fragment);
 static void update_navigation_buttons   (BooksWindowPrivate *priv);
 
 
@@ -43,11 +77,492 @@ books_window_set_epub (BooksWindow *window,
     g_return_if_fail (BOOKS_IS_WINDOW (window));
 
     window->priv->epub = epub;
-    load_web_view_content (window->priv);
+    load_web_view_content (window->priv, NULL);
+}
+
+static gdouble
+get_scroll_range (GtkAdjustment *adjustment)
+{
+    return gtk_adjustment_get_upper (adjustment) - gtk_adjustment_get_page_size (adjustment);
+}
+
+static gboolean
+save_position (BooksWindowPrivate *priv)
+{
+    BooksPosition position;
+    GtkAdjustment *adjustment;
+    const gchar *uri;
+    gdouble range;
+
+    priv->save_source = 0;
+
+    if (priv->collection == NULL || priv->epub == NULL)
+        return FALSE;
+
+    adjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (priv->scrolled_window));
+    range = get_scroll_range (adjustment);
+    uri = webkit_web_view_get_uri (WEBKIT_WEB_VIEW (priv->html_view));
+
+    position.index = books_epub_get_index (priv->epub);
+    position.fragment = uri != NULL && strchr (uri, '#') != NULL ? strchr (uri, '#') + 1 : NULL;
+    position.fraction = range > 0.0 ? gtk_adjustment_get_value (adjustment) / range : 0.0;
+
+    /* Not laid out yet, what is stored is still right */
+    if (priv->restore_fraction >= 0.0)
+        position.fraction = priv->restore_fraction;
+
+    books_collection_set_position (priv->collection, priv->path, &position);
+    return FALSE;
+}
+
+/* Many scroll events end up in a single write */
+static void
+schedule_save_position (BooksWindowPrivate *priv)
+{
+    if (priv->collection != NULL && priv->save_source == 0)
+        priv->save_source = g_timeout_add_seconds (SAVE_POSITION_DELAY, (GSourceFunc) save_position, priv);
 }
 
 static void
-load_web_view_content (BooksWindowPrivate *priv)
+flush_position (BooksWindowPrivate *priv)
+{
+    if (priv->save_source != 0) {
+        g_source_remove (priv->save_source);
+        save_position (priv);
+    }
+}
+
+/*
+ * Applies the saved offset, which has to wait until the document is long
+ * enough to scroll there.
+ */
+static void
+restore_scroll_offset (BooksWindowPrivate *priv)
+{
+    GtkAdjustment *adjustment;
+    gdouble range;
+
+    if (priv->restore_fraction < 0.0)
+        return;
+
+    adjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (priv->scrolled_window));
+    range = get_scroll_range (adjustment);
+
+    if (range <= 0.0 && priv->restore_fraction > 0.0)
+        return;
+
+    /* At the top the fragment alone tells where to go */
+    if (priv->restore_fraction > 0.0)
+        gtk_adjustment_set_value (adjustment, priv->restore_fraction * range);
+
+    priv->restore_fraction = -1.0;
+}
+
+/**
+ * Shows @epub, which is the book at @path in @collection, where its
+ * reading stopped last time. The position is kept up to date from then on.
+ */
+void
+books_window_set_book (BooksWindow *window,
+                       BooksEpub *epub,
+                       BooksCollection *collection,
+                       const gchar *path)
+{
+    BooksWindowPrivate *priv;
+    BooksPosition position;
+
+    g_return_if_fail (BOOKS_IS_WINDOW (window) && BOOKS_IS_COLLECTION (collection) && path != NULL);
+
+    priv = window->priv;
+    priv->epub = epub;
+    priv->collection = g_object_ref (collection);
+    priv->path = g_strdup (path);
+    priv->annotations = books_collection_get_annotations (collection, path);
+
+    gtk_widget_set_sensitive (priv->highlight_item, priv->annotations != NULL);
+    gtk_widget_set_sensitive (priv->note_item, priv->annotations != NULL);
+    gtk_widget_set_sensitive (priv->unhighlight_item, priv->annotations != NULL);
+
+    if (!books_collection_get_position (collection, path, &position)) {
+        load_web_view_content (priv, NULL);
+        return;
+    }
+
+    /* The saved chapter is loaded right away instead of the first one */
+    books_epub_set_index (epub, position.index);
+    priv->restore_fraction = position.fraction;
+    load_web_view_content (priv, position.fragment);
+    g_free (position.fragment);
+}
+
+static glong
+get_text_length (const gchar *text)
+{
+    gunichar2 *utf16;
+    glong length = 0;
+
+    /* DOM offsets count UTF-16 units */
+    utf16 = g_utf8_to_utf16 (text != NULL ? text : "", -1, NULL, &length, NULL);
+    g_free (utf16);
+    return length;
+}
+
+static GArray *
+merge_annotations (GPtrArray *annotations)
+{
+    GArray *segments;
+    guint i;
+
+    segments = g_array_new (FALSE, FALSE, sizeof (Segment));
+
+    for (i = 0; i < annotations->len; i++) {
+        BooksAnnotation *annotation;
+        Segment *last;
+
+        annotation = g_ptr_array_index (annotations, i);
+        last = segments->len > 0 ? &g_array_index (segments, Segment, segments->len - 1) : NULL;
+
+        if (last != NULL && annotation->start < last->end) {
+            last->end = MAX (last->end, annotation->end);
+
+            if (annotation->note != NULL && last->note != NULL)
+                g_string_append_printf (last->note, "\n%s", annotation->note);
+            else if (annotation->note != NULL)
+                last->note = g_string_new (annotation->note);
+        }
+        else {
+            Segment segment;
+
+            segment.start = annotation->start;
+            segment.end = annotation->end;
+            segment.note = annotation->note != NULL ? g_string_new (annotation->note) : NULL;
+            g_array_append_val (segments, segment);
+        }
+    }
+
+    return segments;
+}
+
+static void
+free_segments (GArray *segments)
+{
+    guint i;
+
+    for (i = 0; i < segments->len; i++) {
+        Segment *segment;
+
+        segment = &g_array_index (segments, Segment, i);
+
+        if (segment->note != NULL)
+            g_string_free (segment->note, TRUE);
+    }
+
+    g_array_free (segments, TRUE);
+}
+
+static void
+wrap_text_node (WebKitDOMDocument *document,
+                WebKitDOMNode *node,
+                Segment *segment)
+{
+    WebKitDOMElement *span;
+    WebKitDOMNode *parent;
+
+    span = webkit_dom_document_create_element (document, "span", NULL);
+    webkit_dom_element_set_attribute (span, "class", ANNOTATION_CLASS, NULL);
+
+    if (segment->note != NULL) {
+        webkit_dom_element_set_attribute (span, "style", NOTE_STYLE, NULL);
+        webkit_dom_element_set_attribute (span, "title", segment->note->str, NULL);
+    }
+    else {
+        webkit_dom_element_set_attribute (span, "style", HIGHLIGHT_STYLE, NULL);
+    }
+
+    parent = webkit_dom_node_get_parent_node (node);
+    webkit_dom_node_replace_child (parent, WEBKIT_DOM_NODE (span), node, NULL);
+    webkit_dom_node_append_child (WEBKIT_DOM_NODE (span), node, NULL);
+}
+
+/*
+ * Wraps the parts of @node, which starts at @position of the document
+ * text, covered by segments from @current on. Leaves @current at the
+ * first segment reaching beyond the node.
+ */
+static void
+highlight_text_node (WebKitDOMDocument *document,
+                     WebKitDOMText *node,
+                     guint position,
+                     guint length,
+                     GArray *segments,
+                     guint *current)
+{
+    while (*current < segments->len) {
+        Segment *segment;
+        WebKitDOMText *rest = NULL;
+        guint first;
+        guint last;
+
+        segment = &g_array_index (segments, Segment, *current);
+
+        if (segment->start >= position + length)
+            return;
+
+        if (segment->end <= position) {
+            (*current)++;
+            continue;
+        }
+
+        first = MAX (segment->start, position) - position;
+        last = MIN (segment->end, position + length) - position;
+
+        if (first > 0)
+            node = webkit_dom_text_split_text (node, first, NULL);
+
+        if (last < length)
+            rest = webkit_dom_text_split_text (node, last - first, NULL);
+
+        wrap_text_node (document, WEBKIT_DOM_NODE (node), segment);
+
+        if (segment->end <= position + length)
+            (*current)++;
+
+        if (rest == NULL)
+            return;
+
+        node = rest;
+        position += last;
+        length -= last;
+    }
+}
+
+static void
+clear_annotations (WebKitDOMDocument *document)
+{
+    WebKitDOMNodeList *spans;
+    gulong i;
+
+    spans = webkit_dom_document_query_selector_all (document, "span." ANNOTATION_CLASS, NULL);
+
+    if (spans == NULL)
+        return;
+
+    for (i = 0; i < webkit_dom_node_list_get_length (spans); i++) {
+        WebKitDOMNode *span;
+        WebKitDOMNode *parent;
+        WebKitDOMNode *child;
+
+        span = webkit_dom_node_list_item (spans, i);
+        parent = webkit_dom_node_get_parent_node (span);
+
+        while ((child = webkit_dom_node_get_first_child (span)) != NULL)
+            webkit_dom_node_insert_before (parent, child, span, NULL);
+
+        webkit_dom_node_remove_child (parent, span, NULL);
+    }
+
+    /* Joins the text split up for highlighting */
+    webkit_dom_node_normalize (WEBKIT_DOM_NODE (webkit_dom_document_get_body (document)));
+}
+
+/*
+ * Marks the annotations of the current document once it is loaded. The
+ * text is walked a single time for all of them, they come sorted by start
+ * out of the annotation index.
+ */
+static void
+show_annotations (BooksWindowPrivate *priv)
+{
+    WebKitDOMDocument *document;
+    WebKitDOMHTMLElement *body;
+    WebKitDOMTreeWalker *walker;
+    WebKitDOMNode *node;
+    GPtrArray *found;
+    GPtrArray *nodes;
+    GArray *segments;
+    guint position = 0;
+    guint current = 0;
+    guint i;
+
+    if (priv->annotations == NULL)
+        return;
+
+    document = webkit_web_view_get_dom_document (WEBKIT_WEB_VIEW (priv->html_view));
+    body = document != NULL ? webkit_dom_document_get_body (document) : NULL;
+
+    if (body == NULL)
+        return;
+
+    clear_annotations (document);
+    found = books_annotations_lookup (priv->annotations, books_epub_get_index (priv->epub), 0, G_MAXUINT);
+
+    if (found->len == 0) {
+        g_ptr_array_free (found, TRUE);
+        return;
+    }
+
+    segments = merge_annotations (found);
+    g_ptr_array_free (found, TRUE);
+
+    /* Collected first, wrapping changes the tree under the walker */
+    walker = webkit_dom_document_create_tree_walker (document, WEBKIT_DOM_NODE (body), SHOW_TEXT,
+                                                     NULL, FALSE, NULL);
+    nodes = g_ptr_array_new ();
+
+    while ((node = webkit_dom_tree_walker_next_node (walker)) != NULL)
+        g_ptr_array_add (nodes, node);
+
+    for (i = 0; i < nodes->len && current < segments->len; i++) {
+        guint length;
+
+        node = g_ptr_array_index (nodes, i);
+        length = (guint) webkit_dom_character_data_get_length (WEBKIT_DOM_CHARACTER_DATA (node));
+        highlight_text_node (document, WEBKIT_DOM_TEXT (node), position, length, segments, &current);
+        position += length;
+    }
+
+    g_ptr_array_free (nodes, TRUE);
+    free_segments (segments);
+}
+
+/* Returns the offset of a point in the document text */
+static guint
+get_text_offset (WebKitDOMDocument *document,
+                 WebKitDOMNode *body,
+                 WebKitDOMNode *container,
+                 glong offset)
+{
+    WebKitDOMRange *range;
+    gchar *text;
+    guint length;
+
+    range = webkit_dom_document_create_range (document);
+    webkit_dom_range_set_start (range, body, 0, NULL);
+    webkit_dom_range_set_end (range, container, offset, NULL);
+
+    text = webkit_dom_range_to_string (range, NULL);
+    length = (guint) get_text_length (text);
+    g_free (text);
+
+    return length;
+}
+
+static gboolean
+get_selected_text_range (BooksWindowPrivate *priv,
+                         guint *start,
+                         guint *end)
+{
+    WebKitDOMDocument *document;
+    WebKitDOMHTMLElement *body;
+    WebKitDOMDOMSelection *selection;
+    WebKitDOMRange *range;
+
+    document = webkit_web_view_get_dom_document (WEBKIT_WEB_VIEW (priv->html_view));
+    body = document != NULL ? webkit_dom_document_get_body (document) : NULL;
+
+    if (body == NULL)
+        return FALSE;
+
+    selection = webkit_dom_dom_window_get_selection (webkit_dom_document_get_default_view (document));
+
+    if (selection == NULL || webkit_dom_dom_selection_get_range_count (selection) == 0)
+        return FALSE;
+
+    range = webkit_dom_dom_selection_get_range_at (selection, 0, NULL);
+
+    if (range == NULL || webkit_dom_range_get_collapsed (range, NULL))
+        return FALSE;
+
+    *start = get_text_offset (document, WEBKIT_DOM_NODE (body),
+                              webkit_dom_range_get_start_container (range, NULL),
+                              webkit_dom_range_get_start_offset (range, NULL));
+    *end = get_text_offset (document, WEBKIT_DOM_NODE (body),
+                            webkit_dom_range_get_end_container (range, NULL),
+                            webkit_dom_range_get_end_offset (range, NULL));
+
+    webkit_dom_dom_selection_remove_all_ranges (selection);
+    return *start < *end;
+}
+
+static gchar *
+ask_for_note (BooksWindowPrivate *priv)
+{
+    GtkWidget *dialog;
+    GtkWidget *entry;
+    gchar *note = NULL;
+
+    dialog = gtk_dialog_new_with_buttons (_("Add Note"), GTK_WINDOW (gtk_widget_get_toplevel (priv->main_box)),
+                                          GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                          GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                                          GTK_STOCK_ADD, GTK_RESPONSE_ACCEPT,
+                                          NULL);
+    gtk_dialog_set_default_response (GTK_DIALOG (dialog), GTK_RESPONSE_ACCEPT);
+
+    entry = gtk_entry_new ();
+    gtk_entry_set_activates_default (GTK_ENTRY (entry), TRUE);
+    gtk_container_set_border_width (GTK_CONTAINER (dialog), 6);
+    gtk_container_add (GTK_CONTAINER (gtk_dialog_get_content_area (GTK_DIALOG (dialog))), entry);
+    gtk_widget_show (entry);
+
+    if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
+        note = g_strstrip (g_strdup (gtk_entry_get_text (GTK_ENTRY (entry))));
+
+    gtk_widget_destroy (dialog);
+    return note;
+}
+
+static void
+on_highlight_clicked (GtkToolButton *button,
+                      BooksWindowPrivate *priv)
+{
+    guint start;
+    guint end;
+
+    if (priv->annotations == NULL || !get_selected_text_range (priv, &start, &end))
+        return;
+
+    books_annotations_add (priv->annotations, books_epub_get_index (priv->epub), start, end, NULL);
+    show_annotations (priv);
+}
+
+static void
+on_note_clicked (GtkToolButton *button,
+                 BooksWindowPrivate *priv)
+{
+    gchar *note;
+    guint start;
+    guint end;
+
+    if (priv->annotations == NULL || !get_selected_text_range (priv, &start, &end))
+        return;
+
+    note = ask_for_note (priv);
+
+    if (note != NULL) {
+        books_annotations_add (priv->annotations, books_epub_get_index (priv->epub), start, end, note);
+        show_annotations (priv);
+    }
+
+    g_free (note);
+}
+
+static void
+on_unhighlight_clicked (GtkToolButton *button,
+                        BooksWindowPrivate *priv)
+{
+    guint start;
+    guint end;
+
+    if (priv->annotations == NULL || !get_selected_text_range (priv, &start, &end))
+        return;
+
+    if (books_annotations_remove (priv->annotations, books_epub_get_index (priv->epub), start, end) > 0)
+        show_annotations (priv);
+}
+
+static void
+load_web_view_content (BooksWindowPrivate *priv,
+                       const gchar *fragment)
 {
     const gchar *uri;
 
@@ -55,8 +570,11 @@ load_web_view_content (BooksWindowPrivate *priv)
 
     if (uri != NULL) {
         WebKitWebSettings *settings;
+        gchar *anchored_uri;
 
-        webkit_web_view_load_uri (WEBKIT_WEB_VIEW (priv->html_view), uri);
+        anchored_uri = fragment != NULL ? g_strdup_printf ("%s#%s", uri, fragment) : g_strdup (uri);
+        webkit_web_view_load_uri (WEBKIT_WEB_VIEW (priv->html_view), anchored_uri);
+        g_free (anchored_uri);
         settings = webkit_web_view_get_settings (WEBKIT_WEB_VIEW (priv->html_view));
 
         g_object_set (G_OBJECT (settings),
@@ -83,7 +601,9 @@ on_go_back_clicked (GtkToolButton *button,
                     BooksWindowPrivate *priv)
 {
     books_epub_previous (priv->epub);
-    load_web_view_content (priv);
+    priv->restore_fraction = -1.0;
+    load_web_view_content (priv, NULL);
+    schedule_save_position (priv);
 }
 
 static void
@@ -91,7 +611,24 @@ on_go_forward_clicked (GtkToolButton *button,
                        BooksWindowPrivate *priv)
 {
     books_epub_next (priv->epub);
-    load_web_view_content (priv);
+    priv->restore_fraction = -1.0;
+    load_web_view_content (priv, NULL);
+    schedule_save_position (priv);
+}
+
+static void
+on_scroll_value_changed (GtkAdjustment *adjustment,
+                         BooksWindowPrivate *priv)
+{
+    schedule_save_position (priv);
+}
+
+static void
+on_scroll_range_changed (GtkAdjustment *adjustment,
+                         BooksWindowPrivate *priv)
+{
+    if (webkit_web_view_get_load_status (WEBKIT_WEB_VIEW (priv->html_view)) == WEBKIT_LOAD_FINISHED)
+        restore_scroll_offset (priv);
 }
 
 static void
@@ -113,8 +650,12 @@ on_load_status_changed (WebKitWebView *view,
         current_uri = books_epub_get_uri (priv->epub);
         load_uri = webkit_web_view_get_uri (view);
 
-        if (g_strcmp0 (current_uri, load_uri))
+        /* Following a link into another document */
+        if (g_strcmp0 (current_uri, load_uri)) {
             books_epub_set_uri (priv->epub, load_uri);
+            update_navigation_buttons (priv);
+            schedule_save_position (priv);
+        }
 
         document = webkit_web_view_get_dom_document (view);
         sheet_list = webkit_dom_document_get_style_sheets (document);
@@ -125,6 +666,9 @@ on_load_status_changed (WebKitWebView *view,
             style_sheet = webkit_dom_style_sheet_list_item (sheet_list, i);
             webkit_dom_style_sheet_set_disabled (style_sheet, TRUE);
         }
+
+        show_annotations (priv);
+        restore_scroll_offset (priv);
     }
 }
 
@@ -137,6 +681,9 @@ on_window_destroy (GtkWidget *widget,
     gtk_widget_get_allocation (widget, &allocation);
     g_settings_set (priv->settings, "viewer-window-size",
                     "(ii)", allocation.width, allocation.height);
+
+    /* The view still exists here, later the position would be lost */
+    flush_position (priv);
 }
 
 static void
@@ -146,11 +693,22 @@ books_window_dispose (GObject *object)
 
     priv = BOOKS_WINDOW_GET_PRIVATE (object);
 
+    if (priv->save_source != 0) {
+        g_source_remove (priv->save_source);
+        priv->save_source = 0;
+    }
+
     if (priv->epub != NULL) {
         g_object_unref (priv->epub);
         priv->epub = NULL;
     }
 
+    g_clear_object (&priv->collection);
+
+    /* Waits for the last changes to be written */
+    books_annotations_free (priv->annotations);
+    priv->annotations = NULL;
+
     G_OBJECT_CLASS (books_window_parent_class)->dispose (object);
 }
 
@@ -166,6 +724,8 @@ books_window_finalize (GObject *object)
         priv->css_uri = NULL;
     }
 
+    g_free (priv->path);
+
     G_OBJECT_CLASS (books_window_parent_class)->finalize (object);
 }
 
@@ -184,6 +744,7 @@ static void
 books_window_init (BooksWindow *window)
 {
     BooksWindowPrivate *priv;
+    GtkAdjustment *vadjustment;
     guint width, height;
 
     window->priv = priv = BOOKS_WINDOW_GET_PRIVATE (window);
@@ -197,6 +758,11 @@ books_window_init (BooksWindow *window)
     gtk_window_set_default_size (GTK_WINDOW (window), width, height);
 
     priv->epub = NULL;
+    priv->collection = NULL;
+    priv->path = NULL;
+    priv->save_source = 0;
+    priv->restore_fraction = -1.0;
+    priv->annotations = NULL;
     priv->main_box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
     gtk_container_add (GTK_CONTAINER (window), priv->main_box);
 
@@ -218,6 +784,33 @@ books_window_init (BooksWindow *window)
     g_signal_connect (priv->go_forward_item, "clicked",
                       G_CALLBACK (on_go_forward_clicked), priv);
 
+    gtk_toolbar_insert (GTK_TOOLBAR (priv->toolbar), gtk_separator_tool_item_new (), -1);
+
+    priv->highlight_item = GTK_WIDGET (gtk_tool_button_new (NULL, _("Highlight")));
+    gtk_tool_button_set_icon_name (GTK_TOOL_BUTTON (priv->highlight_item), "format-text-underline");
+    gtk_widget_set_tooltip_text (priv->highlight_item, _("Highlight the selected text"));
+    gtk_toolbar_insert (GTK_TOOLBAR (priv->toolbar), GTK_TOOL_ITEM (priv->highlight_item), -1);
+    gtk_widget_set_sensitive (priv->highlight_item, FALSE);
+
+    priv->note_item = GTK_WIDGET (gtk_tool_button_new_from_stock (GTK_STOCK_EDIT));
+    gtk_widget_set_tooltip_text (priv->note_item, _("Add a note to the selected text"));
+    gtk_toolbar_insert (GTK_TOOLBAR (priv->toolbar), GTK_TOOL_ITEM (priv->note_item), -1);
+    gtk_widget_set_sensitive (priv->note_item, FALSE);
+
+    priv->unhighlight_item = GTK_WIDGET (gtk_tool_button_new_from_stock (GTK_STOCK_CLEAR));
+    gtk_widget_set_tooltip_text (priv->unhighlight_item, _("Remove highlights and notes from the selected text"));
+    gtk_toolbar_insert (GTK_TOOLBAR (priv->toolbar), GTK_TOOL_ITEM (priv->unhighlight_item), -1);
+    gtk_widget_set_sensitive (priv->unhighlight_item, FALSE);
+
+    g_signal_connect (priv->highlight_item, "clicked",
+                      G_CALLBACK (on_highlight_clicked), priv);
+
+    g_signal_connect (priv->note_item, "clicked",
+                      G_CALLBACK (on_note_clicked), priv);
+
+    g_signal_connect (priv->unhighlight_item, "clicked",
+                      G_CALLBACK (on_unhighlight_clicked), priv);
+
     /* Add EPUB view */
     priv->scrolled_window = gtk_scrolled_window_new (NULL, NULL);
     gtk_container_add (GTK_CONTAINER (priv->main_box), priv->scrolled_window);
@@ -230,6 +823,14 @@ books_window_init (BooksWindow *window)
                       G_CALLBACK (on_load_status_changed),
                       priv);
 
+    vadjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (priv->scrolled_window));
+
+    g_signal_connect (vadjustment, "value-changed",
+                      G_CALLBACK (on_scroll_value_changed), priv);
+
+    g_signal_connect (vadjustment, "changed",
+                      G_CALLBACK (on_scroll_range_changed), priv);
+
     /* Create CSS uri if requested */
     if (g_settings_get_enum (priv->settings, "style-sheet") == BOOKS_STYLE_SHEET_BOOKS) {
         gchar *css_filename;
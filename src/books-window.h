@@ -4,6 +4,7 @@
 #include <gtk/gtk.h>
 
 #include "books-epub.h"
+#include "books-collection.h"
 
 G_BEGIN_DECLS
 
@@ -32,6 +33,10 @@ struct _BooksWindowClass {
 GtkWidget * books_window_new          (void);
 void        books_window_set_epub     (BooksWindow *window,
                                        BooksEpub *epub);
+void        books_window_set_book     (BooksWindow *window,
+                                       BooksEpub *epub,
+                                       BooksCollection *collection,
+                                       const gchar *path);
 GType       books_window_get_type     (void);
 
 G_END_DECLS
@@ -9,16 +9,89 @@
 #include <glib/gi18n.h>
 
 #include "books-main-window.h"
+#include "books-window.h"
+#include "books-collection.h"
+#include "books-search-provider.h"
 
+static gboolean search_provider = FALSE;
+static gchar **book_files = NULL;
+
+static GOptionEntry entries[] = {
+    { "search-provider", 0, 0, G_OPTION_ARG_NONE, &search_provider,
+      N_("Answer searches of the desktop shell on the session bus"), NULL },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &book_files,
+      NULL, N_("[BOOK...]") },
+    { NULL }
+};
+
+static guint n_book_windows = 0;
+
+
+static void
+on_book_window_destroyed (GtkWidget *window)
+{
+    if (--n_book_windows == 0)
+        gtk_main_quit ();
+}
+
+/*
+ * Shows the books given on the command line, e.g. by the search provider,
+ * without the library window. Reading positions and annotations are still
+ * kept in the library shown.
+ */
+static void
+open_books (void)
+{
+    BooksCollection *collection;
+    GSettings *settings;
+    gchar *library;
+    gchar *database;
+    guint i;
+
+    settings = g_settings_new ("com.github.matze.books");
+    library = books_libraries_get_active (settings);
+    database = books_libraries_get_database (settings, library);
+    collection = books_collection_new (database);
+
+    for (i = 0; book_files[i] != NULL; i++) {
+        GtkWidget *book_window;
+        BooksEpub *epub;
+        GError *error = NULL;
+
+        epub = books_epub_new ();
+
+        if (!books_epub_open (epub, book_files[i], &error)) {
+            g_printerr ("%s: %s\n", book_files[i], error->message);
+            g_error_free (error);
+            g_object_unref (epub);
+            continue;
+        }
+
+        book_window = books_window_new ();
+        books_window_set_book (BOOKS_WINDOW (book_window), epub, collection, book_files[i]);
+        gtk_widget_set_size_request (book_window, 594, 841);
+
+        g_signal_connect (book_window, "destroy",
+                          G_CALLBACK (on_book_window_destroyed), NULL);
+
+        gtk_widget_show_all (book_window);
+        n_book_windows++;
+    }
+
+    g_object_unref (collection);
+    g_object_unref (settings);
+    g_free (database);
+    g_free (library);
+}
 
 int
 main (int argc,
       char *argv[])
 {
+    GOptionContext *context;
     GtkWidget *window;
     gchar *locale_dir;
-
-    gtk_init (&argc, &argv);
+    GError *error = NULL;
 
     locale_dir = g_build_filename (DATADIR,
                                    "locale",
@@ -28,6 +101,45 @@ main (int argc,
     bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
     textdomain (GETTEXT_PACKAGE);
 
+    /* The search provider runs without a display */
+    context = g_option_context_new (NULL);
+    g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+    g_option_context_add_group (context, gtk_get_option_group (FALSE));
+
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_option_context_free (context);
+        g_free (locale_dir);
+        return 1;
+    }
+
+    g_option_context_free (context);
+
+    if (search_provider) {
+        gint status;
+
+        status = books_search_provider_run ();
+        g_free (locale_dir);
+        return status;
+    }
+
+    gtk_init (&argc, &argv);
+
+    if (book_files != NULL) {
+        gboolean opened;
+
+        open_books ();
+        opened = n_book_windows > 0;
+
+        if (opened)
+            gtk_main ();
+
+        g_strfreev (book_files);
+        g_free (locale_dir);
+        return opened ? 0 : 1;
+    }
+
     window = books_main_window_new ();
 
     g_signal_connect (G_OBJECT (window), "delete-event",